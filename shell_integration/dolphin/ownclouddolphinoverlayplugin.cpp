@@ -22,6 +22,7 @@
 #include <QtNetwork/QLocalSocket>
 #include <KIOCore/kfileitem.h>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QTimer>
 #include "ownclouddolphinpluginhelper.h"
 
@@ -32,6 +33,10 @@ class OwncloudDolphinPlugin : public KOverlayIconPlugin
 
     typedef QHash<QByteArray, QByteArray> StatusMap;
     StatusMap m_status;
+    // The directories asked for, their entries are in m_status and kept up to date by the pushes
+    QHash<QByteArray, QElapsedTimer> m_retrievedDirectories;
+    // Asked again after that, like every file was before
+    static const qint64 directoryStatusExpiryMs = 10 * 1000;
 
 public:
 
@@ -39,6 +44,8 @@ public:
         auto helper = OwncloudDolphinPluginHelper::instance();
         QObject::connect(helper, &OwncloudDolphinPluginHelper::commandRecieved,
                          this, &OwncloudDolphinPlugin::slotCommandRecieved);
+        QObject::connect(helper, &OwncloudDolphinPluginHelper::connected,
+                         this, [this] { m_retrievedDirectories.clear(); });
     }
 
     QStringList getOverlays(const QUrl& url) override {
@@ -50,7 +57,7 @@ public:
         QDir localPath(url.toLocalFile());
         const QByteArray localFile = localPath.canonicalPath().toUtf8();
 
-        helper->sendCommand(QByteArray("RETRIEVE_FILE_STATUS:" + localFile + "\n"));
+        retrieveFileStatus(localFile);
 
         StatusMap::iterator it = m_status.find(localFile);
         if (it != m_status.constEnd()) {
@@ -60,6 +67,38 @@ public:
     }
 
 private:
+    /**
+     * Asks for the status of \a file: of all entries of its directory at once
+     * if the client supports it, the answers come as STATUS commands.
+     */
+    void retrieveFileStatus(const QByteArray &file) {
+        auto helper = OwncloudDolphinPluginHelper::instance();
+        const int slash = file.lastIndexOf('/');
+        // The sync folders themselves are not in the answer for their parent directory
+        if (!helper->hasDirectoryStatus() || slash <= 0 || helper->paths().contains(QString::fromUtf8(file))) {
+            helper->sendCommand(QByteArray("RETRIEVE_FILE_STATUS:" + file + "\n"));
+            return;
+        }
+
+        const QByteArray directory = file.left(slash);
+        auto it = m_retrievedDirectories.find(directory);
+        if (it != m_retrievedDirectories.end()) {
+            if (!it->hasExpired(directoryStatusExpiryMs))
+                return;
+            it->restart();
+        } else {
+            // Forget the directories not looked at for a while
+            for (auto old = m_retrievedDirectories.begin(); old != m_retrievedDirectories.end();) {
+                if (old->hasExpired(directoryStatusExpiryMs))
+                    old = m_retrievedDirectories.erase(old);
+                else
+                    ++old;
+            }
+            m_retrievedDirectories[directory].start();
+        }
+        helper->sendCommand(QByteArray("RETRIEVE_DIRECTORY_STATUS:" + directory + "\n"));
+    }
+
     QStringList overlaysForString(const QByteArray &status) {
         QStringList r;
         if (status.startsWith("NOP"))
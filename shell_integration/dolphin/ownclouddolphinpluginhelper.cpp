@@ -59,7 +59,10 @@ void OwncloudDolphinPluginHelper::sendCommand(const char* data)
 
 void OwncloudDolphinPluginHelper::slotConnected()
 {
+    _hasDirectoryStatus = false;
+    sendCommand("VERSION:\n");
     sendCommand("GET_STRINGS:\n");
+    emit connected();
 }
 
 void OwncloudDolphinPluginHelper::tryConnect()
@@ -92,6 +95,15 @@ void OwncloudDolphinPluginHelper::slotReadyRead()
             QString file = QString::fromUtf8(line.constData() + col + 1, line.size() - col - 1);
             _paths.append(file);
             continue;
+        } else if (line.startsWith("VERSION:")) {
+            // VERSION:<client version>:<socket api version>
+            auto args = QString::fromUtf8(line).split(QLatin1Char(':'));
+            auto apiVersion = args.last().split(QLatin1Char('.'));
+            const int major = apiVersion.value(0).toInt();
+            _hasDirectoryStatus = major > 1 || (major == 1 && apiVersion.value(1).toInt() >= 1);
+            continue;
+        } else if (line.startsWith("DIRECTORY_STATUS_END:")) {
+            continue;
         } else if (line.startsWith("STRING:")) {
             auto args = QString::fromUtf8(line).split(QLatin1Char(':'));
             if (args.size() >= 3) {
@@ -32,6 +32,9 @@ public:
     void sendCommand(const char *data);
     QVector<QString> paths() const { return _paths; }
 
+    /// Whether the client answers RETRIEVE_DIRECTORY_STATUS
+    bool hasDirectoryStatus() const { return _hasDirectoryStatus; }
+
     QString contextMenuTitle() const
     {
         return _strings.value("CONTEXT_MENU_TITLE", "ownCloud");
@@ -46,6 +49,8 @@ public:
 
 signals:
     void commandRecieved(const QByteArray &cmd);
+    /// A new connection, nothing is monitored for it yet
+    void connected();
 
 protected:
     void timerEvent(QTimerEvent*) override;
@@ -59,6 +64,7 @@ private:
     QByteArray _line;
     QVector<QString> _paths;
     QBasicTimer _connectTimer;
+    bool _hasDirectoryStatus = false;
 
     QMap<QString, QString> _strings;
 };
@@ -77,27 +77,13 @@ int csync_get_statedb_exists(CSYNC *ctx) {
   return ctx->statedb.exists;
 }
 
-static int _csync_check_db_integrity(sqlite3 *db) {
-    c_strlist_t *result = NULL;
-    int rc = -1;
-
-    result = csync_statedb_query(db, "PRAGMA quick_check;");
-    if (result != NULL) {
-        /* There is  a result */
-        if (result->count > 0) {
-            if (c_streq(result->vector[0], "ok")) {
-                rc = 0;
-            }
-        }
-        c_strlist_destroy(result);
-    }
-
+static int _csync_check_sqlite_threadsafe(void) {
     if( sqlite3_threadsafe() == 0 ) {
         CSYNC_LOG(CSYNC_LOG_PRIORITY_WARN, "* WARNING: SQLite module is not threadsafe!");
-        rc = -1;
+        return -1;
     }
 
-    return rc;
+    return 0;
 }
 
 static int _csync_statedb_is_empty(sqlite3 *db) {
@@ -151,12 +137,13 @@ int csync_statedb_load(CSYNC *ctx, const char *statedb, sqlite3 **pdb) {
     goto out;
   }
 
-  if (_csync_check_db_integrity(db) != 0) {
-      const char *errmsg= sqlite3_errmsg(db);
-      CSYNC_LOG(CSYNC_LOG_PRIORITY_NOTICE, "ERR: sqlite3 integrity check failed - bail out: %s.",
-                errmsg ? errmsg : "<no sqlite3 errormsg>");
+  /* The consistency of the database is checked by the sync journal when it
+   * opens the file before csync does, and later in the background. Running
+   * quick_check here on every sync start is too slow for large databases. */
+  if (_csync_check_sqlite_threadsafe() != 0) {
+      CSYNC_LOG(CSYNC_LOG_PRIORITY_NOTICE, "ERR: sqlite3 is not threadsafe - bail out.");
       rc = -1;
-      ctx->status_code = CSYNC_STATUS_STATEDB_CORRUPTED;
+      ctx->status_code = CSYNC_STATUS_STATEDB_LOAD_ERROR;
       goto out;
   }
 
@@ -229,7 +216,7 @@ int csync_statedb_close(CSYNC *ctx) {
 }
 
 #define METADATA_QUERY                                                                      \
-    "phash, pathlen, path, inode, uid, gid, mode, modtime, type, md5, fileid, remotePerm, " \
+    "phash, pathlen, path, inode, modtime, type, md5, fileid, remotePerm, "                 \
     "filesize, ignoredChildrenRemote, "                                                     \
     "contentchecksumtype.name || ':' || contentChecksum "                                   \
     "FROM metadata "                                                                        \
@@ -255,10 +242,10 @@ static int _csync_file_stat_from_metadata_table( csync_file_stat_t **st, sqlite3
     SQLITE_BUSY_HANDLED( sqlite3_step(stmt) );
 
     if( rc == SQLITE_ROW ) {
-        if(column_count > 7) {
+        if(column_count > 4) {
             const char *name;
 
-            /* phash, pathlen, path, inode, uid, gid, mode, modtime */
+            /* phash, pathlen, path, inode, modtime */
             len = sqlite3_column_int(stmt, 1);
             *st = (csync_file_stat_t*)c_malloc(sizeof(csync_file_stat_t) + len + 1);
             /* clear the whole structure */
@@ -271,32 +258,31 @@ static int _csync_file_stat_from_metadata_table( csync_file_stat_t **st, sqlite3
             name = (const char*) sqlite3_column_text(stmt, 2);
             memcpy((*st)->path, (len ? name : ""), len + 1);
             (*st)->inode = sqlite3_column_int64(stmt,3);
-            (*st)->mode = sqlite3_column_int(stmt, 6);
-            (*st)->modtime = strtoul((char*)sqlite3_column_text(stmt, 7), NULL, 10);
+            (*st)->modtime = sqlite3_column_int64(stmt, 4);
 
-            if(*st && column_count > 8 ) {
-                (*st)->type = static_cast<enum csync_ftw_type_e>(sqlite3_column_int(stmt, 8));
+            if(*st && column_count > 5 ) {
+                (*st)->type = static_cast<enum csync_ftw_type_e>(sqlite3_column_int(stmt, 5));
             }
 
-            if(column_count > 9 && sqlite3_column_text(stmt, 9)) {
-                (*st)->etag = c_strdup( (char*) sqlite3_column_text(stmt, 9) );
+            if(column_count > 6 && sqlite3_column_text(stmt, 6)) {
+                (*st)->etag = c_strdup( (char*) sqlite3_column_text(stmt, 6) );
             }
-            if(column_count > 10 && sqlite3_column_text(stmt,10)) {
-                csync_vio_set_file_id((*st)->file_id, (char*) sqlite3_column_text(stmt, 10));
+            if(column_count > 7 && sqlite3_column_text(stmt,7)) {
+                csync_vio_set_file_id((*st)->file_id, (char*) sqlite3_column_text(stmt, 7));
             }
-            if(column_count > 11 && sqlite3_column_text(stmt,11)) {
+            if(column_count > 8 && sqlite3_column_text(stmt,8)) {
                 strncpy((*st)->remotePerm,
-                        (char*) sqlite3_column_text(stmt, 11),
+                        (char*) sqlite3_column_text(stmt, 8),
                         REMOTE_PERM_BUF_SIZE);
             }
-            if(column_count > 12 && sqlite3_column_int64(stmt,12)) {
-                (*st)->size = sqlite3_column_int64(stmt, 12);
+            if(column_count > 9 && sqlite3_column_int64(stmt,9)) {
+                (*st)->size = sqlite3_column_int64(stmt, 9);
             }
-            if(column_count > 13) {
-                (*st)->has_ignored_files = sqlite3_column_int(stmt, 13);
+            if(column_count > 10) {
+                (*st)->has_ignored_files = sqlite3_column_int(stmt, 10);
             }
-            if (column_count > 14 && sqlite3_column_text(stmt, 14)) {
-                (*st)->checksumHeader = c_strdup((char *)sqlite3_column_text(stmt, 14));
+            if (column_count > 11 && sqlite3_column_text(stmt, 11)) {
+                (*st)->checksumHeader = c_strdup((char *)sqlite3_column_text(stmt, 11));
             }
 
         }
@@ -560,6 +560,8 @@ void Folder::wipe()
 
     //Unregister the socket API so it does not keep the ._sync_journal file open
     FolderMan::instance()->socketApi()->slotUnregisterPath(alias());
+    // The maintenance must be done with the journal before it is closed and removed
+    _engine->journalMaintenance()->interrupt();
     _journal.close(); // close the sync journal
 
     QFile file(stateDbFile);
@@ -693,6 +695,26 @@ void Folder::setSyncOptions()
         opt._targetChunkUploadDuration = cfgFile.targetChunkUploadDuration();
     }
 
+    QByteArray largeFileSizeEnv = qgetenv("OWNCLOUD_LARGE_FILE_SIZE");
+    if (!largeFileSizeEnv.isEmpty()) {
+        opt._largeFileSize = largeFileSizeEnv.toULongLong();
+    }
+
+    QByteArray segmentedDownloadSizeEnv = qgetenv("OWNCLOUD_SEGMENTED_DOWNLOAD_SIZE");
+    if (!segmentedDownloadSizeEnv.isEmpty()) {
+        opt._segmentedDownloadSize = segmentedDownloadSizeEnv.toULongLong();
+    }
+
+    QByteArray downloadBufferSizeEnv = qgetenv("OWNCLOUD_DOWNLOAD_BUFFER_SIZE");
+    if (!downloadBufferSizeEnv.isEmpty()) {
+        opt._downloadBufferSize = downloadBufferSizeEnv.toLongLong();
+    }
+
+    QByteArray downloadWriteAlignmentEnv = qgetenv("OWNCLOUD_DOWNLOAD_WRITE_ALIGNMENT");
+    if (!downloadWriteAlignmentEnv.isEmpty()) {
+        opt._downloadWriteAlignment = downloadWriteAlignmentEnv.toLongLong();
+    }
+
     _engine->setSyncOptions(opt);
 }
 
@@ -87,6 +87,9 @@ FolderMan *FolderMan::instance()
 
 FolderMan::~FolderMan()
 {
+    foreach (Folder *f, _folderMap) {
+        _socketApi->removeFolder(f);
+    }
     qDeleteAll(_folderMap);
     _instance = 0;
 }
@@ -119,6 +122,7 @@ void FolderMan::unloadFolder(Folder *f)
         this, SLOT(slotFolderSyncPaused(Folder *, bool)));
     disconnect(&f->syncEngine().syncFileStatusTracker(), SIGNAL(fileStatusChanged(const QString &, SyncFileStatus)),
         _socketApi.data(), SLOT(broadcastStatusPushMessage(const QString &, SyncFileStatus)));
+    _socketApi->removeFolder(f);
     disconnect(f, SIGNAL(watchedFileChangedExternally(QString)),
         &f->syncEngine().syncFileStatusTracker(), SLOT(slotPathTouched(QString)));
 }
@@ -961,6 +965,7 @@ Folder *FolderMan::addFolderInternal(FolderDefinition folderDefinition,
     connect(folder, SIGNAL(canSyncChanged()), SLOT(slotFolderCanSyncChanged()));
     connect(&folder->syncEngine().syncFileStatusTracker(), SIGNAL(fileStatusChanged(const QString &, SyncFileStatus)),
         _socketApi.data(), SLOT(broadcastStatusPushMessage(const QString &, SyncFileStatus)));
+    _socketApi->addFolder(folder);
     connect(folder, SIGNAL(watchedFileChangedExternally(QString)),
         &folder->syncEngine().syncFileStatusTracker(), SLOT(slotPathTouched(QString)));
 
@@ -1093,6 +1098,7 @@ bool FolderMan::startFromScratch(const QString &localFolder)
             if (localFolder.startsWith(f->path())) {
                 _socketApi->slotUnregisterPath(f->alias());
             }
+            f->syncEngine().journalMaintenance()->interrupt();
             f->journalDb()->close();
             f->slotTerminateSync(); // Normally it should not be running, but viel hilft viel
         }
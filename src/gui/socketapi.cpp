@@ -15,6 +15,7 @@
  */
 
 #include "socketapi.h"
+#include "socketapiworker.h"
 
 #include "config.h"
 #include "configfile.h"
@@ -35,7 +36,6 @@
 #include "guiutility.h"
 
 #include <array>
-#include <QBitArray>
 #include <QUrl>
 #include <QMetaMethod>
 #include <QMetaObject>
@@ -60,7 +60,7 @@
 // This is the version that is returned when the client asks for the VERSION.
 // The first number should be changed if there is an incompatible change that breaks old clients.
 // The second number should be changed when there are new features.
-#define MIRALL_SOCKET_API_VERSION "1.0"
+#define MIRALL_SOCKET_API_VERSION "1.1"
 
 static inline QString removeTrailingSlash(QString path)
 {
@@ -89,33 +89,6 @@ namespace OCC {
 
 Q_LOGGING_CATEGORY(lcSocketApi, "gui.socketapi", QtInfoMsg)
 
-class BloomFilter
-{
-    // Initialize with m=1024 bits and k=2 (high and low 16 bits of a qHash).
-    // For a client navigating in less than 100 directories, this gives us a probability less than (1-e^(-2*100/1024))^2 = 0.03147872136 false positives.
-    const static int NumBits = 1024;
-
-public:
-    BloomFilter()
-        : hashBits(NumBits)
-    {
-    }
-
-    void storeHash(uint hash)
-    {
-        hashBits.setBit((hash & 0xFFFF) % NumBits);
-        hashBits.setBit((hash >> 16) % NumBits);
-    }
-    bool isHashMaybeStored(uint hash) const
-    {
-        return hashBits.testBit((hash & 0xFFFF) % NumBits)
-            && hashBits.testBit((hash >> 16) % NumBits);
-    }
-
-private:
-    QBitArray hashBits;
-};
-
 class SocketListener
 {
 public:
@@ -144,19 +117,20 @@ public:
         }
     }
 
-    void sendMessageIfDirectoryMonitored(const QString &message, uint systemDirectoryHash) const
+    /// Sends all \a messages with one write
+    void sendMessages(const QStringList &messages) const
     {
-        if (_monitoredDirectoriesBloomFilter.isHashMaybeStored(systemDirectoryHash))
-            sendMessage(message, false);
-    }
-
-    void registerMonitoredDirectory(uint systemDirectoryHash)
-    {
-        _monitoredDirectoriesBloomFilter.storeHash(systemDirectoryHash);
+        qCInfo(lcSocketApi) << "Sending" << messages.size() << "SocketAPI messages -->" << messages.value(0) << "... to" << socket;
+        QByteArray bytesToSend;
+        foreach (const QString &message, messages) {
+            bytesToSend += message.toUtf8();
+            bytesToSend += '\n';
+        }
+        qint64 sent = socket->write(bytesToSend);
+        if (sent != bytesToSend.length()) {
+            qCWarning(lcSocketApi) << "Could not send all data on socket for " << messages.size() << "messages";
+        }
     }
-
-private:
-    BloomFilter _monitoredDirectoriesBloomFilter;
 };
 
 struct ListenerHasSocketPred
@@ -171,7 +145,30 @@ struct ListenerHasSocketPred
 
 SocketApi::SocketApi(QObject *parent)
     : QObject(parent)
+    , _worker(new SocketApiWorker)
 {
+    // The commands by name, instead of looking up the method of every message
+    for (int i = staticMetaObject.methodOffset(); i < staticMetaObject.methodCount(); ++i) {
+        const QMetaMethod method = staticMetaObject.method(i);
+        if (method.name().startsWith("command_")) {
+            _commands.insert(method.name().mid(8), method);
+        }
+    }
+
+    qRegisterMetaType<QIODevice *>("QIODevice*");
+    qRegisterMetaType<SyncFileStatusTracker *>("SyncFileStatusTracker*");
+    _worker->moveToThread(&_workerThread);
+    connect(this, SIGNAL(statusRequestReceived(QIODevice *, QByteArray)),
+        _worker, SLOT(slotRequest(QIODevice *, QByteArray)));
+    connect(this, SIGNAL(statusPushed(SyncFileStatusTracker *, QStringList, QStringList)),
+        _worker, SLOT(slotStatusPushes(SyncFileStatusTracker *, QStringList, QStringList)));
+    connect(this, SIGNAL(socketClosed(QIODevice *)), _worker, SLOT(slotSocketClosed(QIODevice *)));
+    connect(_worker, SIGNAL(messagesReady(QIODevice *, QStringList)),
+        this, SLOT(slotSendMessages(QIODevice *, QStringList)));
+    // Its journal connections are closed on the worker thread
+    connect(&_workerThread, SIGNAL(finished()), _worker, SLOT(deleteLater()));
+    _workerThread.start();
+
     QString socketPath;
 
     if (Utility::isWindows()) {
@@ -229,6 +226,9 @@ SocketApi::SocketApi(QObject *parent)
 SocketApi::~SocketApi()
 {
     qCDebug(lcSocketApi) << "dtor";
+    _workerThread.quit();
+    _workerThread.wait();
+    _worker = 0;
     _localServer.close();
     // All remaining sockets will be destroyed with _localServer, their parent
     ASSERT(_listeners.isEmpty() || _listeners.first().socket->parent() == &_localServer);
@@ -269,6 +269,7 @@ void SocketApi::slotSocketDestroyed(QObject *obj)
 {
     QIODevice *socket = static_cast<QIODevice *>(obj);
     _listeners.erase(std::remove_if(_listeners.begin(), _listeners.end(), ListenerHasSocketPred(socket)), _listeners.end());
+    emit socketClosed(socket);
 }
 
 void SocketApi::slotReadSocket()
@@ -278,24 +279,52 @@ void SocketApi::slotReadSocket()
     SocketListener *listener = &*std::find_if(_listeners.begin(), _listeners.end(), ListenerHasSocketPred(socket));
 
     while (socket->canReadLine()) {
+        QByteArray line = socket->readLine();
+        line.chop(1); // remove the '\n'
+        const QByteArray command = line.left(line.indexOf(':'));
+        if (SocketApiWorker::handlesCommand(command)) {
+            emit statusRequestReceived(socket, line);
+            continue;
+        }
+
         // Make sure to normalize the input from the socket to
         // make sure that the path will match, especially on OS X.
-        QString line = QString::fromUtf8(socket->readLine()).normalized(QString::NormalizationForm_C);
-        line.chop(1); // remove the '\n'
-        qCInfo(lcSocketApi) << "Received SocketAPI message <--" << line << "from" << socket;
-        QByteArray command = line.split(":").value(0).toAscii();
-        QByteArray functionWithArguments = "command_" + command + "(QString,SocketListener*)";
-        int indexOfMethod = staticMetaObject.indexOfMethod(functionWithArguments);
-
-        QString argument = line.remove(0, command.length() + 1);
-        if (indexOfMethod != -1) {
-            staticMetaObject.method(indexOfMethod).invoke(this, Q_ARG(QString, argument), Q_ARG(SocketListener *, listener));
+        const QString argument = QString::fromUtf8(line.mid(command.length() + 1)).normalized(QString::NormalizationForm_C);
+        qCInfo(lcSocketApi) << "Received SocketAPI message <--" << command << argument << "from" << socket;
+        auto method = _commands.constFind(command);
+        if (method != _commands.constEnd()) {
+            method->invoke(this, Q_ARG(QString, argument), Q_ARG(SocketListener *, listener));
         } else {
             qCWarning(lcSocketApi) << "The command is not supported by this version of the client:" << command << "with argument:" << argument;
         }
     }
 }
 
+void SocketApi::slotSendMessages(QIODevice *socket, const QStringList &messages)
+{
+    auto listener = std::find_if(_listeners.begin(), _listeners.end(), ListenerHasSocketPred(socket));
+    if (listener == _listeners.end()) {
+        return; // gone in the meantime
+    }
+    if (messages.size() == 1) {
+        listener->sendMessage(messages.first());
+    } else {
+        listener->sendMessages(messages);
+    }
+}
+
+void SocketApi::addFolder(Folder *folder)
+{
+    _worker->addFolder(folder->cleanPath(), &folder->syncEngine().syncFileStatusTracker(),
+        folder->journalDb()->databaseFilePath());
+}
+
+void SocketApi::removeFolder(Folder *folder)
+{
+    _statusPushes.remove(&folder->syncEngine().syncFileStatusTracker());
+    _worker->removeFolder(&folder->syncEngine().syncFileStatusTracker());
+}
+
 void SocketApi::slotRegisterPath(const QString &alias)
 {
     // Make sure not to register twice to each connected client
@@ -340,7 +369,8 @@ void SocketApi::slotUpdateFolderView(Folder *f)
             || f->syncResult().status() == SyncResult::Error
             || f->syncResult().status() == SyncResult::SetupError) {
             QString rootPath = removeTrailingSlash(f->path());
-            broadcastStatusPushMessage(rootPath, f->syncEngine().syncFileStatusTracker().fileStatus(""));
+            auto &tracker = f->syncEngine().syncFileStatusTracker();
+            pushStatus(&tracker, rootPath, tracker.fileStatus(""));
 
             broadcastMessage(buildMessage(QLatin1String("UPDATE_VIEW"), rootPath));
         } else {
@@ -358,46 +388,30 @@ void SocketApi::broadcastMessage(const QString &msg, bool doWait)
 
 void SocketApi::broadcastStatusPushMessage(const QString &systemPath, SyncFileStatus fileStatus)
 {
-    QString msg = buildMessage(QLatin1String("STATUS"), systemPath, fileStatus.toSocketAPIString());
-    Q_ASSERT(!systemPath.endsWith('/'));
-    uint directoryHash = qHash(systemPath.left(systemPath.lastIndexOf('/')));
-    foreach (auto &listener, _listeners) {
-        listener.sendMessageIfDirectoryMonitored(msg, directoryHash);
-    }
+    SyncFileStatusTracker *tracker = qobject_cast<SyncFileStatusTracker *>(sender());
+    ASSERT(tracker);
+    pushStatus(tracker, systemPath, fileStatus);
 }
 
-void SocketApi::command_RETRIEVE_FOLDER_STATUS(const QString &argument, SocketListener *listener)
+void SocketApi::pushStatus(SyncFileStatusTracker *tracker, const QString &systemPath, SyncFileStatus fileStatus)
 {
-    // This command is the same as RETRIEVE_FILE_STATUS
-    command_RETRIEVE_FILE_STATUS(argument, listener);
+    Q_ASSERT(!systemPath.endsWith('/'));
+    // The tracker emits the changes together, hand them over to the worker together.
+    // It sends them to the listeners that monitor the directory.
+    if (_statusPushes.isEmpty()) {
+        QMetaObject::invokeMethod(this, "slotSendStatusPushes", Qt::QueuedConnection);
+    }
+    StatusPushes &pushes = _statusPushes[tracker];
+    pushes._systemPaths.append(systemPath);
+    pushes._statuses.append(fileStatus.toSocketAPIString());
 }
 
-void SocketApi::command_RETRIEVE_FILE_STATUS(const QString &argument, SocketListener *listener)
+void SocketApi::slotSendStatusPushes()
 {
-    QString statusString;
-
-    Folder *syncFolder = FolderMan::instance()->folderForPath(argument);
-    if (!syncFolder) {
-        // this can happen in offline mode e.g.: nothing to worry about
-        statusString = QLatin1String("NOP");
-    } else {
-        QString systemPath = QDir::cleanPath(argument);
-        if (systemPath.endsWith(QLatin1Char('/'))) {
-            systemPath.truncate(systemPath.length() - 1);
-            qCWarning(lcSocketApi) << "Removed trailing slash for directory: " << systemPath << "Status pushes won't have one.";
-        }
-        // The user probably visited this directory in the file shell.
-        // Let the listener know that it should now send status pushes for sibblings of this file.
-        QString directory = systemPath.left(systemPath.lastIndexOf('/'));
-        listener->registerMonitoredDirectory(qHash(directory));
-
-        QString relativePath = systemPath.mid(syncFolder->cleanPath().length() + 1);
-        SyncFileStatus fileStatus = syncFolder->syncEngine().syncFileStatusTracker().fileStatus(relativePath);
-        statusString = fileStatus.toSocketAPIString();
+    for (auto it = _statusPushes.constBegin(); it != _statusPushes.constEnd(); ++it) {
+        emit statusPushed(it.key(), it->_systemPaths, it->_statuses);
     }
-
-    const QString message = QLatin1String("STATUS:") % statusString % QLatin1Char(':') % QDir::toNativeSeparators(argument);
-    listener->sendMessage(message);
+    _statusPushes.clear();
 }
 
 void SocketApi::command_SHARE(const QString &localFile, SocketListener *listener)
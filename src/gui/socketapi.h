@@ -18,8 +18,13 @@
 
 #include "syncfileitem.h"
 #include "syncfilestatus.h"
+#include "syncfilestatustracker.h"
 #include "ownsql.h"
 
+#include <QIODevice>
+#include <QMetaMethod>
+#include <QThread>
+
 #if defined(Q_OS_MAC)
 #include "socketapisocket_mac.h"
 #else
@@ -36,9 +41,13 @@ namespace OCC {
 class SyncFileStatus;
 class Folder;
 class SocketListener;
+class SocketApiWorker;
 
 /**
  * @brief The SocketApi class
+ *
+ * The file status requests and pushes are handled by a SocketApiWorker
+ * on its own thread, the other commands on the GUI thread.
  * @ingroup gui
  */
 class SocketApi : public QObject
@@ -49,6 +58,11 @@ public:
     explicit SocketApi(QObject *parent = 0);
     virtual ~SocketApi();
 
+    /// Makes the statuses of \a folder available to the file managers
+    void addFolder(Folder *folder);
+    /// The folder must be removed before it is deleted
+    void removeFolder(Folder *folder);
+
 public slots:
     void slotUpdateFolderView(Folder *f);
     void slotUnregisterPath(const QString &alias);
@@ -57,18 +71,23 @@ public slots:
 signals:
     void shareCommandReceived(const QString &sharePath, const QString &localPath);
 
+    // To the worker
+    void statusRequestReceived(QIODevice *socket, const QByteArray &line);
+    void statusPushed(SyncFileStatusTracker *tracker, const QStringList &systemPaths, const QStringList &statuses);
+    void socketClosed(QIODevice *socket);
+
 private slots:
     void slotNewConnection();
     void onLostConnection();
     void slotSocketDestroyed(QObject *obj);
     void slotReadSocket();
+    void slotSendMessages(QIODevice *socket, const QStringList &messages);
+    void slotSendStatusPushes();
     void broadcastStatusPushMessage(const QString &systemPath, SyncFileStatus fileStatus);
 
 private:
     void broadcastMessage(const QString &msg, bool doWait = false);
-
-    Q_INVOKABLE void command_RETRIEVE_FOLDER_STATUS(const QString &argument, SocketListener *listener);
-    Q_INVOKABLE void command_RETRIEVE_FILE_STATUS(const QString &argument, SocketListener *listener);
+    void pushStatus(SyncFileStatusTracker *tracker, const QString &systemPath, SyncFileStatus fileStatus);
 
     Q_INVOKABLE void command_VERSION(const QString &argument, SocketListener *listener);
 
@@ -89,6 +108,16 @@ private:
     QSet<QString> _registeredAliases;
     QList<SocketListener> _listeners;
     SocketApiServer _localServer;
+    QHash<QByteArray, QMetaMethod> _commands; // the command_ methods by command
+    QThread _workerThread;
+    SocketApiWorker *_worker;
+    struct StatusPushes
+    {
+        QStringList _systemPaths;
+        QStringList _statuses;
+    };
+    /// The pushes not handed over to the worker yet
+    QHash<SyncFileStatusTracker *, StatusPushes> _statusPushes;
 };
 }
 #endif // SOCKETAPI_H
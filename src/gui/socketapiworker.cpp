@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "socketapiworker.h"
+#include "syncfilestatustracker.h"
+#include "utility.h"
+
+#include <QDir>
+#include <QIODevice>
+#include <QLoggingCategory>
+#include <QStringBuilder>
+
+namespace OCC {
+
+Q_LOGGING_CATEGORY(lcSocketApiWorker, "gui.socketapi.worker", QtInfoMsg)
+
+SocketApiWorker::SocketApiWorker(QObject *parent)
+    : QObject(parent)
+{
+}
+
+const QHash<QByteArray, SocketApiWorker::Command> &SocketApiWorker::commands()
+{
+    static const QHash<QByteArray, Command> commands = {
+        { "RETRIEVE_FOLDER_STATUS", &SocketApiWorker::command_RETRIEVE_FOLDER_STATUS },
+        { "RETRIEVE_FILE_STATUS", &SocketApiWorker::command_RETRIEVE_FILE_STATUS },
+        { "RETRIEVE_DIRECTORY_STATUS", &SocketApiWorker::command_RETRIEVE_DIRECTORY_STATUS },
+    };
+    return commands;
+}
+
+bool SocketApiWorker::handlesCommand(const QByteArray &command)
+{
+    return commands().contains(command);
+}
+
+void SocketApiWorker::addFolder(const QString &path, SyncFileStatusTracker *tracker, const QString &journalPath)
+{
+    QMutexLocker locker(&_foldersMutex);
+    FolderEntry folder;
+    folder._path = path;
+    folder._tracker = tracker;
+    folder._journal.reset(new SyncJournalReader(journalPath));
+    _folders.append(folder);
+}
+
+void SocketApiWorker::removeFolder(SyncFileStatusTracker *tracker)
+{
+    QMutexLocker locker(&_foldersMutex);
+    for (int i = 0; i < _folders.size(); ++i) {
+        if (_folders.at(i)._tracker == tracker) {
+            _folders.removeAt(i);
+            return;
+        }
+    }
+}
+
+SocketApiWorker::FolderEntry *SocketApiWorker::folderForPath(const QString &path)
+{
+    // Like FolderMan::folderForPath()
+    const QString absolutePath = QDir::cleanPath(path) + QLatin1Char('/');
+    for (auto it = _folders.begin(); it != _folders.end(); ++it) {
+        if (absolutePath.startsWith(it->_path + QLatin1Char('/'), (Utility::isWindows() || Utility::isMac()) ? Qt::CaseInsensitive : Qt::CaseSensitive)) {
+            return &*it;
+        }
+    }
+    return 0;
+}
+
+SocketApiWorker::FolderEntry *SocketApiWorker::folderForTracker(SyncFileStatusTracker *tracker)
+{
+    for (auto it = _folders.begin(); it != _folders.end(); ++it) {
+        if (it->_tracker == tracker) {
+            return &*it;
+        }
+    }
+    return 0;
+}
+
+void SocketApiWorker::slotRequest(QIODevice *socket, const QByteArray &line)
+{
+    // Make sure to normalize the input from the socket to
+    // make sure that the path will match, especially on OS X.
+    const QString message = QString::fromUtf8(line).normalized(QString::NormalizationForm_C);
+    qCInfo(lcSocketApiWorker) << "Received SocketAPI message <--" << message << "from" << socket;
+
+    const int colon = message.indexOf(QLatin1Char(':'));
+    const Command command = commands().value(message.left(colon).toLatin1());
+    if (!command) {
+        qCWarning(lcSocketApiWorker) << "Not a status request:" << message;
+        return;
+    }
+    QMutexLocker locker(&_foldersMutex);
+    (this->*command)(colon < 0 ? QString() : message.mid(colon + 1), socket);
+}
+
+void SocketApiWorker::slotStatusPushes(SyncFileStatusTracker *tracker, const QStringList &systemPaths, const QStringList &statuses)
+{
+    Q_ASSERT(systemPaths.size() == statuses.size());
+    {
+        QMutexLocker locker(&_foldersMutex);
+        if (!folderForTracker(tracker)) {
+            return; // removed in the meantime
+        }
+    }
+
+    QHash<QIODevice *, QStringList> messages;
+    for (int i = 0; i < systemPaths.size(); ++i) {
+        const QString &systemPath = systemPaths.at(i);
+        Q_ASSERT(!systemPath.endsWith('/'));
+        const uint directoryHash = qHash(systemPath.left(systemPath.lastIndexOf('/')));
+        QString message;
+        for (auto it = _monitoredDirectories.constBegin(); it != _monitoredDirectories.constEnd(); ++it) {
+            if (it->isHashMaybeStored(directoryHash)) {
+                if (message.isEmpty()) {
+                    message = QLatin1String("STATUS:") % statuses.at(i) % QLatin1Char(':') % QDir::toNativeSeparators(systemPath);
+                }
+                messages[it.key()].append(message);
+            }
+        }
+    }
+
+    for (auto it = messages.constBegin(); it != messages.constEnd(); ++it) {
+        emit messagesReady(it.key(), it.value());
+    }
+}
+
+void SocketApiWorker::slotSocketClosed(QIODevice *socket)
+{
+    _monitoredDirectories.remove(socket);
+}
+
+void SocketApiWorker::command_RETRIEVE_FOLDER_STATUS(const QString &argument, QIODevice *socket)
+{
+    // This command is the same as RETRIEVE_FILE_STATUS
+    command_RETRIEVE_FILE_STATUS(argument, socket);
+}
+
+void SocketApiWorker::command_RETRIEVE_FILE_STATUS(const QString &argument, QIODevice *socket)
+{
+    QString statusString;
+
+    FolderEntry *syncFolder = folderForPath(argument);
+    if (!syncFolder) {
+        // this can happen in offline mode e.g.: nothing to worry about
+        statusString = QLatin1String("NOP");
+    } else {
+        QString systemPath = QDir::cleanPath(argument);
+        if (systemPath.endsWith(QLatin1Char('/'))) {
+            systemPath.truncate(systemPath.length() - 1);
+            qCWarning(lcSocketApiWorker) << "Removed trailing slash for directory: " << systemPath << "Status pushes won't have one.";
+        }
+        // The user probably visited this directory in the file shell.
+        // Let the listener know that it should now send status pushes for sibblings of this file.
+        const uint directoryHash = qHash(systemPath.left(systemPath.lastIndexOf('/')));
+        _monitoredDirectories[socket].storeHash(directoryHash);
+
+        QString relativePath = systemPath.mid(syncFolder->_path.length() + 1);
+        statusString = syncFolder->_tracker->snapshot()->fileStatus(relativePath, syncFolder->_journal.data()).toSocketAPIString();
+    }
+
+    const QString message = QLatin1String("STATUS:") % statusString % QLatin1Char(':') % QDir::toNativeSeparators(argument);
+    emit messagesReady(socket, QStringList(message));
+}
+
+/**
+ * Replies with a STATUS message for every entry of the directory, like
+ * RETRIEVE_FILE_STATUS would for each of them, followed by
+ * DIRECTORY_STATUS_END:<directory>.
+ */
+void SocketApiWorker::command_RETRIEVE_DIRECTORY_STATUS(const QString &argument, QIODevice *socket)
+{
+    QString systemPath = QDir::cleanPath(argument);
+    if (systemPath.endsWith(QLatin1Char('/'))) {
+        systemPath.truncate(systemPath.length() - 1);
+    }
+
+    QStringList messages;
+    FolderEntry *syncFolder = folderForPath(systemPath);
+    if (syncFolder) {
+        // Status pushes are sent for the entries of this directory from now on
+        const uint directoryHash = qHash(systemPath);
+        _monitoredDirectories[socket].storeHash(directoryHash);
+
+        const QString relativePath = systemPath.mid(syncFolder->_path.length() + 1);
+        const auto statuses = syncFolder->_tracker->snapshot()->directoryStatus(relativePath, syncFolder->_journal.data());
+        const QString nativeDirectory = QDir::toNativeSeparators(systemPath + QLatin1Char('/'));
+        for (auto it = statuses.constBegin(); it != statuses.constEnd(); ++it) {
+            const QString message = QLatin1String("STATUS:") % it.value().toSocketAPIString() % QLatin1Char(':') % nativeDirectory % it.key();
+            messages.append(message);
+        }
+    }
+    // Outside of the sync folders there is nothing to report, like the NOP of RETRIEVE_FILE_STATUS
+    messages.append(QLatin1String("DIRECTORY_STATUS_END:") + QDir::toNativeSeparators(argument));
+    emit messagesReady(socket, messages);
+}
+}
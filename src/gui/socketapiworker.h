@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#pragma once
+
+#include "syncfilestatustracker.h"
+#include "syncjournaldb.h"
+
+#include <QBitArray>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
+
+namespace OCC {
+
+class BloomFilter
+{
+    // Initialize with m=1024 bits and k=2 (high and low 16 bits of a qHash).
+    // For a client navigating in less than 100 directories, this gives us a probability less than (1-e^(-2*100/1024))^2 = 0.03147872136 false positives.
+    const static int NumBits = 1024;
+
+public:
+    BloomFilter()
+        : hashBits(NumBits)
+    {
+    }
+
+    void storeHash(uint hash)
+    {
+        hashBits.setBit((hash & 0xFFFF) % NumBits);
+        hashBits.setBit((hash >> 16) % NumBits);
+    }
+    bool isHashMaybeStored(uint hash) const
+    {
+        return hashBits.testBit((hash & 0xFFFF) % NumBits)
+            && hashBits.testBit((hash >> 16) % NumBits);
+    }
+
+private:
+    QBitArray hashBits;
+};
+
+/**
+ * @brief Answers the file status requests of the socket API on its own thread
+ *
+ * The SocketApi reads and writes the sockets on the GUI thread, and hands
+ * the status requests and the status pushes over to this worker. The
+ * statuses are resolved from the snapshot the SyncFileStatusTracker of the
+ * folder publishes, so neither the GUI nor the sync wait for the file
+ * managers.
+ *
+ * Requests and pushes are handled in the order they were received. The
+ * tracker publishes its snapshot before it emits the changes, so a reply
+ * is never older than the pushes sent before it.
+ *
+ * The tracker coalesces the status changes, the pushes it emitted together
+ * are written with one write per listener.
+ * @ingroup gui
+ */
+class SocketApiWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SocketApiWorker(QObject *parent = 0);
+
+    /** Whether \a command is answered here instead of by the SocketApi */
+    static bool handlesCommand(const QByteArray &command);
+
+    /**
+     * Answers requests for the folder at \a path from now on.
+     *
+     * \a tracker must stay valid until removeFolder() returned. The records
+     * are read from the journal at \a journalPath with a connection of the
+     * worker. Both may be called from any thread.
+     */
+    void addFolder(const QString &path, SyncFileStatusTracker *tracker, const QString &journalPath);
+    /// Waits for the request being answered, if any
+    void removeFolder(SyncFileStatusTracker *tracker);
+
+public slots:
+    void slotRequest(QIODevice *socket, const QByteArray &line);
+    void slotStatusPushes(SyncFileStatusTracker *tracker, const QStringList &systemPaths, const QStringList &statuses);
+    void slotSocketClosed(QIODevice *socket);
+
+signals:
+    /** \a messages are to be written to \a socket, together */
+    void messagesReady(QIODevice *socket, const QStringList &messages);
+
+private:
+    struct FolderEntry
+    {
+        QString _path;
+        SyncFileStatusTracker *_tracker;
+        QSharedPointer<SyncJournalReader> _journal;
+    };
+    typedef void (SocketApiWorker::*Command)(const QString &argument, QIODevice *socket);
+
+    static const QHash<QByteArray, Command> &commands();
+
+    // These require _foldersMutex
+    FolderEntry *folderForPath(const QString &path);
+    FolderEntry *folderForTracker(SyncFileStatusTracker *tracker);
+
+    void command_RETRIEVE_FOLDER_STATUS(const QString &argument, QIODevice *socket);
+    void command_RETRIEVE_FILE_STATUS(const QString &argument, QIODevice *socket);
+    void command_RETRIEVE_DIRECTORY_STATUS(const QString &argument, QIODevice *socket);
+
+    QMutex _foldersMutex;
+    QList<FolderEntry> _folders;
+    QHash<QIODevice *, BloomFilter> _monitoredDirectories;
+};
+}
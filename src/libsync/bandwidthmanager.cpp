@@ -12,398 +12,364 @@
  * for more details.
  */
 
-#include "owncloudpropagator.h"
+#include "bandwidthmanager.h"
 #include "propagatedownload.h"
 #include "propagateupload.h"
-#include "propagatorjobs.h"
-#include "utility.h"
-
-#ifdef Q_OS_WIN
-#include <windef.h>
-#include <winbase.h>
-#endif
 
 #include <QLoggingCategory>
 #include <QTimer>
 #include <QObject>
 
+#include <algorithm>
+#include <numeric>
+
 namespace OCC {
 
 Q_LOGGING_CATEGORY(lcBandwidthManager, "sync.bandwidthmanager", QtInfoMsg)
 
-// Because of the many layers of buffering inside Qt (and probably the OS and the network)
-// we cannot lower this value much more. If we do, the estimated bw will be very high
-// because the buffers fill fast while the actual network algorithms are not relevant yet.
-static qint64 relativeLimitMeasuringTimerIntervalMsec = 1000 * 2;
-// See also WritingState in http://code.woboq.org/qt5/qtbase/src/network/access/qhttpprotocolhandler.cpp.html#_ZN20QHttpProtocolHandler11sendRequestEv
+// The buckets are refilled this often. Shorter ticks give smoother limiting
+// but more wakeups while a limit is set.
+static const int tickMsec = 50;
 
-// FIXME At some point:
-//  * Register device only after the QNR received its metaDataChanged() signal
-//  * Incorporate Qt buffer fill state (it's a negative absolute delta).
-//  * Incorporate SSL overhead (percentage)
-//  * For relative limiting, do less measuring and more delaying+giving quota
-//  * For relative limiting, smoothen measurements
+// The tokens a transfer can hold, in time at the limited rate. Transfers
+// that don't use their share leave the rest to the others.
+static const qint64 burstMsec = 100;
+static const qint64 minimumBurstBytes = 4 * 1024;
 
-BandwidthManager::BandwidthManager(OwncloudPropagator *p)
-    : QObject()
-    , _propagator(p)
-    , _relativeLimitCurrentMeasuredDevice(0)
-    , _relativeUploadLimitProgressAtMeasuringRestart(0)
-    , _currentUploadLimit(0)
-    , _relativeLimitCurrentMeasuredJob(0)
-    , _currentDownloadLimit(0)
+// Relative limits measure the bandwidth at full speed for probeMsec out of
+// every cycleMsec. Because of the many layers of buffering inside Qt (and
+// probably the OS and the network) the probe can't be much shorter: the
+// buffers fill fast while the actual network algorithms are not relevant yet.
+static const qint64 probeMsec = 2 * 1000;
+static const qint64 cycleMsec = 30 * 1000;
+
+BandwidthGovernor *BandwidthGovernor::_instance = 0;
+
+BandwidthGovernor *BandwidthGovernor::instance()
 {
-    _currentUploadLimit = _propagator->_uploadLimit.fetchAndAddAcquire(0);
-    _currentDownloadLimit = _propagator->_downloadLimit.fetchAndAddAcquire(0);
-
-    QObject::connect(&_switchingTimer, SIGNAL(timeout()), this, SLOT(switchingTimerExpired()));
-    _switchingTimer.setInterval(10 * 1000);
-    _switchingTimer.start();
-    QMetaObject::invokeMethod(this, "switchingTimerExpired", Qt::QueuedConnection);
-
-    // absolute uploads/downloads
-    QObject::connect(&_absoluteLimitTimer, SIGNAL(timeout()), this, SLOT(absoluteLimitTimerExpired()));
-    _absoluteLimitTimer.setInterval(1000);
-    _absoluteLimitTimer.start();
-
-    // Relative uploads
-    QObject::connect(&_relativeUploadMeasuringTimer, SIGNAL(timeout()),
-        this, SLOT(relativeUploadMeasuringTimerExpired()));
-    _relativeUploadMeasuringTimer.setInterval(relativeLimitMeasuringTimerIntervalMsec);
-    _relativeUploadMeasuringTimer.start();
-    _relativeUploadMeasuringTimer.setSingleShot(true); // will be restarted from the delay timer
-    QObject::connect(&_relativeUploadDelayTimer, SIGNAL(timeout()),
-        this, SLOT(relativeUploadDelayTimerExpired()));
-    _relativeUploadDelayTimer.setSingleShot(true); // will be restarted from the measuring timer
-
-    // Relative downloads
-    QObject::connect(&_relativeDownloadMeasuringTimer, SIGNAL(timeout()),
-        this, SLOT(relativeDownloadMeasuringTimerExpired()));
-    _relativeDownloadMeasuringTimer.setInterval(relativeLimitMeasuringTimerIntervalMsec);
-    _relativeDownloadMeasuringTimer.start();
-    _relativeDownloadMeasuringTimer.setSingleShot(true); // will be restarted from the delay timer
-    QObject::connect(&_relativeDownloadDelayTimer, SIGNAL(timeout()),
-        this, SLOT(relativeDownloadDelayTimerExpired()));
-    _relativeDownloadDelayTimer.setSingleShot(true); // will be restarted from the measuring timer
+    if (!_instance) {
+        _instance = new BandwidthGovernor();
+    }
+    return _instance;
 }
 
-BandwidthManager::~BandwidthManager()
+BandwidthGovernor::BandwidthGovernor()
+    : QObject()
+    , _lastTick(0)
 {
+    _monotonic.start();
+    setClock(Clock());
+    _tickTimer.setInterval(tickMsec);
+    connect(&_tickTimer, SIGNAL(timeout()), SLOT(slotTick()));
 }
 
-void BandwidthManager::registerUploadDevice(UploadDevice *p)
+void BandwidthGovernor::setClock(const Clock &clock)
 {
-    _absoluteUploadDeviceList.append(p);
-    _relativeUploadDeviceList.append(p);
-    QObject::connect(p, SIGNAL(destroyed(QObject *)), this, SLOT(unregisterUploadDevice(QObject *)));
-
-    if (usingAbsoluteUploadLimit()) {
-        p->setBandwidthLimited(true);
-        p->setChoked(false);
-    } else if (usingRelativeUploadLimit()) {
-        p->setBandwidthLimited(true);
-        p->setChoked(true);
+    if (clock) {
+        _clock = clock;
     } else {
-        p->setBandwidthLimited(false);
-        p->setChoked(false);
+        _clock = [this]() { return _monotonic.elapsed(); };
+    }
+    _lastTick = _clock();
+    for (DirectionState &state : _directions) {
+        state._phaseStart = _lastTick;
     }
 }
 
-void BandwidthManager::unregisterUploadDevice(QObject *o)
+QVector<qint64> BandwidthGovernor::fairShares(qint64 amount, const QVector<qint64> &capacities)
 {
-    UploadDevice *p = qobject_cast<UploadDevice *>(o);
-    if (p) {
-        unregisterUploadDevice(p);
+    QVector<qint64> shares(capacities.size(), 0);
+
+    // Fill the smallest capacities first, what they can't take is split between the rest
+    QVector<int> order(capacities.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&capacities](int a, int b) {
+        return capacities[a] < capacities[b];
+    });
+    for (int i = 0; i < order.size() && amount > 0; ++i) {
+        const qint64 share = qMin(capacities[order[i]], amount / (order.size() - i));
+        shares[order[i]] = share;
+        amount -= share;
     }
+    return shares;
 }
 
-void BandwidthManager::unregisterUploadDevice(UploadDevice *p)
+void BandwidthGovernor::setLimit(Direction direction, qint64 limit)
 {
-    _absoluteUploadDeviceList.removeAll(p);
-    _relativeUploadDeviceList.removeAll(p);
-    if (p == _relativeLimitCurrentMeasuredDevice) {
-        _relativeLimitCurrentMeasuredDevice = 0;
-        _relativeUploadLimitProgressAtMeasuringRestart = 0;
+    DirectionState &state = _directions[direction];
+    if (state._limit == limit) {
+        return;
+    }
+    qCInfo(lcBandwidthManager) << (direction == Upload ? "Upload" : "Download")
+                               << "bandwidth limit changed" << state._limit << limit;
+
+    state._limit = limit;
+    state._rootTokens = 0;
+    for (auto it = state._transfers.begin(); it != state._transfers.end(); ++it) {
+        it->_tokens = 0;
     }
+    state._rate = limit > 0 ? limit : 0;
+    state._probing = limit < 0;
+    state._probeBytes = 0;
+    state._phaseStart = _clock();
+
+    // Transfers that were waiting for quota may not need any now
+    wakeAll(state);
+    updateTimer();
 }
 
-void BandwidthManager::registerDownloadJob(GETFileJob *j)
+qint64 BandwidthGovernor::currentRate(Direction direction) const
 {
-    _downloadJobList.append(j);
-    QObject::connect(j, SIGNAL(destroyed(QObject *)), this, SLOT(unregisterDownloadJob(QObject *)));
+    const DirectionState &state = _directions[direction];
+    return state._probing ? 0 : state._rate;
+}
 
-    if (usingAbsoluteDownloadLimit()) {
-        j->setBandwidthLimited(true);
-        j->setChoked(false);
-    } else if (usingRelativeDownloadLimit()) {
-        j->setBandwidthLimited(true);
-        j->setChoked(true);
-    } else {
-        j->setBandwidthLimited(false);
-        j->setChoked(false);
-    }
+void BandwidthGovernor::addTransfer(Direction direction, QObject *folder, QObject *transfer, const char *wakeMethod)
+{
+    // Woken up on the next tick
+    Transfer t = { folder, wakeMethod, 0, true };
+    _directions[direction]._transfers.insert(transfer, t);
+    updateTimer();
 }
 
-void BandwidthManager::unregisterDownloadJob(GETFileJob *j)
+void BandwidthGovernor::removeTransfer(Direction direction, QObject *transfer)
 {
-    _downloadJobList.removeAll(j);
-    if (_relativeLimitCurrentMeasuredJob == j) {
-        _relativeLimitCurrentMeasuredJob = 0;
-        _relativeDownloadLimitProgressAtMeasuringRestart = 0;
+    if (_directions[direction]._transfers.remove(transfer)) {
+        updateTimer();
     }
 }
 
-void BandwidthManager::unregisterDownloadJob(QObject *o)
+qint64 BandwidthGovernor::takeQuota(Direction direction, QObject *transfer, qint64 wanted)
 {
-    GETFileJob *p = qobject_cast<GETFileJob *>(o);
-    if (p) {
-        unregisterDownloadJob(p);
+    DirectionState &state = _directions[direction];
+    if (state._limit == 0 || wanted <= 0) {
+        return wanted;
     }
+    auto it = state._transfers.find(transfer);
+    if (it == state._transfers.end()) {
+        return wanted;
+    }
+    if (state._probing) {
+        state._probeBytes += wanted;
+        return wanted;
+    }
+
+    const qint64 quota = qMin(wanted, it->_tokens);
+    it->_tokens -= quota;
+    if (quota == 0) {
+        it->_waiting = true;
+    }
+    return quota;
 }
 
-void BandwidthManager::relativeUploadMeasuringTimerExpired()
+void BandwidthGovernor::returnQuota(Direction direction, QObject *transfer, qint64 unused)
 {
-    if (!usingRelativeUploadLimit() || _relativeUploadDeviceList.count() == 0) {
-        // Not in this limiting mode, just wait 1 sec to continue the cycle
-        _relativeUploadDelayTimer.setInterval(1000);
-        _relativeUploadDelayTimer.start();
+    DirectionState &state = _directions[direction];
+    if (state._limit == 0 || unused <= 0) {
         return;
     }
-    if (_relativeLimitCurrentMeasuredDevice == 0) {
-        qCDebug(lcBandwidthManager) << "No device set, just waiting 1 sec";
-        _relativeUploadDelayTimer.setInterval(1000);
-        _relativeUploadDelayTimer.start();
+    auto it = state._transfers.find(transfer);
+    if (it == state._transfers.end()) {
         return;
     }
-
-    qCDebug(lcBandwidthManager) << _relativeUploadDeviceList.count() << "Starting Delay";
-
-    qint64 relativeLimitProgressMeasured = (_relativeLimitCurrentMeasuredDevice->_readWithProgress
-                                               + _relativeLimitCurrentMeasuredDevice->_read)
-        / 2;
-    qint64 relativeLimitProgressDifference = relativeLimitProgressMeasured - _relativeUploadLimitProgressAtMeasuringRestart;
-    qCDebug(lcBandwidthManager) << _relativeUploadLimitProgressAtMeasuringRestart
-                                << relativeLimitProgressMeasured << relativeLimitProgressDifference;
-
-    qint64 speedkBPerSec = (relativeLimitProgressDifference / relativeLimitMeasuringTimerIntervalMsec * 1000.0) / 1024.0;
-    qCDebug(lcBandwidthManager) << relativeLimitProgressDifference / 1024 << "kB =>" << speedkBPerSec << "kB/sec on full speed ("
-                                << _relativeLimitCurrentMeasuredDevice->_readWithProgress << _relativeLimitCurrentMeasuredDevice->_read
-                                << qAbs(_relativeLimitCurrentMeasuredDevice->_readWithProgress
-                                       - _relativeLimitCurrentMeasuredDevice->_read)
-                                << ")";
-
-    qint64 uploadLimitPercent = -_currentUploadLimit;
-    // don't use too extreme values
-    uploadLimitPercent = qMin(uploadLimitPercent, qint64(90));
-    uploadLimitPercent = qMax(qint64(10), uploadLimitPercent);
-    qint64 wholeTimeMsec = (100.0 / uploadLimitPercent) * relativeLimitMeasuringTimerIntervalMsec;
-    qint64 waitTimeMsec = wholeTimeMsec - relativeLimitMeasuringTimerIntervalMsec;
-    qint64 realWaitTimeMsec = waitTimeMsec + wholeTimeMsec;
-    qCDebug(lcBandwidthManager) << waitTimeMsec << " - " << realWaitTimeMsec << " msec for " << uploadLimitPercent << "%";
-
-    // We want to wait twice as long since we want to give all
-    // devices the same quota we used now since we don't want
-    // any upload to timeout
-    _relativeUploadDelayTimer.setInterval(realWaitTimeMsec);
-    _relativeUploadDelayTimer.start();
-
-    int deviceCount = _relativeUploadDeviceList.count();
-    qint64 quotaPerDevice = relativeLimitProgressDifference * (uploadLimitPercent / 100.0) / deviceCount + 1.0;
-    Q_FOREACH (UploadDevice *ud, _relativeUploadDeviceList) {
-        ud->setBandwidthLimited(true);
-        ud->setChoked(false);
-        ud->giveBandwidthQuota(quotaPerDevice);
-        qCDebug(lcBandwidthManager) << "Gave" << quotaPerDevice / 1024.0 << "kB to" << ud;
+    if (state._probing) {
+        state._probeBytes -= unused;
+    } else {
+        it->_tokens += unused;
     }
-    _relativeLimitCurrentMeasuredDevice = 0;
 }
 
-void BandwidthManager::relativeUploadDelayTimerExpired()
+void BandwidthGovernor::updateTimer()
 {
-    // Switch to measuring state
-    _relativeUploadMeasuringTimer.start(); // always start to continue the cycle
+    bool active = false;
+    for (const DirectionState &state : _directions) {
+        active = active || (state._limit != 0 && !state._transfers.isEmpty());
+    }
+    if (active && !_tickTimer.isActive()) {
+        _lastTick = _clock();
+        _tickTimer.start();
+    } else if (!active) {
+        _tickTimer.stop();
+    }
+}
 
-    if (!usingRelativeUploadLimit()) {
-        return; // oh, not actually needed
+void BandwidthGovernor::wakeAll(DirectionState &state)
+{
+    for (auto it = state._transfers.begin(); it != state._transfers.end(); ++it) {
+        it->_waiting = false;
+        QMetaObject::invokeMethod(it.key(), it->_wakeMethod, Qt::QueuedConnection);
     }
+}
 
-    if (_relativeUploadDeviceList.isEmpty()) {
+void BandwidthGovernor::updateRelativeLimit(DirectionState &state)
+{
+    const qint64 now = _clock();
+    const qint64 elapsed = now - state._phaseStart;
+    if (!state._probing) {
+        if (elapsed >= cycleMsec - probeMsec) {
+            qCDebug(lcBandwidthManager) << "Starting measuring";
+            state._probing = true;
+            state._probeBytes = 0;
+            state._phaseStart = now;
+            wakeAll(state);
+        }
+        return;
+    }
+    if (elapsed < probeMsec) {
         return;
     }
 
-    qCDebug(lcBandwidthManager) << _relativeUploadDeviceList.count() << "Starting measuring";
-
-    // Take first device and then append it again (= we round robin all devices)
-    _relativeLimitCurrentMeasuredDevice = _relativeUploadDeviceList.takeFirst();
-    _relativeUploadDeviceList.append(_relativeLimitCurrentMeasuredDevice);
-
-    _relativeUploadLimitProgressAtMeasuringRestart = (_relativeLimitCurrentMeasuredDevice->_readWithProgress
-                                                         + _relativeLimitCurrentMeasuredDevice->_read)
-        / 2;
-    _relativeLimitCurrentMeasuredDevice->setBandwidthLimited(false);
-    _relativeLimitCurrentMeasuredDevice->setChoked(false);
-
-    // choke all other UploadDevices
-    Q_FOREACH (UploadDevice *ud, _relativeUploadDeviceList) {
-        if (ud != _relativeLimitCurrentMeasuredDevice) {
-            ud->setBandwidthLimited(true);
-            ud->setChoked(true);
-        }
+    const qint64 measured = state._probeBytes * 1000 / elapsed;
+    state._probeBytes = 0;
+    state._phaseStart = now;
+    if (measured <= 0) {
+        // Nothing was transferred, measure again
+        return;
     }
 
-    // now we're in measuring state
+    // Limit the rest of the cycle so that the whole cycle, probe included,
+    // averages to the percentage. Don't use too extreme values.
+    const qint64 percent = qBound(qint64(10), -state._limit, qint64(90));
+    state._rate = measured * (percent * cycleMsec - 100 * probeMsec) / (100 * (cycleMsec - probeMsec));
+    state._rate = qMax(state._rate, qint64(1));
+    state._probing = false;
+    state._rootTokens = 0;
+    qCDebug(lcBandwidthManager) << measured / 1024 << "kB/sec on full speed, limiting to"
+                                << state._rate / 1024 << "kB/sec for" << percent << "%";
 }
 
-// for downloads:
-void BandwidthManager::relativeDownloadMeasuringTimerExpired()
+void BandwidthGovernor::distribute(DirectionState &state, qint64 msecs)
 {
-    if (!usingRelativeDownloadLimit() || _downloadJobList.count() == 0) {
-        // Not in this limiting mode, just wait 1 sec to continue the cycle
-        _relativeDownloadDelayTimer.setInterval(1000);
-        _relativeDownloadDelayTimer.start();
-        return;
+    const qint64 cap = qMax(minimumBurstBytes, state._rate * burstMsec / 1000);
+    const qint64 amount = state._rootTokens + state._rate * msecs / 1000;
+
+    // First level: the folders, each can hold what its transfers can hold
+    QVector<QObject *> folders;
+    QVector<QVector<Transfer *>> folderTransfers;
+    QVector<qint64> folderCapacities;
+    for (auto it = state._transfers.begin(); it != state._transfers.end(); ++it) {
+        int index = folders.indexOf(it->_folder);
+        if (index < 0) {
+            index = folders.size();
+            folders.append(it->_folder);
+            folderTransfers.append(QVector<Transfer *>());
+            folderCapacities.append(0);
+        }
+        folderTransfers[index].append(&it.value());
+        folderCapacities[index] += qMax(qint64(0), cap - it->_tokens);
     }
-    if (_relativeLimitCurrentMeasuredJob == 0) {
-        qCDebug(lcBandwidthManager) << "No job set, just waiting 1 sec";
-        _relativeDownloadDelayTimer.setInterval(1000);
-        _relativeDownloadDelayTimer.start();
-        return;
+    const QVector<qint64> folderShares = fairShares(amount, folderCapacities);
+
+    // Second level: the transfers of each folder
+    qint64 given = 0;
+    for (int i = 0; i < folders.size(); ++i) {
+        const QVector<Transfer *> &transfers = folderTransfers.at(i);
+        QVector<qint64> capacities;
+        capacities.reserve(transfers.size());
+        for (const Transfer *t : transfers) {
+            capacities.append(qMax(qint64(0), cap - t->_tokens));
+        }
+        const QVector<qint64> shares = fairShares(folderShares.at(i), capacities);
+        for (int j = 0; j < transfers.size(); ++j) {
+            transfers.at(j)->_tokens += shares.at(j);
+            given += shares.at(j);
+        }
     }
 
-    qCDebug(lcBandwidthManager) << _downloadJobList.count() << "Starting Delay";
-
-    qint64 relativeLimitProgressMeasured = _relativeLimitCurrentMeasuredJob->currentDownloadPosition();
-    qint64 relativeLimitProgressDifference = relativeLimitProgressMeasured - _relativeDownloadLimitProgressAtMeasuringRestart;
-    qCDebug(lcBandwidthManager) << _relativeDownloadLimitProgressAtMeasuringRestart
-                                << relativeLimitProgressMeasured << relativeLimitProgressDifference;
-
-    qint64 speedkBPerSec = (relativeLimitProgressDifference / relativeLimitMeasuringTimerIntervalMsec * 1000.0) / 1024.0;
-    qCDebug(lcBandwidthManager) << relativeLimitProgressDifference / 1024 << "kB =>" << speedkBPerSec << "kB/sec on full speed ("
-                                << _relativeLimitCurrentMeasuredJob->currentDownloadPosition();
-
-    qint64 downloadLimitPercent = -_currentDownloadLimit;
-    // don't use too extreme values
-    downloadLimitPercent = qMin(downloadLimitPercent, qint64(90));
-    downloadLimitPercent = qMax(qint64(10), downloadLimitPercent);
-    qint64 wholeTimeMsec = (100.0 / downloadLimitPercent) * relativeLimitMeasuringTimerIntervalMsec;
-    qint64 waitTimeMsec = wholeTimeMsec - relativeLimitMeasuringTimerIntervalMsec;
-    qint64 realWaitTimeMsec = waitTimeMsec + wholeTimeMsec;
-    qCDebug(lcBandwidthManager) << waitTimeMsec << " - " << realWaitTimeMsec << " msec for " << downloadLimitPercent << "%";
-
-    // We want to wait twice as long since we want to give all
-    // devices the same quota we used now since we don't want
-    // any download to timeout
-    _relativeDownloadDelayTimer.setInterval(realWaitTimeMsec);
-    _relativeDownloadDelayTimer.start();
-
-    int jobCount = _downloadJobList.count();
-    qint64 quota = relativeLimitProgressDifference * (downloadLimitPercent / 100.0);
-    if (quota > 20 * 1024) {
-        qCInfo(lcBandwidthManager) << "ADJUSTING QUOTA FROM " << quota << " TO " << quota - 20 * 1024;
-        quota -= 20 * 1024;
-    }
-    qint64 quotaPerJob = quota / jobCount + 1.0;
-    Q_FOREACH (GETFileJob *gfj, _downloadJobList) {
-        gfj->setBandwidthLimited(true);
-        gfj->setChoked(false);
-        gfj->giveBandwidthQuota(quotaPerJob);
-        qCDebug(lcBandwidthManager) << "Gave" << quotaPerJob / 1024.0 << "kB to" << gfj;
+    // What nobody could hold is kept for the next tick, up to one burst
+    state._rootTokens = qMin(amount - given, cap);
+}
+
+void BandwidthGovernor::slotTick()
+{
+    const qint64 now = _clock();
+    const qint64 msecs = qBound(qint64(1), now - _lastTick, qint64(1000));
+    _lastTick = now;
+    for (DirectionState &state : _directions) {
+        if (state._limit == 0 || state._transfers.isEmpty()) {
+            continue;
+        }
+        if (state._limit < 0) {
+            updateRelativeLimit(state);
+        }
+        if (state._probing) {
+            continue;
+        }
+        distribute(state, msecs);
+        for (auto it = state._transfers.begin(); it != state._transfers.end(); ++it) {
+            if (it->_waiting && it->_tokens > 0) {
+                it->_waiting = false;
+                QMetaObject::invokeMethod(it.key(), it->_wakeMethod, Qt::QueuedConnection);
+            }
+        }
     }
-    _relativeLimitCurrentMeasuredDevice = 0;
+    updateTimer();
 }
 
-void BandwidthManager::relativeDownloadDelayTimerExpired()
+BandwidthManager::BandwidthManager()
+    : QObject()
 {
-    // Switch to measuring state
-    _relativeDownloadMeasuringTimer.start(); // always start to continue the cycle
+}
 
-    if (!usingRelativeDownloadLimit()) {
-        return; // oh, not actually needed
+BandwidthManager::~BandwidthManager()
+{
+    // Transfers that outlive the propagation must not be woken up through us
+    BandwidthGovernor *governor = BandwidthGovernor::instance();
+    foreach (QObject *child, _registered) {
+        governor->removeTransfer(BandwidthGovernor::Upload, child);
+        governor->removeTransfer(BandwidthGovernor::Download, child);
     }
+}
 
-    if (_downloadJobList.isEmpty()) {
-        qCDebug(lcBandwidthManager) << _downloadJobList.count() << "No jobs?";
-        return;
-    }
+void BandwidthManager::registerUploadDevice(UploadDevice *p)
+{
+    _registered.insert(p);
+    BandwidthGovernor::instance()->addTransfer(BandwidthGovernor::Upload, this, p, "readyRead");
+    QObject::connect(p, SIGNAL(destroyed(QObject *)), this, SLOT(unregisterUploadDevice(QObject *)));
+}
 
-    qCDebug(lcBandwidthManager) << _downloadJobList.count() << "Starting measuring";
+void BandwidthManager::unregisterUploadDevice(QObject *o)
+{
+    // Not a qobject_cast: this is called from the destructor
+    _registered.remove(o);
+    BandwidthGovernor::instance()->removeTransfer(BandwidthGovernor::Upload, o);
+}
 
-    // Take first device and then append it again (= we round robin all devices)
-    _relativeLimitCurrentMeasuredJob = _downloadJobList.takeFirst();
-    _downloadJobList.append(_relativeLimitCurrentMeasuredJob);
+void BandwidthManager::unregisterUploadDevice(UploadDevice *p)
+{
+    unregisterUploadDevice(static_cast<QObject *>(p));
+}
 
-    _relativeDownloadLimitProgressAtMeasuringRestart = _relativeLimitCurrentMeasuredJob->currentDownloadPosition();
-    _relativeLimitCurrentMeasuredJob->setBandwidthLimited(false);
-    _relativeLimitCurrentMeasuredJob->setChoked(false);
+void BandwidthManager::registerDownloadJob(GETFileJob *j)
+{
+    _registered.insert(j);
+    BandwidthGovernor::instance()->addTransfer(BandwidthGovernor::Download, this, j, "slotReadyRead");
+    QObject::connect(j, SIGNAL(destroyed(QObject *)), this, SLOT(unregisterDownloadJob(QObject *)));
+}
 
-    // choke all other download jobs
-    Q_FOREACH (GETFileJob *gfj, _downloadJobList) {
-        if (gfj != _relativeLimitCurrentMeasuredJob) {
-            gfj->setBandwidthLimited(true);
-            gfj->setChoked(true);
-        }
-    }
+void BandwidthManager::unregisterDownloadJob(GETFileJob *j)
+{
+    unregisterDownloadJob(static_cast<QObject *>(j));
+}
 
-    // now we're in measuring state
+void BandwidthManager::unregisterDownloadJob(QObject *o)
+{
+    _registered.remove(o);
+    BandwidthGovernor::instance()->removeTransfer(BandwidthGovernor::Download, o);
 }
 
-// end downloads
+qint64 BandwidthManager::takeUploadQuota(UploadDevice *device, qint64 wanted)
+{
+    return BandwidthGovernor::instance()->takeQuota(BandwidthGovernor::Upload, device, wanted);
+}
 
-void BandwidthManager::switchingTimerExpired()
+qint64 BandwidthManager::takeDownloadQuota(GETFileJob *job, qint64 wanted)
 {
-    qint64 newUploadLimit = _propagator->_uploadLimit.fetchAndAddAcquire(0);
-    if (newUploadLimit != _currentUploadLimit) {
-        qCInfo(lcBandwidthManager) << "Upload Bandwidth limit changed" << _currentUploadLimit << newUploadLimit;
-        _currentUploadLimit = newUploadLimit;
-        Q_FOREACH (UploadDevice *ud, _relativeUploadDeviceList) {
-            if (newUploadLimit == 0) {
-                ud->setBandwidthLimited(false);
-                ud->setChoked(false);
-            } else if (newUploadLimit > 0) {
-                ud->setBandwidthLimited(true);
-                ud->setChoked(false);
-            } else if (newUploadLimit < 0) {
-                ud->setBandwidthLimited(true);
-                ud->setChoked(true);
-            }
-        }
-    }
-    qint64 newDownloadLimit = _propagator->_downloadLimit.fetchAndAddAcquire(0);
-    if (newDownloadLimit != _currentDownloadLimit) {
-        qCInfo(lcBandwidthManager) << "Download Bandwidth limit changed" << _currentDownloadLimit << newDownloadLimit;
-        _currentDownloadLimit = newDownloadLimit;
-        Q_FOREACH (GETFileJob *j, _downloadJobList) {
-            if (usingAbsoluteDownloadLimit()) {
-                j->setBandwidthLimited(true);
-                j->setChoked(false);
-            } else if (usingRelativeDownloadLimit()) {
-                j->setBandwidthLimited(true);
-                j->setChoked(true);
-            } else {
-                j->setBandwidthLimited(false);
-                j->setChoked(false);
-            }
-        }
-    }
+    return BandwidthGovernor::instance()->takeQuota(BandwidthGovernor::Download, job, wanted);
 }
 
-void BandwidthManager::absoluteLimitTimerExpired()
+void BandwidthManager::returnDownloadQuota(GETFileJob *job, qint64 unused)
 {
-    if (usingAbsoluteUploadLimit() && _absoluteUploadDeviceList.count() > 0) {
-        qint64 quotaPerDevice = _currentUploadLimit / qMax(1, _absoluteUploadDeviceList.count());
-        qCDebug(lcBandwidthManager) << quotaPerDevice << _absoluteUploadDeviceList.count() << _currentUploadLimit;
-        Q_FOREACH (UploadDevice *device, _absoluteUploadDeviceList) {
-            device->giveBandwidthQuota(quotaPerDevice);
-            qCDebug(lcBandwidthManager) << "Gave " << quotaPerDevice / 1024.0 << " kB to" << device;
-        }
-    }
-    if (usingAbsoluteDownloadLimit() && _downloadJobList.count() > 0) {
-        qint64 quotaPerJob = _currentDownloadLimit / qMax(1, _downloadJobList.count());
-        qCDebug(lcBandwidthManager) << quotaPerJob << _downloadJobList.count() << _currentDownloadLimit;
-        Q_FOREACH (GETFileJob *j, _downloadJobList) {
-            j->giveBandwidthQuota(quotaPerJob);
-            qCDebug(lcBandwidthManager) << "Gave " << quotaPerJob / 1024.0 << " kB to" << j;
-        }
-    }
+    BandwidthGovernor::instance()->returnQuota(BandwidthGovernor::Download, job, unused);
 }
 }
@@ -15,92 +15,164 @@
 #ifndef BANDWIDTHMANAGER_H
 #define BANDWIDTHMANAGER_H
 
+#include "owncloudlib.h"
+
+#include <QElapsedTimer>
+#include <QHash>
 #include <QObject>
-#include <QLinkedList>
+#include <QSet>
 #include <QTimer>
-#include <QIODevice>
+#include <QVector>
+
+#include <functional>
 
 namespace OCC {
 
 class UploadDevice;
 class GETFileJob;
-class OwncloudPropagator;
 
 /**
- * @brief The BandwidthManager class
+ * @brief The process wide bandwidth limit, shared by all folders and accounts
+ *
+ * A hierarchical token bucket per direction: every tick the bucket is
+ * refilled at the limited rate and the tokens are split evenly between the
+ * folders with active transfers, then evenly between the transfers of each
+ * folder. Tokens a folder or transfer can't hold go to the others.
+ *
+ * Transfers take tokens for every read with takeQuota(). When they get none,
+ * their wake method is invoked once they have some again.
+ *
+ * A relative limit alternates between a short probe at full speed, which
+ * measures the available bandwidth, and a longer phase at the rate that
+ * makes the average match the percentage.
+ *
+ * Only used from the main thread.
  * @ingroup libsync
  */
-class BandwidthManager : public QObject
+class OWNCLOUDSYNC_EXPORT BandwidthGovernor : public QObject
 {
     Q_OBJECT
 public:
-    BandwidthManager(OwncloudPropagator *p);
-    ~BandwidthManager();
-
-    bool usingAbsoluteUploadLimit() { return _currentUploadLimit > 0; }
-    bool usingRelativeUploadLimit() { return _currentUploadLimit < 0; }
-    bool usingAbsoluteDownloadLimit() { return _currentDownloadLimit > 0; }
-    bool usingRelativeDownloadLimit() { return _currentDownloadLimit < 0; }
-
+    enum Direction {
+        Upload = 0,
+        Download = 1
+    };
 
-public slots:
-    void registerUploadDevice(UploadDevice *);
-    void unregisterUploadDevice(UploadDevice *);
-    void unregisterUploadDevice(QObject *);
+    static BandwidthGovernor *instance();
 
-    void registerDownloadJob(GETFileJob *);
-    void unregisterDownloadJob(GETFileJob *);
-    void unregisterDownloadJob(QObject *);
+    /** \a limit > 0 is in bytes per second, < 0 a percentage of the measured bandwidth, 0 is unlimited */
+    void setLimit(Direction direction, qint64 limit);
+    qint64 limit(Direction direction) const { return _directions[direction]._limit; }
+    bool isLimited(Direction direction) const { return _directions[direction]._limit != 0; }
 
-    void absoluteLimitTimerExpired();
-    void switchingTimerExpired();
+    /** The rate the bucket is refilled with, in bytes per second; 0 while probing or unlimited */
+    qint64 currentRate(Direction direction) const;
 
-    void relativeUploadMeasuringTimerExpired();
-    void relativeUploadDelayTimerExpired();
+    /** Registers a transfer of \a folder; \a wakeMethod is invoked, queued, when it gets tokens */
+    void addTransfer(Direction direction, QObject *folder, QObject *transfer, const char *wakeMethod);
+    void removeTransfer(Direction direction, QObject *transfer);
 
-    void relativeDownloadMeasuringTimerExpired();
-    void relativeDownloadDelayTimerExpired();
-
-private:
-    // for switching between absolute and relative bw limiting
-    QTimer _switchingTimer;
+    /** Takes up to \a wanted bytes of quota, everything if there is no limit */
+    qint64 takeQuota(Direction direction, QObject *transfer, qint64 wanted);
 
-    // FIXME this timer and this variable should be replaced
-    // by the propagator emitting the changed limit values to us as signal
-    OwncloudPropagator *_propagator;
+    /** Gives back quota that was taken but not used */
+    void returnQuota(Direction direction, QObject *transfer, qint64 unused);
 
-    // for absolute up/down bw limiting
-    QTimer _absoluteLimitTimer;
+    /**
+     * Splits \a amount between the \a capacities as evenly as possible.
+     *
+     * Shares that don't fit a capacity go to the others, so the result is
+     * the max-min fair allocation.
+     */
+    static QVector<qint64> fairShares(qint64 amount, const QVector<qint64> &capacities);
 
-    // FIXME merge these two lists
-    QLinkedList<UploadDevice *> _absoluteUploadDeviceList;
-    QLinkedList<UploadDevice *> _relativeUploadDeviceList;
+    /** Milliseconds of a monotonic clock */
+    typedef std::function<qint64()> Clock;
 
-    QTimer _relativeUploadMeasuringTimer;
+    /** Replaces the clock the ticks are measured with, for tests; an empty one restores the default */
+    void setClock(const Clock &clock);
 
-    // for relative bw limiting, we need to wait this amount before measuring again
-    QTimer _relativeUploadDelayTimer;
+private slots:
+    void slotTick();
 
-    // the device measured
-    UploadDevice *_relativeLimitCurrentMeasuredDevice;
+private:
+    BandwidthGovernor();
+    static BandwidthGovernor *_instance;
+
+    struct Transfer
+    {
+        QObject *_folder;
+        const char *_wakeMethod;
+        qint64 _tokens;
+        bool _waiting;
+    };
+
+    struct DirectionState
+    {
+        DirectionState()
+            : _limit(0)
+            , _rate(0)
+            , _rootTokens(0)
+            , _probing(false)
+            , _probeBytes(0)
+            , _phaseStart(0)
+        {
+        }
+        qint64 _limit;
+        qint64 _rate; // current refill rate, for relative limits derived from the last probe
+        qint64 _rootTokens; // tokens no transfer could take yet
+        QHash<QObject *, Transfer> _transfers;
+
+        // Relative limits only
+        bool _probing;
+        qint64 _probeBytes;
+        qint64 _phaseStart; // clock time the current probe or limiting phase started
+    };
+
+    void updateTimer();
+    void updateRelativeLimit(DirectionState &state);
+    void distribute(DirectionState &state, qint64 msecs);
+    void wakeAll(DirectionState &state);
+
+    DirectionState _directions[2];
+    QTimer _tickTimer;
+    QElapsedTimer _monotonic;
+    Clock _clock;
+    qint64 _lastTick;
+};
 
-    // for measuring how much progress we made at start
-    qint64 _relativeUploadLimitProgressAtMeasuringRestart;
-    qint64 _currentUploadLimit;
+/**
+ * @brief The bandwidth limiting of one folder's propagation
+ *
+ * Created per OwncloudPropagator; registers its transfers with the
+ * BandwidthGovernor so all folders share one limit.
+ * @ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT BandwidthManager : public QObject
+{
+    Q_OBJECT
+public:
+    BandwidthManager();
+    ~BandwidthManager();
 
-    QLinkedList<GETFileJob *> _downloadJobList;
-    QTimer _relativeDownloadMeasuringTimer;
+    bool isUploadLimited() const { return BandwidthGovernor::instance()->isLimited(BandwidthGovernor::Upload); }
+    bool isDownloadLimited() const { return BandwidthGovernor::instance()->isLimited(BandwidthGovernor::Download); }
 
-    // for relative bw limiting, we need to wait this amount before measuring again
-    QTimer _relativeDownloadDelayTimer;
+    qint64 takeUploadQuota(UploadDevice *device, qint64 wanted);
+    qint64 takeDownloadQuota(GETFileJob *job, qint64 wanted);
+    void returnDownloadQuota(GETFileJob *job, qint64 unused);
 
-    // the device measured
-    GETFileJob *_relativeLimitCurrentMeasuredJob;
+public slots:
+    void registerUploadDevice(UploadDevice *);
+    void unregisterUploadDevice(UploadDevice *);
+    void unregisterUploadDevice(QObject *);
 
-    // for measuring how much progress we made at start
-    qint64 _relativeDownloadLimitProgressAtMeasuringRestart;
+    void registerDownloadJob(GETFileJob *);
+    void unregisterDownloadJob(GETFileJob *);
+    void unregisterDownloadJob(QObject *);
 
-    qint64 _currentDownloadLimit;
+private:
+    QSet<QObject *> _registered; // our transfers in the governor
 };
 }
 
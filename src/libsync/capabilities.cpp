@@ -132,6 +132,26 @@ bool Capabilities::chunkingParallelUploadDisabled() const
     return _capabilities["dav"].toMap()["chunkingParallelUploadDisabled"].toBool();
 }
 
+bool Capabilities::bulkUpload() const
+{
+    static const auto bulkupload = qgetenv("OWNCLOUD_BULK_UPLOAD");
+    if (bulkupload == "0")
+        return false;
+    if (bulkupload == "1")
+        return true;
+    return _capabilities["dav"].toMap()["bulkupload"].toByteArray() >= "1.0";
+}
+
+bool Capabilities::bulkDownload() const
+{
+    static const auto bulkdownload = qgetenv("OWNCLOUD_BULK_DOWNLOAD");
+    if (bulkdownload == "0")
+        return false;
+    if (bulkdownload == "1")
+        return true;
+    return _capabilities["dav"].toMap()["bulkdownload"].toByteArray() >= "1.0";
+}
+
 QList<int> Capabilities::httpErrorCodesThatResetFailingChunkedUploads() const
 {
     QList<int> list;
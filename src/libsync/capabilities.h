@@ -47,6 +47,12 @@ public:
     /// disable parallel upload in chunking
     bool chunkingParallelUploadDisabled() const;
 
+    /// whether small files may be uploaded together in one multipart request
+    bool bulkUpload() const;
+
+    /// whether small files may be downloaded together in one multipart response
+    bool bulkDownload() const;
+
     /// returns true if the capabilities report notifications
     bool notificationsAvailable() const;
 
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "checksumkernels.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_KERNELS_X86
+#include <cpuid.h>
+#include <immintrin.h>
+// The kernels are compiled for their instruction set only, the rest of the
+// library must still run on CPUs without it
+#define KERNEL_TARGET(features) __attribute__((target(features)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CHECKSUM_KERNELS_X86
+#include <intrin.h>
+#include <immintrin.h>
+#define KERNEL_TARGET(features)
+#endif
+
+namespace OCC {
+
+namespace {
+
+#ifdef CHECKSUM_KERNELS_X86
+    struct CpuFeatures
+    {
+        bool ssse3 = false;
+        bool sse41 = false;
+        bool sha = false;
+
+        CpuFeatures()
+        {
+            unsigned int regs[4] = { 0, 0, 0, 0 };
+            cpuid(0, regs);
+            const unsigned int maxLeaf = regs[0];
+            if (maxLeaf >= 1) {
+                cpuid(1, regs);
+                ssse3 = regs[2] & (1u << 9);
+                sse41 = regs[2] & (1u << 19);
+            }
+            if (maxLeaf >= 7) {
+                cpuid(7, regs);
+                sha = regs[1] & (1u << 29);
+            }
+        }
+
+        static void cpuid(unsigned int leaf, unsigned int regs[4])
+        {
+#ifdef _MSC_VER
+            __cpuidex(reinterpret_cast<int *>(regs), leaf, 0);
+#else
+            __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        }
+    };
+
+    const CpuFeatures &cpuFeatures()
+    {
+        static const CpuFeatures features;
+        return features;
+    }
+#endif
+
+    bool kernelsDisabled()
+    {
+        static const bool disabled = !qgetenv("OWNCLOUD_DISABLE_CHECKSUM_KERNELS").isEmpty();
+        return disabled;
+    }
+
+#ifdef CHECKSUM_KERNELS_X86
+    /*
+     * One group of four SHA1 rounds. The message schedule for the following
+     * groups is computed alongside: group g uses msg[g % 4] and prepares the
+     * words for the groups g + 1, g + 2 and g + 3.
+     */
+#define SHA1_GROUP(g, f, e, eNext)                                                  \
+    e = _mm_sha1nexte_epu32(e, msg[(g) % 4]);                                       \
+    eNext = abcd;                                                                   \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f);                                         \
+    if ((g) >= 3 && (g) <= 18)                                                      \
+        msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]); \
+    if ((g) >= 2 && (g) <= 17)                                                      \
+        msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], msg[(g) % 4]);      \
+    if ((g) >= 1 && (g) <= 16)                                                      \
+        msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]);
+
+    KERNEL_TARGET("sha,ssse3,sse4.1")
+    void sha1Blocks(quint32 state[5], const unsigned char *data, qint64 blocks)
+    {
+        // Reverses the bytes: the message words are big endian
+        const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+        __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+        __m128i e0 = _mm_set_epi32(int(state[4]), 0, 0, 0);
+        __m128i e1;
+        __m128i msg[4];
+
+        for (; blocks > 0; --blocks, data += 64) {
+            const __m128i abcdSave = abcd;
+            const __m128i e0Save = e0;
+
+            for (int i = 0; i < 4; ++i) {
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)), byteSwap);
+            }
+
+            // The first group adds e directly, the others derive it from a
+            e0 = _mm_add_epi32(e0, msg[0]);
+            e1 = abcd;
+            abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+            SHA1_GROUP(1, 0, e1, e0)
+            SHA1_GROUP(2, 0, e0, e1)
+            SHA1_GROUP(3, 0, e1, e0)
+            SHA1_GROUP(4, 0, e0, e1)
+            SHA1_GROUP(5, 1, e1, e0)
+            SHA1_GROUP(6, 1, e0, e1)
+            SHA1_GROUP(7, 1, e1, e0)
+            SHA1_GROUP(8, 1, e0, e1)
+            SHA1_GROUP(9, 1, e1, e0)
+            SHA1_GROUP(10, 2, e0, e1)
+            SHA1_GROUP(11, 2, e1, e0)
+            SHA1_GROUP(12, 2, e0, e1)
+            SHA1_GROUP(13, 2, e1, e0)
+            SHA1_GROUP(14, 2, e0, e1)
+            SHA1_GROUP(15, 3, e1, e0)
+            SHA1_GROUP(16, 3, e0, e1)
+            SHA1_GROUP(17, 3, e1, e0)
+            SHA1_GROUP(18, 3, e0, e1)
+            SHA1_GROUP(19, 3, e1, e0)
+
+            e0 = _mm_sha1nexte_epu32(e0, e0Save);
+            abcd = _mm_add_epi32(abcd, abcdSave);
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+        state[4] = quint32(_mm_extract_epi32(e0, 3));
+    }
+#undef SHA1_GROUP
+
+    // Largest number of bytes before the sums must be reduced modulo adlerBase
+    const int adlerNMax = 5552;
+    const quint32 adlerBase = 65521;
+
+    KERNEL_TARGET("ssse3")
+    quint32 adler32Ssse3(quint32 adler, const unsigned char *data, qint64 length)
+    {
+        quint32 s1 = adler & 0xffff;
+        quint32 s2 = adler >> 16;
+
+        // Blocks of 32 bytes: s1 gets the sum of the bytes, s2 the bytes
+        // weighted by their distance to the end of the block
+        const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+        const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+
+        qint64 blocks = length / 32;
+        length -= blocks * 32;
+        while (blocks > 0) {
+            int n = int(qMin(blocks, qint64(adlerNMax / 32)));
+            blocks -= n;
+
+            // Every block adds 32 times the s1 of the blocks before it to s2
+            __m128i previousS1 = _mm_set_epi32(0, 0, 0, int(s1 * n));
+            __m128i vs1 = zero;
+            __m128i vs2 = _mm_set_epi32(0, 0, 0, int(s2));
+            for (; n > 0; --n, data += 32) {
+                const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+                const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16));
+                previousS1 = _mm_add_epi32(previousS1, vs1);
+                vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes1, zero));
+                vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+                vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes2, zero));
+                vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            }
+            vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(previousS1, 5));
+
+            // Sum up the lanes
+            vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(2, 3, 0, 1)));
+            vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+            s1 += quint32(_mm_cvtsi128_si32(vs1));
+            vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+            vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+            s2 = quint32(_mm_cvtsi128_si32(vs2));
+
+            s1 %= adlerBase;
+            s2 %= adlerBase;
+        }
+
+        // Less than one block is left
+        for (; length > 0; --length) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= adlerBase;
+        s2 %= adlerBase;
+
+        return s1 | (s2 << 16);
+    }
+#endif
+}
+
+namespace ChecksumKernels {
+
+    bool sha1Supported()
+    {
+#ifdef CHECKSUM_KERNELS_X86
+        return !kernelsDisabled() && cpuFeatures().sha && cpuFeatures().ssse3 && cpuFeatures().sse41;
+#else
+        return false;
+#endif
+    }
+
+    bool adler32Supported()
+    {
+#ifdef CHECKSUM_KERNELS_X86
+        return !kernelsDisabled() && cpuFeatures().ssse3;
+#else
+        return false;
+#endif
+    }
+
+    quint32 adler32(quint32 adler, const char *data, qint64 length)
+    {
+#ifdef CHECKSUM_KERNELS_X86
+        return adler32Ssse3(adler, reinterpret_cast<const unsigned char *>(data), length);
+#else
+        Q_UNUSED(data);
+        Q_UNUSED(length);
+        return adler;
+#endif
+    }
+
+    Sha1::Sha1()
+    {
+        reset();
+    }
+
+    void Sha1::reset()
+    {
+        _state[0] = 0x67452301;
+        _state[1] = 0xEFCDAB89;
+        _state[2] = 0x98BADCFE;
+        _state[3] = 0x10325476;
+        _state[4] = 0xC3D2E1F0;
+        _length = 0;
+    }
+
+    void Sha1::addData(const char *data, qint64 length)
+    {
+#ifdef CHECKSUM_KERNELS_X86
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        int buffered = int(_length % 64);
+        _length += length;
+
+        if (buffered > 0) {
+            const int fill = int(qMin(qint64(64 - buffered), length));
+            std::memcpy(_buffer + buffered, bytes, fill);
+            bytes += fill;
+            length -= fill;
+            if (buffered + fill < 64) {
+                return;
+            }
+            sha1Blocks(_state, _buffer, 1);
+        }
+
+        sha1Blocks(_state, bytes, length / 64);
+        bytes += length / 64 * 64;
+        std::memcpy(_buffer, bytes, length % 64);
+#else
+        Q_UNUSED(data);
+        Q_UNUSED(length);
+#endif
+    }
+
+    QByteArray Sha1::result() const
+    {
+        // Pad a copy: the bit 1, zeros, and the length in bits as 64 bit big endian
+        Sha1 copy = *this;
+        const quint64 bitLength = quint64(_length) * 8;
+        const int buffered = int(_length % 64);
+        const int padding = buffered < 56 ? 56 - buffered : 120 - buffered;
+        char trailer[64 + 8] = { 0 };
+        trailer[0] = char(0x80);
+        for (int i = 0; i < 8; ++i) {
+            trailer[padding + i] = char(bitLength >> (56 - 8 * i));
+        }
+        copy.addData(trailer, padding + 8);
+
+        QByteArray hash(20, Qt::Uninitialized);
+        for (int i = 0; i < 5; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                hash[4 * i + j] = char(copy._state[i] >> (24 - 8 * j));
+            }
+        }
+        return hash;
+    }
+}
+}
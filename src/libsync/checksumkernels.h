@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#pragma once
+
+#include "owncloudlib.h"
+
+#include <QByteArray>
+
+namespace OCC {
+
+/**
+ *  \addtogroup libsync
+ *  @{
+ */
+
+/**
+ * @brief Checksum implementations using special CPU instructions
+ *
+ * They give the same results as QCryptographicHash and zlib, but may only
+ * be used if the CPU supports them. ChecksumCalculator picks them when possible.
+ *
+ * Setting OWNCLOUD_DISABLE_CHECKSUM_KERNELS disables them.
+ */
+namespace ChecksumKernels {
+
+    /**
+     * Whether Sha1 can be used: the CPU has the SHA extensions.
+     */
+    bool OWNCLOUDSYNC_EXPORT sha1Supported();
+
+    /**
+     * Whether adler32() can be used: the CPU has SSSE3.
+     */
+    bool OWNCLOUDSYNC_EXPORT adler32Supported();
+
+    /**
+     * Continues the Adler32 checksum \a adler with \a length bytes of \a data,
+     * like zlib's adler32(). The checksum of no data is 1.
+     */
+    quint32 OWNCLOUDSYNC_EXPORT adler32(quint32 adler, const char *data, qint64 length);
+
+    /**
+     * @brief SHA1 computed with the SHA extensions of x86 CPUs
+     */
+    class OWNCLOUDSYNC_EXPORT Sha1
+    {
+    public:
+        Sha1();
+
+        void reset();
+        void addData(const char *data, qint64 length);
+
+        /** The raw hash of the data added so far, more data may still be added */
+        QByteArray result() const;
+
+    private:
+        quint32 _state[5];
+        unsigned char _buffer[64];
+        qint64 _length;
+    };
+}
+
+/** @} */
+}
@@ -19,7 +19,12 @@
 #include "account.h"
 
 #include <QLoggingCategory>
-#include <qtconcurrentrun.h>
+#include <QSharedPointer>
+#include <QThreadStorage>
+
+#ifdef ZLIB_FOUND
+#include <zlib.h>
+#endif
 
 /** \file checksums.cpp
  *
@@ -73,6 +78,16 @@
  * - MD5
  * - SHA1
  *
+ * Downloads compute their checksums with ChecksumCalculator while the
+ * data is written, so the downloaded file doesn't need to be read again.
+ * Uploads compute the content and the transmission checksum together with
+ * ComputeMultipleChecksums, which reads the file only once.
+ *
+ * All checksums of files are computed on the threads of the ChecksumExecutor.
+ *
+ * Checksums of local files are cached in the journal, keyed by the inode,
+ * size, mtime and ctime of the file, so an unchanged file isn't read again.
+ *
  */
 
 namespace OCC {
@@ -132,11 +147,126 @@ QByteArray contentChecksumType()
     return type;
 }
 
+bool isCollisionSafeChecksumType(const QByteArray &checksumType)
+{
+    // Like in the reconcile: Adler32 collides too easily for particular inputs
+    return checksumType == checkSumSHA1C || checksumType == checkSumMD5C;
+}
+
+ChecksumCalculator::ChecksumCalculator(const QByteArray &checksumType)
+    : _checksumType(checksumType)
+    , _isAdler(false)
+    , _adler(1)
+{
+    if (checksumType == checkSumMD5C) {
+        _cryptoHash.reset(new QCryptographicHash(QCryptographicHash::Md5));
+    } else if (checksumType == checkSumSHA1C) {
+        if (ChecksumKernels::sha1Supported()) {
+            _sha1Kernel.reset(new ChecksumKernels::Sha1);
+        } else {
+            _cryptoHash.reset(new QCryptographicHash(QCryptographicHash::Sha1));
+        }
+    }
+#ifdef ZLIB_FOUND
+    else if (checksumType == checkSumAdlerC) {
+        _isAdler = true;
+    }
+#endif
+}
+
+ChecksumCalculator::~ChecksumCalculator()
+{
+}
+
+bool ChecksumCalculator::isValid() const
+{
+    return _cryptoHash || _sha1Kernel || _isAdler;
+}
+
+void ChecksumCalculator::addData(const char *data, qint64 length)
+{
+    if (_cryptoHash) {
+        _cryptoHash->addData(data, length);
+    } else if (_sha1Kernel) {
+        _sha1Kernel->addData(data, length);
+    }
+#ifdef ZLIB_FOUND
+    else if (_isAdler && ChecksumKernels::adler32Supported()) {
+        _adler = ChecksumKernels::adler32(_adler, data, length);
+    } else if (_isAdler) {
+        _adler = adler32(_adler, reinterpret_cast<const Bytef *>(data), length);
+    }
+#endif
+}
+
+void ChecksumCalculator::reset()
+{
+    if (_cryptoHash) {
+        _cryptoHash->reset();
+    }
+    if (_sha1Kernel) {
+        _sha1Kernel->reset();
+    }
+    _adler = 1;
+}
+
+QByteArray ChecksumCalculator::result() const
+{
+    if (_cryptoHash) {
+        return _cryptoHash->result().toHex();
+    } else if (_sha1Kernel) {
+        return _sha1Kernel->result().toHex();
+    } else if (_isAdler) {
+        return QByteArray::number(_adler, 16);
+    }
+    return QByteArray();
+}
+
+ChecksumExecutor::ChecksumExecutor()
+{
+    static const int threads = qgetenv("OWNCLOUD_CHECKSUM_THREADS").toInt();
+    _pool.setMaxThreadCount(threads > 0 ? threads : 2);
+}
+
+ChecksumExecutor *ChecksumExecutor::instance()
+{
+    static ChecksumExecutor executor;
+    return &executor;
+}
+
+int ChecksumExecutor::maxThreadCount() const
+{
+    return _pool.maxThreadCount();
+}
+
+void ChecksumExecutor::setMaxThreadCount(int count)
+{
+    _pool.setMaxThreadCount(count);
+}
+
+Q_GLOBAL_STATIC(QThreadStorage<QFutureInterfaceBase>, currentChecksumTask)
+
+void ChecksumExecutor::setCurrentTask(const QFutureInterfaceBase &task)
+{
+    currentChecksumTask()->setLocalData(task);
+}
+
+bool ChecksumExecutor::isCanceled()
+{
+    return currentChecksumTask()->hasLocalData() && currentChecksumTask()->localData().isCanceled();
+}
+
 ComputeChecksum::ComputeChecksum(QObject *parent)
     : QObject(parent)
+    , _checksumCache(0)
 {
 }
 
+ComputeChecksum::~ComputeChecksum()
+{
+    cancel();
+}
+
 void ComputeChecksum::setChecksumType(const QByteArray &type)
 {
     _checksumType = type;
@@ -147,51 +277,208 @@ QByteArray ComputeChecksum::checksumType() const
     return _checksumType;
 }
 
+void ComputeChecksum::cancel()
+{
+    _watcher.cancel();
+}
+
+void ComputeChecksum::setChecksumCache(SyncJournalDb *journal)
+{
+    _checksumCache = journal;
+}
+
 void ComputeChecksum::start(const QString &filePath)
 {
+    if (_checksumCache) {
+        _cacheKey = SyncJournalDb::ChecksumCacheKey::forFile(filePath);
+        const QByteArray checksum = _checksumCache->getCachedChecksum(_cacheKey, _checksumType);
+        if (!checksum.isEmpty()) {
+            emit done(_checksumType, checksum);
+            return;
+        }
+    }
+
     // Calculate the checksum in a different thread first.
     connect(&_watcher, SIGNAL(finished()),
         this, SLOT(slotCalculationDone()),
         Qt::UniqueConnection);
-    _watcher.setFuture(QtConcurrent::run(ComputeChecksum::computeNow, filePath, checksumType()));
+    const QByteArray type = checksumType();
+    _watcher.setFuture(ChecksumExecutor::instance()->run<QByteArray>(ChecksumExecutor::TransferPriority, [filePath, type]() {
+        return ComputeChecksum::computeNow(filePath, type);
+    }));
 }
 
 QByteArray ComputeChecksum::computeNow(const QString &filePath, const QByteArray &checksumType)
 {
-    if (checksumType == checkSumMD5C) {
-        return FileSystem::calcMd5(filePath);
-    } else if (checksumType == checkSumSHA1C) {
-        return FileSystem::calcSha1(filePath);
-    }
-#ifdef ZLIB_FOUND
-    else if (checksumType == checkSumAdlerC) {
-        return FileSystem::calcAdler32(filePath);
-    }
-#endif
-    // for an unknown checksum or no checksum, we're done right now
-    if (!checksumType.isEmpty()) {
-        qCWarning(lcChecksums) << "Unknown checksum type:" << checksumType;
-    }
-    return QByteArray();
+    // for an unknown checksum or no checksum, the result is empty
+    return ComputeMultipleChecksums::computeNow(filePath, QList<QByteArray>() << checksumType).checksums.value(checksumType);
 }
 
 void ComputeChecksum::slotCalculationDone()
 {
+    if (_watcher.isCanceled()) {
+        return;
+    }
     QByteArray checksum = _watcher.future().result();
     if (!checksum.isNull()) {
+        if (_checksumCache) {
+            _checksumCache->setCachedChecksum(_cacheKey, _checksumType, checksum);
+        }
         emit done(_checksumType, checksum);
     } else {
         emit done(QByteArray(), QByteArray());
     }
 }
 
+ComputeMultipleChecksums::ComputeMultipleChecksums(QObject *parent)
+    : QObject(parent)
+    , _keepContentsSize(0)
+    , _checksumCache(0)
+{
+}
+
+ComputeMultipleChecksums::~ComputeMultipleChecksums()
+{
+    cancel();
+}
+
+void ComputeMultipleChecksums::setChecksumTypes(const QList<QByteArray> &types)
+{
+    _checksumTypes = types;
+}
+
+QList<QByteArray> ComputeMultipleChecksums::checksumTypes() const
+{
+    return _checksumTypes;
+}
+
+void ComputeMultipleChecksums::setKeepContentsSize(qint64 maxSize)
+{
+    _keepContentsSize = maxSize;
+}
+
+void ComputeMultipleChecksums::cancel()
+{
+    _watcher.cancel();
+}
+
+void ComputeMultipleChecksums::setChecksumCache(SyncJournalDb *journal)
+{
+    _checksumCache = journal;
+}
+
+void ComputeMultipleChecksums::start(const QString &filePath)
+{
+    QList<QByteArray> types = _checksumTypes;
+    _cachedChecksums.clear();
+    if (_checksumCache) {
+        _cacheKey = SyncJournalDb::ChecksumCacheKey::forFile(filePath);
+        foreach (const QByteArray &type, _checksumTypes) {
+            const QByteArray checksum = _checksumCache->getCachedChecksum(_cacheKey, type);
+            if (!checksum.isEmpty()) {
+                _cachedChecksums.insert(type, checksum);
+                types.removeAll(type);
+            }
+        }
+        if (types.isEmpty()) {
+            emit done(_cachedChecksums, QByteArray());
+            return;
+        }
+    }
+
+    // Calculate the checksums in a different thread first.
+    connect(&_watcher, SIGNAL(finished()),
+        this, SLOT(slotCalculationDone()),
+        Qt::UniqueConnection);
+    const qint64 keepContentsSize = _keepContentsSize;
+    _watcher.setFuture(ChecksumExecutor::instance()->run<Result>(ChecksumExecutor::TransferPriority, [filePath, types, keepContentsSize]() {
+        return ComputeMultipleChecksums::computeNow(filePath, types, keepContentsSize);
+    }));
+}
+
+ComputeMultipleChecksums::Result ComputeMultipleChecksums::computeNow(const QString &filePath,
+    const QList<QByteArray> &checksumTypes, qint64 keepContentsSize)
+{
+    Result result;
+
+    QList<QSharedPointer<ChecksumCalculator>> calculators;
+    foreach (const QByteArray &type, checksumTypes) {
+        QSharedPointer<ChecksumCalculator> calculator(new ChecksumCalculator(type));
+        if (calculator->isValid()) {
+            calculators.append(calculator);
+        } else if (!type.isEmpty()) {
+            qCWarning(lcChecksums) << "Unknown checksum type:" << type;
+        }
+    }
+    if (calculators.isEmpty()) {
+        return result;
+    }
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(lcChecksums) << "Could not open" << filePath << "for computing checksums:" << file.errorString();
+        return result;
+    }
+
+    const qint64 fileSize = file.size();
+    if (fileSize > 0 && fileSize <= keepContentsSize) {
+        result.contents = file.read(fileSize);
+        if (result.contents.size() != fileSize) {
+            qCWarning(lcChecksums) << "Could not read" << filePath << "for computing checksums:" << file.errorString();
+            result.contents.clear();
+            return result;
+        }
+        foreach (const auto &calculator, calculators) {
+            calculator->addData(result.contents.constData(), result.contents.size());
+        }
+    } else {
+        const qint64 bufSize = qMin(qint64(500 * 1024), fileSize + 1);
+        QByteArray buf(bufSize, Qt::Uninitialized);
+        qint64 size;
+        while ((size = file.read(buf.data(), bufSize)) > 0) {
+            if (ChecksumExecutor::isCanceled()) {
+                return result;
+            }
+            foreach (const auto &calculator, calculators) {
+                calculator->addData(buf.constData(), size);
+            }
+        }
+        if (size < 0) {
+            qCWarning(lcChecksums) << "Could not read" << filePath << "for computing checksums:" << file.errorString();
+            return result;
+        }
+    }
+
+    foreach (const auto &calculator, calculators) {
+        result.checksums.insert(calculator->checksumType(), calculator->result());
+    }
+    return result;
+}
+
+void ComputeMultipleChecksums::slotCalculationDone()
+{
+    if (_watcher.isCanceled()) {
+        return;
+    }
+    const Result result = _watcher.future().result();
+    QHash<QByteArray, QByteArray> checksums = _cachedChecksums;
+    for (auto it = result.checksums.constBegin(); it != result.checksums.constEnd(); ++it) {
+        if (_checksumCache) {
+            _checksumCache->setCachedChecksum(_cacheKey, it.key(), it.value());
+        }
+        checksums.insert(it.key(), it.value());
+    }
+    emit done(checksums, result.contents);
+}
+
 
 ValidateChecksumHeader::ValidateChecksumHeader(QObject *parent)
     : QObject(parent)
 {
 }
 
-void ValidateChecksumHeader::start(const QString &filePath, const QByteArray &checksumHeader)
+void ValidateChecksumHeader::start(const QString &filePath, const QByteArray &checksumHeader,
+    const QHash<QByteArray, QByteArray> &knownChecksums)
 {
     // If the incoming header is empty no validation can happen. Just continue.
     if (checksumHeader.isEmpty()) {
@@ -205,6 +492,11 @@ void ValidateChecksumHeader::start(const QString &filePath, const QByteArray &ch
         return;
     }
 
+    if (knownChecksums.contains(_expectedChecksumType)) {
+        slotChecksumCalculated(_expectedChecksumType, knownChecksums.value(_expectedChecksumType));
+        return;
+    }
+
     auto calculator = new ComputeChecksum(this);
     calculator->setChecksumType(_expectedChecksumType);
     connect(calculator, SIGNAL(done(QByteArray, QByteArray)),
@@ -226,20 +518,32 @@ void ValidateChecksumHeader::slotChecksumCalculated(const QByteArray &checksumTy
     emit validated(checksumType, checksum);
 }
 
-CSyncChecksumHook::CSyncChecksumHook()
+CSyncChecksumHook::CSyncChecksumHook(SyncJournalDb *journal)
+    : _journal(journal)
 {
 }
 
-const char *CSyncChecksumHook::hook(const char *path, const char *otherChecksumHeader, void * /*this_obj*/)
+const char *CSyncChecksumHook::hook(const char *path, const char *otherChecksumHeader, void *this_obj)
 {
     QByteArray type = parseChecksumHeaderType(QByteArray(otherChecksumHeader));
     if (type.isEmpty())
         return NULL;
 
-    QByteArray checksum = ComputeChecksum::computeNow(path, type);
-    if (checksum.isNull()) {
-        qCWarning(lcChecksums) << "Failed to compute checksum" << type << "for" << path;
-        return NULL;
+    auto self = static_cast<CSyncChecksumHook *>(this_obj);
+    const QString filePath = QString::fromUtf8(path);
+    const auto cacheKey = SyncJournalDb::ChecksumCacheKey::forFile(filePath);
+    QByteArray checksum = self->_journal->getCachedChecksum(cacheKey, type);
+    if (checksum.isEmpty()) {
+        // Wait for the executor, so the discovery doesn't compete with all the
+        // other checksum computations for the disk
+        checksum = ChecksumExecutor::instance()->run<QByteArray>(ChecksumExecutor::DiscoveryPriority, [filePath, type]() {
+            return ComputeChecksum::computeNow(filePath, type);
+        }).result();
+        if (checksum.isNull()) {
+            qCWarning(lcChecksums) << "Failed to compute checksum" << type << "for" << path;
+            return NULL;
+        }
+        self->_journal->setCachedChecksum(cacheKey, type, checksum);
     }
 
     QByteArray checksumHeader = makeChecksumHeader(type, checksum);
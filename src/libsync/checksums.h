@@ -16,14 +16,23 @@
 
 #include "owncloudlib.h"
 #include "accountfwd.h"
+#include "checksumkernels.h"
+#include "syncjournaldb.h"
 
 #include <QObject>
 #include <QByteArray>
+#include <QCryptographicHash>
+#include <QFutureInterface>
 #include <QFutureWatcher>
+#include <QHash>
+#include <QList>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QThreadPool>
 
-namespace OCC {
+#include <functional>
 
-class SyncJournalDb;
+namespace OCC {
 
 /// Creates a checksum header from type and value.
 QByteArray makeChecksumHeader(const QByteArray &checksumType, const QByteArray &checksum);
@@ -40,6 +49,133 @@ bool uploadChecksumEnabled();
 /// Checks OWNCLOUD_CONTENT_CHECKSUM_TYPE (default: SHA1)
 QByteArray contentChecksumType();
 
+/// Whether equal checksums of \a checksumType are reasonably certain to mean equal contents
+bool isCollisionSafeChecksumType(const QByteArray &checksumType);
+
+
+/**
+ * Computes a checksum from data that is given piece by piece.
+ *
+ * The results are the same as the ones of ComputeChecksum. Where the CPU
+ * supports it, the ChecksumKernels are used.
+ * \ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT ChecksumCalculator
+{
+public:
+    explicit ChecksumCalculator(const QByteArray &checksumType);
+    ~ChecksumCalculator();
+
+    QByteArray checksumType() const { return _checksumType; }
+
+    /** Whether the checksum type is known, result() is empty otherwise */
+    bool isValid() const;
+
+    void addData(const char *data, qint64 length);
+
+    /** Starts over, as if no data had been added */
+    void reset();
+
+    /** The checksum of the data added so far, more data may still be added */
+    QByteArray result() const;
+
+private:
+    Q_DISABLE_COPY(ChecksumCalculator)
+
+    QByteArray _checksumType;
+    QScopedPointer<QCryptographicHash> _cryptoHash;
+    // Used instead of _cryptoHash if the CPU supports it
+    QScopedPointer<ChecksumKernels::Sha1> _sha1Kernel;
+    bool _isAdler;
+    quint32 _adler;
+};
+
+/**
+ * Runs the checksum computations on a bounded number of threads.
+ *
+ * The checksums of big files are limited by the disk, hashing too many of them
+ * at once only makes everything slower. Waiting computations start in the order
+ * of their priority, so that discovery isn't stuck behind a burst of uploads.
+ *
+ * The number of threads is 2, or OWNCLOUD_CHECKSUM_THREADS.
+ * \ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT ChecksumExecutor
+{
+public:
+    enum Priority {
+        /// Uploads and downloads
+        TransferPriority = 0,
+        /// Checksums the discovery needs to compare local and remote files
+        DiscoveryPriority
+    };
+
+    static ChecksumExecutor *instance();
+
+    int maxThreadCount() const;
+    void setMaxThreadCount(int count);
+
+    /**
+     * Queues \a function and returns the future for its result.
+     *
+     * Canceling the future drops the function if it didn't start yet, and
+     * its result otherwise. A running function should check isCanceled()
+     * to stop early.
+     */
+    template <typename T>
+    QFuture<T> run(Priority priority, const std::function<T()> &function);
+
+    /** Whether the computation running on the calling thread was canceled */
+    static bool isCanceled();
+
+private:
+    ChecksumExecutor();
+
+    template <typename T>
+    class Task;
+
+    static void setCurrentTask(const QFutureInterfaceBase &task);
+
+    QThreadPool _pool;
+};
+
+template <typename T>
+class ChecksumExecutor::Task : public QRunnable
+{
+public:
+    explicit Task(const std::function<T()> &function)
+        : _function(function)
+    {
+        _interface.reportStarted();
+    }
+
+    QFuture<T> future() { return _interface.future(); }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        if (!_interface.isCanceled()) {
+            setCurrentTask(_interface);
+            const T result = _function();
+            setCurrentTask(QFutureInterfaceBase());
+            // ignored if the future was canceled in the meantime
+            _interface.reportResult(result);
+        }
+        _interface.reportFinished();
+    }
+
+private:
+    QFutureInterface<T> _interface;
+    std::function<T()> _function;
+};
+
+template <typename T>
+QFuture<T> ChecksumExecutor::run(Priority priority, const std::function<T()> &function)
+{
+    auto task = new Task<T>(function);
+    QFuture<T> future = task->future();
+    _pool.start(task, priority);
+    return future;
+}
 
 /**
  * Computes the checksum of a file.
@@ -50,6 +186,7 @@ class OWNCLOUDSYNC_EXPORT ComputeChecksum : public QObject
     Q_OBJECT
 public:
     explicit ComputeChecksum(QObject *parent = 0);
+    ~ComputeChecksum();
 
     /**
      * Sets the checksum type to be used. The default is empty.
@@ -58,6 +195,17 @@ public:
 
     QByteArray checksumType() const;
 
+    /** Stops the computation, done() won't be emitted */
+    void cancel();
+
+    /**
+     * Looks up the checksum in the checksum cache of \a journal before
+     * computing it, and stores computed checksums there.
+     *
+     * Default: no cache
+     */
+    void setChecksumCache(SyncJournalDb *journal);
+
     /**
      * Computes the checksum for the given file path.
      *
@@ -78,11 +226,87 @@ private slots:
 
 private:
     QByteArray _checksumType;
+    SyncJournalDb *_checksumCache;
+    SyncJournalDb::ChecksumCacheKey _cacheKey;
 
     // watcher for the checksum calculation thread
     QFutureWatcher<QByteArray> _watcher;
 };
 
+/**
+ * Computes the checksums of several types for a file, reading it only once.
+ *
+ * Small files can also be kept in memory, so they don't need to be read
+ * again for the upload.
+ * \ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT ComputeMultipleChecksums : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ComputeMultipleChecksums(QObject *parent = 0);
+    ~ComputeMultipleChecksums();
+
+    void setChecksumTypes(const QList<QByteArray> &types);
+
+    QList<QByteArray> checksumTypes() const;
+
+    /** Stops the computation, done() won't be emitted */
+    void cancel();
+
+    /**
+     * Looks up the checksum in the checksum cache of \a journal before
+     * computing it, and stores computed checksums there.
+     *
+     * Default: no cache
+     */
+    void setChecksumCache(SyncJournalDb *journal);
+
+    /**
+     * Files with a size up to \a maxSize are kept in memory and passed to done().
+     *
+     * Default: 0, nothing is kept.
+     */
+    void setKeepContentsSize(qint64 maxSize);
+
+    /**
+     * Computes the checksums for the given file path.
+     *
+     * done() is emitted when the calculation finishes.
+     */
+    void start(const QString &filePath);
+
+    struct Result
+    {
+        /// The checksums, mapped from their type. Unknown types are missing.
+        QHash<QByteArray, QByteArray> checksums;
+        /// The whole file, if it was small enough to be kept
+        QByteArray contents;
+    };
+
+    /**
+     * Computes the checksums synchronously.
+     */
+    static Result computeNow(const QString &filePath, const QList<QByteArray> &checksumTypes, qint64 keepContentsSize = 0);
+
+signals:
+    void done(const QHash<QByteArray, QByteArray> &checksums, const QByteArray &contents);
+
+private slots:
+    void slotCalculationDone();
+
+private:
+    QList<QByteArray> _checksumTypes;
+    qint64 _keepContentsSize;
+    SyncJournalDb *_checksumCache;
+    SyncJournalDb::ChecksumCacheKey _cacheKey;
+    // Checksums found in the cache
+    QHash<QByteArray, QByteArray> _cachedChecksums;
+
+    // watcher for the checksum calculation thread
+    QFutureWatcher<Result> _watcher;
+};
+
 /**
  * Checks whether a file's checksum matches the expected value.
  * @ingroup libsync
@@ -99,8 +323,13 @@ public:
      * If no checksum is there, or if a correct checksum is there, the signal validated()
      * will be emitted. In case of any kind of error, the signal validationFailed() will
      * be emitted.
+     *
+     * If \a knownChecksums has a checksum of the header's type, mapped from the
+     * type, it is used instead of reading the file and the signals are emitted
+     * right away.
      */
-    void start(const QString &filePath, const QByteArray &checksumHeader);
+    void start(const QString &filePath, const QByteArray &checksumHeader,
+        const QHash<QByteArray, QByteArray> &knownChecksums = QHash<QByteArray, QByteArray>());
 
 signals:
     void validated(const QByteArray &checksumType, const QByteArray &checksum);
@@ -122,7 +351,8 @@ class OWNCLOUDSYNC_EXPORT CSyncChecksumHook : public QObject
 {
     Q_OBJECT
 public:
-    explicit CSyncChecksumHook();
+    /** Uses the checksum cache of \a journal */
+    explicit CSyncChecksumHook(SyncJournalDb *journal);
 
     /**
      * Returns the checksum value for \a path that is comparable to \a otherChecksum.
@@ -132,5 +362,8 @@ public:
      * The return value will be owned by csync.
      */
     static const char *hook(const char *path, const char *otherChecksumHeader, void *this_obj);
+
+private:
+    SyncJournalDb *_journal;
 };
 }
@@ -43,6 +43,10 @@ struct SyncOptions
         , _minChunkSize(1 * 1000 * 1000) // 1 MB
         , _maxChunkSize(100 * 1000 * 1000) // 100 MB
         , _targetChunkUploadDuration(60 * 1000) // 1 minute
+        , _largeFileSize(100 * 1000 * 1000) // 100 MB
+        , _segmentedDownloadSize(100 * 1000 * 1000) // 100 MB
+        , _downloadBufferSize(256 * 1024) // 256 KiB
+        , _downloadWriteAlignment(0)
     {
     }
 
@@ -73,6 +77,38 @@ struct SyncOptions
      * Set to 0 it will disable dynamic chunk sizing.
      */
     quint64 _targetChunkUploadDuration;
+
+    /** Files of at least this size are scheduled as large transfers.
+     *
+     * File transfers are then picked from a global ready queue: large
+     * files are started early and only a bounded number of them run at
+     * once, while small files keep filling the remaining slots.
+     *
+     * Set to 0 it will disable size-aware scheduling and transfers are
+     * started in plan order.
+     */
+    quint64 _largeFileSize;
+
+    /** Downloads of files of at least this size are split into byte ranges.
+     *
+     * The ranges are fetched with parallel GET requests into the same
+     * temporary file, as many as the free transfer slots allow.
+     *
+     * Set to 0 it will disable segmented downloads.
+     */
+    quint64 _segmentedDownloadSize;
+
+    /** The size in bytes of the buffer downloads are read into.
+     *
+     * Bigger buffers mean fewer reads, writes and event loop wakeups on
+     * fast links. Not used while the download bandwidth is limited.
+     */
+    qint64 _downloadBufferSize;
+
+    /** If not 0, downloads are written to disk in blocks ending on a
+     *  multiple of this many bytes, keeping the rest buffered.
+     */
+    qint64 _downloadWriteAlignment;
 };
 
 
@@ -49,12 +49,14 @@ void ExcludedFiles::addExcludeFilePath(const QString &path)
 #ifdef WITH_TESTING
 void ExcludedFiles::addExcludeExpr(const QString &expr)
 {
+    QWriteLocker locker(&_lock);
     _csync_exclude_add(_excludesPtr, expr.toLatin1().constData());
 }
 #endif
 
 bool ExcludedFiles::reloadExcludes()
 {
+    QWriteLocker locker(&_lock);
     c_strlist_destroy(*_excludesPtr);
     *_excludesPtr = NULL;
 
@@ -102,5 +104,26 @@ bool ExcludedFiles::isExcluded(
         relativePath.chop(1);
     }
 
+    QReadLocker locker(&_lock);
+    return csync_excluded_no_ctx(*_excludesPtr, relativePath.toUtf8(), type) != CSYNC_NOT_EXCLUDED;
+}
+
+bool ExcludedFiles::isEntryExcluded(
+    const QFileInfo &entry,
+    const QString &basePath,
+    bool excludeHidden) const
+{
+    const QString filePath = entry.absoluteFilePath();
+    if (!filePath.startsWith(basePath, Utility::fsCasePreserving() ? Qt::CaseInsensitive : Qt::CaseSensitive)) {
+        return true;
+    }
+
+    if (excludeHidden && (entry.isHidden() || entry.fileName().startsWith(QLatin1Char('.')))) {
+        return true;
+    }
+
+    const QString relativePath = filePath.mid(basePath.size());
+    csync_ftw_type_e type = entry.isDir() ? CSYNC_FTW_TYPE_DIR : CSYNC_FTW_TYPE_FILE;
+    QReadLocker locker(&_lock);
     return csync_excluded_no_ctx(*_excludesPtr, relativePath.toUtf8(), type) != CSYNC_NOT_EXCLUDED;
 }
@@ -17,6 +17,8 @@
 #include "owncloudlib.h"
 
 #include <QObject>
+#include <QFileInfo>
+#include <QReadWriteLock>
 #include <QSet>
 #include <QString>
 
@@ -28,6 +30,8 @@ namespace OCC {
 
 /**
  * Manages the global system and user exclude lists.
+ *
+ * The checks may run on any thread.
  */
 class OWNCLOUDSYNC_EXPORT ExcludedFiles : public QObject
 {
@@ -56,6 +60,18 @@ public:
         const QString &basePath,
         bool excludeHidden) const;
 
+    /**
+     * Like isExcluded(), for an entry of a directory that is known not to be
+     * excluded: only the name of the entry is checked for being hidden, and
+     * its type is taken from \a entry instead of being looked up again.
+     *
+     * Meant for checking all entries of a directory listing.
+     */
+    bool isEntryExcluded(
+        const QFileInfo &entry,
+        const QString &basePath,
+        bool excludeHidden) const;
+
 #ifdef WITH_TESTING
     void addExcludeExpr(const QString &expr);
 #endif
@@ -71,6 +87,8 @@ private:
     // but the pointer can be in a csync_context so that it can itself also query the list.
     c_strlist_t **_excludesPtr;
     QSet<QString> _excludeFiles;
+    mutable QReadWriteLock _lock; // protects the list against reloads while checking
+
 };
 
 } // namespace OCC
@@ -29,6 +29,11 @@
 #include <qabstractfileengine.h>
 #endif
 
+#ifdef Q_OS_LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #ifdef Q_OS_WIN
 #include <windows.h>
 #include <windef.h>
@@ -64,6 +69,11 @@ QString FileSystem::longWinPath(const QString &inpath)
 bool FileSystem::fileEquals(const QString &fn1, const QString &fn2)
 {
     // compare two files with given filename and return true if they have the same content
+    const qint64 size = getSize(fn1);
+    if (size != getSize(fn2)) {
+        return false;
+    }
+
     QFile f1(fn1);
     QFile f2(fn2);
     if (!f1.open(QIODevice::ReadOnly) || !f2.open(QIODevice::ReadOnly)) {
@@ -71,27 +81,36 @@ bool FileSystem::fileEquals(const QString &fn1, const QString &fn2)
         return false;
     }
 
-    if (getSize(fn1) != getSize(fn2)) {
-        return false;
-    }
-
-    const int BufferSize = 16 * 1024;
-    char buffer1[BufferSize];
-    char buffer2[BufferSize];
-    do {
-        int r = f1.read(buffer1, BufferSize);
-        if (f2.read(buffer2, BufferSize) != r) {
+    // The second file is compared in big mapped windows, the first one is read:
+    // a mapped file that gets truncated meanwhile would crash us.
+    const qint64 WindowSize = 4 * 1024 * 1024;
+    QByteArray buffer1(int(qMin(size, WindowSize)), Qt::Uninitialized);
+    QByteArray buffer2;
+    for (qint64 offset = 0; offset < size; offset += WindowSize) {
+        const qint64 length = qMin(WindowSize, size - offset);
+        if (f1.read(buffer1.data(), length) != length) {
             // this should normally not happen: the files are supposed to have the same size.
             return false;
         }
-        if (r <= 0) {
-            return true;
+        uchar *mapped = f2.map(offset, length);
+        const uchar *data2 = mapped;
+        if (!mapped) {
+            // Not every file system can map files
+            buffer2.resize(buffer1.size());
+            if (!f2.seek(offset) || f2.read(buffer2.data(), length) != length) {
+                return false;
+            }
+            data2 = reinterpret_cast<const uchar *>(buffer2.constData());
         }
-        if (memcmp(buffer1, buffer2, r) != 0) {
+        const bool equal = memcmp(buffer1.constData(), data2, length) == 0;
+        if (mapped) {
+            f2.unmap(mapped);
+        }
+        if (!equal) {
             return false;
         }
-    } while (true);
-    return false;
+    }
+    return true;
 }
 
 void FileSystem::setFileHidden(const QString &filename, bool hidden)
@@ -584,6 +603,51 @@ QString FileSystem::makeConflictFileName(const QString &fn, const QDateTime &dt)
     return conflictFileName;
 }
 
+bool FileSystem::cloneFile(const QString &sourceFileName,
+    const QString &destinationFileName,
+    QString *errorString)
+{
+    QFile source(sourceFileName);
+    QFile destination(destinationFileName);
+    if (!openAndSeekFileSharedRead(&source, errorString, 0)) {
+        return false;
+    }
+    if (!destination.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) {
+        if (errorString) {
+            *errorString = destination.errorString();
+        }
+        return false;
+    }
+
+#if defined(Q_OS_LINUX) && defined(FICLONE)
+    if (ioctl(destination.handle(), FICLONE, source.handle()) == 0) {
+        return true;
+    }
+    // Not supported by the file system or across file systems, copy instead
+#endif
+
+    QByteArray buffer(1024 * 1024, Qt::Uninitialized);
+    while (true) {
+        const qint64 read = source.read(buffer.data(), buffer.size());
+        if (read < 0) {
+            if (errorString) {
+                *errorString = source.errorString();
+            }
+            return false;
+        }
+        if (read == 0) {
+            break;
+        }
+        if (destination.write(buffer.constData(), read) != read) {
+            if (errorString) {
+                *errorString = destination.errorString();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
 bool FileSystem::remove(const QString &fileName, QString *errorString)
 {
 #ifdef Q_OS_WIN
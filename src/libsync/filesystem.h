@@ -40,8 +40,11 @@ namespace FileSystem {
 
     /**
  * @brief compare two files with given filename and return true if they have the same content
+ *
+ * \a fn2 is mapped into memory, it must be a file nobody else truncates
+ * meanwhile, like a temporary file of ours.
  */
-    bool fileEquals(const QString &fn1, const QString &fn2);
+    bool OWNCLOUDSYNC_EXPORT fileEquals(const QString &fn1, const QString &fn2);
 
     /**
  * @brief Mark the file as hidden  (only has effects on windows)
@@ -154,6 +157,17 @@ namespace FileSystem {
         const QString &destinationFileName,
         QString *errorString);
 
+    /**
+ * Replaces the contents of \a destinationFileName with the contents of
+ * \a sourceFileName.
+ *
+ * Where the file system supports it (FICLONE on Linux) the destination
+ * shares the data of the source instead of getting a copy.
+ */
+    bool cloneFile(const QString &sourceFileName,
+        const QString &destinationFileName,
+        QString *errorString);
+
     /**
  * Removes a file.
  *
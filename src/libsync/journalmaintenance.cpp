@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "journalmaintenance.h"
+#include "ownsql.h"
+#include "syncjournaldb.h"
+
+#include <QFile>
+#include <QLoggingCategory>
+#include <QtConcurrent>
+
+#include <sqlite3.h>
+
+namespace OCC {
+
+Q_LOGGING_CATEGORY(lcJournalMaintenance, "sync.database.maintenance", QtInfoMsg)
+
+static const int defaultIdleDelayMs = 30 * 1000;
+static const int stepDelayMs = 1000;
+static const qint64 integrityCheckIntervalMs = 24 * 60 * 60 * 1000;
+static const qint64 analyzeIntervalMs = 24 * 60 * 60 * 1000;
+static const qint64 vacuumIntervalMs = 24 * 60 * 60 * 1000;
+
+// The maintenance gives way instead of waiting for the journal's connections
+static const int busyTimeoutMs = 100;
+
+// How many virtual machine instructions run between checks for an interrupt
+static const int interruptCheckOps = 1000;
+
+// Aborts the running statement once the maintenance is interrupted. Unlike
+// sqlite3_interrupt() this also catches the statements started after the
+// interrupt() call.
+static int checkInterrupted(void *interrupted)
+{
+    return static_cast<QAtomicInt *>(interrupted)->load();
+}
+
+JournalMaintenance::JournalMaintenance(SyncJournalDb *journal, QObject *parent)
+    : QObject(parent)
+    , _journal(journal)
+    , _idleDelayMs(defaultIdleDelayMs)
+    , _runningStep(NoStep)
+    , _checkpointDue(false)
+    , _vacuumDue(false)
+    , _runningDb(0)
+{
+    // The journal is checked when it is opened the first time
+    _lastIntegrityCheck.start();
+
+    _idleTimer.setSingleShot(true);
+    connect(&_idleTimer, SIGNAL(timeout()), SLOT(slotRunNextStep()));
+    connect(&_watcher, SIGNAL(finished()), SLOT(slotStepDone()));
+}
+
+JournalMaintenance::~JournalMaintenance()
+{
+    interrupt();
+}
+
+QString JournalMaintenance::stepName(Step step)
+{
+    switch (step) {
+    case CheckpointStep:
+        return QLatin1String("WAL checkpoint");
+    case IntegrityCheckStep:
+        return QLatin1String("Integrity check");
+    case AnalyzeStep:
+        return QLatin1String("Analyze");
+    case VacuumStep:
+        return QLatin1String("Vacuum");
+    case NoStep:
+        break;
+    }
+    return QString();
+}
+
+void JournalMaintenance::scheduleWhenIdle()
+{
+    _interrupted.store(0);
+    _checkpointDue = true;
+    if (!_lastVacuum.isValid() || _lastVacuum.hasExpired(vacuumIntervalMs)) {
+        _vacuumDue = true;
+    }
+    if (!_watcher.isRunning()) {
+        _idleTimer.start(_idleDelayMs);
+    }
+}
+
+void JournalMaintenance::interrupt()
+{
+    _idleTimer.stop();
+    _interrupted.store(1);
+    {
+        QMutexLocker locker(&_runningDbMutex);
+        if (_runningDb) {
+            sqlite3_interrupt(_runningDb);
+        }
+    }
+    // Interrupted statements return quickly
+    _watcher.waitForFinished();
+}
+
+JournalMaintenance::Step JournalMaintenance::nextDueStep() const
+{
+    if (_checkpointDue)
+        return CheckpointStep;
+    if (_lastIntegrityCheck.hasExpired(integrityCheckIntervalMs))
+        return IntegrityCheckStep;
+    if (!_lastAnalyze.isValid() || _lastAnalyze.hasExpired(analyzeIntervalMs))
+        return AnalyzeStep;
+    if (_vacuumDue)
+        return VacuumStep;
+    return NoStep;
+}
+
+void JournalMaintenance::slotRunNextStep()
+{
+    if (_interrupted.load() || _watcher.isRunning()) {
+        return;
+    }
+    const QString dbFile = _journal->databaseFilePath();
+    _runningStep = nextDueStep();
+    if (_runningStep == NoStep || !QFile::exists(dbFile)) {
+        _runningStep = NoStep;
+        emit idle();
+        return;
+    }
+
+    const Step step = _runningStep;
+    _watcher.setFuture(QtConcurrent::run([this, dbFile, step]() {
+        return runStep(dbFile, step);
+    }));
+}
+
+void JournalMaintenance::slotStepDone()
+{
+    const Step step = _runningStep;
+    _runningStep = NoStep;
+    if (step == NoStep) {
+        return;
+    }
+    const Result result = _watcher.future().result();
+    emit stepFinished(stepName(step), result._msecs, result._ok);
+
+    if (result._corrupted) {
+        qCCritical(lcJournalMaintenance) << "Journal" << _journal->databaseFilePath() << "is corrupted";
+        _journal->setIntegrityCheckNeeded();
+    }
+    if (_interrupted.load()) {
+        return;
+    }
+
+    // Failed steps aren't retried before they are due again
+    switch (step) {
+    case CheckpointStep:
+        _checkpointDue = false;
+        break;
+    case IntegrityCheckStep:
+        _lastIntegrityCheck.start();
+        break;
+    case AnalyzeStep:
+        _lastAnalyze.start();
+        break;
+    case VacuumStep:
+        _vacuumDue = false;
+        if (result._vacuumed) {
+            _lastVacuum.start();
+        }
+        break;
+    case NoStep:
+        break;
+    }
+    _idleTimer.start(stepDelayMs);
+}
+
+JournalMaintenance::Result JournalMaintenance::runStep(const QString &dbFile, Step step)
+{
+    Result result = { false, false, false, 0 };
+    QElapsedTimer timer;
+    timer.start();
+
+    SqlDatabase db;
+    if (!db.openOrCreateReadWrite(dbFile, /*checkIntegrity=*/false)) {
+        result._msecs = timer.elapsed();
+        return result;
+    }
+    sqlite3_busy_timeout(db.sqliteDb(), busyTimeoutMs);
+    sqlite3_progress_handler(db.sqliteDb(), interruptCheckOps, checkInterrupted, &_interrupted);
+    {
+        QMutexLocker locker(&_runningDbMutex);
+        _runningDb = db.sqliteDb();
+    }
+
+    if (!_interrupted.load()) {
+        SqlQuery query(db);
+        switch (step) {
+        case CheckpointStep:
+            // Never waits for readers or writers, unlike FULL
+            result._ok = query.prepare("PRAGMA wal_checkpoint(PASSIVE);", /*allow_failure=*/true) == SQLITE_OK
+                && query.exec() && query.next();
+            break;
+        case IntegrityCheckStep:
+            if (query.prepare("PRAGMA quick_check;", /*allow_failure=*/true) == SQLITE_OK && query.exec()) {
+                if (query.next()) {
+                    result._ok = query.stringValue(0) == QLatin1String("ok");
+                    result._corrupted = !result._ok;
+                    if (result._corrupted) {
+                        qCWarning(lcJournalMaintenance) << "quick_check returned failure:" << query.stringValue(0);
+                    }
+                }
+            }
+            if (query.errorId() == SQLITE_CORRUPT || query.errorId() == SQLITE_NOTADB) {
+                result._corrupted = true;
+            }
+            break;
+        case AnalyzeStep:
+            result._ok = query.prepare("ANALYZE;", /*allow_failure=*/true) == SQLITE_OK && query.exec();
+            break;
+        case VacuumStep: {
+            qint64 pageCount = 0;
+            qint64 freePages = 0;
+            if (query.prepare("PRAGMA page_count;", /*allow_failure=*/true) == SQLITE_OK && query.exec() && query.next()) {
+                pageCount = query.int64Value(0);
+            }
+            if (query.prepare("PRAGMA freelist_count;", /*allow_failure=*/true) == SQLITE_OK && query.exec() && query.next()) {
+                freePages = query.int64Value(0);
+            }
+            if (freePages * 4 > pageCount && !_interrupted.load()) {
+                qCInfo(lcJournalMaintenance) << "Vacuum" << dbFile << ":" << freePages << "of" << pageCount << "pages are unused";
+                result._ok = query.prepare("VACUUM;", /*allow_failure=*/true) == SQLITE_OK && query.exec();
+                result._vacuumed = result._ok;
+            } else {
+                result._ok = pageCount > 0;
+            }
+            break;
+        }
+        case NoStep:
+            break;
+        }
+    }
+    if (_interrupted.load()) {
+        result._ok = false;
+    }
+
+    {
+        QMutexLocker locker(&_runningDbMutex);
+        _runningDb = 0;
+    }
+    db.close();
+    result._msecs = timer.elapsed();
+    return result;
+}
+
+} // namespace OCC
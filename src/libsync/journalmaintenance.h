@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#pragma once
+
+#include "owncloudlib.h"
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+struct sqlite3;
+
+namespace OCC {
+
+class SyncJournalDb;
+
+/**
+ * @brief Runs the upkeep of a sync journal while its folder is idle
+ *
+ * The steps run one at a time in a worker thread, each on its own short
+ * lived database connection, so they never block the thread that uses
+ * the journal:
+ *
+ * - a passive WAL checkpoint after every sync
+ * - a consistency check of the whole database once a day, the journal
+ *   itself only checks when it is first opened
+ * - ANALYZE once a day
+ * - VACUUM when more than a quarter of the file is unused, at most once a day
+ *
+ * A running step is interrupted as soon as the next sync starts.
+ *
+ * @ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT JournalMaintenance : public QObject
+{
+    Q_OBJECT
+public:
+    explicit JournalMaintenance(SyncJournalDb *journal, QObject *parent = 0);
+    ~JournalMaintenance();
+
+    /** How long the folder has to be idle before the first step runs, in ms */
+    void setIdleDelay(int msecs) { _idleDelayMs = msecs; }
+
+    /** Schedules the due steps, call when a sync is done */
+    void scheduleWhenIdle();
+
+    /** Cancels the scheduled steps and interrupts the running one, call before a sync starts */
+    void interrupt();
+
+    bool isRunning() const { return _watcher.isRunning(); }
+
+signals:
+    /** A step finished, was interrupted or failed */
+    void stepFinished(const QString &step, qint64 msecs, bool ok);
+
+    /** No more steps are due until the next sync */
+    void idle();
+
+private slots:
+    void slotRunNextStep();
+    void slotStepDone();
+
+private:
+    enum Step {
+        NoStep,
+        CheckpointStep,
+        IntegrityCheckStep,
+        AnalyzeStep,
+        VacuumStep
+    };
+
+    struct Result
+    {
+        bool _ok;
+        bool _corrupted;
+        bool _vacuumed;
+        qint64 _msecs;
+    };
+
+    static QString stepName(Step step);
+    Step nextDueStep() const;
+    Result runStep(const QString &dbFile, Step step);
+
+    SyncJournalDb *_journal;
+    QTimer _idleTimer;
+    int _idleDelayMs;
+    Step _runningStep;
+    QFutureWatcher<Result> _watcher;
+
+    bool _checkpointDue;
+    bool _vacuumDue;
+    QElapsedTimer _lastIntegrityCheck;
+    QElapsedTimer _lastAnalyze;
+    QElapsedTimer _lastVacuum;
+
+    // Shared with the worker thread
+    QMutex _runningDbMutex;
+    sqlite3 *_runningDb;
+    QAtomicInt _interrupted;
+};
+}
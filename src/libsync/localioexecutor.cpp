@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "localioexecutor.h"
+
+namespace OCC {
+
+LocalIoExecutor::LocalIoExecutor()
+{
+    // More threads would reorder the operations, see the class documentation
+    _pool.setMaxThreadCount(1);
+}
+
+LocalIoExecutor *LocalIoExecutor::instance()
+{
+    static LocalIoExecutor executor;
+    return &executor;
+}
+}
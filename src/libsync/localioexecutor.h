@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#pragma once
+
+#include "owncloudlib.h"
+
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <functional>
+
+namespace OCC {
+
+/**
+ * @brief Runs the local filesystem operations of the propagation jobs
+ *
+ * Removing, creating and renaming files and folders can take long, for
+ * example for a folder with many files or on a slow disk. The jobs run
+ * these operations here and continue on their own thread once they are
+ * done, so the thread owning the propagator keeps serving the network
+ * jobs and the user interface.
+ *
+ * There is a single thread: the operations run one after the other in the
+ * order they were queued, which is the order the jobs used to run them in
+ * synchronously. Together with the jobs only finishing after their
+ * operation is done, this keeps the ordering between directory jobs.
+ *
+ * The functions must not touch the jobs or the journal: they get copies of
+ * what they need and return what the job has to know.
+ * \ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT LocalIoExecutor
+{
+public:
+    static LocalIoExecutor *instance();
+
+    /** Queues \a function and returns the future for its result */
+    template <typename T>
+    QFuture<T> run(const std::function<T()> &function)
+    {
+        return QtConcurrent::run(&_pool, function);
+    }
+
+private:
+    LocalIoExecutor();
+
+    QThreadPool _pool;
+};
+}
@@ -18,6 +18,8 @@
 #include "syncjournalfilerecord.h"
 #include "propagatedownload.h"
 #include "propagateupload.h"
+#include "propagateuploadbulk.h"
+#include "propagatedownloadbulk.h"
 #include "propagateremotedelete.h"
 #include "propagateremotemove.h"
 #include "propagateremotemkdir.h"
@@ -80,10 +82,8 @@ OwncloudPropagator::~OwncloudPropagator()
 
 int OwncloudPropagator::maximumActiveTransferJob()
 {
-    if (_downloadLimit.fetchAndAddAcquire(0) != 0 || _uploadLimit.fetchAndAddAcquire(0) != 0) {
-        // disable parallelism when there is a network limit.
-        return 1;
-    }
+    // Network limits don't disable parallelism: the BandwidthGovernor
+    // splits the limit between all transfers.
     return qMin(3, qCeil(hardMaximumActiveJob() / 2.));
 }
 
@@ -98,6 +98,57 @@ int OwncloudPropagator::hardMaximumActiveJob()
     return 6; // (Qt cannot do more anyway)
 }
 
+int OwncloudPropagator::maximumActiveLargeTransferJob()
+{
+    // Always keep one of the transfer slots for the smaller files
+    return qMax(1, maximumActiveTransferJob() - 1);
+}
+
+/** Whether the task will become an upload or a download
+ *
+ * Only these are taken out of plan order by the size-aware scheduling.
+ */
+static bool isTransferTask(const SyncFileItem &item)
+{
+    return !item._isDirectory
+        && (item._instruction == CSYNC_INSTRUCTION_NEW
+               || item._instruction == CSYNC_INSTRUCTION_SYNC
+               || item._instruction == CSYNC_INSTRUCTION_CONFLICT);
+}
+
+/** Whether the task is an upload that may be part of a PropagateBulkUpload */
+static bool isBulkUploadTask(const SyncFileItem &item, quint64 smallFileSize)
+{
+    return !item._isDirectory
+        && item._direction == SyncFileItem::Up
+        && (item._instruction == CSYNC_INSTRUCTION_NEW
+               || item._instruction == CSYNC_INSTRUCTION_SYNC)
+        && item._size < smallFileSize;
+}
+
+/** Whether the task is a download that may be part of a PropagateBulkDownload */
+static bool isBulkDownloadTask(const SyncFileItem &item, quint64 smallFileSize)
+{
+    return !item._isDirectory
+        && item._direction == SyncFileItem::Down
+        && (item._instruction == CSYNC_INSTRUCTION_NEW
+               || item._instruction == CSYNC_INSTRUCTION_SYNC)
+        && item._size < smallFileSize
+        && item._directDownloadUrl.isEmpty();
+}
+
+bool OwncloudPropagator::isBulkUploadEnabled()
+{
+    // The parts are not throttled: leave limited uploads to the PUTs
+    return account()->capabilities().bulkUpload() && !_bandwidthManager.isUploadLimited();
+}
+
+bool OwncloudPropagator::isBulkDownloadEnabled()
+{
+    // Same for the downloads, they are left to the GETs
+    return account()->capabilities().bulkDownload() && !_bandwidthManager.isDownloadLimited();
+}
+
 PropagateItemJob::~PropagateItemJob()
 {
     if (auto p = propagator()) {
@@ -657,10 +708,18 @@ void OwncloudPropagator::scheduleNextJobImpl()
     // Making sure we do up/down at same time? https://github.com/owncloud/client/issues/1633
 
     if (_activeJobList.count() < maximumActiveTransferJob()) {
-        if (_rootJob->scheduleSelfOrChild()) {
+        // The tree walk goes first: it starts the jobs the transfers depend on
+        // (like creating directories) and fills the ready queue.
+        if (_rootJob->scheduleSelfOrChild() || startReadyTask(false)) {
             scheduleNextJob();
         }
     } else if (_activeJobList.count() < hardMaximumActiveJob()) {
+        // Keep small files flowing even if large transfers use all the regular slots.
+        if (startReadyTask(true)) {
+            scheduleNextJob();
+            return;
+        }
+
         int likelyFinishedQuicklyCount = 0;
         // NOTE: Only counts the first 3 jobs! Then for each
         // one that is likely finished quickly, we can launch another one.
@@ -680,6 +739,64 @@ void OwncloudPropagator::scheduleNextJobImpl()
     }
 }
 
+void OwncloudPropagator::enqueueReadyTask(PropagatorCompositeJob *owner, const SyncFileItemPtr &item)
+{
+    ReadyTask task;
+    task._owner = owner;
+    task._item = item;
+    if (item->_size < smallFileSize()) {
+        _smallReadyTasks.append(task);
+    } else {
+        _bigReadyTasks.insert(std::make_pair(item->_size, task));
+    }
+}
+
+bool OwncloudPropagator::startReadyTask(bool smallOnly)
+{
+    // A job that is not parallel must finish before anything else may start.
+    if (_rootJob->parallelism() != PropagatorJob::FullParallelism) {
+        return false;
+    }
+
+    const quint64 largeSize = _syncOptions._largeFileSize;
+    ReadyTask task;
+    if (!smallOnly && !_bigReadyTasks.empty()) {
+        auto it = _bigReadyTasks.begin();
+        if (it->first >= largeSize && _activeLargeTransfers >= maximumActiveLargeTransferJob()) {
+            // Skip to the biggest file that is not a large one
+            it = _bigReadyTasks.lower_bound(largeSize - 1);
+        }
+        if (it != _bigReadyTasks.end()) {
+            task = it->second;
+            _bigReadyTasks.erase(it);
+        }
+    }
+    if (!task._item && !_smallReadyTasks.isEmpty()) {
+        task = _smallReadyTasks.takeFirst();
+    }
+    if (!task._item) {
+        return false;
+    }
+    if (!task._owner) {
+        // The owning directory job is gone, try the next one
+        return startReadyTask(smallOnly);
+    }
+
+    PropagateItemJob *job = createJob(task._item);
+    if (!job) {
+        qCWarning(lcPropagator) << "Useless task found for file" << task._item->destination() << "instruction" << task._item->_instruction;
+    } else if (task._item->_size >= largeSize) {
+        _activeLargeTransfers++;
+        connect(job, SIGNAL(finished(SyncFileItem::Status)), this, SLOT(slotLargeTransferFinished()));
+    }
+    return task._owner->startReadyTask(job) || startReadyTask(smallOnly);
+}
+
+void OwncloudPropagator::slotLargeTransferFinished()
+{
+    _activeLargeTransfers--;
+}
+
 void OwncloudPropagator::reportProgress(const SyncFileItem &item, quint64 bytes)
 {
     emit progress(item, bytes);
@@ -744,6 +861,23 @@ bool PropagatorCompositeJob::scheduleSelfOrChild()
     // Start the composite job
     if (_state == NotYetStarted) {
         _state = Running;
+
+        createBulkTransfers();
+
+        if (propagator()->isSizeAwareScheduling()) {
+            // Our transfers are ready to go: let the propagator pick them
+            // by size together with the ones of all other directories.
+            SyncFileItemVector otherTasks;
+            foreach (const SyncFileItemPtr &task, _tasksToDo) {
+                if (isTransferTask(*task)) {
+                    propagator()->enqueueReadyTask(this, task);
+                    _tasksInReadyQueue++;
+                } else {
+                    otherTasks.append(task);
+                }
+            }
+            _tasksToDo = otherTasks;
+        }
     }
 
     // Ask all the running composite jobs if they have something new to schedule.
@@ -763,11 +897,22 @@ bool PropagatorCompositeJob::scheduleSelfOrChild()
     }
 
     // Now it's our turn, check if we have something left to do.
-    if (!_jobsToDo.isEmpty()) {
+    while (!_jobsToDo.isEmpty()) {
         PropagatorJob *nextJob = _jobsToDo.first();
         _jobsToDo.remove(0);
         _runningJobs.append(nextJob);
-        return possiblyRunNextJob(nextJob);
+        if (possiblyRunNextJob(nextJob)) {
+            return true;
+        }
+
+        // The sub job had nothing to start right away (it may just have handed its
+        // transfers to the ready queue). Go on with the next one unless it blocks.
+        if (nextJob->parallelism() == WaitForFinished) {
+            return false;
+        }
+        if (!propagator()->isSizeAwareScheduling()) {
+            return false;
+        }
     }
     while (!_tasksToDo.isEmpty()) {
         SyncFileItemPtr nextTask = _tasksToDo.first();
@@ -784,7 +929,7 @@ bool PropagatorCompositeJob::scheduleSelfOrChild()
 
     // If neither us or our children had stuff left to do we could hang. Make sure
     // we mark this job as finished so that the propagator can schedule a new one.
-    if (_jobsToDo.isEmpty() && _tasksToDo.isEmpty() && _runningJobs.isEmpty()) {
+    if (_jobsToDo.isEmpty() && _tasksToDo.isEmpty() && _runningJobs.isEmpty() && _tasksInReadyQueue == 0) {
         // Our parent jobs are already iterating over their running jobs, post to the event loop
         // to avoid removing ourself from that list while they iterate.
         QMetaObject::invokeMethod(this, "finalize", Qt::QueuedConnection);
@@ -792,6 +937,49 @@ bool PropagatorCompositeJob::scheduleSelfOrChild()
     return false;
 }
 
+void PropagatorCompositeJob::createBulkTransfers()
+{
+    const bool bulkUpload = propagator()->isBulkUploadEnabled();
+    const bool bulkDownload = propagator()->isBulkDownloadEnabled();
+    if (!bulkUpload && !bulkDownload) {
+        return;
+    }
+
+    const quint64 smallFileSize = propagator()->smallFileSize();
+    SyncFileItemVector otherTasks;
+    SyncFileItemVector uploads;
+    SyncFileItemVector downloads;
+    foreach (const SyncFileItemPtr &task, _tasksToDo) {
+        if (bulkUpload && isBulkUploadTask(*task, smallFileSize)) {
+            uploads.append(task);
+            if (uploads.size() == PropagateBulkUpload::maxFiles) {
+                appendJob(new PropagateBulkUpload(propagator(), uploads));
+                uploads.clear();
+            }
+        } else if (bulkDownload && isBulkDownloadTask(*task, smallFileSize)) {
+            downloads.append(task);
+            if (downloads.size() == PropagateBulkDownload::maxFiles) {
+                appendJob(new PropagateBulkDownload(propagator(), downloads));
+                downloads.clear();
+            }
+        } else {
+            otherTasks.append(task);
+        }
+    }
+    // A single file is transferred on its own
+    if (uploads.size() > 1) {
+        appendJob(new PropagateBulkUpload(propagator(), uploads));
+    } else {
+        otherTasks += uploads;
+    }
+    if (downloads.size() > 1) {
+        appendJob(new PropagateBulkDownload(propagator(), downloads));
+    } else {
+        otherTasks += downloads;
+    }
+    _tasksToDo = otherTasks;
+}
+
 void PropagatorCompositeJob::slotSubJobFinished(SyncFileItem::Status status)
 {
     PropagatorJob *subJob = static_cast<PropagatorJob *>(sender());
@@ -809,13 +997,27 @@ void PropagatorCompositeJob::slotSubJobFinished(SyncFileItem::Status status)
         _hasError = status;
     }
 
-    if (_jobsToDo.isEmpty() && _tasksToDo.isEmpty() && _runningJobs.isEmpty()) {
+    if (_jobsToDo.isEmpty() && _tasksToDo.isEmpty() && _runningJobs.isEmpty() && _tasksInReadyQueue == 0) {
         finalize();
     } else {
         propagator()->scheduleNextJob();
     }
 }
 
+bool PropagatorCompositeJob::startReadyTask(PropagatorJob *job)
+{
+    ASSERT(_tasksInReadyQueue > 0);
+    _tasksInReadyQueue--;
+    if (!job) {
+        if (_jobsToDo.isEmpty() && _tasksToDo.isEmpty() && _runningJobs.isEmpty() && _tasksInReadyQueue == 0) {
+            QMetaObject::invokeMethod(this, "finalize", Qt::QueuedConnection);
+        }
+        return false;
+    }
+    _runningJobs.append(job);
+    return possiblyRunNextJob(job);
+}
+
 void PropagatorCompositeJob::finalize()
 {
     // The propagator will do parallel scheduling and this could be posted
@@ -908,7 +1110,7 @@ void PropagateDirectory::slotSubJobsFinished(SyncFileItem::Status status)
             if (_item->_instruction == CSYNC_INSTRUCTION_RENAME
                 && _item->_originalFile != _item->_renameTarget) {
                 // Remove the stale entries from the database.
-                propagator()->_journal->deleteFileRecord(_item->_originalFile, true);
+                propagator()->_journal->queueDeleteFileRecord(_item->_originalFile, true);
             }
 
             _item->_file = _item->_renameTarget;
@@ -25,6 +25,9 @@
 #include <QIODevice>
 #include <QMutex>
 
+#include <functional>
+#include <map>
+
 #include "csync_util.h"
 #include "syncfileitem.h"
 #include "syncjournaldb.h"
@@ -186,9 +189,14 @@ public:
     QVector<PropagatorJob *> _runningJobs;
     SyncFileItem::Status _hasError; // NoStatus,  or NormalError / SoftError if there was an error
 
+    /** Number of our file transfers that were handed to the propagator's
+     *  ready queue and were not started yet. */
+    int _tasksInReadyQueue;
+
     explicit PropagatorCompositeJob(OwncloudPropagator *propagator)
         : PropagatorJob(propagator)
         , _hasError(SyncFileItem::NoStatus)
+        , _tasksInReadyQueue(0)
     {
     }
 
@@ -217,6 +225,17 @@ public:
 
     qint64 committedDiskSpace() const Q_DECL_OVERRIDE;
 
+    /** Moves our small uploads and downloads into PropagateBulkUpload
+     *  and PropagateBulkDownload jobs, if they are enabled */
+    void createBulkTransfers();
+
+    /** Runs a job for one of our tasks that the propagator took from its ready queue.
+     *
+     * job may be null if no job was needed for the task.
+     * returns true if a job was started.
+     */
+    bool startReadyTask(PropagatorJob *job);
+
 private slots:
     bool possiblyRunNextJob(PropagatorJob *next)
     {
@@ -319,10 +338,10 @@ public:
         , _remoteFolder((remoteFolder.endsWith(QChar('/'))) ? remoteFolder : remoteFolder + '/')
         , _journal(progressDb)
         , _finishedEmited(false)
-        , _bandwidthManager(this)
         , _anotherSyncNeeded(false)
         , _chunkSize(10 * 1000 * 1000) // 10 MB, overridden in setSyncOptions
         , _account(account)
+        , _activeLargeTransfers(0)
     {
     }
 
@@ -333,8 +352,6 @@ public:
     const SyncOptions &syncOptions() const;
     void setSyncOptions(const SyncOptions &syncOptions);
 
-    QAtomicInt _downloadLimit;
-    QAtomicInt _uploadLimit;
     BandwidthManager _bandwidthManager;
 
     QAtomicInt _abortRequested; // boolean set by the main thread to abort.
@@ -365,6 +382,26 @@ public:
     /* The maximum number of active jobs in parallel  */
     int hardMaximumActiveJob();
 
+    /** Whether small uploads are sent together, see PropagateBulkUpload */
+    bool isBulkUploadEnabled();
+
+    /** Whether small downloads are fetched together, see PropagateBulkDownload */
+    bool isBulkDownloadEnabled();
+
+    /** Whether file transfers are picked from the ready queue by size
+     *  rather than started in plan order, see SyncOptions::_largeFileSize */
+    bool isSizeAwareScheduling() const { return _syncOptions._largeFileSize > 0; }
+
+    /* the maximum number of large file transfers running in parallel */
+    int maximumActiveLargeTransferJob();
+
+    /** Adds a file transfer of a running composite job to the ready queue.
+     *
+     * The scheduler will later take it from there and hand its job back
+     * to PropagatorCompositeJob::startReadyTask().
+     */
+    void enqueueReadyTask(PropagatorCompositeJob *owner, const SyncFileItemPtr &item);
+
     bool isInSharedDirectory(const QString &file);
 
     /** Check whether a download would clash with an existing file
@@ -428,6 +465,8 @@ private slots:
 
     void scheduleNextJobImpl();
 
+    void slotLargeTransferFinished();
+
 signals:
     void itemCompleted(const SyncFileItemPtr &);
     void progress(const SyncFileItem &, quint64 bytes);
@@ -447,10 +486,31 @@ signals:
     void insufficientRemoteStorage();
 
 private:
+    /** Starts the next file transfer from the ready queue.
+     *
+     * Large files are preferred while fewer than maximumActiveLargeTransferJob()
+     * of them run, then the biggest of the medium sized files, then small
+     * files in plan order. If smallOnly is set only small files are considered.
+     *
+     * returns true if a job was started.
+     */
+    bool startReadyTask(bool smallOnly);
+
     AccountPtr _account;
     QScopedPointer<PropagateDirectory> _rootJob;
     SyncOptions _syncOptions;
 
+    struct ReadyTask
+    {
+        QPointer<PropagatorCompositeJob> _owner;
+        SyncFileItemPtr _item;
+    };
+    /// Small transfers, in plan order
+    QLinkedList<ReadyTask> _smallReadyTasks;
+    /// Medium and large transfers, biggest first
+    std::multimap<quint64, ReadyTask, std::greater<quint64>> _bigReadyTasks;
+    int _activeLargeTransfers;
+
 #if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
     // access to signals which are protected in Qt4
     friend class PropagateDownloadFile;
@@ -35,7 +35,12 @@ public:
     explicit SqlDatabase();
 
     bool isOpen();
-    bool openOrCreateReadWrite(const QString &filename);
+    /**
+     * Opens the database, creating it if needed. A database that fails the
+     * consistency check is removed and created again, unless the check is
+     * skipped with checkIntegrity.
+     */
+    bool openOrCreateReadWrite(const QString &filename, bool checkIntegrity = true);
     bool openReadOnly(const QString &filename);
     bool transaction();
     bool commit();
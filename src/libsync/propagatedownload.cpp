@@ -15,6 +15,7 @@
 #include "config.h"
 #include "owncloudpropagator_p.h"
 #include "propagatedownload.h"
+#include "propagatedownloadbulk.h"
 #include "networkjobs.h"
 #include "account.h"
 #include "syncjournaldb.h"
@@ -23,6 +24,7 @@
 #include "filesystem.h"
 #include "propagatorjobs.h"
 #include "checksums.h"
+#include "localioexecutor.h"
 #include "asserts.h"
 
 #include <QLoggingCategory>
@@ -30,6 +32,7 @@
 #include <QFileInfo>
 #include <QDir>
 #include <cmath>
+#include <cstring>
 
 #ifdef Q_OS_UNIX
 #include <unistd.h>
@@ -40,6 +43,9 @@ namespace OCC {
 Q_LOGGING_CATEGORY(lcGetJob, "sync.networkjob.get", QtInfoMsg)
 Q_LOGGING_CATEGORY(lcPropagateDownload, "sync.propagator.download", QtInfoMsg)
 
+// How many local files with the announced checksum are tried before downloading
+static const int maxReuseCandidates = 3;
+
 // Always coming in with forward slashes.
 // In csync_excluded_no_ctx we ignore all files with longer than 254 chars
 // This function also adds a dot at the beginning of the filename to hide the file on OS X and Linux
@@ -74,13 +80,15 @@ GETFileJob::GETFileJob(AccountPtr account, const QString &path, QFile *device,
     , _headers(headers)
     , _expectedEtagForResume(expectedEtagForResume)
     , _resumeStart(resumeStart)
+    , _rangeEnd(0)
     , _errorStatus(SyncFileItem::NoStatus)
     , _bandwidthLimited(false)
-    , _bandwidthChoked(false)
-    , _bandwidthQuota(0)
     , _bandwidthManager(0)
     , _hasEmittedFinishedSignal(false)
     , _lastModified()
+    , _readBufferSize(16 * 1024)
+    , _writeAlignment(0)
+    , _bufferedBytes(0)
 {
 }
 
@@ -93,21 +101,27 @@ GETFileJob::GETFileJob(AccountPtr account, const QUrl &url, QFile *device,
     , _headers(headers)
     , _expectedEtagForResume(expectedEtagForResume)
     , _resumeStart(resumeStart)
+    , _rangeEnd(0)
     , _errorStatus(SyncFileItem::NoStatus)
     , _directDownloadUrl(url)
     , _bandwidthLimited(false)
-    , _bandwidthChoked(false)
-    , _bandwidthQuota(0)
     , _bandwidthManager(0)
     , _hasEmittedFinishedSignal(false)
     , _lastModified()
+    , _readBufferSize(16 * 1024)
+    , _writeAlignment(0)
+    , _bufferedBytes(0)
 {
 }
 
 
 void GETFileJob::start()
 {
-    if (_resumeStart > 0) {
+    if (_rangeEnd > 0) {
+        _headers["Range"] = "bytes=" + QByteArray::number(_resumeStart) + '-' + QByteArray::number(_rangeEnd - 1);
+        _headers["Accept-Ranges"] = "bytes";
+        qCDebug(lcGetJob) << "Segment with range " << _headers["Range"];
+    } else if (_resumeStart > 0) {
         _headers["Range"] = "bytes=" + QByteArray::number(_resumeStart) + '-';
         _headers["Accept-Ranges"] = "bytes";
         qCDebug(lcGetJob) << "Retry with range " << _headers["Range"];
@@ -127,8 +141,9 @@ void GETFileJob::start()
         sendRequest("GET", _directDownloadUrl, req);
     }
 
-    reply()->setReadBufferSize(16 * 1024); // keep low so we can easier limit the bandwidth
-    qCDebug(lcGetJob) << _bandwidthManager << _bandwidthChoked << _bandwidthLimited;
+    _bandwidthLimited = _bandwidthManager && _bandwidthManager->isDownloadLimited();
+    reply()->setReadBufferSize(replyReadBufferSize());
+    qCDebug(lcGetJob) << _bandwidthManager << _bandwidthLimited;
     if (_bandwidthManager) {
         _bandwidthManager->registerDownloadJob(this);
     }
@@ -149,7 +164,7 @@ void GETFileJob::slotMetaDataChanged()
 {
     // For some reason setting the read buffer in GETFileJob::start doesn't seem to go
     // through the HTTP layer thread(?)
-    reply()->setReadBufferSize(16 * 1024);
+    reply()->setReadBufferSize(replyReadBufferSize());
 
     int httpStatus = reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 
@@ -185,17 +200,23 @@ void GETFileJob::slotMetaDataChanged()
     }
 
     quint64 start = 0;
+    quint64 end = 0;
     QByteArray ranges = reply()->rawHeader("Content-Range");
     if (!ranges.isEmpty()) {
-        QRegExp rx("bytes (\\d+)-");
+        QRegExp rx("bytes (\\d+)-(\\d*)");
         if (rx.indexIn(ranges) >= 0) {
             start = rx.cap(1).toULongLong();
+            end = rx.cap(2).toULongLong() + 1;
         }
     }
-    if (start != _resumeStart) {
-        qCWarning(lcGetJob) << "Wrong content-range: " << ranges << " while expecting start was" << _resumeStart;
-        if (ranges.isEmpty()) {
+    if (start != _resumeStart || (_rangeEnd > 0 && end != _rangeEnd)) {
+        qCWarning(lcGetJob) << "Wrong content-range: " << ranges << " while expecting start was" << _resumeStart
+                            << "and end was" << _rangeEnd;
+        if (ranges.isEmpty() && _rangeEnd == 0) {
             // device doesn't support range, just try again from scratch
+            foreach (ChecksumCalculator *calculator, _checksumCalculators) {
+                calculator->reset();
+            }
             _device->close();
             if (!_device->open(QIODevice::WriteOnly)) {
                 _errorString = _device->errorString();
@@ -223,56 +244,87 @@ void GETFileJob::setBandwidthManager(BandwidthManager *bwm)
     _bandwidthManager = bwm;
 }
 
-void GETFileJob::setChoked(bool c)
+qint64 GETFileJob::currentDownloadPosition()
 {
-    _bandwidthChoked = c;
-    QMetaObject::invokeMethod(this, "slotReadyRead", Qt::QueuedConnection);
+    if (_device && _device->pos() > 0 && _device->pos() > qint64(_resumeStart)) {
+        return _device->pos();
+    }
+    return _resumeStart;
 }
 
-void GETFileJob::setBandwidthLimited(bool b)
+qint64 GETFileJob::replyReadBufferSize() const
 {
-    _bandwidthLimited = b;
-    QMetaObject::invokeMethod(this, "slotReadyRead", Qt::QueuedConnection);
+    if (_bandwidthLimited) {
+        return 16 * 1024; // keep low so we can easier limit the bandwidth
+    }
+    return qMax(16 * 1024ll, _readBufferSize);
 }
 
-void GETFileJob::giveBandwidthQuota(qint64 q)
+bool GETFileJob::writeBuffer(bool all)
 {
-    _bandwidthQuota = q;
-    qCDebug(lcGetJob) << "Got" << q << "bytes";
-    QMetaObject::invokeMethod(this, "slotReadyRead", Qt::QueuedConnection);
-}
+    qint64 toWrite = _bufferedBytes;
+    if (!all && _writeAlignment > 0) {
+        // Keep what is past the last boundary, unless that leaves no room in the buffer
+        const qint64 aligned = _bufferedBytes - (_device->pos() + _bufferedBytes) % _writeAlignment;
+        if (aligned > 0 || _bufferedBytes < _buffer.size()) {
+            toWrite = aligned;
+        }
+    }
+    if (_errorStatus != SyncFileItem::NoStatus) {
+        // Nothing more is written once the download failed
+        return false;
+    }
+    if (toWrite <= 0) {
+        return true;
+    }
 
-qint64 GETFileJob::currentDownloadPosition()
-{
-    if (_device && _device->pos() > 0 && _device->pos() > qint64(_resumeStart)) {
-        return _device->pos();
+    if (_device->isOpen()) {
+        qint64 w = _device->write(_buffer.constData(), toWrite);
+        if (w != toWrite) {
+            _errorString = _device->errorString();
+            _errorStatus = SyncFileItem::NormalError;
+            qCWarning(lcGetJob) << "Error while writing to file" << w << toWrite << _errorString;
+            reply()->abort();
+            return false;
+        }
+        foreach (ChecksumCalculator *calculator, _checksumCalculators) {
+            calculator->addData(_buffer.constData(), toWrite);
+        }
     }
-    return _resumeStart;
+    _bufferedBytes -= toWrite;
+    if (_bufferedBytes > 0) {
+        std::memmove(_buffer.data(), _buffer.constData() + toWrite, _bufferedBytes);
+    }
+    return true;
 }
 
 void GETFileJob::slotReadyRead()
 {
     if (!reply())
         return;
-    int bufferSize = qMin(1024 * 8ll, reply()->bytesAvailable());
-    QByteArray buffer(bufferSize, Qt::Uninitialized);
+    if (_buffer.size() < _readBufferSize) {
+        _buffer.resize(_readBufferSize);
+    }
+    // The limit may have changed since the last read
+    const bool limited = _bandwidthManager && _bandwidthManager->isDownloadLimited();
+    if (limited != _bandwidthLimited) {
+        _bandwidthLimited = limited;
+        reply()->setReadBufferSize(replyReadBufferSize());
+    }
 
     while (reply()->bytesAvailable() > 0) {
-        if (_bandwidthChoked) {
-            qCWarning(lcGetJob) << "Download choked";
-            break;
-        }
-        qint64 toRead = bufferSize;
-        if (_bandwidthLimited) {
-            toRead = qMin(qint64(bufferSize), _bandwidthQuota);
+        // Drain as much as fits in the buffer with a single read, and write it at once
+        qint64 toRead = qMin(_buffer.size() - _bufferedBytes, reply()->bytesAvailable());
+        if (_bandwidthManager) {
+            toRead = _bandwidthManager->takeDownloadQuota(this, toRead);
             if (toRead == 0) {
-                qCWarning(lcGetJob) << "Out of quota";
+                // slotReadyRead() is called again when there is quota
+                qCDebug(lcGetJob) << "Out of quota";
                 break;
             }
-            _bandwidthQuota -= toRead;
         }
 
-        qint64 r = reply()->read(buffer.data(), toRead);
+        qint64 r = reply()->read(_buffer.data() + _bufferedBytes, toRead);
         if (r < 0) {
             _errorString = networkReplyErrorString(*reply());
             _errorStatus = SyncFileItem::NormalError;
@@ -280,21 +332,20 @@ void GETFileJob::slotReadyRead()
             reply()->abort();
             return;
         }
+        if (_bandwidthManager && r < toRead) {
+            _bandwidthManager->returnDownloadQuota(this, toRead - r);
+        }
 
-        if (_device->isOpen()) {
-            qint64 w = _device->write(buffer.constData(), r);
-            if (w != r) {
-                _errorString = _device->errorString();
-                _errorStatus = SyncFileItem::NormalError;
-                qCWarning(lcGetJob) << "Error while writing to file" << w << r << _errorString;
-                reply()->abort();
-                return;
-            }
+        _bufferedBytes += r;
+        if (!writeBuffer(false)) {
+            // If the reply already finished, aborting it doesn't finish the job
+            break;
         }
     }
 
     if (reply()->isFinished() && reply()->bytesAvailable() == 0) {
         qCDebug(lcGetJob) << "Actually finished!";
+        writeBuffer(true);
         if (_bandwidthManager) {
             _bandwidthManager->unregisterDownloadJob(this);
         }
@@ -329,6 +380,78 @@ QString GETFileJob::errorString() const
     return AbstractNetworkJob::errorString();
 }
 
+// Feeds the first size bytes of the file to the calculators, reading it once
+static bool checksumFilePrefix(const QString &fileName, qint64 size,
+    const QVector<QSharedPointer<ChecksumCalculator>> &calculators)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray buffer(qMin(size, qint64(500 * 1024)), Qt::Uninitialized);
+    while (size > 0) {
+        qint64 r = file.read(buffer.data(), qMin(size, qint64(buffer.size())));
+        if (r <= 0 || ChecksumExecutor::isCanceled()) {
+            return false;
+        }
+        foreach (const QSharedPointer<ChecksumCalculator> &calculator, calculators) {
+            calculator->addData(buffer.constData(), r);
+        }
+        size -= r;
+    }
+    return true;
+}
+
+/**
+ * Copies the first of \a sources, from index \a first on, to \a tmpFileName
+ * and returns its index.
+ *
+ * The sources come from the journal: a source whose size or mtime isn't
+ * the \a expected one anymore has different content by now. Since it can
+ * change while it is copied too, the checksum of the copy is verified
+ * afterwards. Returns -1 and leaves \a tmpFileName empty if no source could
+ * be copied.
+ */
+static int copyUnchangedSource(const QStringList &sources, const QVector<QPair<qint64, time_t>> &expected,
+    int first, const QString &tmpFileName)
+{
+    for (int i = first; i < sources.size(); ++i) {
+        const QString &source = sources.at(i);
+        if (!FileSystem::verifyFileUnchanged(source, expected.at(i).first, expected.at(i).second)) {
+            continue;
+        }
+        QString error;
+        if (!FileSystem::cloneFile(source, tmpFileName, &error)) {
+            qCWarning(lcPropagateDownload) << "Could not copy" << source << error;
+            continue;
+        }
+        return i;
+    }
+    QFile::resize(tmpFileName, 0);
+    return -1;
+}
+
+/**
+ * Whether the local file \a fn has the same content as the download \a tmpFileName.
+ *
+ * If \a checksumType is set, \a checksum is the checksum of the download and
+ * the local file is only read to compute its own, unless \a localChecksum came
+ * from the checksum cache already. Without one, both files are compared.
+ */
+static bool localContentEquals(const QString &fn, const QString &tmpFileName,
+    const QByteArray &checksumType, const QByteArray &checksum, const QByteArray &localChecksum)
+{
+    if (!checksumType.isEmpty() && FileSystem::getSize(fn) == FileSystem::getSize(tmpFileName)) {
+        const QByteArray local = localChecksum.isEmpty()
+            ? ComputeChecksum::computeNow(fn, checksumType)
+            : localChecksum;
+        if (!local.isEmpty()) {
+            return local == checksum;
+        }
+    }
+    return FileSystem::fileEquals(fn, tmpFileName);
+}
+
 void PropagateDownloadFile::start()
 {
     if (propagator()->_abortRequested.fetchAndAddRelaxed(0))
@@ -356,6 +479,7 @@ void PropagateDownloadFile::start()
         qCDebug(lcPropagateDownload) << _item->_file << "may not need download, computing checksum";
         auto computeChecksum = new ComputeChecksum(this);
         computeChecksum->setChecksumType(parseChecksumHeaderType(_item->_checksumHeader));
+        computeChecksum->setChecksumCache(propagator()->_journal);
         connect(computeChecksum, SIGNAL(done(QByteArray, QByteArray)),
             SLOT(conflictChecksumComputed(QByteArray, QByteArray)));
         computeChecksum->start(propagator()->getFilePath(_item->_file));
@@ -390,7 +514,8 @@ void PropagateDownloadFile::startDownload()
     propagator()->reportProgress(*_item, 0);
 
     QString tmpFileName;
-    QByteArray expectedEtagForResume;
+    _expectedEtagForResume.clear();
+    _checksumCalculators.clear();
     const SyncJournalDb::DownloadInfo progressInfo = propagator()->_journal->getDownloadInfo(_item->_file);
     if (progressInfo._valid) {
         // if the etag has changed meanwhile, remove the already downloaded part.
@@ -399,7 +524,8 @@ void PropagateDownloadFile::startDownload()
             propagator()->_journal->setDownloadInfo(_item->_file, SyncJournalDb::DownloadInfo());
         } else {
             tmpFileName = progressInfo._tmpfile;
-            expectedEtagForResume = progressInfo._etag;
+            _expectedEtagForResume = progressInfo._etag;
+            _segments = progressInfo._segments;
         }
     }
 
@@ -415,7 +541,18 @@ void PropagateDownloadFile::startDownload()
 
     FileSystem::setFileHidden(_tmpFile.fileName(), true);
 
-    _resumeStart = _tmpFile.size();
+    if (_segments.isEmpty() && _tmpFile.size() == 0) {
+        _segments = planSegments();
+    }
+    if (_segments.isEmpty()) {
+        _resumeStart = _tmpFile.size();
+    } else {
+        // The temporary file has holes, only the segments tell what is there
+        _resumeStart = 0;
+        foreach (quint64 done, _segments) {
+            _resumeStart += done;
+        }
+    }
     if (_resumeStart > 0) {
         if (_resumeStart == _item->_size) {
             qCInfo(lcPropagateDownload) << "File is already complete, no need to download";
@@ -453,17 +590,192 @@ void PropagateDownloadFile::startDownload()
         pi._etag = _item->_etag;
         pi._tmpfile = tmpFileName;
         pi._valid = true;
+        pi._segments = _segments;
         propagator()->_journal->setDownloadInfo(_item->_file, pi);
         propagator()->_journal->commit("download file start");
     }
 
+    // Maybe a local file already has the content: copying it is faster
+    if (_resumeStart == 0 && reuseLocalContent()) {
+        return;
+    }
+
+    startServerDownload();
+}
+
+bool PropagateDownloadFile::reuseLocalContent()
+{
+    QByteArray checksumType, checksum;
+    if (_item->_size <= 0 || !parseChecksumHeader(_item->_checksumHeader, &checksumType, &checksum)
+        || checksumType.isEmpty()) {
+        return false;
+    }
+
+    _reuseSources.clear();
+    _reuseExpected.clear();
+    const auto records = propagator()->_journal->getFileRecordsByChecksum(
+        _item->_checksumHeader, _item->_size, maxReuseCandidates);
+    foreach (const SyncJournalFileRecord &record, records) {
+        if (record._type != SyncFileItem::File) {
+            continue;
+        }
+        _reuseSources.append(propagator()->getFilePath(record._path));
+        _reuseExpected.append(qMakePair(record._fileSize, Utility::qDateTimeToTime_t(record._modtime)));
+    }
+    if (_reuseSources.isEmpty()) {
+        return false;
+    }
+
+    qCInfo(lcPropagateDownload) << "Trying to reuse the content of" << _reuseSources << "for" << _item->_file;
+    _tmpFile.close();
+    propagator()->_activeJobList.append(this);
+    copyReuseSource(0);
+    return true;
+}
+
+void PropagateDownloadFile::copyReuseSource(int first)
+{
+    const QStringList sources = _reuseSources;
+    const QVector<QPair<qint64, time_t>> expected = _reuseExpected;
+    const QString tmpFileName = _tmpFile.fileName();
+    connect(&_reuseCopyWatcher, SIGNAL(finished()), this, SLOT(slotReuseCopied()), Qt::UniqueConnection);
+    _reuseCopyWatcher.setFuture(LocalIoExecutor::instance()->run<int>([sources, expected, first, tmpFileName]() {
+        return copyUnchangedSource(sources, expected, first, tmpFileName);
+    }));
+}
+
+void PropagateDownloadFile::slotReuseCopied()
+{
+    _reuseSource = _reuseCopyWatcher.result();
+    if (_reuseSource < 0 || propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        reuseFailed();
+        return;
+    }
+
+    // Like all checksums of files, not on the LocalIoExecutor
+    QByteArray checksumType, checksum;
+    parseChecksumHeader(_item->_checksumHeader, &checksumType, &checksum);
+    const QString tmpFileName = _tmpFile.fileName();
+    connect(&_reuseChecksumWatcher, SIGNAL(finished()), this, SLOT(slotReuseChecksumComputed()), Qt::UniqueConnection);
+    _reuseChecksumWatcher.setFuture(ChecksumExecutor::instance()->run<QByteArray>(ChecksumExecutor::TransferPriority,
+        [tmpFileName, checksumType]() { return ComputeChecksum::computeNow(tmpFileName, checksumType); }));
+}
+
+void PropagateDownloadFile::slotReuseChecksumComputed()
+{
+    if (_reuseChecksumWatcher.isCanceled()) {
+        propagator()->_activeJobList.removeOne(this);
+        return;
+    }
+
+    QByteArray checksumType, checksum;
+    parseChecksumHeader(_item->_checksumHeader, &checksumType, &checksum);
+    const QString source = _reuseSources.at(_reuseSource);
+    if (_reuseChecksumWatcher.result() != checksum) {
+        qCInfo(lcPropagateDownload) << "The copy of" << source << "has a different checksum";
+        copyReuseSource(_reuseSource + 1);
+        return;
+    }
+
+    propagator()->_activeJobList.removeOne(this);
+    qCInfo(lcPropagateDownload) << "Reused the content of" << source << "for" << _item->_file;
+    _contentChecksumVerified = true; // the copy has it
+    propagator()->reportProgress(*_item, _item->_size);
+    downloadFinished();
+}
+
+void PropagateDownloadFile::reuseFailed()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    // Nothing usable was found, the temporary file is empty again
+    if (!_tmpFile.open(QIODevice::Append | QIODevice::Unbuffered)) {
+        done(SyncFileItem::NormalError, _tmpFile.errorString());
+        return;
+    }
+    startServerDownload();
+}
+
+void PropagateDownloadFile::startServerDownload()
+{
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0))
+        return;
+
+    if (!_segments.isEmpty()) {
+        startSegmentedDownload();
+        return;
+    }
+
+    // Checksum the data while it is written: for the type the server is expected
+    // to send in the checksum header, and for the content checksum.
+    QList<QByteArray> checksumTypes;
+    checksumTypes << parseChecksumHeaderType(_item->_checksumHeader);
+    if (!checksumTypes.contains(contentChecksumType())) {
+        checksumTypes << contentChecksumType();
+    }
+    foreach (const QByteArray &type, checksumTypes) {
+        if (type.isEmpty()) {
+            continue;
+        }
+        QSharedPointer<ChecksumCalculator> calculator(new ChecksumCalculator(type));
+        if (calculator->isValid()) {
+            _checksumCalculators.append(calculator);
+        }
+    }
+
+    // When resuming, the calculators first need the part that is already there
+    if (_resumeStart > 0 && !_checksumCalculators.isEmpty()) {
+        connect(&_resumeChecksumWatcher, SIGNAL(finished()),
+            this, SLOT(slotResumeChecksumsComputed()), Qt::UniqueConnection);
+        const QString fileName = _tmpFile.fileName();
+        const qint64 prefixSize = _resumeStart;
+        const auto calculators = _checksumCalculators;
+        _resumeChecksumWatcher.setFuture(ChecksumExecutor::instance()->run<bool>(ChecksumExecutor::TransferPriority,
+            [fileName, prefixSize, calculators]() { return checksumFilePrefix(fileName, prefixSize, calculators); }));
+        return;
+    }
+
+    startGetJob();
+}
+
+void PropagateDownloadFile::slotResumeChecksumsComputed()
+{
+    if (_resumeChecksumWatcher.isCanceled()) {
+        return;
+    }
+    if (!_resumeChecksumWatcher.future().result()) {
+        qCWarning(lcPropagateDownload) << "Could not checksum the resumed part of" << _tmpFile.fileName();
+        _checksumCalculators.clear();
+    }
+    startGetJob();
+}
+
+void PropagateDownloadFile::startGetJob()
+{
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0))
+        return;
+
+    if (_bulkDownload) {
+        if (_resumeStart == 0 && _item->_directDownloadUrl.isEmpty()) {
+            QList<ChecksumCalculator *> calculators;
+            foreach (const QSharedPointer<ChecksumCalculator> &calculator, _checksumCalculators) {
+                calculators.append(calculator.data());
+            }
+            _bulkDownload->addPart(this, propagator()->_remoteFolder + _item->_file, &_tmpFile, calculators);
+            return;
+        }
+        // A part of the file is there already, only a GET can resume
+        _bulkDownload->removePart(this);
+        _bulkDownload.clear();
+    }
+
     QMap<QByteArray, QByteArray> headers;
 
     if (_item->_directDownloadUrl.isEmpty()) {
         // Normal job, download from oC instance
         _job = new GETFileJob(propagator()->account(),
             propagator()->_remoteFolder + _item->_file,
-            &_tmpFile, headers, expectedEtagForResume, _resumeStart, this);
+            &_tmpFile, headers, _expectedEtagForResume, _resumeStart, this);
     } else {
         // We were provided a direct URL, use that one
         qCInfo(lcPropagateDownload) << "directDownloadUrl given for " << _item->_file << _item->_directDownloadUrl;
@@ -475,15 +787,86 @@ void PropagateDownloadFile::startDownload()
         QUrl url = QUrl::fromUserInput(_item->_directDownloadUrl);
         _job = new GETFileJob(propagator()->account(),
             url,
-            &_tmpFile, headers, expectedEtagForResume, _resumeStart, this);
+            &_tmpFile, headers, _expectedEtagForResume, _resumeStart, this);
     }
     _job->setBandwidthManager(&propagator()->_bandwidthManager);
+    _job->setReadBufferSize(propagator()->syncOptions()._downloadBufferSize);
+    _job->setWriteAlignment(propagator()->syncOptions()._downloadWriteAlignment);
+    foreach (const QSharedPointer<ChecksumCalculator> &calculator, _checksumCalculators) {
+        _job->addChecksumCalculator(calculator.data());
+    }
     connect(_job, SIGNAL(finishedSignal()), this, SLOT(slotGetFinished()));
     connect(_job, SIGNAL(downloadProgress(qint64, qint64)), this, SLOT(slotDownloadProgress(qint64, qint64)));
     propagator()->_activeJobList.append(this);
     _job->start();
 }
 
+QMap<quint64, quint64> PropagateDownloadFile::planSegments()
+{
+    QMap<quint64, quint64> segments;
+    const quint64 segmentedDownloadSize = propagator()->syncOptions()._segmentedDownloadSize;
+    if (segmentedDownloadSize == 0 || _item->_size < segmentedDownloadSize
+        || !_item->_directDownloadUrl.isEmpty()) {
+        return segments;
+    }
+
+    // Each segment takes a slot in _activeJobList, don't take more than what is free
+    const int count = qMin(propagator()->maximumActiveTransferJob(),
+        propagator()->hardMaximumActiveJob() - propagator()->_activeJobList.count());
+    if (count < 2) {
+        return segments;
+    }
+    for (int i = 0; i < count; ++i) {
+        segments[_item->_size * i / count] = 0;
+    }
+    qCInfo(lcPropagateDownload) << "Downloading" << _item->_file << "in" << count << "segments";
+    return segments;
+}
+
+void PropagateDownloadFile::startSegmentedDownload()
+{
+    _tmpFile.close();
+
+    // Open every segment before starting any, so a failure doesn't leave requests running
+    QList<GETFileJob *> jobs;
+    for (auto it = _segments.constBegin(); it != _segments.constEnd(); ++it) {
+        auto next = it + 1;
+        const quint64 end = next == _segments.constEnd() ? _item->_size : next.key();
+        const quint64 position = it.key() + it.value();
+        if (position >= end) {
+            continue; // already complete
+        }
+
+        // Each job writes at its own position, so it needs its own file handle
+        QFile *file = new QFile(_tmpFile.fileName());
+        if (!file->open(QIODevice::ReadWrite | QIODevice::Unbuffered) || !file->seek(position)) {
+            done(SyncFileItem::NormalError, file->errorString());
+            delete file;
+            qDeleteAll(jobs);
+            _segmentJobs.clear();
+            return;
+        }
+
+        auto job = new GETFileJob(propagator()->account(),
+            propagator()->_remoteFolder + _item->_file,
+            file, QMap<QByteArray, QByteArray>(), _item->_etag, position, this);
+        file->setParent(job);
+        job->setRangeEnd(end);
+        job->setBandwidthManager(&propagator()->_bandwidthManager);
+        job->setReadBufferSize(propagator()->syncOptions()._downloadBufferSize);
+        job->setWriteAlignment(propagator()->syncOptions()._downloadWriteAlignment);
+        connect(job, SIGNAL(finishedSignal()), this, SLOT(slotSegmentFinished()));
+        connect(job, SIGNAL(downloadProgress(qint64, qint64)), this, SLOT(slotSegmentProgress()));
+        _segmentJobs.insert(job, it.key());
+        jobs.append(job);
+    }
+
+    foreach (GETFileJob *job, jobs) {
+        propagator()->_activeJobList.append(this);
+        job->start();
+    }
+}
+
 qint64 PropagateDownloadFile::committedDiskSpace() const
 {
     if (_state == Running) {
@@ -497,6 +880,66 @@ void PropagateDownloadFile::setDeleteExistingFolder(bool enabled)
     _deleteExisting = enabled;
 }
 
+void PropagateDownloadFile::setBulkDownload(PropagateBulkDownload *bulk)
+{
+    _bulkDownload = bulk;
+}
+
+void PropagateDownloadFile::bulkDownloadFinished(const QMap<QByteArray, QByteArray> &headers, const QByteArray &responseTimestamp)
+{
+    // Like for a GET, a part without an etag can't be trusted
+    const QByteArray etag = parseEtag(headers.value("etag"));
+    if (etag.isEmpty()) {
+        qCWarning(lcPropagateDownload) << "No E-Tag in the bulk download of" << _item->_file;
+        bulkDownloadFailed();
+        return;
+    }
+    _bulkDownload.clear();
+    _item->_etag = etag;
+    bool ok = false;
+    const time_t modtime = headers.value("x-oc-mtime").toLongLong(&ok);
+    if (ok && modtime > 0) {
+        _item->_modtime = modtime;
+    }
+    _item->_responseTimeStamp = responseTimestamp;
+
+    _tmpFile.close();
+    if (_tmpFile.size() == 0 && _item->_size > 0) {
+        FileSystem::remove(_tmpFile.fileName());
+        done(SyncFileItem::NormalError,
+            tr("The downloaded file is empty despite the server announced it should have been %1.")
+                .arg(Utility::octetsToString(_item->_size)));
+        return;
+    }
+    _downloadProgress = _tmpFile.size();
+    propagator()->reportProgress(*_item, _downloadProgress);
+
+    validateTransmissionChecksum(headers.value("oc-checksum"));
+}
+
+void PropagateDownloadFile::bulkDownloadFailed()
+{
+    _bulkDownload.clear();
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        done(SyncFileItem::NormalError, tr("Aborted by the user"));
+        return;
+    }
+
+    // Drop what the bulk download wrote and start over with a GET
+    if (!_tmpFile.isOpen() && !_tmpFile.open(QIODevice::Append | QIODevice::Unbuffered)) {
+        done(SyncFileItem::NormalError, _tmpFile.errorString());
+        return;
+    }
+    if (!_tmpFile.resize(0)) {
+        done(SyncFileItem::NormalError, _tmpFile.errorString());
+        return;
+    }
+    foreach (const QSharedPointer<ChecksumCalculator> &calculator, _checksumCalculators) {
+        calculator->reset();
+    }
+    startGetJob();
+}
+
 const char owncloudCustomSoftErrorStringC[] = "owncloud-custom-soft-error-string";
 void PropagateDownloadFile::slotGetFinished()
 {
@@ -506,32 +949,12 @@ void PropagateDownloadFile::slotGetFinished()
     ASSERT(job);
 
     QNetworkReply::NetworkError err = job->reply()->error();
-    if (err != QNetworkReply::NoError) {
-        _item->_httpErrorCode = job->reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-
-        // If we sent a 'Range' header and get 416 back, we want to retry
-        // without the header.
-        const bool badRangeHeader = job->resumeStart() > 0 && _item->_httpErrorCode == 416;
-        if (badRangeHeader) {
-            qCWarning(lcPropagateDownload) << "server replied 416 to our range request, trying again without";
-            propagator()->_anotherSyncNeeded = true;
-        }
+    // The last write to the temporary file may fail after the reply finished without error
+    if (err != QNetworkReply::NoError || job->errorStatus() != SyncFileItem::NoStatus) {
+        SyncFileItem::Status status = handleGetError(job);
 
-        // Getting a 404 probably means that the file was deleted on the server.
-        const bool fileNotFound = _item->_httpErrorCode == 404;
-        if (fileNotFound) {
-            qCWarning(lcPropagateDownload) << "server replied 404, assuming file was deleted";
-        }
-
-        // Don't keep the temporary file if it is empty or we
-        // used a bad range header or the file's not on the server anymore.
-        if (_tmpFile.size() == 0 || badRangeHeader || fileNotFound) {
-            _tmpFile.close();
-            FileSystem::remove(_tmpFile.fileName());
-            propagator()->_journal->setDownloadInfo(_item->_file, SyncJournalDb::DownloadInfo());
-        }
-
-        if (!_item->_directDownloadUrl.isEmpty() && err != QNetworkReply::OperationCanceledError) {
+        if (!_item->_directDownloadUrl.isEmpty() && err != QNetworkReply::NoError
+            && err != QNetworkReply::OperationCanceledError) {
             // If this was with a direct download, retry without direct download
             qCWarning(lcPropagateDownload) << "Direct download of" << _item->_directDownloadUrl << "failed. Retrying through owncloud.";
             _item->_directDownloadUrl.clear();
@@ -539,33 +962,6 @@ void PropagateDownloadFile::slotGetFinished()
             return;
         }
 
-        // This gives a custom QNAM (by the user of libowncloudsync) to abort() a QNetworkReply in its metaDataChanged() slot and
-        // set a custom error string to make this a soft error. In contrast to the default hard error this won't bring down
-        // the whole sync and allows for a custom error message.
-        QNetworkReply *reply = job->reply();
-        if (err == QNetworkReply::OperationCanceledError && reply->property(owncloudCustomSoftErrorStringC).isValid()) {
-            job->setErrorString(reply->property(owncloudCustomSoftErrorStringC).toString());
-            job->setErrorStatus(SyncFileItem::SoftError);
-        } else if (badRangeHeader) {
-            // Can't do this in classifyError() because 416 without a
-            // Range header should result in NormalError.
-            job->setErrorStatus(SyncFileItem::SoftError);
-        } else if (fileNotFound) {
-            job->setErrorString(tr("File was deleted from server"));
-            job->setErrorStatus(SyncFileItem::SoftError);
-
-            // As a precaution against bugs that cause our database and the
-            // reality on the server to diverge, rediscover this folder on the
-            // next sync run.
-            propagator()->_journal->avoidReadFromDbOnNextSync(_item->_file);
-        }
-
-        SyncFileItem::Status status = job->errorStatus();
-        if (status == SyncFileItem::NoStatus) {
-            status = classifyError(err, _item->_httpErrorCode,
-                &propagator()->_anotherSyncNeeded);
-        }
-
         done(status, job->errorString());
         return;
     }
@@ -616,6 +1012,132 @@ void PropagateDownloadFile::slotGetFinished()
         return;
     }
 
+    validateTransmissionChecksum(job->reply()->rawHeader(checkSumHeaderC));
+}
+
+SyncFileItem::Status PropagateDownloadFile::handleGetError(GETFileJob *job)
+{
+    QNetworkReply::NetworkError err = job->reply()->error();
+    _item->_httpErrorCode = job->reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    // If we sent a 'Range' header and get 416 back, we want to retry
+    // without the header.
+    const bool badRangeHeader = (job->resumeStart() > 0 || !_segments.isEmpty()) && _item->_httpErrorCode == 416;
+    if (badRangeHeader) {
+        qCWarning(lcPropagateDownload) << "server replied 416 to our range request, trying again without";
+        propagator()->_anotherSyncNeeded = true;
+    }
+
+    // Getting a 404 probably means that the file was deleted on the server.
+    const bool fileNotFound = _item->_httpErrorCode == 404;
+    if (fileNotFound) {
+        qCWarning(lcPropagateDownload) << "server replied 404, assuming file was deleted";
+    }
+
+    // Don't keep the temporary file if it is empty or we
+    // used a bad range header or the file's not on the server anymore.
+    if (_tmpFile.size() == 0 || badRangeHeader || fileNotFound) {
+        _tmpFile.close();
+        FileSystem::remove(_tmpFile.fileName());
+        propagator()->_journal->setDownloadInfo(_item->_file, SyncJournalDb::DownloadInfo());
+        _segments.clear();
+    }
+
+    // This gives a custom QNAM (by the user of libowncloudsync) to abort() a QNetworkReply in its metaDataChanged() slot and
+    // set a custom error string to make this a soft error. In contrast to the default hard error this won't bring down
+    // the whole sync and allows for a custom error message.
+    QNetworkReply *reply = job->reply();
+    if (err == QNetworkReply::OperationCanceledError && reply->property(owncloudCustomSoftErrorStringC).isValid()) {
+        job->setErrorString(reply->property(owncloudCustomSoftErrorStringC).toString());
+        job->setErrorStatus(SyncFileItem::SoftError);
+    } else if (badRangeHeader) {
+        // Can't do this in classifyError() because 416 without a
+        // Range header should result in NormalError.
+        job->setErrorStatus(SyncFileItem::SoftError);
+    } else if (fileNotFound) {
+        job->setErrorString(tr("File was deleted from server"));
+        job->setErrorStatus(SyncFileItem::SoftError);
+
+        // As a precaution against bugs that cause our database and the
+        // reality on the server to diverge, rediscover this folder on the
+        // next sync run.
+        propagator()->_journal->avoidReadFromDbOnNextSync(_item->_file);
+    }
+
+    SyncFileItem::Status status = job->errorStatus();
+    if (status == SyncFileItem::NoStatus) {
+        status = classifyError(err, _item->_httpErrorCode,
+            &propagator()->_anotherSyncNeeded);
+    }
+    return status;
+}
+
+void PropagateDownloadFile::slotSegmentFinished()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    GETFileJob *job = qobject_cast<GETFileJob *>(sender());
+    ASSERT(job);
+    const quint64 segmentStart = _segmentJobs.take(job);
+    job->device()->close();
+    if (_segments.contains(segmentStart)) {
+        _segments[segmentStart] = job->currentDownloadPosition() - segmentStart;
+    }
+
+    if (job->reply()->error() != QNetworkReply::NoError || job->errorStatus() != SyncFileItem::NoStatus) {
+        // Only the first error is reported, it is why the other segments are aborted
+        if (_segmentErrorStatus == SyncFileItem::NoStatus) {
+            _segmentErrorStatus = handleGetError(job);
+            _segmentErrorString = job->errorString();
+            foreach (GETFileJob *other, _segmentJobs.keys()) {
+                if (other->reply()) {
+                    other->reply()->abort();
+                }
+            }
+        }
+    } else {
+        if (job->lastModified()) {
+            _item->_modtime = job->lastModified();
+        }
+        _item->_responseTimeStamp = job->responseTimestamp();
+        _segmentChecksumHeader = job->reply()->rawHeader(checkSumHeaderC);
+    }
+
+    // Keep what was downloaded so far for resuming
+    if (!_segments.isEmpty()) {
+        auto pi = propagator()->_journal->getDownloadInfo(_item->_file);
+        if (pi._valid) {
+            pi._segments = _segments;
+            propagator()->_journal->setDownloadInfo(_item->_file, pi);
+        }
+    }
+
+    if (!_segmentJobs.isEmpty()) {
+        return;
+    }
+
+    if (_segmentErrorStatus != SyncFileItem::NoStatus) {
+        done(_segmentErrorStatus, _segmentErrorString);
+        return;
+    }
+
+    // Like the Content-Length check of a single GET: every segment must be complete
+    for (auto it = _segments.constBegin(); it != _segments.constEnd(); ++it) {
+        auto next = it + 1;
+        const quint64 end = next == _segments.constEnd() ? _item->_size : next.key();
+        if (it.key() + it.value() != end) {
+            qCDebug(lcPropagateDownload) << "Segment" << it.key() << "has" << it.value() << "bytes, expected" << end - it.key();
+            propagator()->_anotherSyncNeeded = true;
+            done(SyncFileItem::SoftError, tr("The file could not be downloaded completely."));
+            return;
+        }
+    }
+
+    validateTransmissionChecksum(_segmentChecksumHeader);
+}
+
+void PropagateDownloadFile::validateTransmissionChecksum(const QByteArray &checksumHeader)
+{
     // Do checksum validation for the download. If there is no checksum header, the validator
     // will also emit the validated() signal to continue the flow in slot transmissionChecksumValidated()
     // as this is (still) also correct.
@@ -624,8 +1146,16 @@ void PropagateDownloadFile::slotGetFinished()
         SLOT(transmissionChecksumValidated(QByteArray, QByteArray)));
     connect(validator, SIGNAL(validationFailed(QString)),
         SLOT(slotChecksumFail(QString)));
-    auto checksumHeader = job->reply()->rawHeader(checkSumHeaderC);
-    validator->start(_tmpFile.fileName(), checksumHeader);
+    validator->start(_tmpFile.fileName(), checksumHeader, inlineChecksums());
+}
+
+QHash<QByteArray, QByteArray> PropagateDownloadFile::inlineChecksums() const
+{
+    QHash<QByteArray, QByteArray> checksums;
+    foreach (const QSharedPointer<ChecksumCalculator> &calculator, _checksumCalculators) {
+        checksums.insert(calculator->checksumType(), calculator->result());
+    }
+    return checksums;
 }
 
 void PropagateDownloadFile::slotChecksumFail(const QString &errMsg)
@@ -746,6 +1276,12 @@ void PropagateDownloadFile::transmissionChecksumValidated(const QByteArray &chec
         return contentChecksumComputed(checksumType, checksum);
     }
 
+    // It may have been computed while downloading
+    const QByteArray inlineChecksum = inlineChecksums().value(theContentChecksumType);
+    if (!inlineChecksum.isNull()) {
+        return contentChecksumComputed(theContentChecksumType, inlineChecksum);
+    }
+
     // Compute the content checksum.
     auto computeChecksum = new ComputeChecksum(this);
     computeChecksum->setChecksumType(theContentChecksumType);
@@ -758,6 +1294,7 @@ void PropagateDownloadFile::transmissionChecksumValidated(const QByteArray &chec
 void PropagateDownloadFile::contentChecksumComputed(const QByteArray &checksumType, const QByteArray &checksum)
 {
     _item->_checksumHeader = makeChecksumHeader(checksumType, checksum);
+    _contentChecksumVerified = true;
 
     downloadFinished();
 }
@@ -773,70 +1310,152 @@ void PropagateDownloadFile::downloadFinished()
         return;
     }
 
-    // In case of conflict, make a backup of the old file
-    // Ignore conflicts where both files are binary equal
-    bool isConflict = _item->_instruction == CSYNC_INSTRUCTION_CONFLICT
-        && !FileSystem::fileEquals(fn, _tmpFile.fileName());
-    if (isConflict) {
-        QString renameError;
-        QString conflictFileName = FileSystem::makeConflictFileName(
-            fn, Utility::qDateTimeFromTime_t(FileSystem::getModTime(fn)));
-        if (!FileSystem::rename(fn, conflictFileName, &renameError)) {
-            // If the rename fails, don't replace it.
-
-            // If the file is locked, we want to retry this sync when it
-            // becomes available again.
-            if (FileSystem::isFileLocked(fn)) {
-                emit propagator()->seenLockedFile(fn);
-            }
-
-            done(SyncFileItem::SoftError, renameError);
-            return;
-        }
-        qCInfo(lcPropagateDownload) << "Created conflict file" << fn << "->" << conflictFileName;
+    if (_item->_instruction != CSYNC_INSTRUCTION_CONFLICT) {
+        replaceLocalFile(false);
+        return;
     }
 
-    FileSystem::setModTime(_tmpFile.fileName(), _item->_modtime);
-    // We need to fetch the time again because some file systems such as FAT have worse than a second
-    // Accuracy, and we really need the time from the file system. (#3103)
-    _item->_modtime = FileSystem::getModTime(_tmpFile.fileName());
+    // The local version may get moved to a conflict file: make the queued
+    // journal writes durable before its old name gets the downloaded data.
+    propagator()->_journal->flushPendingWrites();
+
+    // Whether the local file is a conflict is decided by the checksums, if the one
+    // of the download is good enough. The local one may be cached, for example by
+    // conflictChecksumComputed().
+    QByteArray checksumType, checksum, localChecksum;
+    if (_contentChecksumVerified
+        && parseChecksumHeader(_item->_checksumHeader, &checksumType, &checksum)
+        && isCollisionSafeChecksumType(checksumType)) {
+        localChecksum = propagator()->_journal->getCachedChecksum(
+            SyncJournalDb::ChecksumCacheKey::forFile(fn), checksumType);
+    } else {
+        checksumType.clear();
+    }
 
-    if (FileSystem::fileExists(fn)) {
-        // Preserve the existing file permissions.
-        QFileInfo existingFile(fn);
-        if (existingFile.permissions() != _tmpFile.permissions()) {
-            _tmpFile.setPermissions(existingFile.permissions());
-        }
-        preserveGroupOwnership(_tmpFile.fileName(), existingFile);
+    // Reading the local file must not hold up the LocalIoExecutor
+    const QString tmpFileName = _tmpFile.fileName();
+    propagator()->_activeJobList.append(this);
+    connect(&_conflictCheckWatcher, SIGNAL(finished()), this, SLOT(slotConflictChecked()), Qt::UniqueConnection);
+    _conflictCheckWatcher.setFuture(ChecksumExecutor::instance()->run<bool>(ChecksumExecutor::TransferPriority,
+        [fn, tmpFileName, checksumType, checksum, localChecksum]() {
+            return !localContentEquals(fn, tmpFileName, checksumType, checksum, localChecksum);
+        }));
+}
 
-        // Check whether the existing file has changed since the discovery
-        // phase by comparing size and mtime to the previous values. This
-        // is necessary to avoid overwriting user changes that happened between
-        // the discovery phase and now.
-        const qint64 expectedSize = _item->log._other_size;
-        const time_t expectedMtime = _item->log._other_modtime;
-        if (!FileSystem::verifyFileUnchanged(fn, expectedSize, expectedMtime)) {
-            propagator()->_anotherSyncNeeded = true;
-            done(SyncFileItem::SoftError, tr("File has changed since discovery"));
-            return;
-        }
+void PropagateDownloadFile::slotConflictChecked()
+{
+    propagator()->_activeJobList.removeOne(this);
+    if (_conflictCheckWatcher.isCanceled()) {
+        return;
     }
+    replaceLocalFile(_conflictCheckWatcher.result());
+}
+
+void PropagateDownloadFile::replaceLocalFile(bool isConflict)
+{
+    QString fn = propagator()->getFilePath(_item->_file);
 
     // Apply the remote permissions
     // Older server versions sometimes provide empty remote permissions
     // see #4450 - don't adjust the write permissions there.
     const int serverVersionGoodRemotePerm = Account::makeServerVersion(7, 0, 0);
-    if (propagator()->account()->serverVersionInt() >= serverVersionGoodRemotePerm) {
-        FileSystem::setFileReadOnlyWeak(_tmpFile.fileName(),
-            !_item->_remotePerm.contains('W'));
-    }
+    const bool applyRemotePerm = propagator()->account()->serverVersionInt() >= serverVersionGoodRemotePerm;
+    const bool readOnly = !_item->_remotePerm.contains('W');
+
+    const QString tmpFileName = _tmpFile.fileName();
+    const time_t modtime = _item->_modtime;
+    const qint64 expectedSize = _item->log._other_size;
+    const time_t expectedMtime = _item->log._other_modtime;
 
-    QString error;
     emit propagator()->touchedFile(fn);
-    // The fileChanged() check is done above to generate better error messages.
-    if (!FileSystem::uncheckedRenameReplace(_tmpFile.fileName(), fn, &error)) {
-        qCWarning(lcPropagateDownload) << QString("Rename failed: %1 => %2").arg(_tmpFile.fileName()).arg(fn);
+    propagator()->_activeJobList.append(this);
+    connect(&_replaceWatcher, SIGNAL(finished()), this, SLOT(slotReplaceDone()), Qt::UniqueConnection);
+    _replaceWatcher.setFuture(LocalIoExecutor::instance()->run<ReplaceResult>(
+        [fn, tmpFileName, isConflict, modtime, expectedSize, expectedMtime, applyRemotePerm, readOnly]() {
+            ReplaceResult result;
+
+            // In case of conflict, make a backup of the old file
+            // Conflicts where both files are equal were ignored already
+            result._isConflict = isConflict;
+            if (result._isConflict) {
+                QString conflictFileName = FileSystem::makeConflictFileName(
+                    fn, Utility::qDateTimeFromTime_t(FileSystem::getModTime(fn)));
+                if (!FileSystem::rename(fn, conflictFileName, &result._error)) {
+                    // If the rename fails, don't replace it.
+                    result._failure = ReplaceResult::ConflictRenameFailed;
+                    result._locked = FileSystem::isFileLocked(fn);
+                    return result;
+                }
+                qCInfo(lcPropagateDownload) << "Created conflict file" << fn << "->" << conflictFileName;
+            }
+
+            FileSystem::setModTime(tmpFileName, modtime);
+            // We need to fetch the time again because some file systems such as FAT have worse than a second
+            // Accuracy, and we really need the time from the file system. (#3103)
+            result._modtime = FileSystem::getModTime(tmpFileName);
+
+            if (FileSystem::fileExists(fn)) {
+                // Preserve the existing file permissions.
+                QFileInfo existingFile(fn);
+                if (existingFile.permissions() != QFile::permissions(tmpFileName)) {
+                    QFile::setPermissions(tmpFileName, existingFile.permissions());
+                }
+                preserveGroupOwnership(tmpFileName, existingFile);
+
+                // Check whether the existing file has changed since the discovery
+                // phase by comparing size and mtime to the previous values. This
+                // is necessary to avoid overwriting user changes that happened between
+                // the discovery phase and now.
+                if (!FileSystem::verifyFileUnchanged(fn, expectedSize, expectedMtime)) {
+                    result._failure = ReplaceResult::ChangedSinceDiscovery;
+                    result._error = PropagateDownloadFile::tr("File has changed since discovery");
+                    return result;
+                }
+            }
 
+            if (applyRemotePerm) {
+                FileSystem::setFileReadOnlyWeak(tmpFileName, readOnly);
+            }
+
+            // The fileChanged() check is done above to generate better error messages.
+            if (!FileSystem::uncheckedRenameReplace(tmpFileName, fn, &result._error)) {
+                qCWarning(lcPropagateDownload) << QString("Rename failed: %1 => %2").arg(tmpFileName).arg(fn);
+                result._failure = ReplaceResult::RenameFailed;
+                result._locked = FileSystem::isFileLocked(fn);
+                return result;
+            }
+            FileSystem::setFileHidden(fn, false);
+
+            // Maybe we downloaded a newer version of the file than we thought we would...
+            // Get up to date information for the journal.
+            result._size = FileSystem::getSize(fn);
+            return result;
+        }));
+}
+
+void PropagateDownloadFile::slotReplaceDone()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    const ReplaceResult result = _replaceWatcher.result();
+    QString fn = propagator()->getFilePath(_item->_file);
+
+    switch (result._failure) {
+    case ReplaceResult::NoFailure:
+        break;
+    case ReplaceResult::ConflictRenameFailed:
+        // If the file is locked, we want to retry this sync when it
+        // becomes available again.
+        if (result._locked) {
+            emit propagator()->seenLockedFile(fn);
+        }
+        done(SyncFileItem::SoftError, result._error);
+        return;
+    case ReplaceResult::ChangedSinceDiscovery:
+        propagator()->_anotherSyncNeeded = true;
+        done(SyncFileItem::SoftError, result._error);
+        return;
+    case ReplaceResult::RenameFailed:
         // If we moved away the original file due to a conflict but can't
         // put the downloaded file in its place, we are in a bad spot:
         // If we do nothing the next sync run will assume the user deleted
@@ -844,41 +1463,41 @@ void PropagateDownloadFile::downloadFinished()
         // To avoid that, the file is removed from the metadata table entirely
         // which makes it look like we're just about to initially download
         // it.
-        if (isConflict) {
+        if (result._isConflict) {
             propagator()->_journal->deleteFileRecord(fn);
             propagator()->_journal->commit("download finished");
         }
 
         // If the file is locked, we want to retry this sync when it
         // becomes available again, otherwise try again directly
-        if (FileSystem::isFileLocked(fn)) {
+        if (result._locked) {
             emit propagator()->seenLockedFile(fn);
         } else {
             propagator()->_anotherSyncNeeded = true;
         }
 
-        done(SyncFileItem::SoftError, error);
+        done(SyncFileItem::SoftError, result._error);
         return;
     }
-    FileSystem::setFileHidden(fn, false);
 
-    // Maybe we downloaded a newer version of the file than we thought we would...
-    // Get up to date information for the journal.
-    _item->_size = FileSystem::getSize(fn);
+    _item->_modtime = result._modtime;
+    _item->_size = result._size;
 
-    updateMetadata(isConflict);
+    updateMetadata(result._isConflict);
 }
 
 void PropagateDownloadFile::updateMetadata(bool isConflict)
 {
     QString fn = propagator()->getFilePath(_item->_file);
 
-    if (!propagator()->_journal->setFileRecord(SyncJournalFileRecord(*_item, fn))) {
-        done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
-        return;
+    propagator()->_journal->queueFileRecord(SyncJournalFileRecord(*_item, fn));
+    // The content checksum describes the file we just put in place,
+    // an upload of it won't need to read it again.
+    QByteArray checksumType, checksum;
+    if (parseChecksumHeader(_item->_checksumHeader, &checksumType, &checksum)) {
+        propagator()->_journal->setCachedChecksum(SyncJournalDb::ChecksumCacheKey::forFile(fn), checksumType, checksum);
     }
     propagator()->_journal->setDownloadInfo(_item->_file, SyncJournalDb::DownloadInfo());
-    propagator()->_journal->commit("download file start2");
     done(isConflict ? SyncFileItem::Conflict : SyncFileItem::Success);
 
     // handle the special recall file
@@ -903,9 +1522,39 @@ void PropagateDownloadFile::slotDownloadProgress(qint64 received, qint64)
 }
 
 
+void PropagateDownloadFile::slotSegmentProgress()
+{
+    GETFileJob *job = qobject_cast<GETFileJob *>(sender());
+    if (!job || !_segmentJobs.contains(job))
+        return;
+    const quint64 segmentStart = _segmentJobs.value(job);
+    if (_segments.contains(segmentStart)) {
+        _segments[segmentStart] = job->currentDownloadPosition() - segmentStart;
+    }
+
+    quint64 downloaded = 0;
+    foreach (quint64 done, _segments) {
+        downloaded += done;
+    }
+    _downloadProgress = downloaded - _resumeStart;
+    propagator()->reportProgress(*_item, downloaded);
+}
+
+
 void PropagateDownloadFile::abort()
 {
     if (_job && _job->reply())
         _job->reply()->abort();
+    foreach (GETFileJob *job, _segmentJobs.keys()) {
+        if (job->reply())
+            job->reply()->abort();
+    }
+    // Drop the checksum computations, queued ones never start
+    _resumeChecksumWatcher.cancel();
+    _reuseChecksumWatcher.cancel();
+    _conflictCheckWatcher.cancel();
+    foreach (ComputeChecksum *computeChecksum, findChildren<ComputeChecksum *>()) {
+        computeChecksum->cancel();
+    }
 }
 }
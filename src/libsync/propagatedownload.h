@@ -15,12 +15,17 @@
 
 #include "owncloudpropagator.h"
 #include "networkjobs.h"
+#include "checksums.h"
 
 #include <QBuffer>
 #include <QFile>
+#include <QFutureWatcher>
+#include <QSharedPointer>
 
 namespace OCC {
 
+class PropagateBulkDownload;
+
 /**
  * @brief The GETFileJob class
  * @ingroup libsync
@@ -33,15 +38,19 @@ class GETFileJob : public AbstractNetworkJob
     QString _errorString;
     QByteArray _expectedEtagForResume;
     quint64 _resumeStart;
+    quint64 _rangeEnd; // end (exclusive) of the requested byte range, 0 for the whole file
     SyncFileItem::Status _errorStatus;
     QUrl _directDownloadUrl;
     QByteArray _etag;
-    bool _bandwidthLimited; // if _bandwidthQuota will be used
-    bool _bandwidthChoked; // if download is paused (won't read on readyRead())
-    qint64 _bandwidthQuota;
-    QPointer<BandwidthManager> _bandwidthManager;
+    bool _bandwidthLimited; // if the reply's read buffer is sized for the limit
+    QPointer<BandwidthManager> _bandwidthManager; // gives the quota for every read
     bool _hasEmittedFinishedSignal;
     time_t _lastModified;
+    qint64 _readBufferSize; // see setReadBufferSize()
+    qint64 _writeAlignment; // see setWriteAlignment()
+    QByteArray _buffer; // reused for every read from the reply
+    qint64 _bufferedBytes; // bytes at the start of _buffer not written to the device yet
+    QList<ChecksumCalculator *> _checksumCalculators;
 
 public:
     // DOES NOT take ownership of the device.
@@ -65,6 +74,7 @@ public:
         if (reply()->bytesAvailable()) {
             return false;
         } else {
+            writeBuffer(true);
             if (_bandwidthManager) {
                 _bandwidthManager->unregisterDownloadJob(this);
             }
@@ -77,9 +87,6 @@ public:
     }
 
     void setBandwidthManager(BandwidthManager *bwm);
-    void setChoked(bool c);
-    void setBandwidthLimited(bool b);
-    void giveBandwidthQuota(qint64 q);
     qint64 currentDownloadPosition();
 
     QString errorString() const;
@@ -92,6 +99,34 @@ public:
 
     QByteArray &etag() { return _etag; }
     quint64 resumeStart() { return _resumeStart; }
+    QFile *device() { return _device; }
+
+    /** Only download the bytes up to \a end (exclusive), as one segment of the file.
+     *
+     * The server must then answer with exactly that range.
+     */
+    void setRangeEnd(quint64 end) { _rangeEnd = end; }
+
+    /** Size of the buffer the body is read into, default 16 KB.
+     *
+     * Unless the download is bandwidth limited, it is also the size of the
+     * QNetworkReply read buffer, so each readyRead can be drained at once.
+     */
+    void setReadBufferSize(qint64 size) { _readBufferSize = qMax(qint64(1024), size); }
+
+    /** If not 0, writes to the device end on a multiple of this offset.
+     *
+     * The rest stays in the buffer for the next write, the last write of
+     * the download excepted.
+     */
+    void setWriteAlignment(qint64 alignment) { _writeAlignment = alignment; }
+
+    /** Feeds the data written to the device into \a calculator.
+     *
+     * Does not take ownership, the calculator must outlive the job. It is
+     * reset if the server doesn't honor the range and the download restarts.
+     */
+    void addChecksumCalculator(ChecksumCalculator *calculator) { _checksumCalculators.append(calculator); }
     time_t lastModified() { return _lastModified; }
 
 
@@ -101,6 +136,11 @@ signals:
 private slots:
     void slotReadyRead();
     void slotMetaDataChanged();
+
+private:
+    qint64 replyReadBufferSize() const;
+    /// Writes the buffered bytes to the device, see setWriteAlignment()
+    bool writeBuffer(bool all);
 };
 
 /**
@@ -121,9 +161,15 @@ private slots:
     |                         checksum differs?    |
     +-> startDownload() <--------------------------+
           |                                        |
-          +-> run a GETFileJob                     | checksum identical?
+          +-> a local file has the content?        |
+          |   then copy it, and if the copy has    |
+          |   the checksum go to downloadFinished()|
+          |                                        |
+          +-> run a GETFileJob, or hand the        | checksum identical?
+          |   file to the PropagateBulkDownload    |
                                                    |
       done?-> slotGetFinished()                    |
+              or bulkDownloadFinished()            |
                 |                                  |
                 +-> validate checksum header       |
                                                    |
@@ -135,11 +181,30 @@ private slots:
                 |                                  |
                 +-> downloadFinished()             |
                        |                           |
-    +------------------+                           |
+                       +-> conflict? compare the   |
+                           local file on the       |
+                           ChecksumExecutor        |
+                                                   |
+      done?-> replaceLocalFile()                   |
+                |                                  |
+                +-> replace the local file         |
+                    on the LocalIoExecutor         |
+                                                   |
+      done?-> slotReplaceDone()                    |
+                |                                  |
+    +-----------+                                  |
     |                                              |
     +-> updateMetadata() <-------------------------+
 
 \endcode
+
+ The checksums are computed by the GETFileJob while it writes the data, so the
+ validation doesn't need to read the file again, unless the server sends a checksum
+ of an unexpected type.
+
+ Big files may be downloaded in segments instead: startDownload() then runs
+ one GETFileJob per byte range, and slotSegmentFinished() continues with the
+ checksum validation once all of them are done.
  */
 class PropagateDownloadFile : public PropagateItemJob
 {
@@ -150,6 +215,9 @@ public:
         , _resumeStart(0)
         , _downloadProgress(0)
         , _deleteExisting(false)
+        , _contentChecksumVerified(false)
+        , _segmentErrorStatus(SyncFileItem::NoStatus)
+        , _reuseSource(-1)
     {
     }
     void start() Q_DECL_OVERRIDE;
@@ -169,34 +237,127 @@ public:
      */
     void setDeleteExistingFolder(bool enabled);
 
+    /** Hands the file to \a bulk instead of downloading it on its own */
+    void setBulkDownload(PropagateBulkDownload *bulk);
+
+    /** The part of the file in the bulk download is complete, with the \a headers of the part */
+    void bulkDownloadFinished(const QMap<QByteArray, QByteArray> &headers, const QByteArray &responseTimestamp);
+
+    /** The file was not in the bulk download: download it on its own */
+    void bulkDownloadFailed();
+
 private slots:
+    /// Called when the checksums of the part downloaded before are computed
+    void slotResumeChecksumsComputed();
     /// Called when ComputeChecksum on the local file finishes,
     /// maybe the local and remote checksums are identical?
     void conflictChecksumComputed(const QByteArray &checksumType, const QByteArray &checksum);
     /// Called to start downloading the remote file
     void startDownload();
+    /// Called when a local file with the same content was copied, or none could be
+    void slotReuseCopied();
+    /// Called when the checksum of the copied local file is computed
+    void slotReuseChecksumComputed();
+    /// Called to download the file from the server, in segments or not
+    void startServerDownload();
+    /// Called to run the GETFileJob of a download that isn't segmented
+    void startGetJob();
     /// Called when the GETFileJob finishes
     void slotGetFinished();
+    /// Called when the GETFileJob of one segment finishes
+    void slotSegmentFinished();
     /// Called when the download's checksum header was validated
     void transmissionChecksumValidated(const QByteArray &checksumType, const QByteArray &checksum);
     /// Called when the download's checksum computation is done
     void contentChecksumComputed(const QByteArray &checksumType, const QByteArray &checksum);
     void downloadFinished();
+    /// Called when it is known whether the local file of a conflict has other content
+    void slotConflictChecked();
+    /// Called when the downloaded file replaced the local one, or failed to
+    void slotReplaceDone();
     /// Called when it's time to update the db metadata
     void updateMetadata(bool isConflict);
 
     void abort() Q_DECL_OVERRIDE;
     void slotDownloadProgress(qint64, qint64);
+    void slotSegmentProgress();
     void slotChecksumFail(const QString &errMsg);
 
 private:
     void deleteExistingFolder();
+    /// Moves the temporary file to the local file, continues in slotReplaceDone()
+    void replaceLocalFile(bool isConflict);
+    /// Copies a local file with the content the server announced, continues in slotReuseCopied()
+    bool reuseLocalContent();
+    /// Copies the first usable of _reuseSources from \a first on, on the LocalIoExecutor
+    void copyReuseSource(int first);
+    /// Downloads from the server after all, the temporary file is empty
+    void reuseFailed();
+    /// Splits the file into segments if it is big enough and there are free transfer slots
+    QMap<quint64, quint64> planSegments();
+    void startSegmentedDownload();
+    /// Cleans up after a failed GET and returns the status to finish with
+    SyncFileItem::Status handleGetError(GETFileJob *job);
+    /// Validates the checksum header of the download, continues in transmissionChecksumValidated()
+    void validateTransmissionChecksum(const QByteArray &checksumHeader);
+    /// The checksums computed while downloading, mapped from their type
+    QHash<QByteArray, QByteArray> inlineChecksums() const;
 
     quint64 _resumeStart;
     qint64 _downloadProgress;
     QPointer<GETFileJob> _job;
     QFile _tmpFile;
     bool _deleteExisting;
+    /// Set if the file is downloaded as a part of a bulk download
+    QPointer<PropagateBulkDownload> _bulkDownload;
+    /// Whether the checksum header of the item is the one of the temporary file
+    bool _contentChecksumVerified;
+
+    // Segmented download, see SyncJournalDb::DownloadInfo::_segments
+    QMap<quint64, quint64> _segments;
+    QHash<GETFileJob *, quint64> _segmentJobs; // running job -> start of its segment
+    SyncFileItem::Status _segmentErrorStatus;
+    QString _segmentErrorString;
+    QByteArray _segmentChecksumHeader;
+
+    QByteArray _expectedEtagForResume;
+    // Checksums of the temporary file, computed while the GETFileJob writes it
+    QVector<QSharedPointer<ChecksumCalculator>> _checksumCalculators;
+    QFutureWatcher<bool> _resumeChecksumWatcher;
+
+    // The local files that may have the content, see reuseLocalContent()
+    QStringList _reuseSources;
+    QVector<QPair<qint64, time_t>> _reuseExpected; // their size and mtime in the journal
+    int _reuseSource; // the one being tried
+    QFutureWatcher<int> _reuseCopyWatcher;
+    QFutureWatcher<QByteArray> _reuseChecksumWatcher;
+
+    // What downloadFinished() did to the local files
+    struct ReplaceResult
+    {
+        enum Failure {
+            NoFailure,
+            ConflictRenameFailed,
+            ChangedSinceDiscovery,
+            RenameFailed
+        };
+        ReplaceResult()
+            : _failure(NoFailure)
+            , _isConflict(false)
+            , _locked(false)
+            , _modtime(0)
+            , _size(0)
+        {
+        }
+        Failure _failure;
+        QString _error;
+        bool _isConflict; // the local file was moved to a conflict file
+        bool _locked; // the local file was locked when the rename failed
+        time_t _modtime;
+        qint64 _size;
+    };
+    QFutureWatcher<bool> _conflictCheckWatcher; // whether the local file has other content
+    QFutureWatcher<ReplaceResult> _replaceWatcher;
 
     QElapsedTimer _stopwatch;
 };
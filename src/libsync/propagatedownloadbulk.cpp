@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "propagatedownloadbulk.h"
+#include "propagatedownload.h"
+#include "owncloudpropagator_p.h"
+#include "account.h"
+#include "checksums.h"
+#include "utility.h"
+#include "asserts.h"
+
+#include <QBuffer>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+namespace OCC {
+
+Q_LOGGING_CATEGORY(lcBulkDownloadJob, "sync.networkjob.bulkdownload", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcPropagateBulkDownload, "sync.propagator.bulkdownload", QtInfoMsg)
+
+BulkDownloadJob::BulkDownloadJob(AccountPtr account, const QVector<Part> &parts, QObject *parent)
+    : AbstractNetworkJob(account, QString(), parent)
+    , _state(Delimiter)
+    , _remaining(0)
+{
+    foreach (const Part &part, parts) {
+        _parts.insert(part._path, part);
+    }
+}
+
+void BulkDownloadJob::start()
+{
+    QJsonArray paths;
+    foreach (const Part &part, _parts) {
+        paths.append(part._path);
+    }
+
+    QNetworkRequest req;
+    req.setHeader(QNetworkRequest::ContentTypeHeader, QByteArray("application/json"));
+    req.setRawHeader("Accept", "multipart/related");
+    req.setPriority(QNetworkRequest::LowPriority); // Like the GETs, must not block non-propagation jobs.
+
+    QBuffer *buf = new QBuffer(this);
+    buf->setData(QJsonDocument(paths).toJson(QJsonDocument::Compact));
+    buf->open(QIODevice::ReadOnly);
+    sendRequest("POST", Utility::concatUrlPath(account()->url(), QLatin1String("remote.php/dav/bulkdownload")), req, buf);
+
+    if (reply()->error() != QNetworkReply::NoError) {
+        qCWarning(lcBulkDownloadJob) << " Network error: " << reply()->errorString();
+    }
+    connect(reply(), SIGNAL(metaDataChanged()), this, SLOT(slotMetaDataChanged()));
+    connect(reply(), SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+    connect(this, SIGNAL(networkActivity()), account().data(), SIGNAL(propagatorNetworkActivity()));
+    AbstractNetworkJob::start();
+}
+
+void BulkDownloadJob::slotMetaDataChanged()
+{
+    const int httpStatus = reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (httpStatus != 200 || reply()->error() != QNetworkReply::NoError) {
+        return; // handled when the job is finished
+    }
+
+    const QByteArray contentType = reply()->header(QNetworkRequest::ContentTypeHeader).toByteArray();
+    const int boundaryStart = contentType.indexOf("boundary=");
+    if (!contentType.startsWith("multipart/") || boundaryStart < 0) {
+        fail(tr("Invalid bulk download response"));
+        return;
+    }
+    QByteArray boundary = contentType.mid(boundaryStart + 9);
+    boundary = boundary.left(boundary.indexOf(';')).trimmed();
+    if (boundary.startsWith('"') && boundary.endsWith('"')) {
+        boundary = boundary.mid(1, boundary.size() - 2);
+    }
+    _boundary = boundary;
+}
+
+void BulkDownloadJob::slotReadyRead()
+{
+    if (!reply() || _boundary.isEmpty() || _state == Done) {
+        return;
+    }
+    _buffer += reply()->readAll();
+    parse();
+}
+
+bool BulkDownloadJob::parse()
+{
+    while (_state != Done) {
+        if (_state == Body) {
+            const qint64 available = qMin(_remaining, qint64(_buffer.size()));
+            if (available > 0 && _part._device) {
+                if (_part._device->write(_buffer.constData(), available) != available) {
+                    fail(_part._device->errorString());
+                    return false;
+                }
+                foreach (ChecksumCalculator *calculator, _part._checksumCalculators) {
+                    calculator->addData(_buffer.constData(), available);
+                }
+            }
+            _buffer.remove(0, available);
+            _remaining -= available;
+            if (_remaining > 0) {
+                return true; // wait for more
+            }
+            _state = Delimiter;
+            if (_part._device) {
+                _part._device = 0;
+                emit partFinished(_part._path, _partHeaders);
+            }
+            continue;
+        }
+
+        const int lineEnd = _buffer.indexOf("\r\n");
+        if (lineEnd < 0) {
+            return true; // wait for more
+        }
+        const QByteArray line = _buffer.left(lineEnd);
+        _buffer.remove(0, lineEnd + 2);
+
+        if (_state == Delimiter) {
+            if (line.isEmpty()) {
+                continue; // the line break after a body
+            } else if (line == "--" + _boundary) {
+                _state = Headers;
+                _partHeaders.clear();
+            } else if (line == "--" + _boundary + "--") {
+                _state = Done;
+                _buffer.clear();
+            } else {
+                fail(tr("Invalid bulk download response"));
+                return false;
+            }
+        } else if (!line.isEmpty()) {
+            const int colon = line.indexOf(':');
+            if (colon <= 0) {
+                fail(tr("Invalid bulk download response"));
+                return false;
+            }
+            _partHeaders[line.left(colon).trimmed().toLower()] = line.mid(colon + 1).trimmed();
+        } else {
+            // The body of the part starts
+            bool ok = false;
+            _remaining = _partHeaders.value("content-length").toLongLong(&ok);
+            if (!ok || _remaining < 0) {
+                fail(tr("Invalid bulk download response"));
+                return false;
+            }
+            // Taking the part ignores it if it comes twice
+            const QString path = QUrl::fromPercentEncoding(_partHeaders.value("x-file-path"));
+            _part = _parts.take(path);
+            if (!_part._device) {
+                qCWarning(lcBulkDownloadJob) << "Ignoring unexpected part" << path;
+            }
+            _state = Body;
+        }
+    }
+    return true;
+}
+
+void BulkDownloadJob::fail(const QString &error)
+{
+    qCWarning(lcBulkDownloadJob) << "Bulk download failed:" << error;
+    _errorString = error;
+    _state = Done;
+    _buffer.clear();
+    _part._device = 0;
+    reply()->abort();
+}
+
+bool BulkDownloadJob::finished()
+{
+    if (reply()->error() == QNetworkReply::NoError && !_boundary.isEmpty() && _state != Done) {
+        _buffer += reply()->readAll();
+        parse();
+        if (_state != Done) {
+            qCWarning(lcBulkDownloadJob) << "Bulk download response is truncated";
+        }
+    }
+
+    qCInfo(lcBulkDownloadJob) << "POST of" << reply()->request().url() << "FINISHED WITH STATUS"
+                              << reply()->error()
+                              << (reply()->error() == QNetworkReply::NoError ? QLatin1String("") : errorString())
+                              << reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+
+    emit finishedSignal();
+    return true;
+}
+
+QString BulkDownloadJob::errorString() const
+{
+    if (!_errorString.isEmpty()) {
+        return _errorString;
+    }
+    return AbstractNetworkJob::errorString();
+}
+
+PropagateBulkDownload::PropagateBulkDownload(OwncloudPropagator *propagator, const SyncFileItemVector &items)
+    : PropagatorCompositeJob(propagator)
+{
+    foreach (const SyncFileItemPtr &item, items) {
+        auto download = new PropagateDownloadFile(propagator, item);
+        download->setBulkDownload(this);
+        connect(download, SIGNAL(finished(SyncFileItem::Status)), this, SLOT(slotDownloadFinished(SyncFileItem::Status)));
+        _waiting.insert(download);
+        appendJob(download);
+    }
+}
+
+void PropagateBulkDownload::addPart(PropagateDownloadFile *download, const QString &path, QFile *device,
+    const QList<ChecksumCalculator *> &checksumCalculators)
+{
+    _waiting.remove(download);
+    _pending.insert(path, download);
+
+    BulkDownloadJob::Part part;
+    part._path = path;
+    part._device = device;
+    part._checksumCalculators = checksumCalculators;
+    _parts.append(part);
+
+    // The download is not an active job while it waits: others may start
+    startIfReady();
+    propagator()->scheduleNextJob();
+}
+
+void PropagateBulkDownload::removePart(PropagateDownloadFile *download)
+{
+    _waiting.remove(download);
+    startIfReady();
+}
+
+void PropagateBulkDownload::slotDownloadFinished(SyncFileItem::Status)
+{
+    removePart(static_cast<PropagateDownloadFile *>(sender()));
+}
+
+void PropagateBulkDownload::startIfReady()
+{
+    if (!_waiting.isEmpty() || _parts.isEmpty() || _job) {
+        return;
+    }
+
+    qCInfo(lcPropagateBulkDownload) << "Downloading" << _parts.size() << "files in one request";
+    _job = new BulkDownloadJob(propagator()->account(), _parts, this);
+    _parts.clear();
+    connect(_job, SIGNAL(partFinished(QString, QMap<QByteArray, QByteArray>)),
+        this, SLOT(slotPartFinished(QString, QMap<QByteArray, QByteArray>)));
+    connect(_job, SIGNAL(finishedSignal()), this, SLOT(slotBulkDownloadFinished()));
+
+    // The request is one transfer
+    _activeJob = _pending.begin().value();
+    if (_activeJob) {
+        propagator()->_activeJobList.append(_activeJob);
+    }
+    _job->start();
+}
+
+void PropagateBulkDownload::slotPartFinished(const QString &path, const QMap<QByteArray, QByteArray> &headers)
+{
+    BulkDownloadJob *job = qobject_cast<BulkDownloadJob *>(sender());
+    ASSERT(job);
+
+    if (QPointer<PropagateDownloadFile> download = _pending.take(path)) {
+        download->bulkDownloadFinished(headers, job->responseTimestamp());
+    }
+}
+
+void PropagateBulkDownload::slotBulkDownloadFinished()
+{
+    BulkDownloadJob *job = qobject_cast<BulkDownloadJob *>(sender());
+    ASSERT(job);
+
+    if (_activeJob) {
+        propagator()->_activeJobList.removeOne(_activeJob);
+    }
+    _activeJob.clear();
+
+    // What was not in the response is downloaded one by one
+    const auto pending = _pending;
+    _pending.clear();
+    if (!pending.isEmpty()) {
+        qCWarning(lcPropagateBulkDownload) << pending.size() << "files were not in the bulk download, downloading them one by one"
+                                           << job->reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+                                           << job->errorString();
+    }
+    foreach (const QPointer<PropagateDownloadFile> &download, pending) {
+        if (download) {
+            download->bulkDownloadFailed();
+        }
+    }
+}
+
+void PropagateBulkDownload::abort()
+{
+    PropagatorCompositeJob::abort();
+    if (_job) {
+        if (_job->reply()) {
+            _job->reply()->abort();
+        }
+        return;
+    }
+
+    // Nothing was sent yet, the downloads that handed over their file finish now
+    const auto pending = _pending;
+    _pending.clear();
+    _parts.clear();
+    foreach (const QPointer<PropagateDownloadFile> &download, pending) {
+        if (download) {
+            download->bulkDownloadFailed();
+        }
+    }
+}
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+#pragma once
+
+#include "owncloudpropagator.h"
+#include "networkjobs.h"
+
+#include <QFile>
+#include <QHash>
+#include <QPointer>
+#include <QSet>
+
+namespace OCC {
+
+class ChecksumCalculator;
+class PropagateDownloadFile;
+
+/**
+ * @brief The BulkDownloadJob class downloads several files in one request
+ *
+ * The request is a POST of the JSON array of the paths. The server streams a
+ * multipart/related response with one part per file it could send: the part
+ * has the X-File-Path of the file, its ETag, X-OC-MTime, OC-Checksum and
+ * Content-Length headers. The data of every part is written to the device of
+ * its path while it arrives, and partFinished() is emitted once it is complete.
+ * Files the server can't send are left out of the response.
+ * @ingroup libsync
+ */
+class BulkDownloadJob : public AbstractNetworkJob
+{
+    Q_OBJECT
+public:
+    struct Part
+    {
+        Part()
+            : _device(0)
+        {
+        }
+        QString _path;
+        QFile *_device; // not owned
+        QList<ChecksumCalculator *> _checksumCalculators; // not owned, fed with the data
+    };
+
+    explicit BulkDownloadJob(AccountPtr account, const QVector<Part> &parts, QObject *parent = 0);
+
+    void start() Q_DECL_OVERRIDE;
+    bool finished() Q_DECL_OVERRIDE;
+
+    QString errorString() const;
+
+signals:
+    /** The data of \a path is complete, with the headers of its part */
+    void partFinished(const QString &path, const QMap<QByteArray, QByteArray> &headers);
+    void finishedSignal();
+
+private slots:
+    void slotMetaDataChanged();
+    void slotReadyRead();
+
+private:
+    /** Consumes what it can of _buffer, returns false on a malformed response */
+    bool parse();
+    void fail(const QString &error);
+
+    enum State {
+        Delimiter, // before the boundary of the next part
+        Headers,
+        Body,
+        Done // after the closing boundary
+    };
+
+    QHash<QString, Part> _parts;
+    QByteArray _boundary;
+    QByteArray _buffer; // received, not consumed yet
+    State _state;
+    QMap<QByteArray, QByteArray> _partHeaders;
+    Part _part; // the part of the body being received, no _device if it is unknown
+    qint64 _remaining; // bytes of the body still to come
+    QString _errorString;
+};
+
+/**
+ * @brief Downloads a group of small files of one directory together
+ *
+ * The downloads of the files are jobs of their own: they prepare the
+ * temporary file as usual, but instead of sending a GET they hand it to
+ * this job. Once all of them did, or finished otherwise, one
+ * BulkDownloadJob fetches the files, and every download continues with
+ * the checksum validation and the journal as soon as its part is complete.
+ * Downloads whose part is missing or broken fall back to a normal GET.
+ *
+ * Only used if the server has the bulkdownload capability.
+ * @ingroup libsync
+ */
+class PropagateBulkDownload : public PropagatorCompositeJob
+{
+    Q_OBJECT
+public:
+    /** The most files downloaded in one request */
+    static const int maxFiles = 100;
+
+    PropagateBulkDownload(OwncloudPropagator *propagator, const SyncFileItemVector &items);
+
+    /** Called by the downloads once their temporary file \a device is ready */
+    void addPart(PropagateDownloadFile *download, const QString &path, QFile *device,
+        const QList<ChecksumCalculator *> &checksumCalculators);
+
+    /** Called by the downloads that download on their own instead */
+    void removePart(PropagateDownloadFile *download);
+
+    void abort() Q_DECL_OVERRIDE;
+
+private slots:
+    void slotDownloadFinished(SyncFileItem::Status);
+    void slotPartFinished(const QString &path, const QMap<QByteArray, QByteArray> &headers);
+    void slotBulkDownloadFinished();
+
+private:
+    void startIfReady();
+
+    /// The downloads that did not hand over their file yet
+    QSet<PropagateDownloadFile *> _waiting;
+    /// The downloads whose part was requested, or is about to be
+    QHash<QString, QPointer<PropagateDownloadFile>> _pending;
+    QVector<BulkDownloadJob::Part> _parts;
+    QPointer<BulkDownloadJob> _job;
+    QPointer<PropagateDownloadFile> _activeJob; // holds the slot in _activeJobList
+};
+}
@@ -120,8 +120,7 @@ void PropagateRemoteDelete::slotDeleteJobFinished()
         return;
     }
 
-    propagator()->_journal->deleteFileRecord(_item->_originalFile, _item->_isDirectory);
-    propagator()->_journal->commit("Remote Remove");
+    propagator()->_journal->queueDeleteFileRecord(_item->_originalFile, _item->_isDirectory);
     done(SyncFileItem::Success);
 }
 }
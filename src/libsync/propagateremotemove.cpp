@@ -168,7 +168,7 @@ void PropagateRemoteMove::finalize()
     // reopens the db successfully.
     // The db is only queried to transfer the content checksum from the old
     // to the new record. It is not a problem to skip it here.
-    propagator()->_journal->deleteFileRecord(_item->_originalFile);
+    propagator()->_journal->queueDeleteFileRecord(_item->_originalFile);
 
     SyncJournalFileRecord record(*_item, propagator()->getFilePath(_item->_renameTarget));
     record._path = _item->_renameTarget;
@@ -182,10 +182,7 @@ void PropagateRemoteMove::finalize()
         }
     }
 
-    if (!propagator()->_journal->setFileRecord(record)) {
-        done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
-        return;
-    }
+    propagator()->_journal->queueFileRecord(record);
 
     if (_item->_isDirectory) {
         if (!adjustSelectiveSync(propagator()->_journal, _item->_file, _item->_renameTarget)) {
@@ -194,7 +191,6 @@ void PropagateRemoteMove::finalize()
         }
     }
 
-    propagator()->_journal->commit("Remote Rename");
     done(SyncFileItem::Success);
 }
 
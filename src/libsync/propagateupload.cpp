@@ -25,6 +25,7 @@
 #include "checksums.h"
 #include "syncengine.h"
 #include "propagateremotedelete.h"
+#include "propagateuploadbulk.h"
 #include "asserts.h"
 
 #include <QNetworkAccessManager>
@@ -32,6 +33,9 @@
 #include <QDir>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMutex>
+#include <QThreadPool>
+#include <QtConcurrent>
 #include <cmath>
 #include <cstring>
 
@@ -39,8 +43,17 @@ namespace OCC {
 
 Q_LOGGING_CATEGORY(lcPutJob, "sync.networkjob.put", QtInfoMsg)
 Q_LOGGING_CATEGORY(lcPollJob, "sync.networkjob.poll", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcCopyJob, "sync.networkjob.copy", QtInfoMsg)
 Q_LOGGING_CATEGORY(lcPropagateUpload, "sync.propagator.upload", QtInfoMsg)
 
+// The reads of the files to upload. Not on the LocalIoExecutor: a long
+// delete or rename there must not stall the uploads.
+static QThreadPool *uploadReadPool()
+{
+    static QThreadPool pool;
+    return &pool;
+}
+
 /**
  * We do not want to upload files that are currently being modified.
  * To avoid that, we don't upload files that have a modification time
@@ -158,11 +171,70 @@ bool PollJob::finished()
     return true;
 }
 
+CopyJob::CopyJob(AccountPtr account, const QString &path, const QString &destination, QObject *parent)
+    : AbstractNetworkJob(account, path, parent)
+    , _destination(destination)
+{
+}
+
+void CopyJob::start()
+{
+    QNetworkRequest req;
+    req.setRawHeader("Destination", QUrl::toPercentEncoding(_destination, "/"));
+    req.setRawHeader("Overwrite", "F");
+    sendRequest("COPY", makeDavUrl(path()), req);
+
+    if (reply()->error() != QNetworkReply::NoError) {
+        qCWarning(lcCopyJob) << " Network error: " << reply()->errorString();
+    }
+    AbstractNetworkJob::start();
+}
+
+bool CopyJob::finished()
+{
+    qCInfo(lcCopyJob) << "COPY of" << reply()->request().url() << "FINISHED WITH STATUS"
+                      << reply()->error()
+                      << (reply()->error() == QNetworkReply::NoError ? QLatin1String("") : errorString());
+
+    emit finishedSignal();
+    return true;
+}
+
 void PropagateUploadFileCommon::setDeleteExisting(bool enabled)
 {
     _deleteExisting = enabled;
 }
 
+void PropagateUploadFileCommon::setBulkUpload(PropagateBulkUpload *bulk)
+{
+    _bulkUpload = bulk;
+}
+
+void PropagateUploadFileCommon::bulkUploadFinished(const QByteArray &etag, const QByteArray &fileId, const QByteArray &responseTimestamp)
+{
+    _bulkUpload.clear();
+    if (!fileId.isEmpty()) {
+        _item->_fileId = fileId;
+    }
+    _item->_etag = etag;
+    _item->_responseTimeStamp = responseTimestamp;
+
+    if (!FileSystem::verifyFileUnchanged(propagator()->getFilePath(_item->_file), _item->_size, _item->_modtime)) {
+        propagator()->_anotherSyncNeeded = true;
+    }
+    finalize();
+}
+
+void PropagateUploadFileCommon::bulkUploadFailed()
+{
+    _bulkUpload.clear();
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        abortWithError(SyncFileItem::NormalError, tr("Aborted by the user"));
+        return;
+    }
+    doStartUpload();
+}
+
 
 void PropagateUploadFileCommon::start()
 {
@@ -179,19 +251,19 @@ void PropagateUploadFileCommon::start()
     propagator()->_activeJobList.append(this);
 
     if (!_deleteExisting) {
-        return slotComputeContentChecksum();
+        return slotComputeChecksums();
     }
 
     auto job = new DeleteJob(propagator()->account(),
         propagator()->_remoteFolder + _item->_file,
         this);
     _jobs.append(job);
-    connect(job, SIGNAL(finishedSignal()), SLOT(slotComputeContentChecksum()));
+    connect(job, SIGNAL(finishedSignal()), SLOT(slotComputeChecksums()));
     connect(job, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
     job->start();
 }
 
-void PropagateUploadFileCommon::slotComputeContentChecksum()
+void PropagateUploadFileCommon::slotComputeChecksums()
 {
     if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
         return;
@@ -207,58 +279,72 @@ void PropagateUploadFileCommon::slotComputeContentChecksum()
     _stopWatch.start();
 #endif
 
-    QByteArray checksumType = contentChecksumType();
-
-    // Maybe the discovery already computed the checksum?
+    // Maybe the discovery already computed the content checksum?
     QByteArray existingChecksumType, existingChecksum;
     parseChecksumHeader(_item->_checksumHeader, &existingChecksumType, &existingChecksum);
-    if (existingChecksumType == checksumType) {
-        slotComputeTransmissionChecksum(checksumType, existingChecksum);
+
+    QList<QByteArray> checksumTypes;
+    if (existingChecksumType != contentChecksumType()) {
+        checksumTypes.append(contentChecksumType());
+    }
+    const QByteArray transmissionType = transmissionChecksumType();
+    if (transmissionType != existingChecksumType && !checksumTypes.contains(transmissionType)) {
+        checksumTypes.append(transmissionType);
+    }
+    checksumTypes.removeAll(QByteArray());
+
+    if (checksumTypes.isEmpty()) {
+        slotChecksumsComputed(QHash<QByteArray, QByteArray>(), QByteArray());
         return;
     }
 
-    // Compute the content checksum.
-    auto computeChecksum = new ComputeChecksum(this);
-    computeChecksum->setChecksumType(checksumType);
+    // Compute all the checksums in one pass. Small files are kept in memory
+    // so they don't need to be read again for the upload.
+    auto computeChecksums = new ComputeMultipleChecksums(this);
+    computeChecksums->setChecksumTypes(checksumTypes);
+    computeChecksums->setKeepContentsSize(UploadDevice::readWindowSize);
+    computeChecksums->setChecksumCache(propagator()->_journal);
 
-    connect(computeChecksum, SIGNAL(done(QByteArray, QByteArray)),
-        SLOT(slotComputeTransmissionChecksum(QByteArray, QByteArray)));
-    connect(computeChecksum, SIGNAL(done(QByteArray, QByteArray)),
-        computeChecksum, SLOT(deleteLater()));
-    computeChecksum->start(filePath);
+    connect(computeChecksums, SIGNAL(done(QHash<QByteArray, QByteArray>, QByteArray)),
+        SLOT(slotChecksumsComputed(QHash<QByteArray, QByteArray>, QByteArray)));
+    connect(computeChecksums, SIGNAL(done(QHash<QByteArray, QByteArray>, QByteArray)),
+        computeChecksums, SLOT(deleteLater()));
+    computeChecksums->start(filePath);
 }
 
-void PropagateUploadFileCommon::slotComputeTransmissionChecksum(const QByteArray &contentChecksumType, const QByteArray &contentChecksum)
+void PropagateUploadFileCommon::slotChecksumsComputed(const QHash<QByteArray, QByteArray> &computedChecksums, const QByteArray &contents)
 {
-    _item->_checksumHeader = makeChecksumHeader(contentChecksumType, contentChecksum);
+    QHash<QByteArray, QByteArray> checksums = computedChecksums;
+    QByteArray existingChecksumType, existingChecksum;
+    parseChecksumHeader(_item->_checksumHeader, &existingChecksumType, &existingChecksum);
+    if (!existingChecksumType.isEmpty() && !checksums.contains(existingChecksumType)) {
+        checksums.insert(existingChecksumType, existingChecksum);
+    }
+    _fileContents = contents;
+
+    const QByteArray theContentChecksumType = contentChecksumType();
+    _item->_checksumHeader = makeChecksumHeader(theContentChecksumType, checksums.value(theContentChecksumType));
 
 #ifdef WITH_TESTING
     _stopWatch.addLapTime(QLatin1String("ContentChecksum"));
     _stopWatch.start();
 #endif
 
+    const QByteArray transmissionType = transmissionChecksumType();
+    slotStartUpload(transmissionType, checksums.value(transmissionType));
+}
+
+QByteArray PropagateUploadFileCommon::transmissionChecksumType() const
+{
     // Reuse the content checksum as the transmission checksum if possible
-    const auto supportedTransmissionChecksums =
-        propagator()->account()->capabilities().supportedChecksumTypes();
-    if (supportedTransmissionChecksums.contains(contentChecksumType)) {
-        slotStartUpload(contentChecksumType, contentChecksum);
-        return;
+    const auto &capabilities = propagator()->account()->capabilities();
+    if (capabilities.supportedChecksumTypes().contains(contentChecksumType())) {
+        return contentChecksumType();
     }
-
-    // Compute the transmission checksum.
-    auto computeChecksum = new ComputeChecksum(this);
     if (uploadChecksumEnabled()) {
-        computeChecksum->setChecksumType(propagator()->account()->capabilities().uploadChecksumType());
-    } else {
-        computeChecksum->setChecksumType(QByteArray());
+        return capabilities.uploadChecksumType();
     }
-
-    connect(computeChecksum, SIGNAL(done(QByteArray, QByteArray)),
-        SLOT(slotStartUpload(QByteArray, QByteArray)));
-    connect(computeChecksum, SIGNAL(done(QByteArray, QByteArray)),
-        computeChecksum, SLOT(deleteLater()));
-    const QString filePath = propagator()->getFilePath(_item->_file);
-    computeChecksum->start(filePath);
+    return QByteArray();
 }
 
 void PropagateUploadFileCommon::slotStartUpload(const QByteArray &transmissionChecksumType, const QByteArray &transmissionChecksum)
@@ -297,6 +383,11 @@ void PropagateUploadFileCommon::slotStartUpload(const QByteArray &transmissionCh
 
     quint64 fileSize = FileSystem::getSize(fullFilePath);
     _item->_size = fileSize;
+    if (!_fileContents.isEmpty() && quint64(_fileContents.size()) != fileSize) {
+        propagator()->_anotherSyncNeeded = true;
+        done(SyncFileItem::SoftError, tr("Local file changed during syncing. It will be resumed."));
+        return;
+    }
 
     // But skip the file if the mtime is too close to 'now'!
     // That usually indicates a file that is still being changed
@@ -307,23 +398,263 @@ void PropagateUploadFileCommon::slotStartUpload(const QByteArray &transmissionCh
         return;
     }
 
-    doStartUpload();
+    if (startCopyFromExisting()) {
+        return;
+    }
+    startTransfer();
+}
+
+void PropagateUploadFileCommon::startTransfer()
+{
+    if (!_bulkUpload) {
+        doStartUpload();
+        return;
+    }
+
+    if (_fileContents.isEmpty() && _item->_size > 0) {
+        // The checksums came from the cache, the file was not read yet
+        const QString filePath = propagator()->getFilePath(_item->_file);
+        auto watcher = new QFutureWatcher<QByteArray>(this);
+        connect(watcher, SIGNAL(finished()), SLOT(slotBulkContentsRead()));
+        watcher->setFuture(QtConcurrent::run(uploadReadPool(), std::function<QByteArray()>([filePath]() {
+            QFile file(filePath);
+            return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+        })));
+        return;
+    }
+    addBulkPart(_fileContents);
+}
+
+void PropagateUploadFileCommon::slotBulkContentsRead()
+{
+    auto watcher = static_cast<QFutureWatcher<QByteArray> *>(sender());
+    const QByteArray data = watcher->result();
+    watcher->deleteLater();
+
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        abortWithError(SyncFileItem::NormalError, tr("Aborted by the user"));
+        return;
+    }
+    addBulkPart(data);
+}
+
+void PropagateUploadFileCommon::addBulkPart(const QByteArray &data)
+{
+    if (quint64(data.size()) != _item->_size) {
+        // Let the normal upload report what is wrong with the file
+        _bulkUpload->removePart(this);
+        _bulkUpload.clear();
+        doStartUpload();
+        return;
+    }
+
+    auto headers = PropagateUploadFileCommon::headers();
+    headers.remove("OC-Async");
+    if (!_transmissionChecksumHeader.isEmpty()) {
+        headers[checkSumHeaderC] = _transmissionChecksumHeader;
+    }
+    headers["X-File-Path"] = QUrl::toPercentEncoding(propagator()->_remoteFolder + _item->_file, "/");
+    _bulkUpload->addPart(this, headers, data);
+}
+
+bool PropagateUploadFileCommon::startCopyFromExisting()
+{
+    // Only new files: the copy must not replace anything on the server
+    if (_item->_instruction != CSYNC_INSTRUCTION_NEW || _deleteExisting || _item->_size <= 0) {
+        return false;
+    }
+    const QByteArray checksumType = parseChecksumHeaderType(_item->_checksumHeader);
+    if (checksumType.isEmpty() || checksumType != contentChecksumType()) {
+        return false;
+    }
+
+    QString source;
+    const auto records = propagator()->_journal->getFileRecordsByChecksum(_item->_checksumHeader, _item->_size, 2);
+    foreach (const SyncJournalFileRecord &record, records) {
+        if (record._type == SyncFileItem::File && record._path != _item->_file) {
+            source = record._path;
+            break;
+        }
+    }
+    if (source.isEmpty()) {
+        return false;
+    }
+
+    // The copy can only be verified with the checksum the server has for
+    // the source, don't copy if it has none
+    _copySource = source;
+    _copyProperties.clear();
+    auto job = new LsColJob(propagator()->account(), propagator()->_remoteFolder + source, this);
+    job->setProperties(QList<QByteArray>() << "http://owncloud.org/ns:checksums");
+    _jobs.append(job);
+    connect(job, SIGNAL(directoryListingIterated(QString, QMap<QString, QString>)),
+        SLOT(slotCopyListed(QString, QMap<QString, QString>)));
+    connect(job, SIGNAL(finishedWithoutError()), SLOT(slotCopySourceChecked()));
+    connect(job, SIGNAL(finishedWithError(QNetworkReply *)), SLOT(slotCopyFailed()));
+    connect(job, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
+    propagator()->_activeJobList.append(this);
+    job->start();
+    return true;
+}
+
+void PropagateUploadFileCommon::slotCopySourceChecked()
+{
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        slotCopyFailed();
+        return;
+    }
+    if (!_copyProperties.value("checksums").toUtf8().contains(_item->_checksumHeader)) {
+        qCInfo(lcPropagateUpload) << "The server has no checksum" << _item->_checksumHeader << "for" << _copySource;
+        slotCopyFailed();
+        return;
+    }
+
+    qCInfo(lcPropagateUpload) << "Copying" << _copySource << "on the server instead of uploading" << _item->_file;
+    const QString destination = QDir::cleanPath(propagator()->account()->url().path() + QLatin1Char('/')
+        + propagator()->account()->davPath() + propagator()->_remoteFolder + _item->_file);
+    auto job = new CopyJob(propagator()->account(), propagator()->_remoteFolder + _copySource, destination, this);
+    _jobs.append(job);
+    connect(job, SIGNAL(finishedSignal()), SLOT(slotCopyFinished()));
+    connect(job, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
+    job->start();
 }
 
+void PropagateUploadFileCommon::slotCopyFinished()
+{
+    CopyJob *job = qobject_cast<CopyJob *>(sender());
+    ASSERT(job);
+
+    const int httpCode = job->reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (job->reply()->error() != QNetworkReply::NoError || httpCode != 201
+        || propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        slotCopyFailed();
+        return;
+    }
+
+    // The copy has the modification time of its source
+    auto mtimeJob = new ProppatchJob(propagator()->account(), propagator()->_remoteFolder + _item->_file, this);
+    QMap<QByteArray, QByteArray> properties;
+    properties["DAV::lastmodified"] = QByteArray::number(qint64(_item->_modtime));
+    mtimeJob->setProperties(properties);
+    _jobs.append(mtimeJob);
+    connect(mtimeJob, SIGNAL(success()), SLOT(slotCopyMtimeSet()));
+    connect(mtimeJob, SIGNAL(finishedWithError()), SLOT(slotCopyUnverified()));
+    connect(mtimeJob, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
+    mtimeJob->start();
+}
+
+void PropagateUploadFileCommon::slotCopyMtimeSet()
+{
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        slotCopyUnverified();
+        return;
+    }
+
+    // The journal may be outdated: only trust the checksum the server has for the copy
+    _copyProperties.clear();
+    auto job = new LsColJob(propagator()->account(), propagator()->_remoteFolder + _item->_file, this);
+    job->setProperties(QList<QByteArray>() << "getetag"
+                                           << "getcontentlength"
+                                           << "http://owncloud.org/ns:id"
+                                           << "http://owncloud.org/ns:checksums");
+    _jobs.append(job);
+    connect(job, SIGNAL(directoryListingIterated(QString, QMap<QString, QString>)),
+        SLOT(slotCopyListed(QString, QMap<QString, QString>)));
+    connect(job, SIGNAL(finishedWithoutError()), SLOT(slotCopyVerified()));
+    connect(job, SIGNAL(finishedWithError(QNetworkReply *)), SLOT(slotCopyUnverified()));
+    connect(job, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
+    job->start();
+}
+
+void PropagateUploadFileCommon::slotCopyListed(const QString &, const QMap<QString, QString> &properties)
+{
+    _copyProperties = properties;
+}
+
+void PropagateUploadFileCommon::slotCopyVerified()
+{
+    LsColJob *job = qobject_cast<LsColJob *>(sender());
+    ASSERT(job);
+
+    const QByteArray etag = parseEtag(_copyProperties.value("getetag").toUtf8());
+    if (etag.isEmpty()
+        || _copyProperties.value("getcontentlength").toLongLong() != _item->_size
+        || !_copyProperties.value("checksums").toUtf8().contains(_item->_checksumHeader)) {
+        qCWarning(lcPropagateUpload) << "The copy of" << _item->_file << "does not have the expected content"
+                                     << _copyProperties;
+        slotCopyUnverified();
+        return;
+    }
+    propagator()->_activeJobList.removeOne(this);
+
+    const QByteArray fileId = _copyProperties.value("id").toUtf8();
+    if (!fileId.isEmpty()) {
+        _item->_fileId = fileId;
+    }
+    _item->_etag = etag;
+    _item->_responseTimeStamp = job->responseTimestamp();
+
+    if (!FileSystem::verifyFileUnchanged(propagator()->getFilePath(_item->_file), _item->_size, _item->_modtime)) {
+        propagator()->_anotherSyncNeeded = true;
+    }
+    finalize();
+}
+
+void PropagateUploadFileCommon::slotCopyUnverified()
+{
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        slotCopyFailed();
+        return;
+    }
+
+    // Don't leave content nobody verified on the server if the upload fails
+    auto job = new DeleteJob(propagator()->account(), propagator()->_remoteFolder + _item->_file, this);
+    _jobs.append(job);
+    connect(job, SIGNAL(finishedSignal()), SLOT(slotCopyFailed()));
+    connect(job, SIGNAL(destroyed(QObject *)), SLOT(slotJobDestroyed(QObject *)));
+    job->start();
+}
+
+void PropagateUploadFileCommon::slotCopyFailed()
+{
+    propagator()->_activeJobList.removeOne(this);
+    if (propagator()->_abortRequested.fetchAndAddRelaxed(0)) {
+        abortWithError(SyncFileItem::NormalError, tr("Aborted by the user"));
+        return;
+    }
+
+    // A copy that already exists is overwritten by the upload
+    qCInfo(lcPropagateUpload) << "Could not copy" << _item->_file << "on the server, uploading it";
+    startTransfer();
+}
+
+const qint64 UploadDevice::readWindowSize;
+
+struct UploadDevice::SharedFile
+{
+    QMutex _mutex; // one read at a time
+    QFile _file;
+};
+
 UploadDevice::UploadDevice(BandwidthManager *bwm)
-    : _read(0)
+    : _start(0)
+    , _size(0)
+    , _fileSize(0)
+    , _fileMtime(0)
+    , _dataStart(0)
+    , _readingStart(-1)
+    , _failed(false)
+    , _read(0)
     , _bandwidthManager(bwm)
-    , _bandwidthQuota(0)
-    , _readWithProgress(0)
-    , _bandwidthLimited(false)
-    , _choked(false)
 {
+    connect(&_readWatcher, SIGNAL(finished()), SLOT(slotWindowRead()));
     _bandwidthManager->registerUploadDevice(this);
 }
 
 
 UploadDevice::~UploadDevice()
 {
+    // A read in flight keeps the file until it is done, its result is dropped
     if (_bandwidthManager) {
         _bandwidthManager->unregisterUploadDevice(this);
     }
@@ -332,26 +663,116 @@ UploadDevice::~UploadDevice()
 bool UploadDevice::prepareAndOpen(const QString &fileName, qint64 start, qint64 size)
 {
     _data.clear();
+    _dataStart = 0;
+    _readingStart = -1;
+    _readAhead = Window();
+    _failed = false;
     _read = 0;
 
-    QFile file(fileName);
+    _file.reset(new SharedFile);
+    _file->_file.setFileName(fileName);
     QString openError;
-    if (!FileSystem::openAndSeekFileSharedRead(&file, &openError, start)) {
+    if (!FileSystem::openAndSeekFileSharedRead(&_file->_file, &openError, start)) {
         setErrorString(openError);
+        _file.reset();
         return false;
     }
 
-    size = qBound(0ll, size, FileSystem::getSize(fileName) - start);
-    _data.resize(size);
-    auto read = file.read(_data.data(), size);
-    if (read != size) {
-        setErrorString(file.errorString());
-        return false;
-    }
+    _fileSize = FileSystem::getSize(fileName);
+    _fileMtime = FileSystem::getModTime(fileName);
+    _start = start;
+    _size = qBound(0ll, size, _fileSize - start);
+    startReadWindow(0);
 
     return QIODevice::open(QIODevice::ReadOnly);
 }
 
+bool UploadDevice::openOnData(const QByteArray &data)
+{
+    _file.reset();
+    _readingStart = -1;
+    _readAhead = Window();
+    _failed = false;
+    _data = data;
+    _dataStart = 0;
+    _read = 0;
+    _start = 0;
+    _size = data.size();
+    _fileSize = data.size();
+    return QIODevice::open(QIODevice::ReadOnly);
+}
+
+void UploadDevice::startReadWindow(qint64 pos)
+{
+    if (_readingStart == pos || _readAhead._start == pos || !_file) {
+        return;
+    }
+
+    QSharedPointer<SharedFile> file = _file;
+    const qint64 filePos = _start + pos;
+    const qint64 size = qMin(readWindowSize, _size - pos);
+    // Once the whole chunk is in memory the file is not needed anymore
+    const bool wholeChunk = pos == 0 && size == _size;
+    const qint64 fileSize = _fileSize;
+    const time_t fileMtime = _fileMtime;
+    std::function<Window()> read = [file, pos, filePos, size, wholeChunk, fileSize, fileMtime]() {
+        Window window;
+        window._start = pos;
+        QMutexLocker locker(&file->_mutex);
+        QFile &f = file->_file;
+        window._data.resize(size);
+        const qint64 read = f.isOpen() && f.seek(filePos) ? f.read(window._data.data(), size) : -1;
+        // Checked after the read, so that the whole window comes from the same file
+        if (read != size) {
+            window._error = f.error() != QFile::NoError ? f.errorString() : tr("Local file changed during sync.");
+        } else if (FileSystem::fileChanged(f.fileName(), fileSize, fileMtime)) {
+            window._error = tr("Local file changed during sync.");
+        }
+        if (wholeChunk) {
+            f.close();
+        }
+        return window;
+    };
+    _readWatcher.setFuture(QtConcurrent::run(uploadReadPool(), read));
+    _readingStart = pos;
+}
+
+void UploadDevice::slotWindowRead()
+{
+    const Window window = _readWatcher.result();
+    if (window._start != _readingStart) {
+        return; // not needed anymore
+    }
+    _readingStart = -1;
+
+    if (!window._error.isEmpty()) {
+        // Don't serve a partial window, and fail any further read
+        setErrorString(window._error);
+        _failed = true;
+        _data.clear();
+        _readAhead = Window();
+        _file.reset();
+    } else if (_data.isEmpty() || window._start == _read) {
+        useWindow(window);
+    } else {
+        _readAhead = window;
+    }
+    emit readyRead();
+}
+
+void UploadDevice::useWindow(const Window &window)
+{
+    _data = window._data;
+    _dataStart = window._start;
+    _readAhead = Window();
+
+    // Read the next window while this one is sent
+    const qint64 next = _dataStart + _data.size();
+    if (next < _size) {
+        startReadWindow(next);
+    }
+}
+
 
 qint64 UploadDevice::writeData(const char *, qint64)
 {
@@ -361,53 +782,54 @@ qint64 UploadDevice::writeData(const char *, qint64)
 
 qint64 UploadDevice::readData(char *data, qint64 maxlen)
 {
-    if (_data.size() - _read <= 0) {
+    if (_failed) {
+        return -1;
+    }
+    if (_size - _read <= 0) {
         // at end
         if (_bandwidthManager) {
             _bandwidthManager->unregisterUploadDevice(this);
         }
         return -1;
     }
-    maxlen = qMin(maxlen, _data.size() - _read);
+    maxlen = qMin(maxlen, _size - _read);
     if (maxlen == 0) {
         return 0;
     }
-    if (isChoked()) {
-        return 0;
+    if (_read < _dataStart || _read >= _dataStart + _data.size()) {
+        if (_readAhead._start != _read) {
+            // Not read yet, or seeking back when the request is sent again:
+            // readyRead() is emitted once the window is there
+            startReadWindow(_read);
+            return 0;
+        }
+        useWindow(_readAhead);
     }
-    if (isBandwidthLimited()) {
-        maxlen = qMin(maxlen, _bandwidthQuota);
+    maxlen = qMin(maxlen, _dataStart + _data.size() - _read);
+    if (_bandwidthManager) {
+        maxlen = _bandwidthManager->takeUploadQuota(this, maxlen);
         if (maxlen <= 0) { // no quota
             return 0;
         }
-        _bandwidthQuota -= maxlen;
     }
-    std::memcpy(data, _data.data() + _read, maxlen);
+    std::memcpy(data, _data.constData() + (_read - _dataStart), maxlen);
     _read += maxlen;
     return maxlen;
 }
 
-void UploadDevice::slotJobUploadProgress(qint64 sent, qint64 t)
-{
-    if (sent == 0 || t == 0) {
-        return;
-    }
-    _readWithProgress = sent;
-}
-
 bool UploadDevice::atEnd() const
 {
-    return _read >= _data.size();
+    return _read >= _size;
 }
 
 qint64 UploadDevice::size() const
 {
-    return _data.size();
+    return _size;
 }
 
 qint64 UploadDevice::bytesAvailable() const
 {
-    return _data.size() - _read + QIODevice::bytesAvailable();
+    return _size - _read + QIODevice::bytesAvailable();
 }
 
 // random access, we can seek
@@ -421,35 +843,13 @@ bool UploadDevice::seek(qint64 pos)
     if (!QIODevice::seek(pos)) {
         return false;
     }
-    if (pos < 0 || pos > _data.size()) {
+    if (pos < 0 || pos > _size) {
         return false;
     }
     _read = pos;
     return true;
 }
 
-void UploadDevice::giveBandwidthQuota(qint64 bwq)
-{
-    if (!atEnd()) {
-        _bandwidthQuota = bwq;
-        QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection); // tell QNAM that we have quota
-    }
-}
-
-void UploadDevice::setBandwidthLimited(bool b)
-{
-    _bandwidthLimited = b;
-    QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
-}
-
-void UploadDevice::setChoked(bool b)
-{
-    _choked = b;
-    if (!_choked) {
-        QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
-    }
-}
-
 void PropagateUploadFileCommon::startPollJob(const QString &path)
 {
     PollJob *job = new PollJob(propagator()->account(), path, _item,
@@ -501,6 +901,14 @@ void PropagateUploadFileCommon::checkResettingErrors()
     }
 }
 
+bool PropagateUploadFileCommon::openUploadDevice(UploadDevice *device, qint64 start, qint64 size)
+{
+    if (!_fileContents.isEmpty() && start == 0 && size >= _fileContents.size()) {
+        return device->openOnData(_fileContents);
+    }
+    return device->prepareAndOpen(propagator()->getFilePath(_item->_file), start, size);
+}
+
 void PropagateUploadFileCommon::commonErrorHandling(AbstractNetworkJob *job)
 {
     QByteArray replyContent;
@@ -545,6 +953,10 @@ void PropagateUploadFileCommon::abort()
             job->reply()->abort();
         }
     }
+    // Drop the checksum computation, if it is queued it never starts
+    foreach (auto *computeChecksums, findChildren<ComputeMultipleChecksums *>()) {
+        computeChecksums->cancel();
+    }
 }
 
 // This function is used whenever there is an error occuring and jobs might be in progress
@@ -588,13 +1000,9 @@ void PropagateUploadFileCommon::finalize()
 {
     _finished = true;
 
-    if (!propagator()->_journal->setFileRecord(SyncJournalFileRecord(*_item, propagator()->getFilePath(_item->_file)))) {
-        done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
-        return;
-    }
+    propagator()->_journal->queueFileRecord(SyncJournalFileRecord(*_item, propagator()->getFilePath(_item->_file)));
     // Remove from the progress database:
     propagator()->_journal->setUploadInfo(_item->_file, SyncJournalDb::UploadInfo());
-    propagator()->_journal->commit("upload file start");
 
     done(SyncFileItem::Success);
 }
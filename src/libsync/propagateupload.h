@@ -18,6 +18,8 @@
 
 #include <QBuffer>
 #include <QFile>
+#include <QFutureWatcher>
+#include <QSharedPointer>
 #include <QElapsedTimer>
 
 
@@ -27,21 +29,33 @@ Q_DECLARE_LOGGING_CATEGORY(lcPutJob)
 Q_DECLARE_LOGGING_CATEGORY(lcPropagateUpload)
 
 class BandwidthManager;
+class PropagateBulkUpload;
 
 /**
  * @brief The UploadDevice class
  * @ingroup libsync
  */
-class UploadDevice : public QIODevice
+class OWNCLOUDSYNC_EXPORT UploadDevice : public QIODevice
 {
     Q_OBJECT
 public:
     UploadDevice(BandwidthManager *bwm);
     ~UploadDevice();
 
-    /** Reads the data from the file and opens the device */
+    /**
+     * Opens the device on the given range of the file.
+     *
+     * Chunks that fit in readWindowSize are read at once; bigger ones are
+     * streamed from the file through windows of that size, and reading fails
+     * if the file changes in the meantime. The windows are read on reader
+     * threads, the next one while the current one is sent: readData()
+     * returns 0 until a window is there and readyRead() is emitted then.
+     */
     bool prepareAndOpen(const QString &fileName, qint64 start, qint64 size);
 
+    /** Opens the device on data that was already read from the file */
+    bool openOnData(const QByteArray &data);
+
     qint64 writeData(const char *, qint64) Q_DECL_OVERRIDE;
     qint64 readData(char *data, qint64 maxlen) Q_DECL_OVERRIDE;
     bool atEnd() const Q_DECL_OVERRIDE;
@@ -58,32 +72,61 @@ public:
     }
 #endif
 
-    void setBandwidthLimited(bool);
-    bool isBandwidthLimited() { return _bandwidthLimited; }
-    void setChoked(bool);
-    bool isChoked() { return _choked; }
-    void giveBandwidthQuota(qint64 bwq);
+    /** Size of the data kept in memory while streaming a chunk from the file */
+    static const qint64 readWindowSize = 1024 * 1024;
 
 signals:
 #if QT_VERSION < 0x050402
     void wasReset();
 #endif
 
+private slots:
+    void slotWindowRead();
+
 private:
-    // The file data
+    struct SharedFile;
+
+    /** A window of the chunk, as read on a reader thread */
+    struct Window
+    {
+        Window()
+            : _start(-1)
+        {
+        }
+        qint64 _start; // position in the chunk, -1 if none
+        QByteArray _data;
+        QString _error; // the window could not be read or the file changed
+    };
+
+    /** Starts reading the window at \a pos in the chunk, unless it is already read */
+    void startReadWindow(qint64 pos);
+    /** Makes \a window the current one and reads the next one */
+    void useWindow(const Window &window);
+
+    // The file we stream from, shared with the reads in flight
+    QSharedPointer<SharedFile> _file;
+    // Offset of the chunk in the file, and its size
+    qint64 _start;
+    qint64 _size;
+    // Size and mtime of the file when the device was prepared
+    qint64 _fileSize;
+    time_t _fileMtime;
+    // The file data: the whole chunk, or the current window when streaming
     QByteArray _data;
-    // Position in the data
+    // Position of _data in the chunk
+    qint64 _dataStart;
+    // The read in flight and the chunk position it reads at, -1 if none
+    QFutureWatcher<Window> _readWatcher;
+    qint64 _readingStart;
+    // A window that was read before it was needed
+    Window _readAhead;
+    // A read failed, the device only returns errors
+    bool _failed;
+    // Position in the chunk
     qint64 _read;
 
-    // Bandwidth manager related
+    // Gives the quota for every read, emits readyRead() when there is more
     QPointer<BandwidthManager> _bandwidthManager;
-    qint64 _bandwidthQuota;
-    qint64 _readWithProgress;
-    bool _bandwidthLimited; // if _bandwidthQuota will be used
-    bool _choked; // if upload is paused (readData() will return 0)
-    friend class BandwidthManager;
-protected slots:
-    void slotJobUploadProgress(qint64 sent, qint64 t);
 };
 
 /**
@@ -188,6 +231,27 @@ signals:
     void finishedSignal();
 };
 
+/**
+ * @brief The CopyJob class copies a file on the server
+ *
+ * Never overwrites an existing destination.
+ * @ingroup libsync
+ */
+class CopyJob : public AbstractNetworkJob
+{
+    Q_OBJECT
+    const QString _destination;
+
+public:
+    explicit CopyJob(AccountPtr account, const QString &path, const QString &destination, QObject *parent = 0);
+
+    void start() Q_DECL_OVERRIDE;
+    bool finished() Q_DECL_OVERRIDE;
+
+signals:
+    void finishedSignal();
+};
+
 /**
  * @brief The PropagateUploadFileCommon class is the code common between all chunking algorithms
  * @ingroup libsync
@@ -196,17 +260,22 @@ signals:
  *
  *   +---> start()  --> (delete job) -------+
  *   |                                      |
- *   +--> slotComputeContentChecksum()  <---+
+ *   +--> slotComputeChecksums()  <---------+
  *                   |
  *                   v
- *    slotComputeTransmissionChecksum()
+ *    slotChecksumsComputed()
  *         |
  *         v
  *    slotStartUpload()  -> doStartUpload()
- *                                  .
- *                                  .
- *                                  v
- *        finalize() or abortWithError()  or startPollJob()
+ *         |                        .
+ *         |                        .
+ *         |                        v
+ *         |      finalize() or abortWithError()  or startPollJob()
+ *         v
+ *    startCopyFromExisting() -> slotCopySourceChecked() -> slotCopyFinished() -> slotCopyMtimeSet() -> slotCopyVerified()
+ *                                                                                                          |
+ *        slotCopyFailed() -> doStartUpload()   before the copy is made, or finalize()
+ *        slotCopyUnverified() -> slotCopyFailed()   deletes the copy first
  */
 class PropagateUploadFileCommon : public PropagateItemJob
 {
@@ -224,6 +293,12 @@ protected:
 
     QByteArray _transmissionChecksumHeader;
 
+    /// The whole file if it was small enough to be kept when computing the checksums
+    QByteArray _fileContents;
+
+    /// Set if the file is uploaded as a part of a bulk upload
+    QPointer<PropagateBulkUpload> _bulkUpload;
+
 public:
     PropagateUploadFileCommon(OwncloudPropagator *propagator, const SyncFileItemPtr &item)
         : PropagateItemJob(propagator, item)
@@ -240,14 +315,24 @@ public:
      */
     void setDeleteExisting(bool enabled);
 
+    /** Hands the file to \a bulk instead of uploading it on its own */
+    void setBulkUpload(PropagateBulkUpload *bulk);
+
+    /** The part of the file in the bulk upload was stored */
+    void bulkUploadFinished(const QByteArray &etag, const QByteArray &fileId, const QByteArray &responseTimestamp);
+
+    /** The part of the file in the bulk upload failed: upload it on its own */
+    void bulkUploadFailed();
+
     void start() Q_DECL_OVERRIDE;
 
     bool isLikelyFinishedQuickly() Q_DECL_OVERRIDE { return _item->_size < propagator()->smallFileSize(); }
 
 private slots:
-    void slotComputeContentChecksum();
-    // Content checksum computed, compute the transmission checksum
-    void slotComputeTransmissionChecksum(const QByteArray &contentChecksumType, const QByteArray &contentChecksum);
+    // Computes the content and the transmission checksum in one pass
+    void slotComputeChecksums();
+    // Checksums computed, set the content checksum and pick the transmission checksum
+    void slotChecksumsComputed(const QHash<QByteArray, QByteArray> &checksums, const QByteArray &contents);
     // transmission checksum computed, prepare the upload
     void slotStartUpload(const QByteArray &transmissionChecksumType, const QByteArray &transmissionChecksum);
 
@@ -265,6 +350,34 @@ public slots:
 private slots:
     void slotPollFinished();
 
+    // Uploading by copying a file with the same content on the server
+    void slotCopySourceChecked();
+    void slotCopyFinished();
+    void slotCopyMtimeSet();
+    void slotCopyListed(const QString &href, const QMap<QString, QString> &properties);
+    void slotCopyVerified();
+    void slotCopyUnverified();
+    void slotCopyFailed();
+
+    void slotBulkContentsRead();
+
+private:
+    /** Uploads the file, or hands it to the bulk upload */
+    void startTransfer();
+    /** Hands \a data, the whole file, to the bulk upload */
+    void addBulkPart(const QByteArray &data);
+
+    /**
+     * Copies a remote file the journal knows to have the same content instead
+     * of uploading. Returns false if there is no such file.
+     */
+    bool startCopyFromExisting();
+
+    /// The properties of the copy source, then of the copy, to verify them
+    QMap<QString, QString> _copyProperties;
+    /// The file with the same content the copy is made from
+    QString _copySource;
+
 protected:
     /**
      * Checks whether the current error is one that should reset the whole
@@ -273,6 +386,16 @@ protected:
      */
     void checkResettingErrors();
 
+    /**
+     * Opens \a device on the given range of the file.
+     *
+     * Uses the file contents read for the checksums if they cover the range.
+     */
+    bool openUploadDevice(UploadDevice *device, qint64 start, qint64 size);
+
+    /** The checksum type the server wants for the upload, may be the content checksum type */
+    QByteArray transmissionChecksumType() const;
+
     /**
      * Error handling functionality that is shared between jobs.
      */
@@ -342,9 +465,25 @@ private:
     quint64 _sent; /// amount of data (bytes) that was already sent
     uint _transferId; /// transfer id (part of the url)
     int _currentChunk; /// Id of the next chunk that will be sent
-    quint64 _currentChunkSize; /// current chunk size
     bool _removeJobError; /// If not null, there was an error removing the job
 
+    struct ChunkRange
+    {
+        quint64 offset;
+        quint64 size;
+    };
+    /// Chunks that are being uploaded, by chunk number
+    QMap<int, ChunkRange> _runningChunks;
+    /// Holes left on the server by an earlier parallel upload, by chunk number.
+    /// They are uploaded before continuing at _sent.
+    QMap<int, ChunkRange> _chunksToRefill;
+    /// All chunks below this number were acknowledged by the server
+    int _ackedChunks;
+    /// Acknowledged chunks from _ackedChunks on, see SyncJournalDb::UploadInfo::_doneChunks
+    QMap<int, quint64> _doneChunks;
+    /// Size of all the acknowledged chunks
+    quint64 _bytesAcknowledged;
+
     // Map chunk number with its size  from the PROPFIND on resume.
     // (Only used from slotPropfindIterate/slotPropfindFinished because the LsColJob use signals to report data.)
     struct ServerChunkInfo
@@ -360,10 +499,19 @@ private:
      */
     QUrl chunkUrl(int chunk = -1);
 
+    /**
+     * Whether several chunks may be uploaded at the same time.
+     *
+     * The chunks are independent until the final MOVE, so this is only
+     * disabled by the server capability or OWNCLOUD_PARALLEL_CHUNK.
+     */
+    bool isParallelChunkUpload() const;
+
 public:
     PropagateUploadFileNG(OwncloudPropagator *propagator, const SyncFileItemPtr &item)
         : PropagateUploadFileCommon(propagator, item)
-        , _currentChunkSize(0)
+        , _ackedChunks(0)
+        , _bytesAcknowledged(0)
     {
     }
 
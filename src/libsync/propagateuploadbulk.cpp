@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+
+#include "propagateuploadbulk.h"
+#include "propagateupload.h"
+#include "owncloudpropagator_p.h"
+#include "account.h"
+#include "utility.h"
+#include "asserts.h"
+
+#include <QBuffer>
+#include <QJsonDocument>
+#include <QUuid>
+
+namespace OCC {
+
+Q_LOGGING_CATEGORY(lcBulkUploadJob, "sync.networkjob.bulkupload", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcPropagateBulkUpload, "sync.propagator.bulkupload", QtInfoMsg)
+
+BulkUploadJob::BulkUploadJob(AccountPtr account, const QVector<Part> &parts, QObject *parent)
+    : AbstractNetworkJob(account, QString(), parent)
+    , _parts(parts)
+{
+}
+
+void BulkUploadJob::start()
+{
+    const QByteArray boundary = "bulk-" + QUuid::createUuid().toRfc4122().toHex();
+    QByteArray body;
+    foreach (const Part &part, _parts) {
+        body += "--" + boundary + "\r\n";
+        for (auto it = part._headers.constBegin(); it != part._headers.constEnd(); ++it) {
+            body += it.key() + ": " + it.value() + "\r\n";
+        }
+        body += "Content-Length: " + QByteArray::number(part._data.size()) + "\r\n\r\n";
+        body += part._data;
+        body += "\r\n";
+    }
+    body += "--" + boundary + "--\r\n";
+    _parts.clear(); // The body has the data now
+
+    QNetworkRequest req;
+    req.setHeader(QNetworkRequest::ContentTypeHeader, QByteArray("multipart/related; boundary=" + boundary));
+    req.setPriority(QNetworkRequest::LowPriority); // Like the PUTs, must not block non-propagation jobs.
+
+    QBuffer *buf = new QBuffer(this);
+    buf->setData(body);
+    buf->open(QIODevice::ReadOnly);
+    sendRequest("POST", Utility::concatUrlPath(account()->url(), QLatin1String("remote.php/dav/bulk")), req, buf);
+
+    if (reply()->error() != QNetworkReply::NoError) {
+        qCWarning(lcBulkUploadJob) << " Network error: " << reply()->errorString();
+    }
+    connect(this, SIGNAL(networkActivity()), account().data(), SIGNAL(propagatorNetworkActivity()));
+    AbstractNetworkJob::start();
+}
+
+bool BulkUploadJob::finished()
+{
+    qCInfo(lcBulkUploadJob) << "POST of" << reply()->request().url() << "FINISHED WITH STATUS"
+                            << reply()->error()
+                            << (reply()->error() == QNetworkReply::NoError ? QLatin1String("") : errorString())
+                            << reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+
+    if (reply()->error() == QNetworkReply::NoError) {
+        QJsonParseError error;
+        _results = QJsonDocument::fromJson(reply()->readAll(), &error).object();
+        if (error.error != QJsonParseError::NoError) {
+            qCWarning(lcBulkUploadJob) << "Invalid JSON reply:" << error.errorString();
+        }
+    }
+    emit finishedSignal();
+    return true;
+}
+
+QJsonObject BulkUploadJob::partResult(const QByteArray &path) const
+{
+    return _results.value(QString::fromUtf8(path)).toObject();
+}
+
+PropagateBulkUpload::PropagateBulkUpload(OwncloudPropagator *propagator, const SyncFileItemVector &items)
+    : PropagatorCompositeJob(propagator)
+{
+    foreach (const SyncFileItemPtr &item, items) {
+        auto upload = new PropagateUploadFileV1(propagator, item);
+        upload->setBulkUpload(this);
+        connect(upload, SIGNAL(finished(SyncFileItem::Status)), this, SLOT(slotUploadFinished(SyncFileItem::Status)));
+        _waiting.insert(upload);
+        appendJob(upload);
+    }
+}
+
+void PropagateBulkUpload::addPart(PropagateUploadFileCommon *upload, const QMap<QByteArray, QByteArray> &headers, const QByteArray &data)
+{
+    _waiting.remove(upload);
+
+    PendingPart pending;
+    pending._upload = upload;
+    pending._path = headers.value("X-File-Path");
+    _pendingParts.append(pending);
+
+    BulkUploadJob::Part part;
+    part._headers = headers;
+    part._data = data;
+    _parts.append(part);
+
+    // The upload is not an active job while it waits: others may start
+    startIfReady();
+    propagator()->scheduleNextJob();
+}
+
+void PropagateBulkUpload::removePart(PropagateUploadFileCommon *upload)
+{
+    _waiting.remove(upload);
+    startIfReady();
+}
+
+void PropagateBulkUpload::slotUploadFinished(SyncFileItem::Status)
+{
+    removePart(static_cast<PropagateUploadFileCommon *>(sender()));
+}
+
+void PropagateBulkUpload::startIfReady()
+{
+    if (!_waiting.isEmpty() || _parts.isEmpty() || _job) {
+        return;
+    }
+
+    qCInfo(lcPropagateBulkUpload) << "Uploading" << _parts.size() << "files in one request";
+    _job = new BulkUploadJob(propagator()->account(), _parts, this);
+    _parts.clear();
+    connect(_job, SIGNAL(finishedSignal()), this, SLOT(slotBulkUploadFinished()));
+
+    // The request is one transfer
+    if (PropagateUploadFileCommon *upload = _pendingParts.first()._upload) {
+        propagator()->_activeJobList.append(upload);
+    }
+    _job->start();
+}
+
+void PropagateBulkUpload::slotBulkUploadFinished()
+{
+    BulkUploadJob *job = qobject_cast<BulkUploadJob *>(sender());
+    ASSERT(job);
+
+    const QVector<PendingPart> pendingParts = _pendingParts;
+    _pendingParts.clear();
+    if (PropagateUploadFileCommon *upload = pendingParts.first()._upload) {
+        propagator()->_activeJobList.removeOne(upload);
+    }
+
+    const int httpCode = job->reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    const bool accepted = job->reply()->error() == QNetworkReply::NoError && httpCode == 200;
+    if (!accepted) {
+        qCWarning(lcPropagateBulkUpload) << "Bulk upload failed, uploading the files one by one"
+                                         << httpCode << job->errorString();
+    }
+
+    foreach (const PendingPart &pending, pendingParts) {
+        if (!pending._upload) {
+            continue;
+        }
+        const QJsonObject result = accepted ? job->partResult(pending._path) : QJsonObject();
+        const QByteArray etag = parseEtag(result.value("etag").toString().toUtf8());
+        if (result.value("error").toBool() || etag.isEmpty()) {
+            if (accepted) {
+                qCWarning(lcPropagateBulkUpload) << "Bulk upload of" << pending._path << "failed:"
+                                                 << result.value("message").toString();
+            }
+            pending._upload->bulkUploadFailed();
+        } else {
+            pending._upload->bulkUploadFinished(etag, result.value("fileid").toString().toUtf8(),
+                job->responseTimestamp());
+        }
+    }
+}
+
+void PropagateBulkUpload::abort()
+{
+    PropagatorCompositeJob::abort();
+    if (_job) {
+        if (_job->reply()) {
+            _job->reply()->abort();
+        }
+        return;
+    }
+
+    // Nothing was sent yet, the uploads that handed over their part finish now
+    const QVector<PendingPart> pendingParts = _pendingParts;
+    _pendingParts.clear();
+    _parts.clear();
+    foreach (const PendingPart &pending, pendingParts) {
+        if (pending._upload) {
+            pending._upload->bulkUploadFailed();
+        }
+    }
+}
+}
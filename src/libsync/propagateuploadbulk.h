@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) by ownCloud GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ */
+#pragma once
+
+#include "owncloudpropagator.h"
+#include "networkjobs.h"
+
+#include <QJsonObject>
+#include <QPointer>
+#include <QSet>
+
+namespace OCC {
+
+class PropagateUploadFileCommon;
+
+/**
+ * @brief The BulkUploadJob class uploads several files in one multipart request
+ *
+ * Every part has the headers of a PUT of the file and an X-File-Path header
+ * with its path. The server replies with a JSON object that has the result
+ * of every part under its X-File-Path: "error", "message", "etag" and "fileid".
+ * @ingroup libsync
+ */
+class BulkUploadJob : public AbstractNetworkJob
+{
+    Q_OBJECT
+public:
+    struct Part
+    {
+        QMap<QByteArray, QByteArray> _headers;
+        QByteArray _data;
+    };
+
+    explicit BulkUploadJob(AccountPtr account, const QVector<Part> &parts, QObject *parent = 0);
+
+    void start() Q_DECL_OVERRIDE;
+    bool finished() Q_DECL_OVERRIDE;
+
+    /** The result of the part with the given X-File-Path, empty if there is none */
+    QJsonObject partResult(const QByteArray &path) const;
+
+signals:
+    void finishedSignal();
+
+private:
+    QVector<Part> _parts;
+    QJsonObject _results;
+};
+
+/**
+ * @brief Uploads a group of small files of one directory together
+ *
+ * The uploads of the files are jobs of their own: they compute the checksums
+ * and check the file as usual, but instead of sending a PUT they hand their
+ * part to this job. Once all of them did, or finished otherwise, the parts
+ * are sent in one BulkUploadJob and every upload finishes with the result of
+ * its part. Uploads whose part failed, or all of them if the server did not
+ * accept the request, fall back to a normal upload.
+ *
+ * Only used if the server has the bulkupload capability.
+ * @ingroup libsync
+ */
+class PropagateBulkUpload : public PropagatorCompositeJob
+{
+    Q_OBJECT
+public:
+    /** The most files uploaded in one request */
+    static const int maxFiles = 100;
+
+    PropagateBulkUpload(OwncloudPropagator *propagator, const SyncFileItemVector &items);
+
+    /** Called by the uploads once they are ready to send \a data */
+    void addPart(PropagateUploadFileCommon *upload, const QMap<QByteArray, QByteArray> &headers, const QByteArray &data);
+
+    /** Called by the uploads that upload on their own instead */
+    void removePart(PropagateUploadFileCommon *upload);
+
+    void abort() Q_DECL_OVERRIDE;
+
+private slots:
+    void slotUploadFinished(SyncFileItem::Status);
+    void slotBulkUploadFinished();
+
+private:
+    void startIfReady();
+
+    struct PendingPart
+    {
+        QPointer<PropagateUploadFileCommon> _upload;
+        QByteArray _path;
+    };
+
+    /// The uploads that did not hand over their part yet
+    QSet<PropagateUploadFileCommon *> _waiting;
+    QVector<PendingPart> _pendingParts;
+    QVector<BulkUploadJob::Part> _parts;
+    QPointer<BulkUploadJob> _job;
+};
+}
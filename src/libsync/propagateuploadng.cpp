@@ -47,6 +47,18 @@ QUrl PropagateUploadFileNG::chunkUrl(int chunk)
     return Utility::concatUrlPath(propagator()->account()->url(), path);
 }
 
+bool PropagateUploadFileNG::isParallelChunkUpload() const
+{
+    if (propagator()->account()->capabilities().chunkingParallelUploadDisabled()) {
+        return false;
+    }
+    static const QByteArray env = qgetenv("OWNCLOUD_PARALLEL_CHUNK");
+    if (!env.isEmpty()) {
+        return env != "false" && env != "0";
+    }
+    return true;
+}
+
 /*
   State machine:
 
@@ -67,11 +79,12 @@ QUrl PropagateUploadFileNG::chunkUrl(int chunk)
           |                                                       |                      |
     +-----+<------------------------------------------------------+<---  slotDeleteJobFinished()
     |
-    +---->  startNextChunk()  ---finished?  --+
-                  ^               |          |
-                  +---------------+          |
-                                             |
-    +----------------------------------------+
+    +---->  startNextChunk()  ---all chunks acknowledged?  --+
+                  ^  ^            |                            |
+                  |  +------------+ (more chunks in parallel)  |
+                  +--- slotPutFinished()                       |
+                                                               |
+    +----------------------------------------------------------+
     |
     +-> MOVE ------> moveJobFinished() ---> finalize()
 
@@ -85,6 +98,7 @@ void PropagateUploadFileNG::doStartUpload()
     const SyncJournalDb::UploadInfo progressInfo = propagator()->_journal->getUploadInfo(_item->_file);
     if (progressInfo._valid && Utility::qDateTimeToTime_t(progressInfo._modtime) == _item->_modtime) {
         _transferId = progressInfo._transferid;
+        _doneChunks = progressInfo._doneChunks;
         auto url = chunkUrl();
         auto job = new LsColJob(propagator()->account(), url, this);
         _jobs.append(job);
@@ -136,6 +150,42 @@ void PropagateUploadFileNG::slotPropfindFinished()
         _serverChunks.remove(_currentChunk);
         ++_currentChunk;
     }
+    _ackedChunks = _currentChunk;
+    _bytesAcknowledged = _sent;
+
+    // A parallel upload may have left acknowledged chunks behind a hole. Keep the ones
+    // we know the offset of. The holes are uploaded again using the chunk numbers in
+    // between, so the server still finds contiguous chunks in the right order.
+    const QMap<int, quint64> knownChunks = _doneChunks;
+    _doneChunks.clear();
+    _chunksToRefill.clear();
+    for (auto it = knownChunks.constBegin(); it != knownChunks.constEnd(); ++it) {
+        const int chunk = it.key();
+        const quint64 offset = it.value();
+        if (chunk < _currentChunk || offset < _sent || !_serverChunks.contains(chunk)) {
+            continue;
+        }
+        const quint64 size = _serverChunks[chunk].size;
+        const quint64 holeSize = offset - _sent;
+        const int holeChunks = chunk - _currentChunk;
+        if (offset + size > _item->_size
+            || (holeChunks == 0) != (holeSize == 0)
+            || holeSize < quint64(holeChunks)) {
+            // Does not fit with what we know, the chunk will be removed
+            continue;
+        }
+        for (int i = 0; i < holeChunks; ++i) {
+            ChunkRange range;
+            range.offset = _sent + i * (holeSize / holeChunks);
+            range.size = (i == holeChunks - 1) ? offset - range.offset : holeSize / holeChunks;
+            _chunksToRefill[_currentChunk + i] = range;
+        }
+        _doneChunks[chunk] = offset;
+        _bytesAcknowledged += size;
+        _serverChunks.remove(chunk);
+        _sent = offset + size;
+        _currentChunk = chunk + 1;
+    }
 
     if (_sent > _item->_size) {
         // Normally this can't happen because the size is xor'ed with the transfer id, and it is
@@ -147,7 +197,8 @@ void PropagateUploadFileNG::slotPropfindFinished()
         return;
     }
 
-    qCInfo(lcPropagateUpload) << "Resuming " << _item->_file << " from chunk " << _currentChunk << "; sent =" << _sent;
+    qCInfo(lcPropagateUpload) << "Resuming " << _item->_file << " from chunk " << _currentChunk << "; sent =" << _sent
+                              << "; holes to upload again =" << _chunksToRefill.keys();
 
     if (!_serverChunks.isEmpty()) {
         qCInfo(lcPropagateUpload) << "To Delete" << _serverChunks.keys();
@@ -223,6 +274,10 @@ void PropagateUploadFileNG::startNewUpload()
     _transferId = qrand() ^ _item->_modtime ^ (_item->_size << 16) ^ qHash(_item->_file);
     _sent = 0;
     _currentChunk = 0;
+    _ackedChunks = 0;
+    _bytesAcknowledged = 0;
+    _doneChunks.clear();
+    _chunksToRefill.clear();
 
     propagator()->reportProgress(*_item, 0);
 
@@ -267,10 +322,22 @@ void PropagateUploadFileNG::startNextChunk()
     quint64 fileSize = _item->_size;
     ENFORCE(fileSize >= _sent, "Sent data exceeds file size");
 
-    // prevent situation that chunk size is bigger then required one to send
-    _currentChunkSize = qMin(propagator()->_chunkSize, fileSize - _sent);
-
-    if (_currentChunkSize == 0) {
+    int chunk = 0;
+    ChunkRange range;
+    if (!_chunksToRefill.isEmpty()) {
+        chunk = _chunksToRefill.firstKey();
+        range = _chunksToRefill.take(chunk);
+    } else if (_sent < fileSize) {
+        chunk = _currentChunk++;
+        range.offset = _sent;
+        // prevent situation that chunk size is bigger then required one to send
+        range.size = qMin(propagator()->_chunkSize, fileSize - _sent);
+        _sent += range.size;
+    } else {
+        if (!_runningChunks.isEmpty()) {
+            // The MOVE has to wait until all the chunks are acknowledged
+            return;
+        }
         Q_ASSERT(_jobs.isEmpty()); // There should be no running job anymore
         _finished = true;
         // Finish with a MOVE
@@ -302,7 +369,7 @@ void PropagateUploadFileNG::startNextChunk()
     auto device = new UploadDevice(&propagator()->_bandwidthManager);
     const QString fileName = propagator()->getFilePath(_item->_file);
 
-    if (!device->prepareAndOpen(fileName, _sent, _currentChunkSize)) {
+    if (!openUploadDevice(device, range.offset, range.size)) {
         qCWarning(lcPropagateUpload) << "Could not prepare upload device: " << device->errorString();
 
         // If the file is currently locked, we want to retry the sync
@@ -316,23 +383,30 @@ void PropagateUploadFileNG::startNextChunk()
     }
 
     QMap<QByteArray, QByteArray> headers;
-    headers["OC-Chunk-Offset"] = QByteArray::number(_sent);
+    headers["OC-Chunk-Offset"] = QByteArray::number(range.offset);
 
-    _sent += _currentChunkSize;
-    QUrl url = chunkUrl(_currentChunk);
+    QUrl url = chunkUrl(chunk);
 
     // job takes ownership of device via a QScopedPointer. Job deletes itself when finishing
-    PUTFileJob *job = new PUTFileJob(propagator()->account(), url, device, headers, _currentChunk, this);
+    PUTFileJob *job = new PUTFileJob(propagator()->account(), url, device, headers, chunk, this);
     _jobs.append(job);
+    _runningChunks[chunk] = range;
     connect(job, SIGNAL(finishedSignal()), this, SLOT(slotPutFinished()));
     connect(job, SIGNAL(uploadProgress(qint64, qint64)),
         this, SLOT(slotUploadProgress(qint64, qint64)));
-    connect(job, SIGNAL(uploadProgress(qint64, qint64)),
-        device, SLOT(slotJobUploadProgress(qint64, qint64)));
     connect(job, SIGNAL(destroyed(QObject *)), this, SLOT(slotJobDestroyed(QObject *)));
     job->start();
     propagator()->_activeJobList.append(this);
-    _currentChunk++;
+
+    if (isParallelChunkUpload()) {
+        // Put more chunks in flight as long as the propagator has room for transfers
+        bool moreChunks = !_chunksToRefill.isEmpty() || _sent < fileSize;
+        if (moreChunks && propagator()->_activeJobList.count() < propagator()->maximumActiveTransferJob()) {
+            startNextChunk();
+        } else {
+            propagator()->scheduleNextJob();
+        }
+    }
 }
 
 void PropagateUploadFileNG::slotPutFinished()
@@ -370,6 +444,14 @@ void PropagateUploadFileNG::slotPutFinished()
 
     ENFORCE(_sent <= _item->_size, "can't send more than size");
 
+    const ChunkRange range = _runningChunks.take(job->_chunk);
+    _bytesAcknowledged += range.size;
+    _doneChunks[job->_chunk] = range.offset;
+    while (_doneChunks.contains(_ackedChunks)) {
+        _doneChunks.remove(_ackedChunks);
+        ++_ackedChunks;
+    }
+
     // Adjust the chunk size for the time taken.
     //
     // Dynamic chunk sizing is enabled if the server configured a
@@ -379,7 +461,7 @@ void PropagateUploadFileNG::slotPutFinished()
         double uploadTime = job->msSinceStart();
 
         auto predictedGoodSize = static_cast<quint64>(
-            _currentChunkSize / uploadTime * targetDuration);
+            range.size / uploadTime * targetDuration);
 
         // The whole targeting is heuristic. The predictedGoodSize will fluctuate
         // quite a bit because of external factors (like available bandwidth)
@@ -395,13 +477,13 @@ void PropagateUploadFileNG::slotPutFinished()
             targetSize,
             propagator()->syncOptions()._maxChunkSize);
 
-        qCInfo(lcPropagateUpload) << "Chunked upload of" << _currentChunkSize << "bytes took" << uploadTime
+        qCInfo(lcPropagateUpload) << "Chunked upload of" << range.size << "bytes took" << uploadTime
                                   << "ms, desired is" << targetDuration << "ms, expected good chunk size is"
                                   << predictedGoodSize << "bytes and nudged next chunk size to "
                                   << propagator()->_chunkSize << "bytes";
     }
 
-    bool finished = _sent == _item->_size;
+    bool finished = _sent == _item->_size && _chunksToRefill.isEmpty() && _runningChunks.isEmpty();
 
     // Check if the file still exists
     const QString fullFilePath(propagator()->getFilePath(_item->_file));
@@ -430,9 +512,11 @@ void PropagateUploadFileNG::slotPutFinished()
             _item->_hasBlacklistEntry = false;
         }
 
-        // Reset the error count on successful chunk upload
+        // Reset the error count on successful chunk upload and remember
+        // the chunks that were acknowledged out of order for resuming
         auto uploadInfo = propagator()->_journal->getUploadInfo(_item->_file);
         uploadInfo._errorCount = 0;
+        uploadInfo._doneChunks = _doneChunks;
         propagator()->_journal->setUploadInfo(_item->_file, uploadInfo);
         propagator()->_journal->commit("Upload info");
     }
@@ -500,6 +584,13 @@ void PropagateUploadFileNG::slotUploadProgress(qint64 sent, qint64 total)
     if (sent == 0 && total == 0) {
         return;
     }
-    propagator()->reportProgress(*_item, _sent + sent - total);
+
+    // The acknowledged chunks plus what the running chunk uploads have sent so far
+    quint64 amount = _bytesAcknowledged;
+    sender()->setProperty("byteWritten", sent);
+    foreach (QObject *j, _jobs) {
+        amount += j->property("byteWritten").toULongLong();
+    }
+    propagator()->reportProgress(*_item, amount);
 }
 }
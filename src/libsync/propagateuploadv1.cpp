@@ -109,7 +109,7 @@ void PropagateUploadFileV1::startNextChunk()
     }
 
     const QString fileName = propagator()->getFilePath(_item->_file);
-    if (!device->prepareAndOpen(fileName, chunkStart, currentChunkSize)) {
+    if (!openUploadDevice(device, chunkStart, currentChunkSize)) {
         qCWarning(lcPropagateUpload) << "Could not prepare upload device: " << device->errorString();
 
         // If the file is currently locked, we want to retry the sync
@@ -128,7 +128,6 @@ void PropagateUploadFileV1::startNextChunk()
     _jobs.append(job);
     connect(job, SIGNAL(finishedSignal()), this, SLOT(slotPutFinished()));
     connect(job, SIGNAL(uploadProgress(qint64, qint64)), this, SLOT(slotUploadProgress(qint64, qint64)));
-    connect(job, SIGNAL(uploadProgress(qint64, qint64)), device, SLOT(slotJobUploadProgress(qint64, qint64)));
     connect(job, SIGNAL(destroyed(QObject *)), this, SLOT(slotJobDestroyed(QObject *)));
     job->start();
     propagator()->_activeJobList.append(this);
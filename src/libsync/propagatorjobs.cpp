@@ -20,6 +20,7 @@
 #include "syncjournaldb.h"
 #include "syncjournalfilerecord.h"
 #include "filesystem.h"
+#include "localioexecutor.h"
 #include <qfile.h>
 #include <qdir.h>
 #include <qdiriterator.h>
@@ -49,17 +50,18 @@ QByteArray localFileIdFromFullId(const QByteArray &id)
 
 /**
  * Code inspired from Qt5's QDir::removeRecursively
- * The code will update the database in case of error.
+ * Runs on the LocalIoExecutor, so it can't update the database itself.
  * If everything goes well (no error, returns true), the caller is responsible for removing the entries
- * in the database.  But in case of error, we need to remove the entries from the database of the files
- * that were deleted.
+ * in the database.  But in case of error, the entries of the files that were deleted need to be
+ * removed from the database too: they are collected in \a result.
  *
- * \a path is relative to propagator()->_localDir + _item->_file and should start with a slash
+ * \a path is relative to \a root and should start with a slash
  */
-bool PropagateLocalRemove::removeRecursively(const QString &path)
+bool PropagateLocalRemove::removeRecursively(const QString &root, const QString &path,
+    RemoveResult *result, const QAtomicInt *canceled)
 {
     bool success = true;
-    QString absolute = propagator()->_localDir + _item->_file + path;
+    QString absolute = root + path;
     QDirIterator di(absolute, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
 
     QVector<QPair<QString, bool>> deleted;
@@ -71,21 +73,26 @@ bool PropagateLocalRemove::removeRecursively(const QString &path)
         // The use of isSymLink here is okay:
         // we never want to go into this branch for .lnk files
         bool isDir = fi.isDir() && !fi.isSymLink();
-        if (isDir) {
-            ok = removeRecursively(path + QLatin1Char('/') + di.fileName()); // recursive
+        if (canceled->load()) {
+            // Stop, keeping what is left like a failure would
+            if (success) {
+                result->_error += PropagateLocalRemove::tr("Removal of '%1' was aborted").arg(QDir::toNativeSeparators(absolute)) + " ";
+            }
+            ok = false;
+        } else if (isDir) {
+            ok = removeRecursively(root, path + QLatin1Char('/') + di.fileName(), result, canceled); // recursive
         } else {
             QString removeError;
             ok = FileSystem::remove(di.filePath(), &removeError);
             if (!ok) {
-                _error += PropagateLocalRemove::tr("Error removing '%1': %2;").arg(QDir::toNativeSeparators(di.filePath()), removeError) + " ";
+                result->_error += PropagateLocalRemove::tr("Error removing '%1': %2;").arg(QDir::toNativeSeparators(di.filePath()), removeError) + " ";
                 qCWarning(lcPropagateLocalRemove) << "Error removing " << di.filePath() << ':' << removeError;
             }
         }
         if (success && !ok) {
             // We need to delete the entries from the database now from the deleted vector
             foreach (const auto &it, deleted) {
-                propagator()->_journal->deleteFileRecord(_item->_originalFile + path + QLatin1Char('/') + it.first,
-                    it.second);
+                result->_removed.append(qMakePair(path + QLatin1Char('/') + it.first, it.second));
             }
             success = false;
             deleted.clear();
@@ -95,15 +102,17 @@ bool PropagateLocalRemove::removeRecursively(const QString &path)
         }
         if (!success && ok) {
             // This succeeded, so we need to delete it from the database now because the caller won't
-            propagator()->_journal->deleteFileRecord(_item->_originalFile + path + QLatin1Char('/') + di.fileName(),
-                isDir);
+            result->_removed.append(qMakePair(path + QLatin1Char('/') + di.fileName(), isDir));
+        }
+        if (!success && canceled->load()) {
+            break;
         }
     }
     if (success) {
         success = QDir().rmdir(absolute);
         if (!success) {
-            _error += PropagateLocalRemove::tr("Could not remove folder '%1'")
-                          .arg(QDir::toNativeSeparators(absolute))
+            result->_error += PropagateLocalRemove::tr("Could not remove folder '%1'")
+                                  .arg(QDir::toNativeSeparators(absolute))
                 + " ";
             qCWarning(lcPropagateLocalRemove) << "Error removing folder" << absolute;
         }
@@ -111,6 +120,20 @@ bool PropagateLocalRemove::removeRecursively(const QString &path)
     return success;
 }
 
+PropagateLocalRemove::~PropagateLocalRemove()
+{
+    // Destroyed before the removal finished, for example because the sync was
+    // aborted: the journal must still forget what is gone. Without a future,
+    // the watcher is canceled.
+    if (_state == Running && !_removeWatcher.isCanceled()) {
+        _canceled.fetchAndStoreOrdered(true);
+        _removeWatcher.waitForFinished();
+        if (propagator()) {
+            forgetRemovedEntries(_removeWatcher.result());
+        }
+    }
+}
+
 void PropagateLocalRemove::start()
 {
     if (propagator()->_abortRequested.fetchAndAddRelaxed(0))
@@ -125,22 +148,48 @@ void PropagateLocalRemove::start()
         return;
     }
 
-    if (_item->_isDirectory) {
-        if (QDir(filename).exists() && !removeRecursively(QString())) {
-            done(SyncFileItem::NormalError, _error);
-            return;
-        }
-    } else {
-        QString removeError;
-        if (FileSystem::fileExists(filename)
-            && !FileSystem::remove(filename, &removeError)) {
-            done(SyncFileItem::NormalError, removeError);
-            return;
+    const bool isDirectory = _item->_isDirectory;
+    const QAtomicInt *canceled = &_canceled;
+    propagator()->_activeJobList.append(this);
+    connect(&_removeWatcher, SIGNAL(finished()), this, SLOT(slotRemoveDone()));
+    _removeWatcher.setFuture(LocalIoExecutor::instance()->run<RemoveResult>([filename, isDirectory, canceled]() {
+        RemoveResult result;
+        if (isDirectory) {
+            if (QDir(filename).exists()) {
+                result._ok = removeRecursively(filename, QString(), &result, canceled);
+            }
+        } else if (FileSystem::fileExists(filename)) {
+            result._ok = FileSystem::remove(filename, &result._error);
         }
+        return result;
+    }));
+}
+
+void PropagateLocalRemove::abort()
+{
+    // The removal stops before the next entry, slotRemoveDone() reports the error
+    _canceled.fetchAndStoreOrdered(true);
+}
+
+void PropagateLocalRemove::forgetRemovedEntries(const RemoveResult &result)
+{
+    foreach (const auto &it, result._removed) {
+        propagator()->_journal->deleteFileRecord(_item->_originalFile + it.first, it.second);
+    }
+}
+
+void PropagateLocalRemove::slotRemoveDone()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    const RemoveResult result = _removeWatcher.result();
+    forgetRemovedEntries(result);
+    if (!result._ok) {
+        done(SyncFileItem::NormalError, result._error);
+        return;
     }
     propagator()->reportProgress(*_item, 0);
-    propagator()->_journal->deleteFileRecord(_item->_originalFile, _item->_isDirectory);
-    propagator()->_journal->commit("Local remove");
+    propagator()->_journal->queueDeleteFileRecord(_item->_originalFile, _item->_isDirectory);
     done(SyncFileItem::Success);
 }
 
@@ -152,31 +201,49 @@ void PropagateLocalMkdir::start()
     QDir newDir(propagator()->getFilePath(_item->_file));
     QString newDirStr = QDir::toNativeSeparators(newDir.path());
 
-    // When turning something that used to be a file into a directory
-    // we need to delete the file first.
-    QFileInfo fi(newDirStr);
-    if (_deleteExistingFile && fi.exists() && fi.isFile()) {
-        QString removeError;
-        if (!FileSystem::remove(newDirStr, &removeError)) {
-            done(SyncFileItem::NormalError,
-                tr("could not delete file %1, error: %2")
-                    .arg(newDirStr, removeError));
-            return;
-        }
-    }
-
     if (Utility::fsCasePreserving() && propagator()->localFileNameClash(_item->_file)) {
         qCWarning(lcPropagateLocalMkdir) << "New folder to create locally already exists with different case:" << _item->_file;
         done(SyncFileItem::NormalError, tr("Attention, possible case sensitivity clash with %1").arg(newDirStr));
         return;
     }
     emit propagator()->touchedFile(newDirStr);
-    QDir localDir(propagator()->_localDir);
-    if (!localDir.mkpath(_item->_file)) {
-        done(SyncFileItem::NormalError, tr("could not create folder %1").arg(newDirStr));
+
+    const bool deleteExistingFile = _deleteExistingFile;
+    const QString localDir = propagator()->_localDir;
+    const QString file = _item->_file;
+    propagator()->_activeJobList.append(this);
+    connect(&_mkdirWatcher, SIGNAL(finished()), this, SLOT(slotMkdirDone()));
+    _mkdirWatcher.setFuture(LocalIoExecutor::instance()->run<QString>([newDirStr, deleteExistingFile, localDir, file]() {
+        // When turning something that used to be a file into a directory
+        // we need to delete the file first.
+        QFileInfo fi(newDirStr);
+        if (deleteExistingFile && fi.exists() && fi.isFile()) {
+            QString removeError;
+            if (!FileSystem::remove(newDirStr, &removeError)) {
+                return PropagateLocalMkdir::tr("could not delete file %1, error: %2")
+                    .arg(newDirStr, removeError);
+            }
+        }
+
+        if (!QDir(localDir).mkpath(file)) {
+            return PropagateLocalMkdir::tr("could not create folder %1").arg(newDirStr);
+        }
+        return QString();
+    }));
+}
+
+void PropagateLocalMkdir::slotMkdirDone()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    const QString error = _mkdirWatcher.result();
+    if (!error.isEmpty()) {
+        done(SyncFileItem::NormalError, error);
         return;
     }
 
+    QString newDirStr = QDir::toNativeSeparators(propagator()->getFilePath(_item->_file));
+
     // Insert the directory into the database. The correct etag will be set later,
     // once all contents have been propagated, because should_update_metadata is true.
     // Adding an entry with a dummy etag to the database still makes sense here
@@ -184,11 +251,7 @@ void PropagateLocalMkdir::start()
     // before the correct etag is stored.
     SyncJournalFileRecord record(*_item, newDirStr);
     record._etag = "_invalid_";
-    if (!propagator()->_journal->setFileRecord(record)) {
-        done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
-        return;
-    }
-    propagator()->_journal->commit("localMkdir");
+    propagator()->_journal->queueFileRecord(record);
 
     done(SyncFileItem::Success);
 }
@@ -208,36 +271,60 @@ void PropagateLocalRename::start()
 
     // if the file is a file underneath a moved dir, the _item->file is equal
     // to _item->renameTarget and the file is not moved as a result.
-    if (_item->_file != _item->_renameTarget) {
-        propagator()->reportProgress(*_item, 0);
-        qCDebug(lcPropagateLocalRename) << "MOVE " << existingFile << " => " << targetFile;
-
-        if (QString::compare(_item->_file, _item->_renameTarget, Qt::CaseInsensitive) != 0
-            && propagator()->localFileNameClash(_item->_renameTarget)) {
-            // Only use localFileNameClash for the destination if we know that the source was not
-            // the one conflicting  (renaming  A.txt -> a.txt is OK)
-
-            // Fixme: the file that is the reason for the clash could be named here,
-            // it would have to come out the localFileNameClash function
-            done(SyncFileItem::NormalError,
-                tr("File %1 can not be renamed to %2 because of a local file name clash")
-                    .arg(QDir::toNativeSeparators(_item->_file))
-                    .arg(QDir::toNativeSeparators(_item->_renameTarget)));
-            return;
-        }
+    if (_item->_file == _item->_renameTarget) {
+        updateMetadata();
+        return;
+    }
 
-        emit propagator()->touchedFile(existingFile);
-        emit propagator()->touchedFile(targetFile);
+    propagator()->reportProgress(*_item, 0);
+    qCDebug(lcPropagateLocalRename) << "MOVE " << existingFile << " => " << targetFile;
+
+    if (QString::compare(_item->_file, _item->_renameTarget, Qt::CaseInsensitive) != 0
+        && propagator()->localFileNameClash(_item->_renameTarget)) {
+        // Only use localFileNameClash for the destination if we know that the source was not
+        // the one conflicting  (renaming  A.txt -> a.txt is OK)
+
+        // Fixme: the file that is the reason for the clash could be named here,
+        // it would have to come out the localFileNameClash function
+        done(SyncFileItem::NormalError,
+            tr("File %1 can not be renamed to %2 because of a local file name clash")
+                .arg(QDir::toNativeSeparators(_item->_file))
+                .arg(QDir::toNativeSeparators(_item->_renameTarget)));
+        return;
+    }
+
+    emit propagator()->touchedFile(existingFile);
+    emit propagator()->touchedFile(targetFile);
+    propagator()->_activeJobList.append(this);
+    connect(&_renameWatcher, SIGNAL(finished()), this, SLOT(slotRenameDone()));
+    _renameWatcher.setFuture(LocalIoExecutor::instance()->run<QString>([existingFile, targetFile]() {
         QString renameError;
         if (!FileSystem::rename(existingFile, targetFile, &renameError)) {
-            done(SyncFileItem::NormalError, renameError);
-            return;
+            return renameError.isEmpty() ? PropagateLocalRename::tr("Could not rename %1").arg(existingFile) : renameError;
         }
+        return QString();
+    }));
+}
+
+void PropagateLocalRename::slotRenameDone()
+{
+    propagator()->_activeJobList.removeOne(this);
+
+    const QString renameError = _renameWatcher.result();
+    if (!renameError.isEmpty()) {
+        done(SyncFileItem::NormalError, renameError);
+        return;
     }
+    updateMetadata();
+}
+
+void PropagateLocalRename::updateMetadata()
+{
+    QString targetFile = propagator()->getFilePath(_item->_renameTarget);
 
     SyncJournalFileRecord oldRecord =
         propagator()->_journal->getFileRecord(_item->_originalFile);
-    propagator()->_journal->deleteFileRecord(_item->_originalFile);
+    propagator()->_journal->queueDeleteFileRecord(_item->_originalFile);
 
     // store the rename file name in the item.
     const auto oldFile = _item->_file;
@@ -250,10 +337,7 @@ void PropagateLocalRename::start()
     }
 
     if (!_item->_isDirectory) { // Directories are saved at the end
-        if (!propagator()->_journal->setFileRecord(record)) {
-            done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
-            return;
-        }
+        propagator()->_journal->queueFileRecord(record);
     } else {
         if (!PropagateRemoteMove::adjustSelectiveSync(propagator()->_journal, oldFile, _item->_renameTarget)) {
             done(SyncFileItem::FatalError, tr("Error writing metadata to the database"));
@@ -261,8 +345,6 @@ void PropagateLocalRename::start()
         }
     }
 
-    propagator()->_journal->commit("localRename");
-
     done(SyncFileItem::Success);
 }
 }
@@ -16,7 +16,9 @@
 #pragma once
 
 #include "owncloudpropagator.h"
+#include <QAtomicInt>
 #include <QFile>
+#include <QFutureWatcher>
 
 namespace OCC {
 
@@ -34,6 +36,9 @@ static const char checkSumAdlerC[] = "Adler32";
 
 /**
  * @brief Declaration of the other propagation jobs
+ *
+ * The local jobs run their filesystem operations on the LocalIoExecutor
+ * and finish once these are done.
  * @ingroup libsync
  */
 class PropagateLocalRemove : public PropagateItemJob
@@ -44,11 +49,33 @@ public:
         : PropagateItemJob(propagator, item)
     {
     }
+    ~PropagateLocalRemove();
     void start() Q_DECL_OVERRIDE;
+    void abort() Q_DECL_OVERRIDE;
+
+private slots:
+    void slotRemoveDone();
 
 private:
-    bool removeRecursively(const QString &path);
-    QString _error;
+    struct RemoveResult
+    {
+        RemoveResult()
+            : _ok(true)
+        {
+        }
+        bool _ok;
+        QString _error;
+        // Entries that are gone although the removal failed, with their path
+        // relative to the item and whether they are directories
+        QVector<QPair<QString, bool>> _removed;
+    };
+
+    static bool removeRecursively(const QString &root, const QString &path,
+        RemoveResult *result, const QAtomicInt *canceled);
+    void forgetRemovedEntries(const RemoveResult &result);
+
+    QFutureWatcher<RemoveResult> _removeWatcher;
+    QAtomicInt _canceled;
 };
 
 /**
@@ -74,8 +101,12 @@ public:
      */
     void setDeleteExistingFile(bool enabled);
 
+private slots:
+    void slotMkdirDone();
+
 private:
     bool _deleteExistingFile;
+    QFutureWatcher<QString> _mkdirWatcher; // the error, empty on success
 };
 
 /**
@@ -92,5 +123,13 @@ public:
     }
     void start() Q_DECL_OVERRIDE;
     JobParallelism parallelism() Q_DECL_OVERRIDE { return _item->_isDirectory ? WaitForFinished : FullParallelism; }
+
+private slots:
+    void slotRenameDone();
+
+private:
+    void updateMetadata();
+
+    QFutureWatcher<QString> _renameWatcher; // the error, empty on success
 };
 }
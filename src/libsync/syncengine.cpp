@@ -73,8 +73,7 @@ SyncEngine::SyncEngine(AccountPtr account, const QString &localPath,
     , _hasRemoveFile(false)
     , _hasForwardInTimeFiles(false)
     , _backInTimeFiles(0)
-    , _uploadLimit(0)
-    , _downloadLimit(0)
+    , _checksum_hook(journal)
     , _anotherSyncNeeded(NoFollowUpSync)
 {
     qRegisterMetaType<SyncFileItem>("SyncFileItem");
@@ -94,6 +93,9 @@ SyncEngine::SyncEngine(AccountPtr account, const QString &localPath,
 
     _excludedFiles.reset(new ExcludedFiles(&_csync_ctx->excludes));
     _syncFileStatusTracker.reset(new SyncFileStatusTracker(this));
+    _journalMaintenance.reset(new JournalMaintenance(_journal));
+    connect(_journalMaintenance.data(), SIGNAL(stepFinished(QString, qint64, bool)),
+        SLOT(slotJournalMaintenanceStepFinished(QString, qint64, bool)));
 
     _clearTouchedFilesTimer.setSingleShot(true);
     _clearTouchedFilesTimer.setInterval(30 * 1000);
@@ -105,6 +107,7 @@ SyncEngine::SyncEngine(AccountPtr account, const QString &localPath,
 SyncEngine::~SyncEngine()
 {
     abort();
+    _journalMaintenance.reset();
     _thread.quit();
     _thread.wait();
     _excludedFiles.reset();
@@ -729,6 +732,9 @@ void SyncEngine::csyncError(const QString &message)
 
 void SyncEngine::startSync()
 {
+    // The maintenance must not compete with the sync for the journal
+    _journalMaintenance->interrupt();
+
     if (_journal->exists()) {
         QVector<SyncJournalDb::PollInfo> pollInfos = _journal->getPollInfos();
         if (!pollInfos.isEmpty()) {
@@ -1059,9 +1065,6 @@ void SyncEngine::slotDiscoveryJobFinished(int discoveryResult)
     connect(_propagator.data(), SIGNAL(insufficientLocalStorage()), SLOT(slotInsufficientLocalStorage()));
     connect(_propagator.data(), SIGNAL(insufficientRemoteStorage()), SLOT(slotInsufficientRemoteStorage()));
 
-    // apply the network limits to the propagator
-    setNetworkLimits(_uploadLimit, _downloadLimit);
-
     deleteStaleDownloadInfos(syncItems);
     deleteStaleUploadInfos(syncItems);
     deleteStaleErrorBlacklistEntries(syncItems);
@@ -1084,28 +1087,12 @@ void SyncEngine::slotCleanPollsJobAborted(const QString &error)
 
 void SyncEngine::setNetworkLimits(int upload, int download)
 {
-    _uploadLimit = upload;
-    _downloadLimit = download;
-
-    if (!_propagator)
-        return;
+    // The limits are shared by all folders and accounts
+    BandwidthGovernor::instance()->setLimit(BandwidthGovernor::Upload, upload);
+    BandwidthGovernor::instance()->setLimit(BandwidthGovernor::Download, download);
 
-    _propagator->_uploadLimit = upload;
-    _propagator->_downloadLimit = download;
-
-    int propDownloadLimit = _propagator->_downloadLimit
-#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
-                                .load()
-#endif
-        ;
-    int propUploadLimit = _propagator->_uploadLimit
-#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
-                              .load()
-#endif
-        ;
-
-    if (propDownloadLimit != 0 || propUploadLimit != 0) {
-        qCInfo(lcEngine) << "Network Limits (down/up) " << propDownloadLimit << propUploadLimit;
+    if (download != 0 || upload != 0) {
+        qCInfo(lcEngine) << "Network Limits (down/up) " << download << upload;
     }
 }
 
@@ -1127,6 +1114,12 @@ void SyncEngine::slotFinished(bool success)
         _anotherSyncNeeded = ImmediateFollowUp;
     }
 
+    // The propagation jobs queue their journal writes
+    if (!_journal->flushPendingWrites()) {
+        csyncError(tr("Error writing metadata to the database"));
+        success = false;
+    }
+
     if (success) {
         _journal->setDataFingerprint(_discoveryMainThread->_dataFingerprint);
     }
@@ -1172,6 +1165,7 @@ void SyncEngine::finalize(bool success)
     _uniqueErrors.clear();
 
     _clearTouchedFilesTimer.start();
+    _journalMaintenance->scheduleWhenIdle();
 }
 
 void SyncEngine::slotProgress(const SyncFileItem &item, quint64 current)
@@ -1541,6 +1535,11 @@ void SyncEngine::slotClearTouchedFiles()
     _touchedFiles.clear();
 }
 
+void SyncEngine::slotJournalMaintenanceStepFinished(const QString &step, qint64 msecs, bool ok)
+{
+    qCInfo(lcEngine) << "#### Journal maintenance:" << step << (ok ? "took" : "failed or interrupted after") << msecs << "ms";
+}
+
 bool SyncEngine::wasFileTouched(const QString &fn) const
 {
     // Start from the end (most recent) and look for our path. Check the time just in case.
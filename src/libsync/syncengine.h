@@ -39,6 +39,7 @@
 #include "accountfwd.h"
 #include "discoveryphase.h"
 #include "checksums.h"
+#include "journalmaintenance.h"
 
 class QProcess;
 
@@ -69,6 +70,8 @@ public:
     static QString csyncErrorToString(CSYNC_STATUS);
 
     Q_INVOKABLE void startSync();
+
+    /** Sets the bandwidth limits of all folders and accounts, see BandwidthGovernor::setLimit() */
     void setNetworkLimits(int upload, int download);
 
     /* Abort the sync.  Called from the main thread */
@@ -91,6 +94,8 @@ public:
 
     AccountPtr account() const;
     SyncJournalDb *journal() const { return _journal; }
+    /** Runs the journal's upkeep while no sync is running */
+    JournalMaintenance *journalMaintenance() const { return _journalMaintenance.data(); }
     QString localPath() const { return _localPath; }
     /**
      * Minimum age, in milisecond, of a file that can be uploaded.
@@ -161,6 +166,8 @@ private slots:
     /** Emit a summary error, unless it was seen before */
     void slotSummaryError(const QString &message);
 
+    void slotJournalMaintenanceStepFinished(const QString &step, qint64 msecs, bool ok);
+
     void slotInsufficientLocalStorage();
     void slotInsufficientRemoteStorage();
 
@@ -224,6 +231,7 @@ private:
 
     QScopedPointer<ExcludedFiles> _excludedFiles;
     QScopedPointer<SyncFileStatusTracker> _syncFileStatusTracker;
+    QScopedPointer<JournalMaintenance> _journalMaintenance;
     Utility::StopWatch _stopWatch;
 
     // maps the origin and the target of the folders that have been renamed
@@ -255,8 +263,6 @@ private:
     int _backInTimeFiles;
 
 
-    int _uploadLimit;
-    int _downloadLimit;
     SyncOptions _syncOptions;
 
     // hash containing the permissions on the remote directory
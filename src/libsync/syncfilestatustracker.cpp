@@ -19,18 +19,21 @@
 #include "syncjournalfilerecord.h"
 #include "asserts.h"
 
+#include <QDir>
 #include <QLoggingCategory>
 
 namespace OCC {
 
 Q_LOGGING_CATEGORY(lcStatusTracker, "sync.statustracker", QtInfoMsg)
 
-static SyncFileStatus::SyncFileStatusTag lookupProblem(const QString &pathToMatch, const std::map<QString, SyncFileStatus::SyncFileStatusTag> &problemMap)
+static const int flushIntervalMs = 200;
+
+static SyncFileStatus::SyncFileStatusTag lookupProblem(const QString &pathToMatch, const QMap<QString, SyncFileStatus::SyncFileStatusTag> &problemMap)
 {
-    auto lower = problemMap.lower_bound(pathToMatch);
+    auto lower = problemMap.lowerBound(pathToMatch);
     for (auto it = lower; it != problemMap.cend(); ++it) {
-        const QString &problemPath = it->first;
-        SyncFileStatus::SyncFileStatusTag severity = it->second;
+        const QString &problemPath = it.key();
+        SyncFileStatus::SyncFileStatusTag severity = it.value();
 
         if (problemPath == pathToMatch) {
             return severity;
@@ -78,19 +81,14 @@ static inline bool showWarningInSocketApi(const SyncFileItem &item)
         || status == SyncFileItem::Restoration;
 }
 
-SyncFileStatusTracker::SyncFileStatusTracker(SyncEngine *syncEngine)
-    : _syncEngine(syncEngine)
+SyncFileStatusSnapshot::SyncFileStatusSnapshot()
+    : _ignoreHiddenFiles(false)
+    , _excludedFiles(0)
 {
-    connect(syncEngine, SIGNAL(aboutToPropagate(SyncFileItemVector &)),
-        SLOT(slotAboutToPropagate(SyncFileItemVector &)));
-    connect(syncEngine, SIGNAL(itemCompleted(const SyncFileItemPtr &)),
-        SLOT(slotItemCompleted(const SyncFileItemPtr &)));
-    connect(syncEngine, SIGNAL(finished(bool)), SLOT(slotSyncFinished()));
-    connect(syncEngine, SIGNAL(started()), SLOT(slotSyncEngineRunningChanged()));
-    connect(syncEngine, SIGNAL(finished(bool)), SLOT(slotSyncEngineRunningChanged()));
 }
 
-SyncFileStatus SyncFileStatusTracker::fileStatus(const QString &relativePath)
+template <typename Journal>
+SyncFileStatus SyncFileStatusSnapshot::fileStatusFrom(const QString &relativePath, Journal *journal) const
 {
     ASSERT(!relativePath.endsWith(QLatin1Char('/')));
 
@@ -105,9 +103,7 @@ SyncFileStatus SyncFileStatusTracker::fileStatus(const QString &relativePath)
     // update the exclude list at runtime and doing it statically here removes
     // our ability to notify changes through the fileStatusChanged signal,
     // it's an acceptable compromize to treat all exclude types the same.
-    if (_syncEngine->excludedFiles().isExcluded(_syncEngine->localPath() + relativePath,
-            _syncEngine->localPath(),
-            _syncEngine->ignoreHiddenFiles())) {
+    if (_excludedFiles->isExcluded(_localPath + relativePath, _localPath, _ignoreHiddenFiles)) {
         return SyncFileStatus(SyncFileStatus::StatusWarning);
     }
 
@@ -115,7 +111,7 @@ SyncFileStatus SyncFileStatusTracker::fileStatus(const QString &relativePath)
         return SyncFileStatus::StatusSync;
 
     // First look it up in the database to know if it's shared
-    SyncJournalFileRecord rec = _syncEngine->journal()->getFileRecord(relativePath);
+    SyncJournalFileRecord rec = journal->getFileRecord(relativePath);
     if (rec.isValid()) {
         return resolveSyncAndErrorStatus(relativePath, rec._remotePerm.contains("S") ? Shared : NotShared);
     }
@@ -124,109 +120,264 @@ SyncFileStatus SyncFileStatusTracker::fileStatus(const QString &relativePath)
     return resolveSyncAndErrorStatus(relativePath, NotShared, PathUnknown);
 }
 
+template <typename Journal>
+QMap<QString, SyncFileStatus> SyncFileStatusSnapshot::directoryStatusFrom(const QString &relativePath, Journal *journal) const
+{
+    ASSERT(!relativePath.endsWith(QLatin1Char('/')));
+
+    QMap<QString, SyncFileStatus> statuses;
+    const QString &basePath = _localPath;
+    const QFileInfoList entries = QDir(basePath + relativePath).entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
+    if (entries.isEmpty()) {
+        return statuses;
+    }
+
+    // Same checks as fileStatus(), see there
+    const bool directoryExcluded = !relativePath.isEmpty()
+        && _excludedFiles->isExcluded(basePath + relativePath, basePath, _ignoreHiddenFiles);
+
+    QHash<QString, QByteArray> remotePerms;
+    if (!directoryExcluded) {
+        foreach (const SyncJournalFileRecord &rec, journal->getFileRecordsInDirectory(relativePath)) {
+            remotePerms.insert(rec._path, rec._remotePerm);
+        }
+    }
+
+    const QString prefix = relativePath.isEmpty() ? QString() : relativePath + QLatin1Char('/');
+    foreach (const QFileInfo &entry, entries) {
+        const QString path = prefix + entry.fileName();
+        if (directoryExcluded || _excludedFiles->isEntryExcluded(entry, basePath, _ignoreHiddenFiles)) {
+            statuses.insert(entry.fileName(), SyncFileStatus(SyncFileStatus::StatusWarning));
+        } else if (_dirtyPaths.contains(path)) {
+            statuses.insert(entry.fileName(), SyncFileStatus(SyncFileStatus::StatusSync));
+        } else {
+            auto it = remotePerms.constFind(path);
+            if (it != remotePerms.constEnd()) {
+                statuses.insert(entry.fileName(), resolveSyncAndErrorStatus(path, it->contains("S") ? Shared : NotShared));
+            } else {
+                statuses.insert(entry.fileName(), resolveSyncAndErrorStatus(path, NotShared, PathUnknown));
+            }
+        }
+    }
+    return statuses;
+}
+
+SyncFileStatus SyncFileStatusSnapshot::fileStatus(const QString &relativePath, SyncJournalReader *journal) const
+{
+    return fileStatusFrom(relativePath, journal);
+}
+
+QMap<QString, SyncFileStatus> SyncFileStatusSnapshot::directoryStatus(const QString &relativePath, SyncJournalReader *journal) const
+{
+    return directoryStatusFrom(relativePath, journal);
+}
+
+SyncFileStatus SyncFileStatusSnapshot::resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedFlag, PathKnownFlag isPathKnown) const
+{
+    // If it's a new file and that we're not syncing it yet,
+    // don't show any icon and wait for the filesystem watcher to trigger a sync.
+    SyncFileStatus status(isPathKnown ? SyncFileStatus::StatusUpToDate : SyncFileStatus::StatusNone);
+    if (_syncCount.value(relativePath)) {
+        status.set(SyncFileStatus::StatusSync);
+    } else {
+        // After a sync finished, we need to show the users issues from that last sync like the activity list does.
+        // Also used for parent directories showing a warning for an error child.
+        SyncFileStatus::SyncFileStatusTag problemStatus = lookupProblem(relativePath, _syncProblems);
+        if (problemStatus != SyncFileStatus::StatusNone)
+            status.set(problemStatus);
+    }
+
+    ASSERT(sharedFlag != UnknownShared,
+        "The shared status needs to have been fetched from a SyncFileItem or the DB at this point.");
+    if (sharedFlag == Shared)
+        status.setShared(true);
+
+    return status;
+}
+
+SyncFileStatusTracker::SyncFileStatusTracker(SyncEngine *syncEngine)
+    : _syncEngine(syncEngine)
+{
+    _state._localPath = syncEngine->localPath();
+    _state._excludedFiles = &syncEngine->excludedFiles();
+    publishSnapshot();
+
+    // A sync changes many statuses quickly, emit them together at most that late
+    _flushTimer.setInterval(flushIntervalMs);
+    _flushTimer.setSingleShot(true);
+    connect(&_flushTimer, SIGNAL(timeout()), SLOT(flushChangedStatuses()));
+
+    connect(syncEngine, SIGNAL(aboutToPropagate(SyncFileItemVector &)),
+        SLOT(slotAboutToPropagate(SyncFileItemVector &)));
+    connect(syncEngine, SIGNAL(itemCompleted(const SyncFileItemPtr &)),
+        SLOT(slotItemCompleted(const SyncFileItemPtr &)));
+    connect(syncEngine, SIGNAL(finished(bool)), SLOT(slotSyncFinished()));
+    connect(syncEngine, SIGNAL(started()), SLOT(slotSyncEngineRunningChanged()));
+    connect(syncEngine, SIGNAL(finished(bool)), SLOT(slotSyncEngineRunningChanged()));
+}
+
+SyncFileStatus SyncFileStatusTracker::fileStatus(const QString &relativePath)
+{
+    _state._ignoreHiddenFiles = _syncEngine->ignoreHiddenFiles();
+    return _state.fileStatusFrom(relativePath, _syncEngine->journal());
+}
+
+QMap<QString, SyncFileStatus> SyncFileStatusTracker::directoryStatus(const QString &relativePath)
+{
+    _state._ignoreHiddenFiles = _syncEngine->ignoreHiddenFiles();
+    return _state.directoryStatusFrom(relativePath, _syncEngine->journal());
+}
+
+QSharedPointer<const SyncFileStatusSnapshot> SyncFileStatusTracker::snapshot() const
+{
+    QMutexLocker locker(&_snapshotMutex);
+    return _snapshot;
+}
+
+void SyncFileStatusTracker::publishSnapshot()
+{
+    _state._ignoreHiddenFiles = _syncEngine->ignoreHiddenFiles();
+    // The containers are implicitly shared: copying them is cheap, _state
+    // detaches from the snapshot when it changes them next
+    QSharedPointer<const SyncFileStatusSnapshot> snapshot(new SyncFileStatusSnapshot(_state));
+    QMutexLocker locker(&_snapshotMutex);
+    _snapshot = snapshot;
+}
+
+void SyncFileStatusTracker::markChanged(const QString &relativePath, SharedFlag sharedFlag)
+{
+    // The status is resolved when it is emitted, once for all the changes
+    // of the path and of its children until then
+    auto it = _changedPaths.find(relativePath);
+    if (it == _changedPaths.end()) {
+        _changedPaths.insert(relativePath, sharedFlag);
+    } else if (sharedFlag != SyncFileStatusSnapshot::UnknownShared) {
+        *it = sharedFlag;
+    }
+    if (!_flushTimer.isActive()) {
+        _flushTimer.start();
+    }
+}
+
+void SyncFileStatusTracker::flushChangedStatuses()
+{
+    _flushTimer.stop();
+    if (_changedPaths.isEmpty()) {
+        return;
+    }
+    // Who receives a change can already resolve it from the snapshot
+    publishSnapshot();
+
+    QMap<QString, SharedFlag> changedPaths;
+    std::swap(_changedPaths, changedPaths);
+    // Backwards, so that children are emitted before their parents
+    for (auto it = changedPaths.constEnd(); it != changedPaths.constBegin();) {
+        --it;
+        SyncFileStatus status = it.value() == SyncFileStatusSnapshot::UnknownShared
+            ? fileStatus(it.key())
+            : resolveSyncAndErrorStatus(it.key(), it.value());
+        emit fileStatusChanged(getSystemDestination(it.key()), status);
+    }
+}
+
 void SyncFileStatusTracker::slotPathTouched(const QString &fileName)
 {
     QString folderPath = _syncEngine->localPath();
 
     ASSERT(fileName.startsWith(folderPath));
     QString localPath = fileName.mid(folderPath.size());
-    _dirtyPaths.insert(localPath);
+    _state._dirtyPaths.insert(localPath);
 
-    emit fileStatusChanged(fileName, SyncFileStatus::StatusSync);
+    markChanged(localPath, SyncFileStatusSnapshot::UnknownShared);
 }
 
-void SyncFileStatusTracker::incSyncCountAndEmitStatusChanged(const QString &relativePath, SharedFlag sharedFlag)
+void SyncFileStatusTracker::incSyncCount(const QString &relativePath, SharedFlag sharedFlag)
 {
     // Will return 0 (and increase to 1) if the path wasn't in the map yet
-    int count = _syncCount[relativePath]++;
+    int count = _state._syncCount[relativePath]++;
     if (!count) {
-        SyncFileStatus status = sharedFlag == UnknownShared
-            ? fileStatus(relativePath)
-            : resolveSyncAndErrorStatus(relativePath, sharedFlag);
-        emit fileStatusChanged(getSystemDestination(relativePath), status);
+        markChanged(relativePath, sharedFlag);
 
         // We passed from OK to SYNC, increment the parent to keep it marked as
         // SYNC while we propagate ourselves and our own children.
         ASSERT(!relativePath.endsWith('/'));
         int lastSlashIndex = relativePath.lastIndexOf('/');
         if (lastSlashIndex != -1)
-            incSyncCountAndEmitStatusChanged(relativePath.left(lastSlashIndex), UnknownShared);
+            incSyncCount(relativePath.left(lastSlashIndex), SyncFileStatusSnapshot::UnknownShared);
         else if (!relativePath.isEmpty())
-            incSyncCountAndEmitStatusChanged(QString(), UnknownShared);
+            incSyncCount(QString(), SyncFileStatusSnapshot::UnknownShared);
     }
 }
 
-void SyncFileStatusTracker::decSyncCountAndEmitStatusChanged(const QString &relativePath, SharedFlag sharedFlag)
+void SyncFileStatusTracker::decSyncCount(const QString &relativePath, SharedFlag sharedFlag)
 {
-    int count = --_syncCount[relativePath];
+    int count = --_state._syncCount[relativePath];
     if (!count) {
         // Remove from the map, same as 0
-        _syncCount.remove(relativePath);
+        _state._syncCount.remove(relativePath);
 
-        SyncFileStatus status = sharedFlag == UnknownShared
-            ? fileStatus(relativePath)
-            : resolveSyncAndErrorStatus(relativePath, sharedFlag);
-        emit fileStatusChanged(getSystemDestination(relativePath), status);
+        markChanged(relativePath, sharedFlag);
 
         // We passed from SYNC to OK, decrement our parent.
         ASSERT(!relativePath.endsWith('/'));
         int lastSlashIndex = relativePath.lastIndexOf('/');
         if (lastSlashIndex != -1)
-            decSyncCountAndEmitStatusChanged(relativePath.left(lastSlashIndex), UnknownShared);
+            decSyncCount(relativePath.left(lastSlashIndex), SyncFileStatusSnapshot::UnknownShared);
         else if (!relativePath.isEmpty())
-            decSyncCountAndEmitStatusChanged(QString(), UnknownShared);
+            decSyncCount(QString(), SyncFileStatusSnapshot::UnknownShared);
     }
 }
 
 void SyncFileStatusTracker::slotAboutToPropagate(SyncFileItemVector &items)
 {
-    ASSERT(_syncCount.isEmpty());
+    ASSERT(_state._syncCount.isEmpty());
 
-    std::map<QString, SyncFileStatus::SyncFileStatusTag> oldProblems;
-    std::swap(_syncProblems, oldProblems);
+    QMap<QString, SyncFileStatus::SyncFileStatusTag> oldProblems;
+    std::swap(_state._syncProblems, oldProblems);
 
     foreach (const SyncFileItemPtr &item, items) {
         qCDebug(lcStatusTracker) << "Investigating" << item->destination() << item->_status << item->_instruction;
-        _dirtyPaths.remove(item->destination());
+        _state._dirtyPaths.remove(item->destination());
 
         if (showErrorInSocketApi(*item)) {
-            _syncProblems[item->_file] = SyncFileStatus::StatusError;
+            _state._syncProblems[item->_file] = SyncFileStatus::StatusError;
             invalidateParentPaths(item->destination());
         } else if (showWarningInSocketApi(*item)) {
-            _syncProblems[item->_file] = SyncFileStatus::StatusWarning;
+            _state._syncProblems[item->_file] = SyncFileStatus::StatusWarning;
         }
 
-        SharedFlag sharedFlag = item->_remotePerm.contains("S") ? Shared : NotShared;
+        SharedFlag sharedFlag = item->_remotePerm.contains("S") ? SyncFileStatusSnapshot::Shared : SyncFileStatusSnapshot::NotShared;
         if (item->_instruction != CSYNC_INSTRUCTION_NONE
             && item->_instruction != CSYNC_INSTRUCTION_UPDATE_METADATA
             && item->_instruction != CSYNC_INSTRUCTION_IGNORE
             && item->_instruction != CSYNC_INSTRUCTION_ERROR) {
             // Mark this path as syncing for instructions that will result in propagation.
-            incSyncCountAndEmitStatusChanged(item->destination(), sharedFlag);
+            incSyncCount(item->destination(), sharedFlag);
         } else {
-            emit fileStatusChanged(getSystemDestination(item->destination()), resolveSyncAndErrorStatus(item->destination(), sharedFlag));
+            markChanged(item->destination(), sharedFlag);
         }
     }
 
     // Some metadata status won't trigger files to be synced, make sure that we
     // push the OK status for dirty files that don't need to be propagated.
-    // Swap into a copy since fileStatus() reads _dirtyPaths to determine the status
-    QSet<QString> oldDirtyPaths;
-    std::swap(_dirtyPaths, oldDirtyPaths);
-    for (auto it = oldDirtyPaths.constBegin(); it != oldDirtyPaths.constEnd(); ++it)
-        emit fileStatusChanged(getSystemDestination(*it), fileStatus(*it));
+    for (auto it = _state._dirtyPaths.constBegin(); it != _state._dirtyPaths.constEnd(); ++it)
+        markChanged(*it, SyncFileStatusSnapshot::UnknownShared);
+    _state._dirtyPaths.clear();
 
     // Make sure to push any status that might have been resolved indirectly since the last sync
     // (like an error file being deleted from disk)
-    for (auto it = _syncProblems.begin(); it != _syncProblems.end(); ++it)
-        oldProblems.erase(it->first);
-    for (auto it = oldProblems.begin(); it != oldProblems.end(); ++it) {
-        const QString &path = it->first;
-        SyncFileStatus::SyncFileStatusTag severity = it->second;
+    for (auto it = _state._syncProblems.constBegin(); it != _state._syncProblems.constEnd(); ++it)
+        oldProblems.remove(it.key());
+    for (auto it = oldProblems.constBegin(); it != oldProblems.constEnd(); ++it) {
+        const QString &path = it.key();
+        SyncFileStatus::SyncFileStatusTag severity = it.value();
         if (severity == SyncFileStatus::StatusError)
             invalidateParentPaths(path);
-        emit fileStatusChanged(getSystemDestination(path), fileStatus(path));
+        markChanged(path, SyncFileStatusSnapshot::UnknownShared);
     }
+
+    // Show that the sync started right away
+    flushChangedStatuses();
 }
 
 void SyncFileStatusTracker::slotItemCompleted(const SyncFileItemPtr &item)
@@ -234,23 +385,23 @@ void SyncFileStatusTracker::slotItemCompleted(const SyncFileItemPtr &item)
     qCDebug(lcStatusTracker) << "Item completed" << item->destination() << item->_status << item->_instruction;
 
     if (showErrorInSocketApi(*item)) {
-        _syncProblems[item->_file] = SyncFileStatus::StatusError;
+        _state._syncProblems[item->_file] = SyncFileStatus::StatusError;
         invalidateParentPaths(item->destination());
     } else if (showWarningInSocketApi(*item)) {
-        _syncProblems[item->_file] = SyncFileStatus::StatusWarning;
+        _state._syncProblems[item->_file] = SyncFileStatus::StatusWarning;
     } else {
-        _syncProblems.erase(item->_file);
+        _state._syncProblems.remove(item->_file);
     }
 
-    SharedFlag sharedFlag = item->_remotePerm.contains("S") ? Shared : NotShared;
+    SharedFlag sharedFlag = item->_remotePerm.contains("S") ? SyncFileStatusSnapshot::Shared : SyncFileStatusSnapshot::NotShared;
     if (item->_instruction != CSYNC_INSTRUCTION_NONE
         && item->_instruction != CSYNC_INSTRUCTION_UPDATE_METADATA
         && item->_instruction != CSYNC_INSTRUCTION_IGNORE
         && item->_instruction != CSYNC_INSTRUCTION_ERROR) {
         // decSyncCount calls *must* be symetric with incSyncCount calls in slotAboutToPropagate
-        decSyncCountAndEmitStatusChanged(item->destination(), sharedFlag);
+        decSyncCount(item->destination(), sharedFlag);
     } else {
-        emit fileStatusChanged(getSystemDestination(item->destination()), resolveSyncAndErrorStatus(item->destination(), sharedFlag));
+        markChanged(item->destination(), sharedFlag);
     }
 }
 
@@ -258,37 +409,21 @@ void SyncFileStatusTracker::slotSyncFinished()
 {
     // Clear the sync counts to reduce the impact of unsymetrical inc/dec calls (e.g. when directory job abort)
     QHash<QString, int> oldSyncCount;
-    std::swap(_syncCount, oldSyncCount);
+    std::swap(_state._syncCount, oldSyncCount);
     for (auto it = oldSyncCount.begin(); it != oldSyncCount.end(); ++it)
-        emit fileStatusChanged(getSystemDestination(it.key()), fileStatus(it.key()));
+        markChanged(it.key(), SyncFileStatusSnapshot::UnknownShared);
+    flushChangedStatuses();
 }
 
 void SyncFileStatusTracker::slotSyncEngineRunningChanged()
 {
-    emit fileStatusChanged(getSystemDestination(QString()), resolveSyncAndErrorStatus(QString(), NotShared));
+    markChanged(QString(), SyncFileStatusSnapshot::NotShared);
 }
 
-SyncFileStatus SyncFileStatusTracker::resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedFlag, PathKnownFlag isPathKnown)
+SyncFileStatus SyncFileStatusTracker::resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedFlag,
+    SyncFileStatusSnapshot::PathKnownFlag isPathKnown)
 {
-    // If it's a new file and that we're not syncing it yet,
-    // don't show any icon and wait for the filesystem watcher to trigger a sync.
-    SyncFileStatus status(isPathKnown ? SyncFileStatus::StatusUpToDate : SyncFileStatus::StatusNone);
-    if (_syncCount.value(relativePath)) {
-        status.set(SyncFileStatus::StatusSync);
-    } else {
-        // After a sync finished, we need to show the users issues from that last sync like the activity list does.
-        // Also used for parent directories showing a warning for an error child.
-        SyncFileStatus::SyncFileStatusTag problemStatus = lookupProblem(relativePath, _syncProblems);
-        if (problemStatus != SyncFileStatus::StatusNone)
-            status.set(problemStatus);
-    }
-
-    ASSERT(sharedFlag != UnknownShared,
-        "The shared status needs to have been fetched from a SyncFileItem or the DB at this point.");
-    if (sharedFlag == Shared)
-        status.setShared(true);
-
-    return status;
+    return _state.resolveSyncAndErrorStatus(relativePath, sharedFlag, isPathKnown);
 }
 
 void SyncFileStatusTracker::invalidateParentPaths(const QString &path)
@@ -296,7 +431,7 @@ void SyncFileStatusTracker::invalidateParentPaths(const QString &path)
     QStringList splitPath = path.split('/', QString::SkipEmptyParts);
     for (int i = 0; i < splitPath.size(); ++i) {
         QString parentPath = QStringList(splitPath.mid(0, i)).join(QLatin1String("/"));
-        emit fileStatusChanged(getSystemDestination(parentPath), fileStatus(parentPath));
+        markChanged(parentPath, SyncFileStatusSnapshot::UnknownShared);
     }
 }
 
@@ -19,12 +19,65 @@
 #include "ownsql.h"
 #include "syncfileitem.h"
 #include "syncfilestatus.h"
-#include <map>
+#include <QMap>
+#include <QMutex>
 #include <QSet>
+#include <QSharedPointer>
+#include <QTimer>
 
 namespace OCC {
 
 class SyncEngine;
+class SyncJournalReader;
+class ExcludedFiles;
+
+/**
+ * @brief The status of the files as the SyncFileStatusTracker knew it at one point
+ *
+ * The tracker publishes copies of its state that are never modified again,
+ * so other threads can resolve statuses from them without waiting for the
+ * thread of the tracker. A copy is published before the status changes it
+ * contains are emitted. They read the records with a SyncJournalReader of
+ * their own, not to wait for the journal either. The excludes are checked
+ * when a status is resolved, they may be used as long as the tracker exists.
+ * @ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT SyncFileStatusSnapshot
+{
+public:
+    enum SharedFlag { UnknownShared,
+        NotShared,
+        Shared };
+    enum PathKnownFlag { PathUnknown = 0,
+        PathKnown };
+
+    SyncFileStatusSnapshot();
+
+    SyncFileStatus fileStatus(const QString &relativePath, SyncJournalReader *journal) const;
+    QMap<QString, SyncFileStatus> directoryStatus(const QString &relativePath, SyncJournalReader *journal) const;
+
+    SyncFileStatus resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedState, PathKnownFlag isPathKnown = PathKnown) const;
+
+private:
+    friend class SyncFileStatusTracker;
+
+    // The tracker uses the SyncJournalDb
+    template <typename Journal>
+    SyncFileStatus fileStatusFrom(const QString &relativePath, Journal *journal) const;
+    template <typename Journal>
+    QMap<QString, SyncFileStatus> directoryStatusFrom(const QString &relativePath, Journal *journal) const;
+
+    QString _localPath;
+    bool _ignoreHiddenFiles;
+    const ExcludedFiles *_excludedFiles;
+
+    QMap<QString, SyncFileStatus::SyncFileStatusTag> _syncProblems;
+    QSet<QString> _dirtyPaths;
+    // Counts the number direct children currently being synced (has unfinished propagation jobs).
+    // We'll show a file/directory as SYNC as long as its sync count is > 0.
+    // A directory that starts/ends propagation will in turn increase/decrease its own parent by 1.
+    QHash<QString, int> _syncCount;
+};
 
 /**
  * @brief Takes care of tracking the status of individual files as they
@@ -38,10 +91,30 @@ public:
     explicit SyncFileStatusTracker(SyncEngine *syncEngine);
     SyncFileStatus fileStatus(const QString &relativePath);
 
+    /**
+     * The fileStatus() of every entry of the local directory \a relativePath,
+     * by file name.
+     *
+     * Checks the excludes and reads the journal once for the whole directory.
+     */
+    QMap<QString, SyncFileStatus> directoryStatus(const QString &relativePath);
+
+    /**
+     * The latest published state, may be used from any thread.
+     *
+     * It is published right before the changed statuses are emitted.
+     */
+    QSharedPointer<const SyncFileStatusSnapshot> snapshot() const;
+
 public slots:
     void slotPathTouched(const QString &fileName);
 
 signals:
+    /**
+     * Emitted for the paths whose status may have changed, at most once
+     * per path for changes that happen together. Children are emitted
+     * before their parents.
+     */
     void fileStatusChanged(const QString &systemFileName, SyncFileStatus fileStatus);
 
 private slots:
@@ -49,28 +122,29 @@ private slots:
     void slotItemCompleted(const SyncFileItemPtr &item);
     void slotSyncFinished();
     void slotSyncEngineRunningChanged();
+    void flushChangedStatuses();
 
 private:
-    enum SharedFlag { UnknownShared,
-        NotShared,
-        Shared };
-    enum PathKnownFlag { PathUnknown = 0,
-        PathKnown };
-    SyncFileStatus resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedState, PathKnownFlag isPathKnown = PathKnown);
+    typedef SyncFileStatusSnapshot::SharedFlag SharedFlag;
+
+    void markChanged(const QString &relativePath, SharedFlag sharedFlag);
+    void publishSnapshot();
+    SyncFileStatus resolveSyncAndErrorStatus(const QString &relativePath, SharedFlag sharedState,
+        SyncFileStatusSnapshot::PathKnownFlag isPathKnown = SyncFileStatusSnapshot::PathKnown);
 
     void invalidateParentPaths(const QString &path);
     QString getSystemDestination(const QString &relativePath);
-    void incSyncCountAndEmitStatusChanged(const QString &relativePath, SharedFlag sharedState);
-    void decSyncCountAndEmitStatusChanged(const QString &relativePath, SharedFlag sharedState);
+    void incSyncCount(const QString &relativePath, SharedFlag sharedState);
+    void decSyncCount(const QString &relativePath, SharedFlag sharedState);
 
     SyncEngine *_syncEngine;
 
-    std::map<QString, SyncFileStatus::SyncFileStatusTag> _syncProblems;
-    QSet<QString> _dirtyPaths;
-    // Counts the number direct children currently being synced (has unfinished propagation jobs).
-    // We'll show a file/directory as SYNC as long as its sync count is > 0.
-    // A directory that starts/ends propagation will in turn increase/decrease its own parent by 1.
-    QHash<QString, int> _syncCount;
+    SyncFileStatusSnapshot _state; // the current one
+    mutable QMutex _snapshotMutex;
+    QSharedPointer<const SyncFileStatusSnapshot> _snapshot;
+    // The paths to emit on the next flush, with their shared flag if it is known
+    QMap<QString, SharedFlag> _changedPaths;
+    QTimer _flushTimer;
 };
 }
 
@@ -18,6 +18,9 @@
 #include <QElapsedTimer>
 #include <QUrl>
 #include <QDir>
+#include <QThread>
+
+#include <algorithm>
 
 #include "ownsql.h"
 
@@ -30,15 +33,108 @@
 #include "checksums.h"
 
 #include "std/c_jhash.h"
+#include "csync.h"
+#include "vio/csync_vio_local.h"
 
 namespace OCC {
 
 Q_LOGGING_CATEGORY(lcDb, "sync.database", QtInfoMsg)
 
+// The writer thread waits this long for more queued writes before it
+// applies them, unless this many are already queued.
+static const unsigned long writerBatchDelayMs = 1000;
+static const int writerBatchSize = 500;
+
+static int fileRecordCacheSize()
+{
+    static QByteArray env = qgetenv("OWNCLOUD_FILE_RECORD_CACHE_SIZE");
+    bool ok = false;
+    int size = env.toInt(&ok);
+    return ok && size >= 0 ? size : 10000;
+}
+
+static const char getFileRecordsInDirectorySql[] =
+    "SELECT path, inode, modtime, type, md5, fileid, remotePerm, filesize FROM metadata"
+    " WHERE path > ?1 ORDER BY path";
+
+/**
+ * Runs \a query, prepared with getFileRecordsInDirectorySql, for the direct
+ * children of \a directory.
+ *
+ * Walks the path index from the first child on, and seeks past the subtree
+ * of every child directory instead of reading it: '0' follows '/'
+ */
+static QVector<SyncJournalFileRecord> selectFileRecordsInDirectory(SqlQuery *query, const QString &directory)
+{
+    QVector<SyncJournalFileRecord> records;
+    const QString prefix = directory.isEmpty() ? QString::fromLatin1("") : directory + QLatin1Char('/');
+    QString lowerBound = prefix;
+    bool seek = true;
+    while (true) {
+        if (seek) {
+            query->reset_and_clear_bindings();
+            query->bindValue(1, lowerBound);
+            if (!query->exec()) {
+                break;
+            }
+            seek = false;
+        }
+        if (!query->next()) {
+            break;
+        }
+        const QString path = query->stringValue(0);
+        if (!path.startsWith(prefix)) {
+            break; // past the directory
+        }
+        const int slash = path.indexOf(QLatin1Char('/'), prefix.size());
+        if (slash != -1) {
+            // Below a child, which itself was already listed if it has a record
+            lowerBound = path.left(slash) + QLatin1Char('0');
+            seek = true;
+            continue;
+        }
+        SyncJournalFileRecord rec;
+        rec._path = path;
+        rec._inode = query->int64Value(1);
+        rec._modtime = Utility::qDateTimeFromTime_t(query->int64Value(2));
+        rec._type = query->intValue(3);
+        rec._etag = query->baValue(4);
+        rec._fileId = query->baValue(5);
+        rec._remotePerm = query->baValue(6);
+        rec._fileSize = query->int64Value(7);
+        records.append(rec);
+    }
+    query->reset_and_clear_bindings();
+    return records;
+}
+
+/** Applies the queued file record writes of a SyncJournalDb */
+class JournalWriterThread : public QThread
+{
+public:
+    explicit JournalWriterThread(SyncJournalDb *journal)
+        : _journal(journal)
+    {
+    }
+
+protected:
+    void run() Q_DECL_OVERRIDE
+    {
+        _journal->runWriter();
+    }
+
+private:
+    SyncJournalDb *_journal;
+};
+
 SyncJournalDb::SyncJournalDb(const QString &dbFilePath, QObject *parent)
     : QObject(parent)
     , _dbFile(dbFilePath)
     , _transaction(0)
+    , _integrityChecked(false)
+    , _fileRecordCache(fileRecordCacheSize())
+    , _pendingWriteFailed(false)
+    , _writerThread(0)
 {
 }
 
@@ -166,18 +262,13 @@ QString SyncJournalDb::databaseFilePath() const
     return _dbFile;
 }
 
-// Note that this does not change the size of the -wal file, but it is supposed to make
-// the normal .db faster since the changes from the wal will be incorporated into it.
-// Then the next sync (and the SocketAPI) will have a faster access.
-void SyncJournalDb::walCheckpoint()
+void SyncJournalDb::setIntegrityCheckNeeded()
 {
-    QElapsedTimer t;
-    t.start();
-    SqlQuery pragma1(_db);
-    pragma1.prepare("PRAGMA wal_checkpoint(FULL);");
-    if (pragma1.exec()) {
-        qCDebug(lcDb) << "took" << t.elapsed() << "msec";
+    {
+        QMutexLocker locker(&_mutex);
+        _integrityChecked = false;
     }
+    close();
 }
 
 void SyncJournalDb::startTransaction()
@@ -215,6 +306,39 @@ bool SyncJournalDb::sqlFail(const QString &log, const SqlQuery &query)
     return false;
 }
 
+/*
+ * The metadata table: keyed by the integer phash without a rowid and with typed
+ * integer columns. The path index covers the columns read by
+ * csync_statedb_get_below_path, so the discovery's range query doesn't look up
+ * every row in the table.
+ */
+static QByteArray compactMetadataTableQuery(const QByteArray &tableName)
+{
+    return "CREATE TABLE " + tableName + "("
+           "phash INTEGER NOT NULL,"
+           "pathlen INTEGER,"
+           "path TEXT,"
+           "inode INTEGER,"
+           "modtime INTEGER,"
+           "type INTEGER,"
+           "md5 TEXT," /* This is the etag.  Called md5 for compatibility */
+           "fileid TEXT,"
+           "remotePerm TEXT,"
+           "filesize INTEGER,"
+           "ignoredChildrenRemote INTEGER,"
+           "contentChecksum TEXT,"
+           "contentChecksumTypeId INTEGER,"
+           "PRIMARY KEY(phash)"
+           ") WITHOUT ROWID;";
+}
+
+static const char *const compactMetadataIndexQueries[] = {
+    "CREATE INDEX metadata_inode ON metadata(inode);",
+    "CREATE INDEX metadata_file_id ON metadata(fileid);",
+    "CREATE INDEX metadata_path ON metadata(path, pathlen, inode, modtime, type, md5, fileid, remotePerm, "
+    "filesize, ignoredChildrenRemote, contentChecksum, contentChecksumTypeId);"
+};
+
 static QString defaultJournalMode(const QString &dbPath)
 {
 #ifdef Q_OS_WIN
@@ -244,11 +368,13 @@ bool SyncJournalDb::checkConnect()
     }
 
     // The database file is created by this call (SQLITE_OPEN_CREATE)
-    if (!_db.openOrCreateReadWrite(_dbFile)) {
+    // Checking is slow on large databases, later ones happen in the background.
+    if (!_db.openOrCreateReadWrite(_dbFile, !_integrityChecked)) {
         QString error = _db.error();
         qCWarning(lcDb) << "Error opening the db: " << error;
         return false;
     }
+    _integrityChecked = true;
 
     if (!QFile::exists(_dbFile)) {
         qCWarning(lcDb) << "Database file" + _dbFile + " does not exist";
@@ -301,29 +427,18 @@ bool SyncJournalDb::checkConnect()
     startTransaction();
 
     SqlQuery createQuery(_db);
-    createQuery.prepare("CREATE TABLE IF NOT EXISTS metadata("
-                        "phash INTEGER(8),"
-                        "pathlen INTEGER,"
-                        "path VARCHAR(4096),"
-                        "inode INTEGER,"
-                        "uid INTEGER,"
-                        "gid INTEGER,"
-                        "mode INTEGER,"
-                        "modtime INTEGER(8),"
-                        "type INTEGER,"
-                        "md5 VARCHAR(32)," /* This is the etag.  Called md5 for compatibility */
-                        // updateDatabaseStructure() will add
-                        // fileid
-                        // remotePerm
-                        // filesize
-                        // ignoredChildrenRemote
-                        // contentChecksum
-                        // contentChecksumTypeId
-                        "PRIMARY KEY(phash)"
-                        ");");
-
-    if (!createQuery.exec()) {
-        return sqlFail("Create table metadata", createQuery);
+    // Older journals are moved to the compact table by updateMetadataTableStructure()
+    if (tableColumns("metadata").isEmpty()) {
+        createQuery.prepare(compactMetadataTableQuery("metadata"));
+        if (!createQuery.exec()) {
+            return sqlFail("Create table metadata", createQuery);
+        }
+        for (const char *indexQuery : compactMetadataIndexQueries) {
+            createQuery.prepare(indexQuery);
+            if (!createQuery.exec()) {
+                return sqlFail("Create index metadata", createQuery);
+            }
+        }
     }
 
     createQuery.prepare("CREATE TABLE IF NOT EXISTS downloadinfo("
@@ -401,6 +516,20 @@ bool SyncJournalDb::checkConnect()
         return sqlFail("Create table datafingerprint", createQuery);
     }
 
+    // create the checksumcache table.
+    createQuery.prepare("CREATE TABLE IF NOT EXISTS checksumcache("
+                        "inode INTEGER,"
+                        "checksumTypeId INTEGER,"
+                        "size INTEGER,"
+                        "modtime INTEGER,"
+                        "ctime INTEGER,"
+                        "checksum TEXT,"
+                        "PRIMARY KEY(inode, checksumTypeId)"
+                        ");");
+    if (!createQuery.exec()) {
+        return sqlFail("Create table checksumcache", createQuery);
+    }
+
     createQuery.prepare("CREATE TABLE IF NOT EXISTS version("
                         "major INTEGER(8),"
                         "minor INTEGER(8),"
@@ -484,7 +613,7 @@ bool SyncJournalDb::checkConnect()
 
     _getFileRecordQuery.reset(new SqlQuery(_db));
     if (_getFileRecordQuery->prepare(
-            "SELECT path, inode, uid, gid, mode, modtime, type, md5, fileid, remotePerm, filesize,"
+            "SELECT path, inode, modtime, type, md5, fileid, remotePerm, filesize,"
             "  ignoredChildrenRemote, contentchecksumtype.name || ':' || contentChecksum"
             " FROM metadata"
             "  LEFT JOIN checksumtype as contentchecksumtype ON metadata.contentChecksumTypeId == contentchecksumtype.id"
@@ -492,10 +621,22 @@ bool SyncJournalDb::checkConnect()
         return sqlFail("prepare _getFileRecordQuery", *_getFileRecordQuery);
     }
 
+    _getFileRecordsByChecksumQuery.reset(new SqlQuery(_db));
+    if (_getFileRecordsByChecksumQuery->prepare(
+            "SELECT path, inode, modtime, type, filesize FROM metadata"
+            " WHERE contentChecksum=?1 AND contentChecksumTypeId=?2 AND filesize=?3 LIMIT ?4")) {
+        return sqlFail("prepare _getFileRecordsByChecksumQuery", *_getFileRecordsByChecksumQuery);
+    }
+
+    _getFileRecordsInDirectoryQuery.reset(new SqlQuery(_db));
+    if (_getFileRecordsInDirectoryQuery->prepare(getFileRecordsInDirectorySql)) {
+        return sqlFail("prepare _getFileRecordsInDirectoryQuery", *_getFileRecordsInDirectoryQuery);
+    }
+
     _setFileRecordQuery.reset(new SqlQuery(_db));
     if (_setFileRecordQuery->prepare("INSERT OR REPLACE INTO metadata "
-                                     "(phash, pathlen, path, inode, uid, gid, mode, modtime, type, md5, fileid, remotePerm, filesize, ignoredChildrenRemote, contentChecksum, contentChecksumTypeId) "
-                                     "VALUES (?1 , ?2, ?3 , ?4 , ?5 , ?6 , ?7,  ?8 , ?9 , ?10, ?11, ?12, ?13, ?14, ?15, ?16);")) {
+                                     "(phash, pathlen, path, inode, modtime, type, md5, fileid, remotePerm, filesize, ignoredChildrenRemote, contentChecksum, contentChecksumTypeId) "
+                                     "VALUES (?1 , ?2, ?3 , ?4 , ?5 , ?6 , ?7, ?8, ?9, ?10, ?11, ?12, ?13);")) {
         return sqlFail("prepare _setFileRecordQuery", *_setFileRecordQuery);
     }
 
@@ -516,15 +657,15 @@ bool SyncJournalDb::checkConnect()
     }
 
     _getDownloadInfoQuery.reset(new SqlQuery(_db));
-    if (_getDownloadInfoQuery->prepare("SELECT tmpfile, etag, errorcount FROM "
+    if (_getDownloadInfoQuery->prepare("SELECT tmpfile, etag, errorcount, segments FROM "
                                        "downloadinfo WHERE path=?1")) {
         return sqlFail("prepare _getDownloadInfoQuery", *_getDownloadInfoQuery);
     }
 
     _setDownloadInfoQuery.reset(new SqlQuery(_db));
     if (_setDownloadInfoQuery->prepare("INSERT OR REPLACE INTO downloadinfo "
-                                       "(path, tmpfile, etag, errorcount) "
-                                       "VALUES ( ?1 , ?2, ?3, ?4 )")) {
+                                       "(path, tmpfile, etag, errorcount, segments) "
+                                       "VALUES ( ?1 , ?2, ?3, ?4, ?5 )")) {
         return sqlFail("prepare _setDownloadInfoQuery", *_setDownloadInfoQuery);
     }
 
@@ -534,15 +675,15 @@ bool SyncJournalDb::checkConnect()
     }
 
     _getUploadInfoQuery.reset(new SqlQuery(_db));
-    if (_getUploadInfoQuery->prepare("SELECT chunk, transferid, errorcount, size, modtime FROM "
+    if (_getUploadInfoQuery->prepare("SELECT chunk, transferid, errorcount, size, modtime, donechunks FROM "
                                      "uploadinfo WHERE path=?1")) {
         return sqlFail("prepare _getUploadInfoQuery", *_getUploadInfoQuery);
     }
 
     _setUploadInfoQuery.reset(new SqlQuery(_db));
     if (_setUploadInfoQuery->prepare("INSERT OR REPLACE INTO uploadinfo "
-                                     "(path, chunk, transferid, errorcount, size, modtime) "
-                                     "VALUES ( ?1 , ?2, ?3 , ?4 ,  ?5, ?6 )")) {
+                                     "(path, chunk, transferid, errorcount, size, modtime, donechunks) "
+                                     "VALUES ( ?1 , ?2, ?3 , ?4 ,  ?5, ?6, ?7 )")) {
         return sqlFail("prepare _setUploadInfoQuery", *_setUploadInfoQuery);
     }
 
@@ -615,6 +756,19 @@ bool SyncJournalDb::checkConnect()
         return sqlFail("prepare _setDataFingerprintQuery2", *_setDataFingerprintQuery2);
     }
 
+    _getCachedChecksumQuery.reset(new SqlQuery(_db));
+    if (_getCachedChecksumQuery->prepare("SELECT checksum FROM checksumcache "
+                                         "WHERE inode=?1 AND checksumTypeId=?2 AND size=?3 AND modtime=?4 AND ctime=?5")) {
+        return sqlFail("prepare _getCachedChecksumQuery", *_getCachedChecksumQuery);
+    }
+
+    _setCachedChecksumQuery.reset(new SqlQuery(_db));
+    if (_setCachedChecksumQuery->prepare("INSERT OR REPLACE INTO checksumcache "
+                                         "(inode, checksumTypeId, size, modtime, ctime, checksum) "
+                                         "VALUES (?1, ?2, ?3, ?4, ?5, ?6)")) {
+        return sqlFail("prepare _setCachedChecksumQuery", *_setCachedChecksumQuery);
+    }
+
     // don't start a new transaction now
     commitInternal(QString("checkConnect End"), false);
 
@@ -629,12 +783,20 @@ bool SyncJournalDb::checkConnect()
 
 void SyncJournalDb::close()
 {
+    // The writer thread needs the mutex to finish its batch
+    stopWriter();
+
     QMutexLocker locker(&_mutex);
     qCInfo(lcDb) << "Closing DB" << _dbFile;
 
+    if (_db.isOpen()) {
+        applyPendingWrites();
+    }
     commitTransaction();
 
     _getFileRecordQuery.reset(0);
+    _getFileRecordsByChecksumQuery.reset(0);
+    _getFileRecordsInDirectoryQuery.reset(0);
     _setFileRecordQuery.reset(0);
     _setFileRecordChecksumQuery.reset(0);
     _setFileRecordLocalMetadataQuery.reset(0);
@@ -655,9 +817,12 @@ void SyncJournalDb::close()
     _getDataFingerprintQuery.reset(0);
     _setDataFingerprintQuery1.reset(0);
     _setDataFingerprintQuery2.reset(0);
+    _getCachedChecksumQuery.reset(0);
+    _setCachedChecksumQuery.reset(0);
 
     _db.close();
     _avoidReadFromDbOnNextSyncFilter.clear();
+    _fileRecordCache.clear();
 }
 
 
@@ -667,6 +832,10 @@ bool SyncJournalDb::updateDatabaseStructure()
         return false;
     if (!updateErrorBlacklistTableStructure())
         return false;
+    if (!updateUploadInfoTableStructure())
+        return false;
+    if (!updateDownloadInfoTableStructure())
+        return false;
     return true;
 }
 
@@ -763,6 +932,39 @@ bool SyncJournalDb::updateMetadataTableStructure()
         commitInternal("update database structure: add contentChecksumTypeId col");
     }
 
+    // Move the tables of older clients to the compact table
+    if (columns.indexOf(QLatin1String("uid")) != -1) {
+        QList<QByteArray> statements;
+        statements << compactMetadataTableQuery("metadata_compact")
+                   << "INSERT OR IGNORE INTO metadata_compact "
+                      "SELECT phash, pathlen, path, CAST(inode AS INTEGER), CAST(modtime AS INTEGER), CAST(type AS INTEGER), "
+                      "md5, fileid, remotePerm, filesize, ignoredChildrenRemote, contentChecksum, contentChecksumTypeId "
+                      "FROM metadata WHERE phash IS NOT NULL;"
+                   << "DROP TABLE metadata;"
+                   << "ALTER TABLE metadata_compact RENAME TO metadata;";
+        for (const char *indexQuery : compactMetadataIndexQueries) {
+            statements << indexQuery;
+        }
+        SqlQuery query(_db);
+        foreach (const QByteArray &statement, statements) {
+            query.prepare(statement);
+            if (!query.exec()) {
+                sqlFail("updateMetadataTableStructure: compact metadata table", query);
+                return false;
+            }
+        }
+        commitInternal("update database structure: compact metadata table");
+    }
+
+    if (1) {
+        SqlQuery query(_db);
+        query.prepare("CREATE INDEX IF NOT EXISTS metadata_content_checksum ON metadata(contentChecksum);");
+        if (!query.exec()) {
+            sqlFail("updateMetadataTableStructure: create index contentChecksum", query);
+            re = false;
+        }
+        commitInternal("update database structure: add contentChecksum index");
+    }
 
     return re;
 }
@@ -821,6 +1023,50 @@ bool SyncJournalDb::updateErrorBlacklistTableStructure()
     return re;
 }
 
+bool SyncJournalDb::updateUploadInfoTableStructure()
+{
+    QStringList columns = tableColumns("uploadinfo");
+    bool re = true;
+
+    if (!checkConnect()) {
+        return false;
+    }
+
+    if (columns.indexOf(QLatin1String("donechunks")) == -1) {
+        SqlQuery query(_db);
+        query.prepare("ALTER TABLE uploadinfo ADD COLUMN donechunks TEXT;");
+        if (!query.exec()) {
+            sqlFail("updateUploadInfoTableStructure: add donechunks column", query);
+            re = false;
+        }
+        commitInternal("update database structure: add donechunks col");
+    }
+
+    return re;
+}
+
+bool SyncJournalDb::updateDownloadInfoTableStructure()
+{
+    QStringList columns = tableColumns("downloadinfo");
+    bool re = true;
+
+    if (!checkConnect()) {
+        return false;
+    }
+
+    if (columns.indexOf(QLatin1String("segments")) == -1) {
+        SqlQuery query(_db);
+        query.prepare("ALTER TABLE downloadinfo ADD COLUMN segments TEXT;");
+        if (!query.exec()) {
+            sqlFail("updateDownloadInfoTableStructure: add segments column", query);
+            re = false;
+        }
+        commitInternal("update database structure: add segments col");
+    }
+
+    return re;
+}
+
 QStringList SyncJournalDb::tableColumns(const QString &table)
 {
     QStringList columns;
@@ -859,10 +1105,17 @@ qint64 SyncJournalDb::getPHash(const QString &file)
     return h;
 }
 
-bool SyncJournalDb::setFileRecord(const SyncJournalFileRecord &_record)
+bool SyncJournalDb::setFileRecord(const SyncJournalFileRecord &record)
 {
-    SyncJournalFileRecord record = _record;
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
+    return setFileRecordLocked(record);
+}
+
+bool SyncJournalDb::setFileRecordLocked(const SyncJournalFileRecord &_record)
+{
+    SyncJournalFileRecord record = _record;
+    invalidateFileRecordCache(record._path);
 
     if (!_avoidReadFromDbOnNextSyncFilter.isEmpty()) {
         // If we are a directory that should not be read from db next time, don't write the etag
@@ -899,22 +1152,19 @@ bool SyncJournalDb::setFileRecord(const SyncJournalFileRecord &_record)
         parseChecksumHeader(record._checksumHeader, &checksumType, &checksum);
         int contentChecksumTypeId = mapChecksumType(checksumType);
         _setFileRecordQuery->reset_and_clear_bindings();
-        _setFileRecordQuery->bindValue(1, QString::number(phash));
+        _setFileRecordQuery->bindValue(1, phash);
         _setFileRecordQuery->bindValue(2, plen);
         _setFileRecordQuery->bindValue(3, record._path);
         _setFileRecordQuery->bindValue(4, record._inode);
-        _setFileRecordQuery->bindValue(5, 0); // uid Not used
-        _setFileRecordQuery->bindValue(6, 0); // gid Not used
-        _setFileRecordQuery->bindValue(7, 0); // mode Not used
-        _setFileRecordQuery->bindValue(8, QString::number(Utility::qDateTimeToTime_t(record._modtime)));
-        _setFileRecordQuery->bindValue(9, QString::number(record._type));
-        _setFileRecordQuery->bindValue(10, etag);
-        _setFileRecordQuery->bindValue(11, fileId);
-        _setFileRecordQuery->bindValue(12, remotePerm);
-        _setFileRecordQuery->bindValue(13, record._fileSize);
-        _setFileRecordQuery->bindValue(14, record._serverHasIgnoredFiles ? 1 : 0);
-        _setFileRecordQuery->bindValue(15, checksum);
-        _setFileRecordQuery->bindValue(16, contentChecksumTypeId);
+        _setFileRecordQuery->bindValue(5, qlonglong(Utility::qDateTimeToTime_t(record._modtime)));
+        _setFileRecordQuery->bindValue(6, record._type);
+        _setFileRecordQuery->bindValue(7, etag);
+        _setFileRecordQuery->bindValue(8, fileId);
+        _setFileRecordQuery->bindValue(9, remotePerm);
+        _setFileRecordQuery->bindValue(10, record._fileSize);
+        _setFileRecordQuery->bindValue(11, record._serverHasIgnoredFiles ? 1 : 0);
+        _setFileRecordQuery->bindValue(12, checksum);
+        _setFileRecordQuery->bindValue(13, contentChecksumTypeId);
 
         if (!_setFileRecordQuery->exec()) {
             return false;
@@ -931,14 +1181,20 @@ bool SyncJournalDb::setFileRecord(const SyncJournalFileRecord &_record)
 bool SyncJournalDb::deleteFileRecord(const QString &filename, bool recursively)
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
+    return deleteFileRecordLocked(filename, recursively);
+}
 
+bool SyncJournalDb::deleteFileRecordLocked(const QString &filename, bool recursively)
+{
+    invalidateFileRecordCache(filename, recursively);
     if (checkConnect()) {
         // if (!recursively) {
         // always delete the actual file.
 
         qlonglong phash = getPHash(filename);
         _deleteFileRecordPhash->reset_and_clear_bindings();
-        _deleteFileRecordPhash->bindValue(1, QString::number(phash));
+        _deleteFileRecordPhash->bindValue(1, phash);
 
         if (!_deleteFileRecordPhash->exec()) {
             return false;
@@ -961,10 +1217,124 @@ bool SyncJournalDb::deleteFileRecord(const QString &filename, bool recursively)
     }
 }
 
+void SyncJournalDb::queueFileRecord(const SyncJournalFileRecord &record)
+{
+    PendingWrite write;
+    write._record = record;
+    queueWrite(write);
+}
+
+void SyncJournalDb::queueDeleteFileRecord(const QString &filename, bool recursively)
+{
+    PendingWrite write;
+    write._record._path = filename;
+    write._delete = true;
+    write._recursively = recursively;
+    queueWrite(write);
+}
+
+void SyncJournalDb::queueWrite(const PendingWrite &write)
+{
+    QMutexLocker queueLocker(&_pendingWritesMutex);
+    if (!_writerThread) {
+        _writerThread = new JournalWriterThread(this);
+        _writerThread->start();
+    }
+    _pendingWrites.append(write);
+    // The writer waits for the first write and for a full batch
+    if (_pendingWrites.size() == 1 || _pendingWrites.size() == writerBatchSize) {
+        _pendingWritesChanged.wakeAll();
+    }
+}
+
+bool SyncJournalDb::applyPendingWrites()
+{
+    QVector<PendingWrite> writes;
+    {
+        QMutexLocker queueLocker(&_pendingWritesMutex);
+        if (_pendingWrites.isEmpty()) {
+            return false;
+        }
+        writes.swap(_pendingWrites);
+    }
+
+    foreach (const PendingWrite &write, writes) {
+        bool ok = write._delete
+            ? deleteFileRecordLocked(write._record._path, write._recursively)
+            : setFileRecordLocked(write._record);
+        if (!ok) {
+            qCWarning(lcDb) << "Failed to apply the queued write of" << write._record._path;
+            _pendingWriteFailed = true;
+        }
+    }
+    return true;
+}
+
+bool SyncJournalDb::flushPendingWrites()
+{
+    QMutexLocker locker(&_mutex);
+    if (applyPendingWrites() || _transaction == 1) {
+        commitInternal("flush pending writes");
+    }
+    bool ok = !_pendingWriteFailed;
+    _pendingWriteFailed = false;
+    return ok;
+}
+
+void SyncJournalDb::runWriter()
+{
+    QMutexLocker queueLocker(&_pendingWritesMutex);
+    // stopWriter() resets _writerThread
+    while (_writerThread == QThread::currentThread()) {
+        if (_pendingWrites.isEmpty()) {
+            _pendingWritesChanged.wait(&_pendingWritesMutex);
+            continue;
+        }
+        if (_pendingWrites.size() < writerBatchSize) {
+            _pendingWritesChanged.wait(&_pendingWritesMutex, writerBatchDelayMs);
+            if (_writerThread != QThread::currentThread()) {
+                break;
+            }
+        }
+        queueLocker.unlock();
+        {
+            QMutexLocker locker(&_mutex);
+            if (applyPendingWrites()) {
+                commitInternal("journal writer batch");
+            }
+        }
+        queueLocker.relock();
+    }
+}
+
+void SyncJournalDb::stopWriter()
+{
+    QThread *thread = 0;
+    {
+        QMutexLocker queueLocker(&_pendingWritesMutex);
+        qSwap(thread, _writerThread);
+        _pendingWritesChanged.wakeAll();
+    }
+    if (thread) {
+        thread->wait();
+        delete thread;
+    }
+}
+
 
 SyncJournalFileRecord SyncJournalDb::getFileRecord(const QString &filename)
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
+
+    QElapsedTimer timer;
+    timer.start();
+    if (const SyncJournalFileRecord *cached = _fileRecordCache.object(filename)) {
+        SyncJournalFileRecord rec = *cached;
+        _fileRecordCacheStats._hits++;
+        _fileRecordCacheStats._hitNsecs += timer.nsecsElapsed();
+        return rec;
+    }
 
     qlonglong phash = getPHash(filename);
     SyncJournalFileRecord rec;
@@ -981,19 +1351,17 @@ SyncJournalFileRecord SyncJournalDb::getFileRecord(const QString &filename)
 
         if (_getFileRecordQuery->next()) {
             rec._path = _getFileRecordQuery->stringValue(0);
-            rec._inode = _getFileRecordQuery->intValue(1);
-            //rec._uid     = _getFileRecordQuery->value(2).toInt(&ok); Not Used
-            //rec._gid     = _getFileRecordQuery->value(3).toInt(&ok); Not Used
-            //rec._mode    = _getFileRecordQuery->intValue(4);
-            rec._modtime = Utility::qDateTimeFromTime_t(_getFileRecordQuery->int64Value(5));
-            rec._type = _getFileRecordQuery->intValue(6);
-            rec._etag = _getFileRecordQuery->baValue(7);
-            rec._fileId = _getFileRecordQuery->baValue(8);
-            rec._remotePerm = _getFileRecordQuery->baValue(9);
-            rec._fileSize = _getFileRecordQuery->int64Value(10);
-            rec._serverHasIgnoredFiles = (_getFileRecordQuery->intValue(11) > 0);
-            rec._checksumHeader = _getFileRecordQuery->baValue(12);
+            rec._inode = _getFileRecordQuery->int64Value(1);
+            rec._modtime = Utility::qDateTimeFromTime_t(_getFileRecordQuery->int64Value(2));
+            rec._type = _getFileRecordQuery->intValue(3);
+            rec._etag = _getFileRecordQuery->baValue(4);
+            rec._fileId = _getFileRecordQuery->baValue(5);
+            rec._remotePerm = _getFileRecordQuery->baValue(6);
+            rec._fileSize = _getFileRecordQuery->int64Value(7);
+            rec._serverHasIgnoredFiles = (_getFileRecordQuery->intValue(8) > 0);
+            rec._checksumHeader = _getFileRecordQuery->baValue(9);
             _getFileRecordQuery->reset_and_clear_bindings();
+            _fileRecordCache.insert(filename, new SyncJournalFileRecord(rec));
         } else {
             int errId = _getFileRecordQuery->errorId();
             if (errId != SQLITE_DONE) { // only do this if the problem is different from SQLITE_DONE
@@ -1002,61 +1370,169 @@ SyncJournalFileRecord SyncJournalDb::getFileRecord(const QString &filename)
                 locker.unlock();
                 close();
                 locker.relock();
+            } else {
+                _fileRecordCache.insert(filename, new SyncJournalFileRecord(rec));
             }
         }
         if (_getFileRecordQuery) {
             _getFileRecordQuery->reset_and_clear_bindings();
         }
     }
+    _fileRecordCacheStats._misses++;
+    _fileRecordCacheStats._missNsecs += timer.nsecsElapsed();
     return rec;
 }
 
+QVector<SyncJournalFileRecord> SyncJournalDb::getFileRecordsByChecksum(const QByteArray &checksumHeader,
+    qint64 size, int limit)
+{
+    QMutexLocker locker(&_mutex);
+    applyPendingWrites();
+
+    QVector<SyncJournalFileRecord> records;
+    QByteArray checksumType, checksum;
+    if (!parseChecksumHeader(checksumHeader, &checksumType, &checksum) || checksum.isEmpty()
+        || !checkConnect()) {
+        return records;
+    }
+
+    _getFileRecordsByChecksumQuery->reset_and_clear_bindings();
+    _getFileRecordsByChecksumQuery->bindValue(1, checksum);
+    _getFileRecordsByChecksumQuery->bindValue(2, mapChecksumType(checksumType));
+    _getFileRecordsByChecksumQuery->bindValue(3, size);
+    _getFileRecordsByChecksumQuery->bindValue(4, limit);
+    if (!_getFileRecordsByChecksumQuery->exec()) {
+        return records;
+    }
+    while (_getFileRecordsByChecksumQuery->next()) {
+        SyncJournalFileRecord rec;
+        rec._path = _getFileRecordsByChecksumQuery->stringValue(0);
+        rec._inode = _getFileRecordsByChecksumQuery->int64Value(1);
+        rec._modtime = Utility::qDateTimeFromTime_t(_getFileRecordsByChecksumQuery->int64Value(2));
+        rec._type = _getFileRecordsByChecksumQuery->intValue(3);
+        rec._fileSize = _getFileRecordsByChecksumQuery->int64Value(4);
+        rec._checksumHeader = checksumHeader;
+        records.append(rec);
+    }
+    _getFileRecordsByChecksumQuery->reset_and_clear_bindings();
+    return records;
+}
+
+QVector<SyncJournalFileRecord> SyncJournalDb::getFileRecordsInDirectory(const QString &directory)
+{
+    QMutexLocker locker(&_mutex);
+    applyPendingWrites();
+
+    if (!checkConnect()) {
+        return QVector<SyncJournalFileRecord>();
+    }
+    return selectFileRecordsInDirectory(_getFileRecordsInDirectoryQuery.data(), directory);
+}
+
+SyncJournalDb::FileRecordCacheStats SyncJournalDb::fileRecordCacheStats()
+{
+    QMutexLocker locker(&_mutex);
+    return _fileRecordCacheStats;
+}
+
+void SyncJournalDb::invalidateFileRecordCache(const QString &path, bool recursively)
+{
+    _fileRecordCache.remove(path);
+    if (recursively) {
+        const QString prefix = path + QLatin1Char('/');
+        foreach (const QString &key, _fileRecordCache.keys()) {
+            if (key.startsWith(prefix)) {
+                _fileRecordCache.remove(key);
+            }
+        }
+    }
+}
+
 bool SyncJournalDb::postSyncCleanup(const QSet<QString> &filepathsToKeep,
     const QSet<QString> &prefixesToKeep)
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     if (!checkConnect()) {
         return false;
     }
 
-    SqlQuery query(_db);
-    query.prepare("SELECT phash, path FROM metadata order by path");
-
-    if (!query.exec()) {
-        return false;
+    qCInfo(lcDb) << "File record cache hits:" << _fileRecordCacheStats._hits
+                 << "misses:" << _fileRecordCacheStats._misses
+                 << "hit time:" << _fileRecordCacheStats._hitNsecs / 1000 << "us"
+                 << "miss time:" << _fileRecordCacheStats._missNsecs / 1000 << "us";
+    _fileRecordCache.clear();
+
+    // Drop the prefixes that start with another one. For the remaining ones,
+    // a path can only start with the greatest prefix that is not greater than
+    // the path, so the database can look up the candidate with its index.
+    QStringList prefixes = prefixesToKeep.toList();
+    std::sort(prefixes.begin(), prefixes.end());
+    QStringList minimalPrefixes;
+    foreach (const QString &prefix, prefixes) {
+        if (minimalPrefixes.isEmpty() || !prefix.startsWith(minimalPrefixes.last())) {
+            minimalPrefixes.append(prefix);
+        }
     }
 
-    QStringList superfluousItems;
+    // Everything is kept if the empty prefix is
+    if (minimalPrefixes.isEmpty() || !minimalPrefixes.first().isEmpty()) {
+        // Load the kept paths and prefixes into temporary tables, so stale
+        // rows can be deleted in one indexed statement.
+        SqlQuery query(_db);
+        query.prepare("CREATE TEMP TABLE IF NOT EXISTS cleanup_keep_paths(path TEXT PRIMARY KEY);");
+        if (!query.exec()) {
+            return false;
+        }
+        query.prepare("CREATE TEMP TABLE IF NOT EXISTS cleanup_keep_prefixes(prefix TEXT PRIMARY KEY);");
+        if (!query.exec()) {
+            return false;
+        }
 
-    while (query.next()) {
-        const QString file = query.stringValue(1);
-        bool keep = filepathsToKeep.contains(file);
-        if (!keep) {
-            foreach (const QString &prefix, prefixesToKeep) {
-                if (file.startsWith(prefix)) {
-                    keep = true;
-                    break;
-                }
+        SqlQuery insertQuery(_db);
+        insertQuery.prepare("INSERT OR IGNORE INTO cleanup_keep_paths (path) VALUES (?1);");
+        foreach (const QString &path, filepathsToKeep) {
+            insertQuery.reset_and_clear_bindings();
+            insertQuery.bindValue(1, path);
+            if (!insertQuery.exec()) {
+                return false;
             }
         }
-        if (!keep) {
-            superfluousItems.append(query.stringValue(0));
+        insertQuery.prepare("INSERT OR IGNORE INTO cleanup_keep_prefixes (prefix) VALUES (?1);");
+        foreach (const QString &prefix, minimalPrefixes) {
+            insertQuery.reset_and_clear_bindings();
+            insertQuery.bindValue(1, prefix);
+            if (!insertQuery.exec()) {
+                return false;
+            }
         }
-    }
 
-    if (superfluousItems.count()) {
-        QString sql = "DELETE FROM metadata WHERE phash in (" + superfluousItems.join(",") + ")";
-        qCInfo(lcDb) << "Sync Journal cleanup for" << superfluousItems;
         SqlQuery delQuery(_db);
-        delQuery.prepare(sql);
-        if (!delQuery.exec()) {
+        delQuery.prepare("DELETE FROM metadata WHERE "
+                         "NOT EXISTS (SELECT 1 FROM cleanup_keep_paths WHERE cleanup_keep_paths.path = metadata.path) "
+                         "AND NOT IFNULL((SELECT substr(metadata.path, 1, length(prefix)) = prefix FROM cleanup_keep_prefixes "
+                         "WHERE prefix <= metadata.path ORDER BY prefix DESC LIMIT 1), 0);");
+        bool ok = delQuery.exec();
+        if (ok) {
+            qCInfo(lcDb) << "Sync Journal cleanup removed" << delQuery.numRowsAffected() << "entries";
+        }
+
+        query.prepare("DELETE FROM cleanup_keep_paths;");
+        query.exec();
+        query.prepare("DELETE FROM cleanup_keep_prefixes;");
+        query.exec();
+        if (!ok) {
             return false;
         }
     }
 
-    // Incorporate results back into main DB
-    walCheckpoint();
+    // Cached checksums of files that are gone aren't needed anymore
+    SqlQuery cacheQuery(_db);
+    cacheQuery.prepare("DELETE FROM checksumcache WHERE inode NOT IN (SELECT inode FROM metadata WHERE inode IS NOT NULL)");
+    if (!cacheQuery.exec()) {
+        return false;
+    }
 
     return true;
 }
@@ -1064,6 +1540,7 @@ bool SyncJournalDb::postSyncCleanup(const QSet<QString> &filepathsToKeep,
 int SyncJournalDb::getFileRecordCount()
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     if (!checkConnect()) {
         return -1;
@@ -1089,9 +1566,11 @@ bool SyncJournalDb::updateFileRecordChecksum(const QString &filename,
     const QByteArray &contentChecksumType)
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     qCInfo(lcDb) << "Updating file checksum" << filename << contentChecksum << contentChecksumType;
 
+    invalidateFileRecordCache(filename);
     qlonglong phash = getPHash(filename);
     if (!checkConnect()) {
         qCWarning(lcDb) << "Failed to connect database.";
@@ -1119,9 +1598,11 @@ bool SyncJournalDb::updateLocalMetadata(const QString &filename,
 
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     qCInfo(lcDb) << "Updating local metadata for:" << filename << modtime << size << inode;
 
+    invalidateFileRecordCache(filename);
     qlonglong phash = getPHash(filename);
     if (!checkConnect()) {
         qCWarning(lcDb) << "Failed to connect database.";
@@ -1165,12 +1646,44 @@ bool SyncJournalDb::setFileRecordMetadata(const SyncJournalFileRecord &record)
     return setFileRecord(existing);
 }
 
+/// Encodes UploadInfo::_doneChunks and DownloadInfo::_segments as "key:value" pairs separated by ';'
+template <typename Key>
+static QByteArray offsetMapToString(const QMap<Key, quint64> &map)
+{
+    QByteArray result;
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+        if (!result.isEmpty())
+            result += ';';
+        result += QByteArray::number(it.key()) + ':' + QByteArray::number(it.value());
+    }
+    return result;
+}
+
+template <typename Key>
+static QMap<Key, quint64> offsetMapFromString(const QByteArray &str)
+{
+    QMap<Key, quint64> result;
+    foreach (const QByteArray &pair, str.split(';')) {
+        int colon = pair.indexOf(':');
+        if (colon <= 0)
+            continue;
+        bool keyOk = false;
+        bool valueOk = false;
+        Key key = Key(pair.left(colon).toULongLong(&keyOk));
+        quint64 value = pair.mid(colon + 1).toULongLong(&valueOk);
+        if (keyOk && valueOk)
+            result[key] = value;
+    }
+    return result;
+}
+
 static void toDownloadInfo(SqlQuery &query, SyncJournalDb::DownloadInfo *res)
 {
     bool ok = true;
     res->_tmpfile = query.stringValue(0);
     res->_etag = query.baValue(1);
     res->_errorCount = query.intValue(2);
+    res->_segments = offsetMapFromString<quint64>(query.baValue(3));
     res->_valid = ok;
 }
 
@@ -1231,6 +1744,7 @@ void SyncJournalDb::setDownloadInfo(const QString &file, const SyncJournalDb::Do
         _setDownloadInfoQuery->bindValue(2, i._tmpfile);
         _setDownloadInfoQuery->bindValue(3, i._etag);
         _setDownloadInfoQuery->bindValue(4, i._errorCount);
+        _setDownloadInfoQuery->bindValue(5, offsetMapToString(i._segments));
 
         if (!_setDownloadInfoQuery->exec()) {
             return;
@@ -1261,7 +1775,7 @@ QVector<SyncJournalDb::DownloadInfo> SyncJournalDb::getAndDeleteStaleDownloadInf
 
     SqlQuery query(_db);
     // The selected values *must* match the ones expected by toDownloadInfo().
-    query.prepare("SELECT tmpfile, etag, errorcount, path FROM downloadinfo");
+    query.prepare("SELECT tmpfile, etag, errorcount, segments, path FROM downloadinfo");
 
     if (!query.exec()) {
         return empty_result;
@@ -1271,7 +1785,7 @@ QVector<SyncJournalDb::DownloadInfo> SyncJournalDb::getAndDeleteStaleDownloadInf
     QVector<SyncJournalDb::DownloadInfo> deleted_entries;
 
     while (query.next()) {
-        const QString file = query.stringValue(3); // path
+        const QString file = query.stringValue(4); // path
         if (!keep.contains(file)) {
             superfluousPaths.append(file);
             DownloadInfo info;
@@ -1325,6 +1839,7 @@ SyncJournalDb::UploadInfo SyncJournalDb::getUploadInfo(const QString &file)
             res._errorCount = _getUploadInfoQuery->intValue(2);
             res._size = _getUploadInfoQuery->int64Value(3);
             res._modtime = Utility::qDateTimeFromTime_t(_getUploadInfoQuery->int64Value(4));
+            res._doneChunks = offsetMapFromString<int>(_getUploadInfoQuery->baValue(5));
             res._valid = ok;
         }
         _getUploadInfoQuery->reset_and_clear_bindings();
@@ -1348,6 +1863,7 @@ void SyncJournalDb::setUploadInfo(const QString &file, const SyncJournalDb::Uplo
         _setUploadInfoQuery->bindValue(4, i._errorCount);
         _setUploadInfoQuery->bindValue(5, i._size);
         _setUploadInfoQuery->bindValue(6, Utility::qDateTimeToTime_t(i._modtime));
+        _setUploadInfoQuery->bindValue(7, offsetMapToString(i._doneChunks));
 
         if (!_setUploadInfoQuery->exec()) {
             return;
@@ -1656,13 +2172,16 @@ void SyncJournalDb::setSelectiveSyncList(SyncJournalDb::SelectiveSyncListType ty
 void SyncJournalDb::avoidRenamesOnNextSync(const QString &path)
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     if (!checkConnect()) {
         return;
     }
 
+    invalidateFileRecordCache(path, true);
+
     SqlQuery query(_db);
-    query.prepare("UPDATE metadata SET fileid = '', inode = '0' WHERE path == ?1 OR path LIKE(?2||'/%')");
+    query.prepare("UPDATE metadata SET fileid = '', inode = 0 WHERE path == ?1 OR path LIKE(?2||'/%')");
     query.bindValue(1, path);
     query.bindValue(2, path);
     query.exec();
@@ -1680,12 +2199,16 @@ void SyncJournalDb::avoidReadFromDbOnNextSync(const QString &fileName)
     // We achieve that by clearing the etag of the parents directory recursively
 
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     if (!checkConnect()) {
         return;
     }
 
     SqlQuery query(_db);
+    // Changes the parent directories of fileName
+    _fileRecordCache.clear();
+
     // This query will match entries for which the path is a prefix of fileName
     // Note: CSYNC_FTW_TYPE_DIR == 2
     query.prepare("UPDATE metadata SET md5='_invalid_' WHERE ?1 LIKE(path||'/%') AND type == 2;");
@@ -1699,6 +2222,7 @@ void SyncJournalDb::avoidReadFromDbOnNextSync(const QString &fileName)
 void SyncJournalDb::forceRemoteDiscoveryNextSync()
 {
     QMutexLocker locker(&_mutex);
+    applyPendingWrites();
 
     if (!checkConnect()) {
         return;
@@ -1710,6 +2234,7 @@ void SyncJournalDb::forceRemoteDiscoveryNextSync()
 void SyncJournalDb::forceRemoteDiscoveryNextSyncLocked()
 {
     qCInfo(lcDb) << "Forcing remote re-discovery by deleting folder Etags";
+    _fileRecordCache.clear();
     SqlQuery deleteRemoteFolderEtagsQuery(_db);
     deleteRemoteFolderEtagsQuery.prepare("UPDATE metadata SET md5='_invalid_' WHERE type=2;");
     deleteRemoteFolderEtagsQuery.exec();
@@ -1798,8 +2323,72 @@ void SyncJournalDb::setDataFingerprint(const QByteArray &dataFingerprint)
     _setDataFingerprintQuery2->exec();
 }
 
+SyncJournalDb::ChecksumCacheKey SyncJournalDb::ChecksumCacheKey::forFile(const QString &filePath)
+{
+    ChecksumCacheKey key;
+    csync_vio_file_stat_t *stat = csync_vio_file_stat_new();
+    // The inode field isn't flagged on Windows, a zero inode makes the key invalid
+    if (csync_vio_local_stat(filePath.toUtf8().data(), stat) != -1
+        && (stat->fields & CSYNC_VIO_FILE_STAT_FIELDS_SIZE)
+        && (stat->fields & CSYNC_VIO_FILE_STAT_FIELDS_MTIME)) {
+        key._inode = stat->inode;
+        key._size = stat->size;
+        key._modtime = stat->mtime;
+#ifndef Q_OS_WIN
+        // On Windows this is the creation time, which doesn't change with the content
+        if (stat->fields & CSYNC_VIO_FILE_STAT_FIELDS_CTIME) {
+            key._ctime = stat->ctime;
+        }
+#endif
+    }
+    csync_vio_file_stat_destroy(stat);
+    return key;
+}
+
+QByteArray SyncJournalDb::getCachedChecksum(const ChecksumCacheKey &key, const QByteArray &checksumType)
+{
+    QMutexLocker locker(&_mutex);
+    if (!key.isValid() || checksumType.isEmpty() || !checkConnect()) {
+        return QByteArray();
+    }
+
+    _getCachedChecksumQuery->reset_and_clear_bindings();
+    _getCachedChecksumQuery->bindValue(1, key._inode);
+    _getCachedChecksumQuery->bindValue(2, mapChecksumType(checksumType));
+    _getCachedChecksumQuery->bindValue(3, key._size);
+    _getCachedChecksumQuery->bindValue(4, key._modtime);
+    _getCachedChecksumQuery->bindValue(5, key._ctime);
+    if (!_getCachedChecksumQuery->exec() || !_getCachedChecksumQuery->next()) {
+        return QByteArray();
+    }
+    return _getCachedChecksumQuery->baValue(0);
+}
+
+void SyncJournalDb::setCachedChecksum(const ChecksumCacheKey &key, const QByteArray &checksumType, const QByteArray &checksum)
+{
+    QMutexLocker locker(&_mutex);
+    if (!key.isValid() || checksumType.isEmpty() || checksum.isEmpty() || !checkConnect()) {
+        return;
+    }
+
+    _setCachedChecksumQuery->reset_and_clear_bindings();
+    _setCachedChecksumQuery->bindValue(1, key._inode);
+    _setCachedChecksumQuery->bindValue(2, mapChecksumType(checksumType));
+    _setCachedChecksumQuery->bindValue(3, key._size);
+    _setCachedChecksumQuery->bindValue(4, key._modtime);
+    _setCachedChecksumQuery->bindValue(5, key._ctime);
+    _setCachedChecksumQuery->bindValue(6, checksum);
+    if (!_setCachedChecksumQuery->exec()) {
+        qCWarning(lcDb) << "Error SQL statement setCachedChecksum" << _setCachedChecksumQuery->error();
+    }
+}
+
 void SyncJournalDb::clearFileTable()
 {
+    QMutexLocker lock(&_mutex);
+    applyPendingWrites();
+    _fileRecordCache.clear();
+
     SqlQuery query(_db);
     query.prepare("DELETE FROM metadata;");
     query.exec();
@@ -1808,12 +2397,14 @@ void SyncJournalDb::clearFileTable()
 void SyncJournalDb::commit(const QString &context, bool startTrans)
 {
     QMutexLocker lock(&_mutex);
+    applyPendingWrites();
     commitInternal(context, startTrans);
 }
 
 void SyncJournalDb::commitIfNeededAndStartNewTransaction(const QString &context)
 {
     QMutexLocker lock(&_mutex);
+    applyPendingWrites();
     if (_transaction == 1) {
         commitInternal(context, true);
     } else {
@@ -1849,7 +2440,8 @@ bool operator==(const SyncJournalDb::DownloadInfo &lhs,
     return lhs._errorCount == rhs._errorCount
         && lhs._etag == rhs._etag
         && lhs._tmpfile == rhs._tmpfile
-        && lhs._valid == rhs._valid;
+        && lhs._valid == rhs._valid
+        && lhs._segments == rhs._segments;
 }
 
 bool operator==(const SyncJournalDb::UploadInfo &lhs,
@@ -1860,7 +2452,84 @@ bool operator==(const SyncJournalDb::UploadInfo &lhs,
         && lhs._modtime == rhs._modtime
         && lhs._valid == rhs._valid
         && lhs._size == rhs._size
-        && lhs._transferid == rhs._transferid;
+        && lhs._transferid == rhs._transferid
+        && lhs._doneChunks == rhs._doneChunks;
+}
+
+SyncJournalReader::SyncJournalReader(const QString &dbFilePath)
+    : _dbFilePath(dbFilePath)
+{
+}
+
+SyncJournalReader::~SyncJournalReader()
+{
+    close();
+}
+
+bool SyncJournalReader::checkConnect()
+{
+    if (_db.isOpen()) {
+        return true;
+    }
+    // The journal creates the database
+    if (!QFile::exists(_dbFilePath) || !_db.openReadOnly(_dbFilePath)) {
+        return false;
+    }
+    // Rather a stale status than waiting for a writer
+    sqlite3_busy_timeout(_db.sqliteDb(), 100);
+
+    _getFileRecordQuery.reset(new SqlQuery(_db));
+    _getFileRecordsInDirectoryQuery.reset(new SqlQuery(_db));
+    if (_getFileRecordQuery->prepare(
+            "SELECT path, inode, modtime, type, md5, fileid, remotePerm, filesize FROM metadata"
+            " WHERE phash=?1")
+        || _getFileRecordsInDirectoryQuery->prepare(getFileRecordsInDirectorySql)) {
+        qCWarning(lcDb) << "Could not read the journal" << _dbFilePath;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SyncJournalReader::close()
+{
+    _getFileRecordQuery.reset(0);
+    _getFileRecordsInDirectoryQuery.reset(0);
+    _db.close();
+}
+
+SyncJournalFileRecord SyncJournalReader::getFileRecord(const QString &filename)
+{
+    SyncJournalFileRecord rec;
+    if (filename.isEmpty() || !checkConnect()) {
+        return rec;
+    }
+    _getFileRecordQuery->reset_and_clear_bindings();
+    _getFileRecordQuery->bindValue(1, QString::number(SyncJournalDb::getPHash(filename)));
+    if (!_getFileRecordQuery->exec()) {
+        close();
+        return rec;
+    }
+    if (_getFileRecordQuery->next()) {
+        rec._path = _getFileRecordQuery->stringValue(0);
+        rec._inode = _getFileRecordQuery->int64Value(1);
+        rec._modtime = Utility::qDateTimeFromTime_t(_getFileRecordQuery->int64Value(2));
+        rec._type = _getFileRecordQuery->intValue(3);
+        rec._etag = _getFileRecordQuery->baValue(4);
+        rec._fileId = _getFileRecordQuery->baValue(5);
+        rec._remotePerm = _getFileRecordQuery->baValue(6);
+        rec._fileSize = _getFileRecordQuery->int64Value(7);
+    }
+    _getFileRecordQuery->reset_and_clear_bindings();
+    return rec;
+}
+
+QVector<SyncJournalFileRecord> SyncJournalReader::getFileRecordsInDirectory(const QString &directory)
+{
+    if (!checkConnect()) {
+        return QVector<SyncJournalFileRecord>();
+    }
+    return selectFileRecordsInDirectory(_getFileRecordsInDirectoryQuery.data(), directory);
 }
 
 } // namespace OCC
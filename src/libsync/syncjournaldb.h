@@ -17,13 +17,19 @@
 
 #include <QObject>
 #include <qmutex.h>
+#include <QCache>
 #include <QDateTime>
 #include <QHash>
+#include <QMap>
+#include <QVector>
+#include <QWaitCondition>
 
 #include "utility.h"
 #include "ownsql.h"
 #include "syncjournalfilerecord.h"
 
+class QThread;
+
 namespace OCC {
 class SyncJournalFileRecord;
 
@@ -31,6 +37,10 @@ class SyncJournalFileRecord;
  * @brief Class that handles the sync database
  *
  * This class is thread safe. All public functions lock the mutex.
+ *
+ * File record writes can be queued with queueFileRecord() and
+ * queueDeleteFileRecord(). A writer thread applies them in batched
+ * transactions, so the thread that queues them doesn't wait for the database.
  * @ingroup libsync
  */
 class OWNCLOUDSYNC_EXPORT SyncJournalDb : public QObject
@@ -51,6 +61,8 @@ public:
 
     // to verify that the record could be queried successfully check
     // with SyncJournalFileRecord::isValid()
+    //
+    // Recently read records, and the absence of a record, are cached.
     SyncJournalFileRecord getFileRecord(const QString &filename);
     bool setFileRecord(const SyncJournalFileRecord &record);
 
@@ -58,6 +70,44 @@ public:
     bool setFileRecordMetadata(const SyncJournalFileRecord &record);
 
     bool deleteFileRecord(const QString &filename, bool recursively = false);
+
+    /**
+     * Records of files with the content checksum \a checksumHeader and
+     * \a size, at most \a limit of them.
+     *
+     * The checksums are the ones recorded in the last sync of each file,
+     * the files may have changed since.
+     */
+    QVector<SyncJournalFileRecord> getFileRecordsByChecksum(const QByteArray &checksumHeader,
+        qint64 size, int limit);
+
+    /**
+     * Records of the direct children of \a directory, "" being the root.
+     *
+     * Reads them along the path index instead of a getFileRecord() per
+     * child, skipping the subtrees of the child directories.
+     */
+    QVector<SyncJournalFileRecord> getFileRecordsInDirectory(const QString &directory);
+
+    /**
+     * Queues setFileRecord(\a record) for the writer thread.
+     *
+     * Queued writes are applied in order. All other functions see them as
+     * if they had been applied already; they are durable once
+     * flushPendingWrites() returned.
+     */
+    void queueFileRecord(const SyncJournalFileRecord &record);
+
+    /// Queues deleteFileRecord(\a filename, \a recursively), like queueFileRecord()
+    void queueDeleteFileRecord(const QString &filename, bool recursively = false);
+
+    /**
+     * Applies the queued writes and commits them.
+     *
+     * Returns false if a queued write failed since the last call.
+     */
+    bool flushPendingWrites();
+
     int getFileRecordCount();
     bool updateFileRecordChecksum(const QString &filename,
         const QByteArray &contentChecksum,
@@ -65,7 +115,37 @@ public:
     bool updateLocalMetadata(const QString &filename,
         qint64 modtime, quint64 size, quint64 inode);
     bool exists();
-    void walCheckpoint();
+
+    /**
+     * Makes the next open run the consistency check again.
+     *
+     * The database is only checked when it is first opened; after that
+     * JournalMaintenance checks it in the background and calls this when
+     * it finds a problem. The journal is closed so the next access
+     * reopens, checks and, if needed, recreates it.
+     */
+    void setIntegrityCheckNeeded();
+
+    /**
+     * Counters of the getFileRecord() cache, for tuning its size.
+     *
+     * The size can be set with OWNCLOUD_FILE_RECORD_CACHE_SIZE.
+     */
+    struct FileRecordCacheStats
+    {
+        FileRecordCacheStats()
+            : _hits(0)
+            , _misses(0)
+            , _hitNsecs(0)
+            , _missNsecs(0)
+        {
+        }
+        quint64 _hits;
+        quint64 _misses;
+        qint64 _hitNsecs; // total time spent in getFileRecord() for hits
+        qint64 _missNsecs; // and for misses
+    };
+    FileRecordCacheStats fileRecordCacheStats();
 
     QString databaseFilePath() const;
 
@@ -88,6 +168,14 @@ public:
         QByteArray _etag;
         int _errorCount;
         bool _valid;
+
+        /** Segments of a segmented download, mapping the offset where each
+         *  segment starts to the number of its bytes already in the temporary file.
+         *
+         * A segment ends where the next one starts. Empty for a download with
+         * a single GET, which resumes at the end of the temporary file.
+         */
+        QMap<quint64, quint64> _segments;
     };
     struct UploadInfo
     {
@@ -105,6 +193,13 @@ public:
         QDateTime _modtime;
         int _errorCount;
         bool _valid;
+
+        /** Chunks of a parallel chunking-NG upload that the server acknowledged
+         *  out of order, mapping the chunk number to its offset in the file.
+         *
+         * Chunks below the first unacknowledged one are not listed.
+         */
+        QMap<int, quint64> _doneChunks;
     };
 
     struct PollInfo
@@ -191,6 +286,47 @@ public:
      */
     QByteArray getChecksumType(int checksumTypeId);
 
+    /**
+     * Identifies the content of a local file for the checksum cache.
+     *
+     * A cached checksum is valid as long as the file has the same inode, size
+     * and mtime, like in the discovery's change detection, and the same ctime
+     * where the platform has a change time.
+     */
+    struct ChecksumCacheKey
+    {
+        ChecksumCacheKey()
+            : _inode(0)
+            , _size(0)
+            , _modtime(0)
+            , _ctime(0)
+        {
+        }
+        quint64 _inode;
+        qint64 _size;
+        qint64 _modtime;
+        qint64 _ctime;
+
+        bool isValid() const { return _inode != 0; }
+
+        /** The key for the current state of a local file, invalid if it can't be stat'ed */
+        static ChecksumCacheKey forFile(const QString &filePath);
+    };
+
+    /**
+     * Returns a checksum of \a checksumType computed earlier for the file
+     * version \a key, or an empty array if there is none.
+     */
+    QByteArray getCachedChecksum(const ChecksumCacheKey &key, const QByteArray &checksumType);
+
+    /**
+     * Remembers the checksum of a file version.
+     *
+     * The key must be taken before the file is read, so a change while
+     * computing the checksum makes the entry unreachable.
+     */
+    void setCachedChecksum(const ChecksumCacheKey &key, const QByteArray &checksumType, const QByteArray &checksum);
+
     /**
      * The data-fingerprint used to detect backup
      */
@@ -208,6 +344,8 @@ private:
     bool updateDatabaseStructure();
     bool updateMetadataTableStructure();
     bool updateErrorBlacklistTableStructure();
+    bool updateUploadInfoTableStructure();
+    bool updateDownloadInfoTableStructure();
     bool sqlFail(const QString &log, const SqlQuery &query);
     void commitInternal(const QString &context, bool startTrans = true);
     void startTransaction();
@@ -218,6 +356,32 @@ private:
     // Same as forceRemoteDiscoveryNextSync but without acquiring the lock
     void forceRemoteDiscoveryNextSyncLocked();
 
+    // Drops cached records of \a path, and of its children if \a recursively
+    void invalidateFileRecordCache(const QString &path, bool recursively = false);
+
+    // setFileRecord and deleteFileRecord, without acquiring the lock
+    bool setFileRecordLocked(const SyncJournalFileRecord &record);
+    bool deleteFileRecordLocked(const QString &filename, bool recursively);
+
+    struct PendingWrite
+    {
+        PendingWrite()
+            : _delete(false)
+            , _recursively(false)
+        {
+        }
+        SyncJournalFileRecord _record; // or the path in _record._path to delete
+        bool _delete;
+        bool _recursively;
+    };
+    void queueWrite(const PendingWrite &write);
+    // Applies the queued writes, the caller must hold _mutex.
+    // Returns whether there were any.
+    bool applyPendingWrites();
+    friend class JournalWriterThread;
+    void runWriter();
+    void stopWriter();
+
     // Returns the integer id of the checksum type
     //
     // Returns 0 on failure and for empty checksum types.
@@ -227,9 +391,12 @@ private:
     QString _dbFile;
     QMutex _mutex; // Public functions are protected with the mutex.
     int _transaction;
+    bool _integrityChecked; // Whether the consistency check ran since the process started
 
     // NOTE! when adding a query, don't forget to reset it in SyncJournalDb::close
     QScopedPointer<SqlQuery> _getFileRecordQuery;
+    QScopedPointer<SqlQuery> _getFileRecordsByChecksumQuery;
+    QScopedPointer<SqlQuery> _getFileRecordsInDirectoryQuery;
     QScopedPointer<SqlQuery> _setFileRecordQuery;
     QScopedPointer<SqlQuery> _setFileRecordChecksumQuery;
     QScopedPointer<SqlQuery> _setFileRecordLocalMetadataQuery;
@@ -250,12 +417,58 @@ private:
     QScopedPointer<SqlQuery> _getDataFingerprintQuery;
     QScopedPointer<SqlQuery> _setDataFingerprintQuery1;
     QScopedPointer<SqlQuery> _setDataFingerprintQuery2;
+    QScopedPointer<SqlQuery> _getCachedChecksumQuery;
+    QScopedPointer<SqlQuery> _setCachedChecksumQuery;
 
     /* This is the list of paths we called avoidReadFromDbOnNextSync on.
      * It means that they should not be written to the DB in any case since doing
      * that would write the etag and would void the purpose of avoidReadFromDbOnNextSync
      */
     QList<QString> _avoidReadFromDbOnNextSyncFilter;
+
+    // Records read by getFileRecord(), by path. Invalid records mean there is
+    // no record for that path. Must be updated by every write to metadata.
+    QCache<QString, SyncJournalFileRecord> _fileRecordCache;
+    FileRecordCacheStats _fileRecordCacheStats;
+
+    // Set when a queued write failed, protected by _mutex
+    bool _pendingWriteFailed;
+
+    QMutex _pendingWritesMutex; // Protects the members below
+    QWaitCondition _pendingWritesChanged;
+    QVector<PendingWrite> _pendingWrites;
+    QThread *_writerThread;
+};
+
+/**
+ * @brief Reads the file records of a journal over a connection of its own
+ *
+ * For other threads: it doesn't wait for the mutex of the SyncJournalDb,
+ * and with the WAL not for its writes either. The writes the journal has
+ * queued but not applied yet are not seen. Use an instance on one thread
+ * at a time.
+ * @ingroup libsync
+ */
+class OWNCLOUDSYNC_EXPORT SyncJournalReader
+{
+public:
+    explicit SyncJournalReader(const QString &dbFilePath);
+    ~SyncJournalReader();
+
+    /// Like SyncJournalDb::getFileRecord(), without the checksum
+    SyncJournalFileRecord getFileRecord(const QString &filename);
+    /// Like SyncJournalDb::getFileRecordsInDirectory()
+    QVector<SyncJournalFileRecord> getFileRecordsInDirectory(const QString &directory);
+
+private:
+    Q_DISABLE_COPY(SyncJournalReader)
+    bool checkConnect();
+    void close();
+
+    QString _dbFilePath;
+    SqlDatabase _db;
+    QScopedPointer<SqlQuery> _getFileRecordQuery;
+    QScopedPointer<SqlQuery> _getFileRecordsInDirectoryQuery;
 };
 
 bool OWNCLOUDSYNC_EXPORT
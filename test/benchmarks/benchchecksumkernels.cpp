@@ -0,0 +1,69 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtCore>
+#include <config.h>
+#include <checksums.h>
+#include <checksumkernels.h>
+#include <propagatorjobs.h>
+
+#ifdef ZLIB_FOUND
+#include <zlib.h>
+#endif
+
+using namespace OCC;
+
+static const int rounds = 5;
+
+/* GB/s of hashing data with a ChecksumCalculator, the CPU kernels are used where supported */
+static double calculatorThroughput(const QByteArray &type, const QByteArray &data)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < rounds; ++i) {
+        ChecksumCalculator calculator(type);
+        calculator.addData(data.constData(), data.size());
+        calculator.result();
+    }
+    return double(rounds) * data.size() / timer.nsecsElapsed();
+}
+
+/* GB/s of hashing data with QCryptographicHash, like FileSystem::calcSha1() and calcMd5() */
+static double cryptoHashThroughput(QCryptographicHash::Algorithm algorithm, const QByteArray &data)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < rounds; ++i)
+        QCryptographicHash::hash(data, algorithm);
+    return double(rounds) * data.size() / timer.nsecsElapsed();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QByteArray data(256 * 1024 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < data.size(); i += 4)
+        *reinterpret_cast<quint32 *>(data.data() + i) = quint32(qrand());
+
+    qDebug() << "SHA1 kernel supported" << ChecksumKernels::sha1Supported();
+    qDebug() << "Adler32 kernel supported" << ChecksumKernels::adler32Supported();
+
+    qDebug() << "GB/s SHA1 QCryptographicHash" << cryptoHashThroughput(QCryptographicHash::Sha1, data);
+    qDebug() << "GB/s SHA1 ChecksumCalculator" << calculatorThroughput(checkSumSHA1C, data);
+    qDebug() << "GB/s MD5 QCryptographicHash" << cryptoHashThroughput(QCryptographicHash::Md5, data);
+    qDebug() << "GB/s MD5 ChecksumCalculator" << calculatorThroughput(checkSumMD5C, data);
+#ifdef ZLIB_FOUND
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < rounds; ++i)
+        adler32(1, reinterpret_cast<const Bytef *>(data.constData()), data.size());
+    qDebug() << "GB/s Adler32 zlib" << double(rounds) * data.size() / timer.nsecsElapsed();
+    qDebug() << "GB/s Adler32 ChecksumCalculator" << calculatorThroughput(checkSumAdlerC, data);
+#endif
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include "syncenginetestutils.h"
+#include <syncengine.h>
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QSemaphore>
+#include <QThread>
+#include <memory>
+
+using namespace OCC;
+
+static const qint64 fileSize = 1000 * 1000 * 1000; // 1 GB
+
+/* Answers every GET with fileSize bytes, as fast as the loopback link takes them */
+class StandInServer : public QTcpServer
+{
+protected:
+    void incomingConnection(qintptr handle) override
+    {
+        auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(handle);
+        auto remaining = std::make_shared<qint64>(0);
+        auto request = std::make_shared<QByteArray>();
+
+        auto pump = [socket, remaining]() {
+            static const QByteArray block(1024 * 1024, 'W');
+            while (*remaining > 0 && socket->bytesToWrite() < 4 * block.size()) {
+                qint64 len = qMin(*remaining, qint64(block.size()));
+                socket->write(block.constData(), len);
+                *remaining -= len;
+            }
+        };
+        connect(socket, &QTcpSocket::bytesWritten, socket, pump);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket, remaining, request, pump]() {
+            request->append(socket->readAll());
+            int headerEnd = request->indexOf("\r\n\r\n");
+            if (headerEnd < 0)
+                return;
+            request->remove(0, headerEnd + 4);
+            *remaining = fileSize;
+            socket->write("HTTP/1.1 200 OK\r\n"
+                          "Content-Length: " + QByteArray::number(fileSize) + "\r\n"
+                          "ETag: \"bench\"\r\n"
+                          "OC-ETag: \"bench\"\r\n"
+                          "OC-FileId: 1\r\n"
+                          "\r\n");
+            pump();
+        });
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    }
+};
+
+class StandInServerThread : public QThread
+{
+public:
+    quint16 port = 0;
+    QSemaphore ready;
+
+protected:
+    void run() override
+    {
+        StandInServer server;
+        server.listen(QHostAddress::LocalHost);
+        port = server.serverPort();
+        ready.release();
+        exec();
+    }
+};
+
+/* Downloads one big file from the stand-in server, returns the throughput of the GET in Mbit/s */
+static qint64 downloadThroughput(quint16 port, qint64 bufferSize, qint64 writeAlignment)
+{
+    FakeFolder fakeFolder{FileInfo{}};
+    SyncOptions options;
+    options._segmentedDownloadSize = 0;
+    options._downloadBufferSize = bufferSize;
+    options._downloadWriteAlignment = writeAlignment;
+    fakeFolder.syncEngine().setSyncOptions(options);
+    fakeFolder.remoteModifier().insert("big", fileSize);
+
+    QNetworkAccessManager loopbackQnam;
+    QElapsedTimer timer;
+    qint64 elapsed = -1;
+    fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+        if (op != QNetworkAccessManager::GetOperation)
+            return nullptr;
+        QUrl url = request.url();
+        url.setUserInfo(QString());
+        url.setHost(QStringLiteral("127.0.0.1"));
+        url.setPort(port);
+        QNetworkRequest loopbackRequest(request);
+        loopbackRequest.setUrl(url);
+        auto reply = loopbackQnam.get(loopbackRequest);
+        QObject::connect(reply, &QNetworkReply::finished, [&]() { elapsed = timer.elapsed(); });
+        timer.start();
+        return reply;
+    });
+
+    if (!fakeFolder.syncOnce() || elapsed <= 0)
+        return -1;
+    return fileSize * 8 / 1000 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    StandInServerThread serverThread;
+    serverThread.start();
+    serverThread.ready.acquire();
+
+    // 8 KB was the buffer size before it could be configured
+    qint64 smallBuffer = downloadThroughput(serverThread.port, 8 * 1024, 0);
+    qint64 defaultBuffer = downloadThroughput(serverThread.port, SyncOptions()._downloadBufferSize, 0);
+    qint64 alignedWrites = downloadThroughput(serverThread.port, SyncOptions()._downloadBufferSize, 64 * 1024);
+
+    qDebug() << "THROUGHPUT 8 KiB buffer (Mbit/s)" << smallBuffer;
+    qDebug() << "THROUGHPUT default buffer (Mbit/s)" << defaultBuffer;
+    qDebug() << "THROUGHPUT default buffer, aligned writes (Mbit/s)" << alignedWrites;
+
+    serverThread.quit();
+    serverThread.wait();
+    return smallBuffer > 0 && defaultBuffer > 0 && alignedWrites > 0 ? 0 : -1;
+}
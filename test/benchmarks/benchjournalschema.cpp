@@ -0,0 +1,149 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtCore>
+#include <sqlite3.h>
+
+#include "syncjournaldb.h"
+
+using namespace OCC;
+
+static const int dirCount = 1000;
+static const int filesPerDir = 1000;
+
+static bool exec(sqlite3 *db, const char *sql)
+{
+    char *error = 0;
+    if (sqlite3_exec(db, sql, 0, 0, &error) != SQLITE_OK) {
+        qWarning() << "SQL error" << error << "in" << sql;
+        sqlite3_free(error);
+        return false;
+    }
+    return true;
+}
+
+/* Creates a journal with the metadata table of older clients and dirCount * filesPerDir entries */
+static bool createLegacyJournal(const QString &path)
+{
+    sqlite3 *db = 0;
+    if (sqlite3_open(path.toUtf8().constData(), &db) != SQLITE_OK)
+        return false;
+    bool ok = exec(db, "CREATE TABLE metadata(phash INTEGER(8), pathlen INTEGER, path VARCHAR(4096), inode INTEGER,"
+                       " uid INTEGER, gid INTEGER, mode INTEGER, modtime INTEGER(8), type INTEGER, md5 VARCHAR(32),"
+                       " fileid VARCHAR(128), remotePerm VARCHAR(128), filesize BIGINT, ignoredChildrenRemote INT,"
+                       " contentChecksum TEXT, contentChecksumTypeId INTEGER, PRIMARY KEY(phash));")
+        && exec(db, "CREATE INDEX metadata_file_id ON metadata(fileid);")
+        && exec(db, "CREATE INDEX metadata_inode ON metadata(inode);")
+        && exec(db, "CREATE INDEX metadata_path ON metadata(path);")
+        && exec(db, "CREATE TABLE checksumtype(id INTEGER PRIMARY KEY, name TEXT UNIQUE);")
+        && exec(db, "INSERT INTO checksumtype (name) VALUES ('SHA1');")
+        && exec(db, "BEGIN;");
+
+    sqlite3_stmt *stmt = 0;
+    ok = ok && sqlite3_prepare_v2(db, "INSERT INTO metadata VALUES (?1, ?2, ?3, ?4, 0, 0, 0, ?5, ?6, ?7, ?8, 'WDNVR', ?9, 0, ?10, 1);", -1, &stmt, 0) == SQLITE_OK;
+    const QByteArray checksum(40, 'a');
+    int inode = 1;
+    for (int dirNum = 0; ok && dirNum < dirCount; ++dirNum) {
+        const QString dir = QStringLiteral("top/dir") + QString::number(dirNum);
+        for (int fileNum = -1; ok && fileNum < filesPerDir; ++fileNum) {
+            // Like the client did: phash, modtime and type bound as strings
+            const QByteArray path = (fileNum < 0 ? dir : dir + "/file" + QString::number(fileNum)).toUtf8();
+            const QByteArray phash = QByteArray::number(SyncJournalDb::getPHash(QString::fromUtf8(path)));
+            const QByteArray fileId = "id" + QByteArray::number(inode);
+            sqlite3_bind_text(stmt, 1, phash.constData(), phash.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 2, path.size());
+            sqlite3_bind_text(stmt, 3, path.constData(), path.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 4, inode++);
+            sqlite3_bind_text(stmt, 5, "1500000000", -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 6, fileNum < 0 ? "2" : "0", -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 7, "5a1e7f3b2c", -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 8, fileId.constData(), fileId.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 9, 1000 + fileNum);
+            sqlite3_bind_text(stmt, 10, checksum.constData(), checksum.size(), SQLITE_STATIC);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+    ok = ok && exec(db, "COMMIT;");
+    sqlite3_close(db);
+    return ok;
+}
+
+/* Compacts the file and returns its size */
+static qint64 vacuumedSize(const QString &path)
+{
+    sqlite3 *db = 0;
+    if (sqlite3_open(path.toUtf8().constData(), &db) != SQLITE_OK)
+        return -1;
+    bool ok = exec(db, "PRAGMA journal_mode=DELETE;") && exec(db, "VACUUM;");
+    sqlite3_close(db);
+    return ok ? QFileInfo(path).size() : -1;
+}
+
+/* Runs the discovery's query for everything below "top", returns the time in ms */
+static qint64 discoveryReadTime(const QString &path, bool legacy)
+{
+    sqlite3 *db = 0;
+    if (sqlite3_open_v2(path.toUtf8().constData(), &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK)
+        return -1;
+    // Same as csync_statedb_get_below_path
+    const char *query = legacy
+        ? "SELECT phash, pathlen, path, inode, uid, gid, mode, modtime, type, md5, fileid, remotePerm, filesize,"
+          " ignoredChildrenRemote, contentchecksumtype.name || ':' || contentChecksum FROM metadata"
+          " LEFT JOIN checksumtype as contentchecksumtype ON metadata.contentChecksumTypeId == contentchecksumtype.id"
+          " WHERE path > (?||'/') AND path < (?||'0') ORDER BY path||'/' ASC"
+        : "SELECT phash, pathlen, path, inode, modtime, type, md5, fileid, remotePerm, filesize,"
+          " ignoredChildrenRemote, contentchecksumtype.name || ':' || contentChecksum FROM metadata"
+          " LEFT JOIN checksumtype as contentchecksumtype ON metadata.contentChecksumTypeId == contentchecksumtype.id"
+          " WHERE path > (?||'/') AND path < (?||'0') ORDER BY path||'/' ASC";
+    sqlite3_stmt *stmt = 0;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, 0) != SQLITE_OK) {
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, "top", -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, "top", -1, SQLITE_STATIC);
+
+    QElapsedTimer timer;
+    timer.start();
+    int rows = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        ++rows;
+    qint64 elapsed = timer.elapsed();
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return rows == dirCount * (filesPerDir + 1) ? elapsed : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTemporaryDir dir;
+    const QString legacyPath = dir.path() + "/legacy.db";
+    const QString compactPath = dir.path() + "/compact.db";
+
+    if (!createLegacyJournal(legacyPath) || !QFile::copy(legacyPath, compactPath))
+        return -1;
+    {
+        // Opening the journal migrates it
+        SyncJournalDb journal(compactPath);
+        if (journal.getFileRecordCount() != dirCount * (filesPerDir + 1))
+            return -1;
+    }
+
+    qint64 legacySize = vacuumedSize(legacyPath);
+    qint64 compactSize = vacuumedSize(compactPath);
+    qint64 legacyTime = discoveryReadTime(legacyPath, true);
+    qint64 compactTime = discoveryReadTime(compactPath, false);
+
+    qDebug() << "JOURNAL SIZE legacy schema (MB)" << legacySize / 1000000;
+    qDebug() << "JOURNAL SIZE compact schema (MB)" << compactSize / 1000000;
+    qDebug() << "DISCOVERY READ legacy schema (ms)" << legacyTime;
+    qDebug() << "DISCOVERY READ compact schema (ms)" << compactTime;
+    return legacySize > 0 && compactSize > 0 && legacyTime >= 0 && compactTime >= 0 ? 0 : -1;
+}
@@ -0,0 +1,118 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtCore>
+#include <sqlite3.h>
+
+#include "syncjournaldb.h"
+#include "syncjournalfilerecord.h"
+
+using namespace OCC;
+
+static const int fileCount = 10 * 1000;
+
+/* A sqlite VFS that counts the syncs of the default one */
+static sqlite3_vfs *defaultVfs = 0;
+static sqlite3_vfs countingVfs;
+static QMutex methodsMutex;
+static QHash<const sqlite3_io_methods *, const sqlite3_io_methods *> originalMethods;
+static QAtomicInt syncCount;
+
+static int countingSync(sqlite3_file *file, int flags)
+{
+    syncCount.fetchAndAddRelaxed(1);
+    QMutexLocker locker(&methodsMutex);
+    const sqlite3_io_methods *methods = originalMethods.value(file->pMethods);
+    locker.unlock();
+    return methods->xSync(file, flags);
+}
+
+static int countingOpen(sqlite3_vfs *, const char *name, sqlite3_file *file, int flags, int *outFlags)
+{
+    int rc = defaultVfs->xOpen(defaultVfs, name, file, flags, outFlags);
+    if (rc != SQLITE_OK || !file->pMethods)
+        return rc;
+    QMutexLocker locker(&methodsMutex);
+    static QHash<const sqlite3_io_methods *, sqlite3_io_methods *> wrapped;
+    sqlite3_io_methods *&methods = wrapped[file->pMethods];
+    if (!methods) {
+        methods = new sqlite3_io_methods(*file->pMethods);
+        methods->xSync = countingSync;
+        originalMethods.insert(methods, file->pMethods);
+    }
+    file->pMethods = methods;
+    return rc;
+}
+
+static SyncJournalFileRecord makeRecord(int fileNum)
+{
+    SyncJournalFileRecord record;
+    record._path = QStringLiteral("dir%1/file%2").arg(fileNum / 100).arg(fileNum);
+    record._inode = 1000 + fileNum;
+    record._modtime = QDateTime::currentDateTime();
+    record._type = 0;
+    record._etag = "etag" + QByteArray::number(fileNum);
+    record._fileId = "id" + QByteArray::number(fileNum);
+    record._remotePerm = "WDNVR";
+    record._fileSize = 64;
+    record._checksumHeader = "SHA1:da39a3ee5e6b4b0d3255bfef95601890afd80709";
+    return record;
+}
+
+/* Writes the records of fileCount completed files, like the propagation does:
+ * before the writer thread each one was written and committed directly.
+ */
+static void writeRecords(bool queued)
+{
+    QTemporaryDir dir;
+    SyncJournalDb journal(dir.path() + "/sync.db");
+    journal.getFileRecordCount(); // open the database before measuring
+
+    int syncsBefore = syncCount.load();
+    QElapsedTimer callerTime;
+    QElapsedTimer totalTime;
+    qint64 callerNs = 0;
+    totalTime.start();
+    for (int fileNum = 0; fileNum < fileCount; ++fileNum) {
+        const SyncJournalFileRecord record = makeRecord(fileNum);
+        callerTime.start();
+        if (queued) {
+            journal.queueFileRecord(record);
+        } else {
+            journal.setFileRecord(record);
+            journal.commit("file done");
+        }
+        callerNs += callerTime.nsecsElapsed();
+    }
+    journal.flushPendingWrites();
+    qint64 totalMs = totalTime.elapsed();
+
+    // Per fileCount files: the time the propagation jobs spend in the journal
+    // calls, the time until everything is durable and the syncs it took.
+    const char *name = queued ? "queued" : "direct";
+    qDebug() << "FILES" << name << fileCount;
+    qDebug() << "CALLER TIME" << name << "(ms)" << callerNs / 1000000.0;
+    qDebug() << "CALLER TIME PER FILE" << name << "(us)" << callerNs / 1000.0 / fileCount;
+    qDebug() << "TOTAL TIME" << name << "(ms)" << totalMs;
+    qDebug() << "FSYNCS" << name << syncCount.load() - syncsBefore;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QLoggingCategory::setFilterRules(QStringLiteral("sync.database.info=false"));
+
+    defaultVfs = sqlite3_vfs_find(0);
+    countingVfs = *defaultVfs;
+    countingVfs.zName = "counting";
+    countingVfs.xOpen = countingOpen;
+    sqlite3_vfs_register(&countingVfs, 1);
+
+    writeRecords(false);
+    writeRecords(true);
+    return 0;
+}
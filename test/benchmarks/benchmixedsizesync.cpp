@@ -0,0 +1,122 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include "syncenginetestutils.h"
+#include <syncengine.h>
+
+using namespace OCC;
+
+// Simulated link: every connection gets this many bytes per second
+// and each request has a fixed latency.
+static const qint64 bytesPerSecond = 2 * 1000 * 1000;
+static const int latencyMs = 20;
+
+/* A GET reply that takes as long as the file would need on the simulated link */
+class ThrottledGetReply : public QNetworkReply
+{
+    const FileInfo *_fileInfo;
+    qint64 _remaining = 0;
+
+public:
+    ThrottledGetReply(const FileInfo *fileInfo, const QNetworkRequest &request, QObject *parent)
+        : QNetworkReply{parent}
+        , _fileInfo{fileInfo}
+    {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(QNetworkAccessManager::GetOperation);
+        open(QIODevice::ReadOnly);
+        QTimer::singleShot(latencyMs + _fileInfo->size * 1000 / bytesPerSecond, this, [this] { respond(); });
+    }
+
+    void respond()
+    {
+        _remaining = _fileInfo->size;
+        setHeader(QNetworkRequest::ContentLengthHeader, _remaining);
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+        setRawHeader("OC-ETag", _fileInfo->etag.toLatin1());
+        setRawHeader("ETag", _fileInfo->etag.toLatin1());
+        setRawHeader("OC-FileId", _fileInfo->fileId);
+        emit metaDataChanged();
+        if (bytesAvailable())
+            emit readyRead();
+        emit finished();
+    }
+
+    void abort() override { }
+    qint64 bytesAvailable() const override { return _remaining + QIODevice::bytesAvailable(); }
+    qint64 readData(char *data, qint64 maxlen) override
+    {
+        qint64 len = std::min(_remaining, maxlen);
+        std::fill_n(data, len, _fileInfo->contentChar);
+        _remaining -= len;
+        return len;
+    }
+};
+
+/* Lots of small files in plan order before a few big ones, a few medium sized in between */
+static qint64 syncMixedSizes(quint64 largeFileSize)
+{
+    FakeFolder fakeFolder{FileInfo{}};
+    SyncOptions options;
+    options._largeFileSize = largeFileSize;
+    fakeFolder.syncEngine().setSyncOptions(options);
+
+    FileInfo &remote = fakeFolder.remoteModifier();
+    for (int dirNum = 0; dirNum < 10; ++dirNum) {
+        QString dir = QStringLiteral("dir") + QString::number(dirNum);
+        remote.mkdir(dir);
+        for (int fileNum = 0; fileNum < 100; ++fileNum)
+            remote.insert(dir + "/small" + QString::number(fileNum), 2 * 1000);
+        remote.insert(dir + "/medium", 200 * 1000);
+    }
+    remote.mkdir("zz");
+    for (int fileNum = 0; fileNum < 4; ++fileNum)
+        remote.insert("zz/large" + QString::number(fileNum), 10 * 1000 * 1000);
+
+    fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+        if (op != QNetworkAccessManager::GetOperation)
+            return nullptr;
+        return new ThrottledGetReply{remote.find(getFilePathFromUrl(request.url())), request, &fakeFolder.syncEngine()};
+    });
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!fakeFolder.syncOnce() || !(fakeFolder.currentLocalState() == fakeFolder.currentRemoteState()))
+        return -1;
+    return timer.elapsed();
+}
+
+/* The shortest makespan of a few syncs, the simulated link makes the others only slower */
+static qint64 bestOf(int rounds, quint64 largeFileSize)
+{
+    qint64 best = -1;
+    for (int round = 0; round < rounds; ++round) {
+        qint64 makespan = syncMixedSizes(largeFileSize);
+        if (makespan < 0)
+            return -1;
+        if (best < 0 || makespan < best)
+            best = makespan;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    const int rounds = argc > 1 ? QByteArray(argv[1]).toInt() : 3;
+    qint64 planOrder = bestOf(rounds, 0);
+    qint64 sizeAware = bestOf(rounds, SyncOptions()._largeFileSize / 10);
+    if (planOrder <= 0 || sizeAware <= 0)
+        return -1;
+
+    qDebug() << "MAKESPAN plan order (ms)" << planOrder;
+    qDebug() << "MAKESPAN size aware (ms)" << sizeAware;
+    qDebug() << "MAKESPAN size aware / plan order" << double(sizeAware) / planOrder;
+    return 0;
+}
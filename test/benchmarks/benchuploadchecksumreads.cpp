@@ -0,0 +1,53 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include "syncenginetestutils.h"
+#include <syncengine.h>
+
+using namespace OCC;
+
+/* Bytes this process read so far, -1 where the OS doesn't tell */
+static qint64 bytesReadByProcess()
+{
+#ifdef Q_OS_LINUX
+    QFile io(QStringLiteral("/proc/self/io"));
+    if (!io.open(QIODevice::ReadOnly))
+        return -1;
+    foreach (const QByteArray &line, io.readAll().split('\n')) {
+        if (line.startsWith("rchar:"))
+            return line.mid(6).trimmed().toLongLong();
+    }
+#endif
+    return -1;
+}
+
+/* Uploads fileCount files of fileSize bytes, returns how often every uploaded byte was read from disk */
+static double readsPerUploadedByte(int fileCount, qint64 fileSize)
+{
+    FakeFolder fakeFolder{FileInfo{}};
+    // The server wants another checksum type than the content checksum
+    fakeFolder.syncEngine().account()->setCapabilities({ { "checksums", QVariantMap{ { "supportedTypes", QVariantList{ "MD5" } } } } });
+    for (int fileNum = 0; fileNum < fileCount; ++fileNum)
+        fakeFolder.localModifier().insert("file" + QString::number(fileNum), fileSize);
+
+    qint64 readBefore = bytesReadByProcess();
+    if (readBefore < 0 || !fakeFolder.syncOnce())
+        return -1;
+    return double(bytesReadByProcess() - readBefore) / (fileCount * fileSize);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    double smallFiles = readsPerUploadedByte(500, 100 * 1000);
+    double largeFiles = readsPerUploadedByte(5, 50 * 1000 * 1000);
+
+    qDebug() << "READS PER BYTE small files" << smallFiles;
+    qDebug() << "READS PER BYTE large files" << largeFiles;
+    return smallFiles >= 0 && largeFiles >= 0 ? 0 : -1;
+}
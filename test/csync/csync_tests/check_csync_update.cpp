@@ -31,23 +31,20 @@ static void statedb_create_metadata_table(sqlite3 *db)
 
     if( db ) {
         const char *sql = "CREATE TABLE IF NOT EXISTS metadata("
-                          "phash INTEGER(8),"
+                          "phash INTEGER NOT NULL,"
                           "pathlen INTEGER,"
-                          "path VARCHAR(4096),"
+                          "path TEXT,"
                           "inode INTEGER,"
-                          "uid INTEGER,"
-                          "gid INTEGER,"
-                          "mode INTEGER,"
-                          "modtime INTEGER(8),"
+                          "modtime INTEGER,"
                           "type INTEGER,"
-                          "md5 VARCHAR(32),"
-                          "fileid VARCHAR(128),"
-                          "remotePerm VARCHAR(128),"
-                          "filesize BIGINT,"
-                          "ignoredChildrenRemote INT,"
+                          "md5 TEXT,"
+                          "fileid TEXT,"
+                          "remotePerm TEXT,"
+                          "filesize INTEGER,"
+                          "ignoredChildrenRemote INTEGER,"
                           "contentChecksum TEXT,"
                           "contentChecksumTypeId INTEGER,"
-                          "PRIMARY KEY(phash));";
+                          "PRIMARY KEY(phash)) WITHOUT ROWID;";
 
         rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
         //const char *msg = sqlite3_errmsg(db);
@@ -68,15 +65,12 @@ static void statedb_insert_metadata(sqlite3 *db)
 
     if( db ) {
         char *stmt = sqlite3_mprintf("INSERT INTO metadata"
-                                     "(phash, pathlen, path, inode, uid, gid, mode, modtime,type,md5) VALUES"
-                                     "(%lld, %d, '%q', %d, %d, %d, %d, %lld, %d, '%q');",
+                                     "(phash, pathlen, path, inode, modtime,type,md5) VALUES"
+                                     "(%lld, %d, '%q', %d, %lld, %d, '%q');",
                                      (long long signed int)42,
                                      42,
                                      "I_was_wurst_before_I_became_wurstsalat",
                                      619070,
-                                     42,
-                                     42,
-                                     42,
                                      (long long signed int)42,
                                      0,
                                      "4711");
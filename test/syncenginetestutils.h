@@ -14,6 +14,9 @@
 #include "syncjournaldb.h"
 
 #include <QDir>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QNetworkReply>
 #include <QMap>
 #include <QtTest>
@@ -27,6 +30,8 @@
 static const QUrl sRootUrl("owncloud://somehost/owncloud/remote.php/webdav/");
 static const QUrl sRootUrl2("owncloud://somehost/owncloud/remote.php/dav/files/admin/");
 static const QUrl sUploadUrl("owncloud://somehost/owncloud/remote.php/dav/uploads/admin/");
+static const QUrl sBulkUploadUrl("owncloud://somehost/owncloud/remote.php/dav/bulk");
+static const QUrl sBulkDownloadUrl("owncloud://somehost/owncloud/remote.php/dav/bulkdownload");
 
 inline QString getFilePathFromUrl(const QUrl &url) {
     QString path = url.path();
@@ -540,6 +545,290 @@ public:
     qint64 readData(char *, qint64) override { return 0; }
 };
 
+class FakeCopyReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    FakeCopyReply(FileInfo &remoteRootFileInfo, QNetworkAccessManager::Operation op, const QNetworkRequest &request, QObject *parent)
+    : QNetworkReply{parent} {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        open(QIODevice::ReadOnly);
+
+        QString fileName = getFilePathFromUrl(request.url());
+        Q_ASSERT(!fileName.isEmpty());
+        QString dest = getFilePathFromUrl(QUrl::fromEncoded(request.rawHeader("Destination")));
+        Q_ASSERT(!dest.isEmpty());
+        const FileInfo *source = remoteRootFileInfo.find(fileName);
+        if (!source || source->isDir) {
+            _httpErrorCode = 404;
+        } else if (!remoteRootFileInfo.find(PathComponents{dest}.parentDirComponents())) {
+            _httpErrorCode = 409;
+        } else if (remoteRootFileInfo.find(dest) && request.rawHeader("Overwrite") == "F") {
+            _httpErrorCode = 412;
+        } else {
+            const FileInfo original = *source;
+            FileInfo *copy = remoteRootFileInfo.create(dest, original.size, original.contentChar);
+            copy->checksums = original.checksums;
+            copy->lastModified = original.lastModified;
+        }
+        QMetaObject::invokeMethod(this, "respond", Qt::QueuedConnection);
+    }
+
+    Q_INVOKABLE void respond() {
+        if (_httpErrorCode) {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, _httpErrorCode);
+            setError(InternalServerError, "Copy failed");
+        } else {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 201);
+        }
+        emit metaDataChanged();
+        emit finished();
+    }
+
+    void abort() override { }
+    qint64 readData(char *, qint64) override { return 0; }
+
+    int _httpErrorCode = 0;
+};
+
+class FakeProppatchReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    FakeProppatchReply(FileInfo &remoteRootFileInfo, QNetworkAccessManager::Operation op, const QNetworkRequest &request, const QByteArray &body, QObject *parent)
+    : QNetworkReply{parent} {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        open(QIODevice::ReadOnly);
+
+        QString fileName = getFilePathFromUrl(request.url());
+        FileInfo *fileInfo = remoteRootFileInfo.find(fileName);
+        if (!fileInfo) {
+            QMetaObject::invokeMethod(this, "respond404", Qt::QueuedConnection);
+            return;
+        }
+        // Only the modification time is supported
+        QRegExp lastModified(QStringLiteral("<lastmodified[^>]*>(\\d+)</lastmodified>"));
+        if (lastModified.indexIn(QString::fromUtf8(body)) != -1)
+            remoteRootFileInfo.setModTime(fileName, QDateTime::fromTime_t(lastModified.cap(1).toUInt()));
+        QMetaObject::invokeMethod(this, "respond", Qt::QueuedConnection);
+    }
+
+    Q_INVOKABLE void respond() {
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 207);
+        emit metaDataChanged();
+        emit finished();
+    }
+
+    Q_INVOKABLE void respond404() {
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 404);
+        setError(InternalServerError, "Not Found");
+        emit metaDataChanged();
+        emit finished();
+    }
+
+    void abort() override { }
+    qint64 readData(char *, qint64) override { return 0; }
+};
+
+class FakeBulkUploadReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    QByteArray payload;
+
+    FakeBulkUploadReply(FileInfo &remoteRootFileInfo, QNetworkAccessManager::Operation op, const QNetworkRequest &request,
+                        const QByteArray &body, const QHash<QString, int> &errorPaths, QObject *parent)
+    : QNetworkReply{parent} {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        open(QIODevice::ReadOnly);
+
+        const QByteArray contentType = request.header(QNetworkRequest::ContentTypeHeader).toByteArray();
+        const QByteArray boundary = "--" + contentType.mid(contentType.indexOf("boundary=") + 9);
+        QJsonObject results;
+        int pos = body.indexOf(boundary);
+        while (pos != -1 && body.mid(pos + boundary.size(), 2) == "\r\n") {
+            pos += boundary.size() + 2;
+            QMap<QByteArray, QByteArray> headers;
+            int lineEnd;
+            while ((lineEnd = body.indexOf("\r\n", pos)) > pos) {
+                const QByteArray line = body.mid(pos, lineEnd - pos);
+                const int colon = line.indexOf(':');
+                headers[line.left(colon).toLower()] = line.mid(colon + 1).trimmed();
+                pos = lineEnd + 2;
+            }
+            pos += 2;
+            const QByteArray data = body.mid(pos, headers["content-length"].toInt());
+            pos = body.indexOf(boundary, pos + data.size());
+
+            const QString fileName = QString::fromUtf8(QByteArray::fromPercentEncoding(headers["x-file-path"]));
+            QJsonObject result;
+            result["error"] = true;
+            if (errorPaths.contains(PathComponents{fileName}.join('/'))) {
+                result["message"] = QStringLiteral("Internal Server Fake Error");
+            } else if (headers.contains("oc-checksum") && headers["oc-checksum"].startsWith("SHA1:")
+                && headers["oc-checksum"].mid(5) != QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex()) {
+                result["message"] = QStringLiteral("Checksum mismatch");
+            } else {
+                // Assume that the file is filled with the same character
+                const char contentChar = data.isEmpty() ? 'W' : data.at(0);
+                FileInfo *fileInfo = remoteRootFileInfo.find(fileName);
+                if (fileInfo) {
+                    fileInfo->size = data.size();
+                    fileInfo->contentChar = contentChar;
+                } else {
+                    fileInfo = remoteRootFileInfo.create(fileName, data.size(), contentChar);
+                }
+                result["error"] = false;
+                result["etag"] = fileInfo->etag;
+                result["fileid"] = QString::fromUtf8(fileInfo->fileId);
+            }
+            results[QString::fromUtf8(headers["x-file-path"])] = result;
+        }
+        payload = QJsonDocument(results).toJson();
+        QMetaObject::invokeMethod(this, "respond", Qt::QueuedConnection);
+    }
+
+    Q_INVOKABLE void respond() {
+        setHeader(QNetworkRequest::ContentLengthHeader, payload.size());
+        setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+        setFinished(true);
+        emit metaDataChanged();
+        if (bytesAvailable())
+            emit readyRead();
+        emit finished();
+    }
+
+    void abort() override { }
+
+    qint64 bytesAvailable() const override { return payload.size() + QIODevice::bytesAvailable(); }
+    qint64 readData(char *data, qint64 maxlen) override {
+        qint64 len = std::min(qint64{payload.size()}, maxlen);
+        memcpy(data, payload.constData(), len);
+        payload.remove(0, len);
+        return len;
+    }
+};
+
+class FakeBulkDownloadReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    struct Part {
+        QString path;
+        QByteArray etag;
+        QByteArray mtime;
+        QByteArray checksumHeader;
+        QByteArray data;
+    };
+    // The parts of the response, in order: a test may change them before the response is sent
+    QVector<Part> parts;
+    // The response ends in the middle of the body of this part
+    int cutOffPart = -1;
+    // Called once the first half of the response arrived
+    std::function<void()> afterFirstHalf;
+
+    QByteArray payload;
+    qint64 available = 0; // of the payload, it arrives in two halves
+    bool aborted = false;
+
+    FakeBulkDownloadReply(FileInfo &remoteRootFileInfo, QNetworkAccessManager::Operation op, const QNetworkRequest &request,
+                          const QByteArray &body, const QHash<QString, int> &errorPaths, QObject *parent)
+    : QNetworkReply{parent} {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        open(QIODevice::ReadOnly);
+
+        // Files with an error are left out, the client has to GET them
+        foreach (const QJsonValue &value, QJsonDocument::fromJson(body).array()) {
+            const QString fileName = PathComponents{value.toString()}.join('/');
+            const FileInfo *fileInfo = remoteRootFileInfo.find(fileName);
+            if (!fileInfo || fileInfo->isDir || errorPaths.contains(fileName))
+                continue;
+            parts.append(makePart(value.toString(), *fileInfo));
+        }
+        QMetaObject::invokeMethod(this, "respond", Qt::QueuedConnection);
+    }
+
+    static Part makePart(const QString &path, const FileInfo &fileInfo) {
+        Part part;
+        part.path = path;
+        part.etag = fileInfo.etag.toLatin1();
+        part.mtime = QByteArray::number(fileInfo.lastModified.toTime_t());
+        part.data = QByteArray(fileInfo.size, fileInfo.contentChar);
+        part.checksumHeader = "SHA1:" + QCryptographicHash::hash(part.data, QCryptographicHash::Sha1).toHex();
+        return part;
+    }
+
+    Q_INVOKABLE void respond() {
+        if (aborted) {
+            setError(OperationCanceledError, "Operation Canceled");
+            emit metaDataChanged();
+            emit finished();
+            return;
+        }
+        for (int i = 0; i < parts.size(); ++i) {
+            const Part &part = parts.at(i);
+            payload += "--fakeboundary\r\n";
+            payload += "X-File-Path: " + QUrl::toPercentEncoding(part.path, "/") + "\r\n";
+            payload += "ETag: \"" + part.etag + "\"\r\n";
+            payload += "X-OC-MTime: " + part.mtime + "\r\n";
+            payload += "OC-Checksum: " + part.checksumHeader + "\r\n";
+            payload += "Content-Length: " + QByteArray::number(part.data.size()) + "\r\n\r\n";
+            if (i == cutOffPart) {
+                payload += part.data.left(part.data.size() / 2);
+                break;
+            }
+            payload += part.data + "\r\n";
+        }
+        if (cutOffPart < 0)
+            payload += "--fakeboundary--\r\n";
+
+        setHeader(QNetworkRequest::ContentTypeHeader, "multipart/related; boundary=fakeboundary");
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+        emit metaDataChanged();
+        available = payload.size() / 2;
+        emit readyRead();
+        if (afterFirstHalf)
+            afterFirstHalf();
+        QMetaObject::invokeMethod(this, "respondRest", Qt::QueuedConnection);
+    }
+
+    Q_INVOKABLE void respondRest() {
+        if (aborted) {
+            setError(OperationCanceledError, "Operation Canceled");
+            emit finished();
+            return;
+        }
+        available = payload.size();
+        setFinished(true);
+        emit readyRead();
+        emit finished();
+    }
+
+    void abort() override { aborted = true; }
+
+    qint64 bytesAvailable() const override {
+        if (aborted)
+            return 0;
+        return available + QIODevice::bytesAvailable();
+    }
+    qint64 readData(char *data, qint64 maxlen) override {
+        qint64 len = std::min(available, maxlen);
+        memcpy(data, payload.constData(), len);
+        payload.remove(0, len);
+        available -= len;
+        return len;
+    }
+};
+
 class FakeGetReply : public QNetworkReply
 {
     Q_OBJECT
@@ -571,8 +860,18 @@ public:
         }
         payload = fileInfo->contentChar;
         size = fileInfo->size;
+        int status = 200;
+        QRegExp range("bytes=(\\d+)-(\\d*)");
+        if (range.indexIn(QString::fromLatin1(request().rawHeader("Range"))) == 0) {
+            int start = range.cap(1).toInt();
+            int end = range.cap(2).isEmpty() ? size - 1 : std::min(range.cap(2).toInt(), size - 1);
+            setRawHeader("Content-Range", "bytes " + QByteArray::number(start) + '-' + QByteArray::number(end)
+                    + '/' + QByteArray::number(size));
+            size = end - start + 1;
+            status = 206;
+        }
         setHeader(QNetworkRequest::ContentLengthHeader, size);
-        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, status);
         setRawHeader("OC-ETag", fileInfo->etag.toLatin1());
         setRawHeader("ETag", fileInfo->etag.toLatin1());
         setRawHeader("OC-FileId", fileInfo->fileId);
@@ -717,6 +1016,7 @@ class FakeQNAM : public QNetworkAccessManager
 {
 public:
     using Override = std::function<QNetworkReply *(Operation, const QNetworkRequest &)>;
+    using BulkDownloadOverride = std::function<void(FakeBulkDownloadReply *)>;
 
 private:
     FileInfo _remoteRootFileInfo;
@@ -725,6 +1025,8 @@ private:
     QHash<QString, int> _errorPaths;
     // monitor requests and optionally provide custom replies
     Override _override;
+    // changes the bulk download responses
+    BulkDownloadOverride _bulkDownloadOverride;
 
 public:
     FakeQNAM(FileInfo initialRoot) : _remoteRootFileInfo{std::move(initialRoot)} { }
@@ -734,25 +1036,36 @@ public:
     QHash<QString, int> &errorPaths() { return _errorPaths; }
 
     void setOverride(const Override &override) { _override = override; }
+    void setBulkDownloadOverride(const BulkDownloadOverride &override) { _bulkDownloadOverride = override; }
 
 protected:
     QNetworkReply *createRequest(Operation op, const QNetworkRequest &request,
                                          QIODevice *outgoingData = 0) {
+        const bool isBulkUpload = request.url().path() == sBulkUploadUrl.path();
+        const bool isBulkDownload = request.url().path() == sBulkDownloadUrl.path();
         const QString fileName = getFilePathFromUrl(request.url());
-        Q_ASSERT(!fileName.isNull());
+        Q_ASSERT(!fileName.isNull() || isBulkUpload || isBulkDownload);
+        // The override also sees the requests of the error paths
+        if (_override) {
+            if (auto reply = _override(op, request))
+                return reply;
+        }
         if (_errorPaths.contains(fileName))
             return new FakeErrorReply{op, request, this, _errorPaths[fileName]};
 
         bool isUpload = request.url().path().startsWith(sUploadUrl.path());
         FileInfo &info = isUpload ? _uploadFileInfo : _remoteRootFileInfo;
 
-        if (_override) {
-            if (auto reply = _override(op, request))
-                return reply;
-        }
-
         auto verb = request.attribute(QNetworkRequest::CustomVerbAttribute);
-        if (verb == "PROPFIND")
+        if (isBulkUpload)
+            return new FakeBulkUploadReply{_remoteRootFileInfo, op, request, outgoingData->readAll(), _errorPaths, this};
+        else if (isBulkDownload) {
+            auto reply = new FakeBulkDownloadReply{_remoteRootFileInfo, op, request, outgoingData->readAll(), _errorPaths, this};
+            if (_bulkDownloadOverride)
+                _bulkDownloadOverride(reply);
+            return reply;
+        }
+        else if (verb == "PROPFIND")
             // Ignore outgoingData always returning somethign good enough, works for now.
             return new FakePropfindReply{info, op, request, this};
         else if (verb == QLatin1String("GET") || op == QNetworkAccessManager::GetOperation)
@@ -767,6 +1080,10 @@ protected:
             return new FakeMoveReply{info, op, request, this};
         else if (verb == QLatin1String("MOVE") && isUpload)
             return new FakeChunkMoveReply{info, _remoteRootFileInfo, op, request, this};
+        else if (verb == QLatin1String("COPY") && !isUpload)
+            return new FakeCopyReply{info, op, request, this};
+        else if (verb == QLatin1String("PROPPATCH"))
+            return new FakeProppatchReply{info, op, request, outgoingData->readAll(), this};
         else {
             qDebug() << verb << outgoingData;
             Q_UNREACHABLE();
@@ -849,6 +1166,7 @@ public:
     };
     ErrorList serverErrorPaths() { return {_fakeQnam}; }
     void setServerOverride(const FakeQNAM::Override &override) { _fakeQnam->setOverride(override); }
+    void setBulkDownloadOverride(const FakeQNAM::BulkDownloadOverride &override) { _fakeQnam->setBulkDownloadOverride(override); }
 
     QString localPath() const {
         // SyncEngine wants a trailing slash
@@ -930,6 +1248,48 @@ private:
     }
 };
 
+/** Sets the dav capability \a name, like "bulkupload", of the account of \a fakeFolder */
+inline void enableDavCapability(FakeFolder &fakeFolder, const QString &name)
+{
+    fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ { name, "1.0" } } } });
+}
+
+/**
+ * Counts the single transfers and the bulk requests sent to the server of
+ * \a fakeFolder, as its server override. \a reply may answer a request.
+ */
+class TransferCounter
+{
+public:
+    QStringList transfers; // paths of the single transfers, in order
+    int bulkRequests = 0;
+
+    TransferCounter(FakeFolder &fakeFolder, QNetworkAccessManager::Operation transferOperation, const QUrl &bulkUrl,
+                    const FakeQNAM::Override &reply = FakeQNAM::Override())
+    {
+        fakeFolder.setServerOverride([this, transferOperation, bulkUrl, reply](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == transferOperation)
+                transfers.append(getFilePathFromUrl(request.url()));
+            if (request.url().path() == bulkUrl.path())
+                ++bulkRequests;
+            return reply ? reply(op, request) : nullptr;
+        });
+    }
+
+    QStringList sortedTransfers() const
+    {
+        QStringList sorted = transfers;
+        sorted.sort();
+        return sorted;
+    }
+
+    void clear()
+    {
+        transfers.clear();
+        bulkRequests = 0;
+    }
+};
+
 // QTest::toString overloads
 namespace OCC {
     inline char *toString(const SyncFileStatus &s) {
@@ -0,0 +1,154 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+
+#include "bandwidthmanager.h"
+
+using namespace OCC;
+
+/* Takes all the quota it can get whenever it is woken up, like the transfers do */
+class FakeTransfer : public QObject
+{
+    Q_OBJECT
+public:
+    qint64 _transferred = 0;
+    bool _paused = false;
+
+public slots:
+    void wake()
+    {
+        if (_paused)
+            return;
+        qint64 quota;
+        while ((quota = BandwidthGovernor::instance()->takeQuota(BandwidthGovernor::Download, this, 1024 * 1024)) > 0) {
+            _transferred += quota;
+        }
+    }
+};
+
+class TestBandwidthGovernor : public QObject
+{
+    Q_OBJECT
+
+    qint64 _now = 0;
+
+    /* One tick of the governor after \a msecs, and the wakeups it queued */
+    void tick(qint64 msecs = 50)
+    {
+        _now += msecs;
+        QMetaObject::invokeMethod(BandwidthGovernor::instance(), "slotTick", Qt::DirectConnection);
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::MetaCall);
+    }
+
+private slots:
+    void initTestCase()
+    {
+        BandwidthGovernor::instance()->setClock([this]() { return _now; });
+    }
+
+    void cleanupTestCase()
+    {
+        BandwidthGovernor::instance()->setClock(BandwidthGovernor::Clock());
+    }
+
+    void testFairShares()
+    {
+        typedef QVector<qint64> V;
+        QCOMPARE(BandwidthGovernor::fairShares(90, V() << 100 << 100 << 100), V() << 30 << 30 << 30);
+        // What doesn't fit is split between the others
+        QCOMPARE(BandwidthGovernor::fairShares(90, V() << 10 << 100 << 100), V() << 10 << 40 << 40);
+        QCOMPARE(BandwidthGovernor::fairShares(90, V() << 100 << 0 << 5), V() << 85 << 0 << 5);
+        // More than fits everywhere
+        QCOMPARE(BandwidthGovernor::fairShares(1000, V() << 10 << 20), V() << 10 << 20);
+        QCOMPARE(BandwidthGovernor::fairShares(0, V() << 10 << 20), V() << 0 << 0);
+        QCOMPARE(BandwidthGovernor::fairShares(10, V()), V());
+    }
+
+    void testUnlimited()
+    {
+        auto governor = BandwidthGovernor::instance();
+        QObject folder;
+        FakeTransfer transfer;
+        governor->addTransfer(BandwidthGovernor::Download, &folder, &transfer, "wake");
+        QVERIFY(!governor->isLimited(BandwidthGovernor::Download));
+        QCOMPARE(governor->takeQuota(BandwidthGovernor::Download, &transfer, 12345), qint64(12345));
+        governor->removeTransfer(BandwidthGovernor::Download, &transfer);
+    }
+
+    void testAbsoluteLimitIsSharedFairly()
+    {
+        auto governor = BandwidthGovernor::instance();
+        const qint64 limit = 400 * 1000;
+        governor->setLimit(BandwidthGovernor::Download, limit);
+
+        // One folder with one transfer, another one with three
+        QObject folderA, folderB;
+        FakeTransfer transferA;
+        FakeTransfer transfersB[3];
+        governor->addTransfer(BandwidthGovernor::Download, &folderA, &transferA, "wake");
+        for (auto &t : transfersB) {
+            governor->addTransfer(BandwidthGovernor::Download, &folderB, &t, "wake");
+        }
+
+        // Every tick refills 50ms at the limit, which is taken completely
+        const int ticks = 20;
+        for (int i = 0; i < ticks; ++i)
+            tick();
+
+        governor->removeTransfer(BandwidthGovernor::Download, &transferA);
+        for (auto &t : transfersB) {
+            governor->removeTransfer(BandwidthGovernor::Download, &t);
+        }
+        governor->setLimit(BandwidthGovernor::Download, 0);
+
+        // Each folder gets half, split evenly between its transfers
+        const qint64 perTick = limit * 50 / 1000;
+        QCOMPARE(transferA._transferred, ticks * perTick / 2);
+        const qint64 totalB = transfersB[0]._transferred + transfersB[1]._transferred + transfersB[2]._transferred;
+        QCOMPARE(totalB, ticks * perTick / 2);
+        for (auto &t : transfersB) {
+            QVERIFY(t._transferred >= ticks * (perTick / 2 / 3));
+            QVERIFY(t._transferred <= ticks * (perTick / 2 / 3 + 1));
+        }
+    }
+
+    void testUnusedTokensGoToOthers()
+    {
+        auto governor = BandwidthGovernor::instance();
+        const qint64 limit = 400 * 1000;
+        governor->setLimit(BandwidthGovernor::Download, limit);
+
+        QObject folderA, folderB;
+        FakeTransfer idle, busy;
+        idle._paused = true;
+        governor->addTransfer(BandwidthGovernor::Download, &folderA, &idle, "wake");
+        governor->addTransfer(BandwidthGovernor::Download, &folderB, &busy, "wake");
+
+        // The idle transfer holds at most 100ms at the limit, the rest goes to the busy one
+        const qint64 perTick = limit * 50 / 1000;
+        for (int i = 0; i < 4; ++i)
+            tick();
+        QCOMPARE(busy._transferred, 4 * perTick / 2);
+        for (int i = 0; i < 4; ++i)
+            tick();
+        QCOMPARE(busy._transferred, 4 * perTick / 2 + 4 * perTick);
+
+        // What it holds is still there once it resumes
+        idle._paused = false;
+        idle.wake();
+        QCOMPARE(idle._transferred, limit * 100 / 1000);
+        QCOMPARE(governor->takeQuota(BandwidthGovernor::Download, &idle, 1), qint64(0));
+
+        governor->removeTransfer(BandwidthGovernor::Download, &idle);
+        governor->removeTransfer(BandwidthGovernor::Download, &busy);
+        governor->setLimit(BandwidthGovernor::Download, 0);
+    }
+};
+
+QTEST_GUILESS_MAIN(TestBandwidthGovernor)
+#include "testbandwidthgovernor.moc"
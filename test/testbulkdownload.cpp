@@ -0,0 +1,215 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+#include "syncenginetestutils.h"
+#include <syncengine.h>
+
+using namespace OCC;
+
+/** The index of the part of \a file in \a reply, or -1 */
+static int partIndex(const FakeBulkDownloadReply *reply, const QString &file)
+{
+    for (int i = 0; i < reply->parts.size(); ++i) {
+        if (reply->parts.at(i).path.endsWith(file))
+            return i;
+    }
+    return -1;
+}
+
+class TestBulkDownload : public QObject
+{
+    Q_OBJECT
+
+private slots:
+
+    void testBulkDownload()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+
+        // Small new and changed files of a directory are downloaded together, also in a new directory
+        for (int i = 0; i < 5; ++i)
+            fakeFolder.remoteModifier().insert(QString("A/x%1").arg(i), 10 + i, 'X');
+        fakeFolder.remoteModifier().appendByte("A/a1");
+        fakeFolder.remoteModifier().mkdir("N");
+        fakeFolder.remoteModifier().insert("N/n1", 20, 'N');
+        fakeFolder.remoteModifier().insert("N/n2", 30, 'M');
+        // One file alone, and a file too big for a bulk download
+        fakeFolder.remoteModifier().insert("B/y1", 10, 'Y');
+        fakeFolder.remoteModifier().insert("C/big", 200 * 1000, 'Z');
+
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.bulkRequests, 2);
+        QCOMPARE(counter.sortedTransfers(), QStringList() << "B/y1" << "C/big");
+
+        auto record = fakeFolder.syncJournal().getFileRecord("A/x3");
+        auto remote = fakeFolder.currentRemoteState().find("A/x3");
+        QCOMPARE(record._etag, remote->etag.toUtf8());
+        QVERIFY(record._checksumHeader.startsWith("SHA1:"));
+    }
+
+    void testWithoutCapability()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'X');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.bulkRequests, 0);
+    }
+
+    void testRequestFailureFallsBack()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl,
+            [&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+                if (request.url().path() == sBulkDownloadUrl.path())
+                    return new FakeErrorReply{ op, request, &fakeFolder.syncEngine(), 404 };
+                return nullptr;
+            });
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'Y');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.sortedTransfers(), QStringList() << "A/x1" << "A/x2");
+    }
+
+    void testMissingPart()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'Y');
+        fakeFolder.remoteModifier().insert("A/x3", 10, 'Z');
+        fakeFolder.serverErrorPaths().append("A/x2");
+
+        // Only the file missing in the response is fetched again, and fails again
+        QVERIFY(!fakeFolder.syncOnce());
+        QCOMPARE(counter.transfers, QStringList() << "A/x2");
+        QVERIFY(fakeFolder.currentLocalState().find("A/x1"));
+        QVERIFY(!fakeFolder.currentLocalState().find("A/x2"));
+        QVERIFY(fakeFolder.currentLocalState().find("A/x3"));
+
+        fakeFolder.serverErrorPaths().clear();
+        fakeFolder.syncEngine().journal()->wipeErrorBlacklist();
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+
+    void testPartCutOff()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'Y');
+        fakeFolder.remoteModifier().insert("A/x3", 10, 'Z');
+
+        // The response ends in the middle of the second part
+        QStringList notReceived;
+        fakeFolder.setBulkDownloadOverride([&](FakeBulkDownloadReply *reply) {
+            reply->cutOffPart = 1;
+            for (int i = 1; i < reply->parts.size(); ++i)
+                notReceived.append(PathComponents(reply->parts.at(i).path).join('/'));
+        });
+
+        // The parts received completely are kept, the others are fetched again
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(counter.bulkRequests, 1);
+        QCOMPARE(notReceived.size(), 2);
+        notReceived.sort();
+        QCOMPARE(counter.sortedTransfers(), notReceived);
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+
+    void testBadChecksum()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'Y');
+        fakeFolder.remoteModifier().insert("A/x3", 10, 'Z');
+        fakeFolder.setBulkDownloadOverride([&](FakeBulkDownloadReply *reply) {
+            const int index = partIndex(reply, "A/x2");
+            QVERIFY(index >= 0);
+            reply->parts[index].checksumHeader = "SHA1:" + QByteArray(40, '0');
+        });
+
+        // The broken part is not written and the next sync downloads it again
+        QVERIFY(!fakeFolder.syncOnce());
+        QVERIFY(counter.transfers.isEmpty());
+        QCOMPARE(fakeFolder.syncEngine().isAnotherSyncNeeded(), ImmediateFollowUp);
+        QVERIFY(fakeFolder.currentLocalState().find("A/x1"));
+        QVERIFY(!fakeFolder.currentLocalState().find("A/x2"));
+        QVERIFY(fakeFolder.currentLocalState().find("A/x3"));
+
+        fakeFolder.setBulkDownloadOverride(FakeQNAM::BulkDownloadOverride());
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+
+    void testUnexpectedAndDuplicatePart()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        fakeFolder.remoteModifier().insert("A/x1", 10, 'X');
+        fakeFolder.remoteModifier().insert("A/x2", 10, 'Y');
+        fakeFolder.setBulkDownloadOverride([&](FakeBulkDownloadReply *reply) {
+            const int index = partIndex(reply, "A/x1");
+            QVERIFY(index >= 0);
+            // A part nobody asked for, and the same file again with other content
+            FakeBulkDownloadReply::Part unexpected = reply->parts.at(index);
+            unexpected.path.replace("A/x1", "B/b1");
+            unexpected.data.fill('U');
+            FakeBulkDownloadReply::Part duplicate = reply->parts.at(index);
+            duplicate.data.fill('D');
+            reply->parts.prepend(unexpected);
+            reply->parts.append(duplicate);
+        });
+
+        // Both are ignored
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(counter.transfers.isEmpty());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(fakeFolder.currentLocalState().find("A/x1")->contentChar, 'X');
+    }
+
+    void testAbortWhileStreaming()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkdownload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::GetOperation, sBulkDownloadUrl);
+        for (int i = 1; i <= 4; ++i)
+            fakeFolder.remoteModifier().insert(QString("A/x%1").arg(i), 10, 'X');
+        QString lastFile;
+        fakeFolder.setBulkDownloadOverride([&](FakeBulkDownloadReply *reply) {
+            lastFile = PathComponents(reply->parts.last().path).join('/');
+            reply->afterFirstHalf = [&]() { fakeFolder.syncEngine().abort(); };
+        });
+
+        // What was not received is not fetched one by one
+        QVERIFY(!fakeFolder.syncOnce());
+        QVERIFY(counter.transfers.isEmpty());
+        QVERIFY(!lastFile.isEmpty());
+        QVERIFY(!fakeFolder.currentLocalState().find(lastFile));
+
+        fakeFolder.setBulkDownloadOverride(FakeQNAM::BulkDownloadOverride());
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+};
+
+QTEST_GUILESS_MAIN(TestBulkDownload)
+#include "testbulkdownload.moc"
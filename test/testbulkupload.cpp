@@ -0,0 +1,101 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+#include "syncenginetestutils.h"
+#include <syncengine.h>
+
+using namespace OCC;
+
+class TestBulkUpload : public QObject
+{
+    Q_OBJECT
+
+private slots:
+
+    void testBulkUpload()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkupload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::PutOperation, sBulkUploadUrl);
+
+        // Small new and changed files of a directory are uploaded together, also in a new directory
+        for (int i = 0; i < 5; ++i)
+            fakeFolder.localModifier().insert(QString("A/x%1").arg(i), 10 + i, 'X');
+        fakeFolder.localModifier().appendByte("A/a1");
+        fakeFolder.localModifier().mkdir("N");
+        fakeFolder.localModifier().insert("N/n1", 20, 'N');
+        fakeFolder.localModifier().insert("N/n2", 30, 'M');
+        // One file alone, and a file too big for a bulk upload
+        fakeFolder.localModifier().insert("B/y1", 10, 'Y');
+        fakeFolder.localModifier().insert("C/big", 200 * 1000, 'Z');
+
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.bulkRequests, 2);
+        QCOMPARE(counter.sortedTransfers(), QStringList() << "B/y1" << "C/big");
+
+        auto record = fakeFolder.syncJournal().getFileRecord("A/x3");
+        auto remote = fakeFolder.currentRemoteState().find("A/x3");
+        QCOMPARE(record._etag, remote->etag.toUtf8());
+        QCOMPARE(record._fileId, remote->fileId);
+    }
+
+    void testWithoutCapability()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::PutOperation, sBulkUploadUrl);
+        fakeFolder.localModifier().insert("A/x1", 10, 'X');
+        fakeFolder.localModifier().insert("A/x2", 10, 'X');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.bulkRequests, 0);
+    }
+
+    void testRequestFailureFallsBack()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkupload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::PutOperation, sBulkUploadUrl,
+            [&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+                if (request.url().path() == sBulkUploadUrl.path())
+                    return new FakeErrorReply{ op, request, &fakeFolder.syncEngine(), 404 };
+                return nullptr;
+            });
+        fakeFolder.localModifier().insert("A/x1", 10, 'X');
+        fakeFolder.localModifier().insert("A/x2", 10, 'X');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(counter.sortedTransfers(), QStringList() << "A/x1" << "A/x2");
+    }
+
+    void testPartFailure()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        enableDavCapability(fakeFolder, "bulkupload");
+        TransferCounter counter(fakeFolder, QNetworkAccessManager::PutOperation, sBulkUploadUrl);
+        fakeFolder.localModifier().insert("A/x1", 10, 'X');
+        fakeFolder.localModifier().insert("A/x2", 10, 'Y');
+        fakeFolder.localModifier().insert("A/x3", 10, 'Z');
+        fakeFolder.serverErrorPaths().append("A/x2");
+
+        // Only the failed part is uploaded again, and fails again
+        QVERIFY(!fakeFolder.syncOnce());
+        QCOMPARE(counter.transfers, QStringList() << "A/x2");
+        QVERIFY(fakeFolder.currentRemoteState().find("A/x1"));
+        QVERIFY(!fakeFolder.currentRemoteState().find("A/x2"));
+        QVERIFY(fakeFolder.currentRemoteState().find("A/x3"));
+
+        fakeFolder.serverErrorPaths().clear();
+        fakeFolder.syncEngine().journal()->wipeErrorBlacklist();
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+};
+
+QTEST_GUILESS_MAIN(TestBulkUpload)
+#include "testbulkupload.moc"
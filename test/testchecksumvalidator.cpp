@@ -10,11 +10,16 @@
 #include <QString>
 
 #include "checksums.h"
+#include "checksumkernels.h"
 #include "networkjobs.h"
 #include "utility.h"
 #include "filesystem.h"
 #include "propagatorjobs.h"
 
+#ifdef ZLIB_FOUND
+#include <zlib.h>
+#endif
+
 #if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
 // poor man QTRY_VERIFY when Qt5 is not available.
 #define QTRY_VERIFY(Cond) QTest::qWait(1000); QVERIFY(Cond)
@@ -150,6 +155,151 @@ using namespace OCC;
 #endif
     }
 
+    void testChecksumCalculator() {
+        QFile file(_testfile);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        const QByteArray data = file.readAll();
+
+        QList<QByteArray> types;
+        types << checkSumMD5C << checkSumSHA1C;
+#ifdef ZLIB_FOUND
+        types << checkSumAdlerC;
+#endif
+        foreach (const QByteArray &type, types) {
+            // In uneven pieces, like a download
+            ChecksumCalculator calculator(type);
+            QVERIFY(calculator.isValid());
+            for (int pos = 0; pos < data.size(); pos += 1000) {
+                calculator.addData(data.constData() + pos, qMin(1000, data.size() - pos));
+            }
+            QCOMPARE(calculator.result(), ComputeChecksum::computeNow(_testfile, type));
+
+            calculator.reset();
+            calculator.addData(data.constData(), data.size());
+            QCOMPARE(calculator.result(), ComputeChecksum::computeNow(_testfile, type));
+        }
+
+        QVERIFY(!ChecksumCalculator("Klaas32").isValid());
+    }
+
+    void testChecksumKernels() {
+        QByteArray data(100 * 1000 + 7, Qt::Uninitialized);
+        for (int i = 0; i < data.size(); ++i)
+            data[i] = char(qrand());
+
+        // Lengths around the block sizes, fed in two pieces
+        QList<int> lengths;
+        lengths << 0 << 1 << 31 << 32 << 33 << 55 << 56 << 57 << 63 << 64 << 65 << 127 << 128 << 129
+                << 5551 << 5552 << 5553 << data.size();
+        foreach (int length, lengths) {
+            foreach (int split, QList<int>() << 0 << 1 << 13 << 64 << length / 2) {
+                if (split > length)
+                    continue;
+                const char *first = data.constData();
+                const char *second = data.constData() + split;
+
+                if (ChecksumKernels::sha1Supported()) {
+                    ChecksumKernels::Sha1 sha1;
+                    sha1.addData(first, split);
+                    sha1.addData(second, length - split);
+                    QCOMPARE(sha1.result(), QCryptographicHash::hash(data.left(length), QCryptographicHash::Sha1));
+                }
+#ifdef ZLIB_FOUND
+                if (ChecksumKernels::adler32Supported()) {
+                    quint32 adler = ChecksumKernels::adler32(1, first, split);
+                    adler = ChecksumKernels::adler32(adler, second, length - split);
+                    QCOMPARE(adler, quint32(adler32(1, reinterpret_cast<const Bytef *>(first), length)));
+                }
+#endif
+            }
+        }
+
+#ifdef ZLIB_FOUND
+        // The sums get as big as they can
+        if (ChecksumKernels::adler32Supported()) {
+            QByteArray ones(100 * 1000, char(0xff));
+            QCOMPARE(ChecksumKernels::adler32(1, ones.constData(), ones.size()),
+                quint32(adler32(1, reinterpret_cast<const Bytef *>(ones.constData()), ones.size())));
+        }
+#endif
+    }
+
+    void testComputeMultipleChecksums() {
+        QList<QByteArray> types;
+        types << checkSumMD5C << checkSumSHA1C << "Klaas32";
+#ifdef ZLIB_FOUND
+        types << checkSumAdlerC;
+#endif
+        auto result = ComputeMultipleChecksums::computeNow(_testfile, types);
+        QCOMPARE(result.checksums.value(checkSumMD5C), FileSystem::calcMd5(_testfile));
+        QCOMPARE(result.checksums.value(checkSumSHA1C), FileSystem::calcSha1(_testfile));
+#ifdef ZLIB_FOUND
+        QCOMPARE(result.checksums.value(checkSumAdlerC), FileSystem::calcAdler32(_testfile));
+#endif
+        QVERIFY(!result.checksums.contains("Klaas32"));
+        QVERIFY(result.contents.isEmpty());
+
+        // Small enough to be kept
+        QFile file(_testfile);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        result = ComputeMultipleChecksums::computeNow(_testfile, types, file.size());
+        QCOMPARE(result.contents, file.readAll());
+        QCOMPARE(result.checksums.value(checkSumSHA1C), FileSystem::calcSha1(_testfile));
+
+        // Too big to be kept
+        result = ComputeMultipleChecksums::computeNow(_testfile, types, file.size() - 1);
+        QVERIFY(result.contents.isEmpty());
+        QCOMPARE(result.checksums.value(checkSumSHA1C), FileSystem::calcSha1(_testfile));
+    }
+
+    void testChecksumExecutor() {
+        auto executor = ChecksumExecutor::instance();
+        const int threads = executor->maxThreadCount();
+        executor->setMaxThreadCount(1);
+
+        // Keep the only thread busy while the others are queued
+        QSemaphore blocker;
+        auto blocking = executor->run<int>(ChecksumExecutor::TransferPriority, [&]() { blocker.acquire(); return 0; });
+
+        QMutex mutex;
+        QList<int> order;
+        auto record = [&](int n) { QMutexLocker lock(&mutex); order.append(n); return n; };
+        auto transfer = executor->run<int>(ChecksumExecutor::TransferPriority, [&]() { return record(1); });
+        auto canceled = executor->run<int>(ChecksumExecutor::TransferPriority, [&]() { return record(2); });
+        auto discovery = executor->run<int>(ChecksumExecutor::DiscoveryPriority, [&]() { return record(3); });
+        canceled.cancel();
+
+        blocker.release();
+        transfer.waitForFinished();
+        canceled.waitForFinished();
+        QCOMPARE(order, QList<int>() << 3 << 1);
+        QCOMPARE(transfer.result(), 1);
+        QVERIFY(canceled.isCanceled());
+        QCOMPARE(discovery.result(), 3);
+        QCOMPARE(blocking.result(), 0);
+
+        executor->setMaxThreadCount(threads);
+    }
+
+    void testDownloadKnownChecksum() {
+        ValidateChecksumHeader *vali = new ValidateChecksumHeader(this);
+        connect(vali, SIGNAL(validated(QByteArray,QByteArray)), this, SLOT(slotDownValidated()));
+        connect(vali, SIGNAL(validationFailed(QString)), this, SLOT(slotDownError(QString)));
+
+        // The file isn't read, the signals come right away
+        QHash<QByteArray, QByteArray> known;
+        known[checkSumSHA1C] = "abcdef";
+        _successDown = false;
+        vali->start(_root + "/nonexistent", "SHA1:abcdef", known);
+        QVERIFY(_successDown);
+
+        _expectedError = QLatin1String("The downloaded file does not match the checksum, it will be resumed.");
+        _errorSeen = false;
+        vali->start(_root + "/nonexistent", "SHA1:012345", known);
+        QVERIFY(_errorSeen);
+
+        delete vali;
+    }
 
     void cleanupTestCase() {
     }
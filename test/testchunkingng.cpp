@@ -8,9 +8,42 @@
 #include <QtTest>
 #include "syncenginetestutils.h"
 #include <syncengine.h>
+#include <propagateupload.h>
 
 using namespace OCC;
 
+static void setChunkSize(SyncEngine &engine, quint64 size)
+{
+    SyncOptions options;
+    options._initialChunkSize = size;
+    options._minChunkSize = size;
+    options._maxChunkSize = size;
+    engine.setSyncOptions(options);
+}
+
+/* Fails with an internal server error, but only after the other requests had time to finish */
+class DelayedErrorReply : public QNetworkReply
+{
+public:
+    DelayedErrorReply(QNetworkAccessManager::Operation op, const QNetworkRequest &request, QObject *parent)
+        : QNetworkReply{parent}
+    {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(op);
+        open(QIODevice::ReadOnly);
+        QTimer::singleShot(200, this, [this] {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 500);
+            setError(InternalServerError, "Internal Server Fake Error");
+            emit metaDataChanged();
+            emit finished();
+        });
+    }
+
+    void abort() override { }
+    qint64 readData(char *, qint64) override { return 0; }
+};
+
 /* Upload a 1/3 of a file of given size.
  * fakeFolder needs to be synchronized */
 static void partialUpload(FakeFolder &fakeFolder, const QString &name, int size)
@@ -68,7 +101,9 @@ private slots:
     void testResume () {
 
         FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
-        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        // partialUpload() expects the server to have exactly what was reported as sent: one chunk at a time
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{
+                {"chunking", "1.0"}, {"chunkingParallelUploadDisabled", true} } } });
         const int size = 300 * 1000 * 1000; // 300 MB
         partialUpload(fakeFolder, "A/a0", size);
         QCOMPARE(fakeFolder.uploadState().children.count(), 1);
@@ -89,7 +124,9 @@ private slots:
     void testRemoveStale1() {
 
         FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
-        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        // partialUpload() expects the server to have exactly what was reported as sent: one chunk at a time
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{
+                {"chunking", "1.0"}, {"chunkingParallelUploadDisabled", true} } } });
         const int size = 300 * 1000 * 1000; // 300 MB
         partialUpload(fakeFolder, "A/a0", size);
         QCOMPARE(fakeFolder.uploadState().children.count(), 1);
@@ -112,7 +149,9 @@ private slots:
     void testRemoveStale2() {
 
         FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
-        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        // partialUpload() expects the server to have exactly what was reported as sent: one chunk at a time
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{
+                {"chunking", "1.0"}, {"chunkingParallelUploadDisabled", true} } } });
         const int size = 300 * 1000 * 1000; // 300 MB
         partialUpload(fakeFolder, "A/a0", size);
         QCOMPARE(fakeFolder.uploadState().children.count(), 1);
@@ -216,10 +255,48 @@ private slots:
     }
 
 
+    // Chunks are streamed from the file: what follows a change of the file is not sent
+    void testModifyLocalFileWhileStreamingChunk() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"},
+            {"chunkingParallelUploadDisabled", true} } } });
+        setChunkSize(fakeFolder.syncEngine(), 5 * 1000 * 1000);
+        const int size = 10 * 1000 * 1000; // 10 MB, 2 chunks
+
+        fakeFolder.localModifier().insert("A/a0", size);
+        // The device is open on the first window when the request is created
+        bool modified = false;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::PutOperation && !modified) {
+                fakeFolder.localModifier().appendByte("A/a0");
+                modified = true;
+            }
+            return nullptr;
+        });
+
+        QSignalSpy completeSpy(&fakeFolder.syncEngine(), SIGNAL(itemCompleted(const SyncFileItemPtr &)));
+        QVERIFY(!fakeFolder.syncOnce());
+        QVERIFY(modified);
+        SyncFileItemPtr item;
+        for (const QList<QVariant> &args : completeSpy) {
+            if (args[0].value<SyncFileItemPtr>()->_file == "A/a0")
+                item = args[0].value<SyncFileItemPtr>();
+        }
+        QVERIFY(item);
+        QCOMPARE(item->_status, SyncFileItem::SoftError);
+        QCOMPARE(fakeFolder.syncEngine().isAnotherSyncNeeded(), ImmediateFollowUp);
+
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(fakeFolder.currentRemoteState().find("A/a0")->size, size + 1);
+    }
+
     void testResumeServerDeletedChunks() {
 
         FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
-        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        // partialUpload() expects the server to have exactly what was reported as sent: one chunk at a time
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{
+                {"chunking", "1.0"}, {"chunkingParallelUploadDisabled", true} } } });
         const int size = 300 * 1000 * 1000; // 300 MB
         partialUpload(fakeFolder, "A/a0", size);
         QCOMPARE(fakeFolder.uploadState().children.count(), 1);
@@ -237,6 +314,72 @@ private slots:
         QVERIFY(fakeFolder.uploadState().children.first().name != chunkingId);
     }
 
+    // Several chunks are in flight at the same time
+    void testParallelChunkUpload() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        setChunkSize(fakeFolder.syncEngine(), 1000 * 1000);
+        const int size = 10 * 1000 * 1000; // 10 MB, 10 chunks
+
+        int putCount = 0;
+        int putsBeforeFirstAck = -1;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::PutOperation)
+                ++putCount;
+            return nullptr;
+        });
+        QObject::connect(&fakeFolder.syncEngine(), &SyncEngine::transmissionProgress,
+            [&](const ProgressInfo &progress) {
+                if (putsBeforeFirstAck == -1 && progress.completedSize() > 0)
+                    putsBeforeFirstAck = putCount;
+            });
+
+        fakeFolder.localModifier().insert("A/a0", size);
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(fakeFolder.currentRemoteState().find("A/a0")->size, size);
+        QCOMPARE(putCount, 10);
+        QVERIFY(putsBeforeFirstAck > 1);
+    }
+
+    // A chunk fails while the following ones were acknowledged: only the hole is uploaded again
+    void testResumeParallelWithHole() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.syncEngine().account()->setCapabilities({ { "dav", QVariantMap{ {"chunking", "1.0"} } } });
+        setChunkSize(fakeFolder.syncEngine(), 1000 * 1000);
+        const int size = 10 * 1000 * 1000; // 10 MB, 10 chunks
+
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::PutOperation && request.url().path().endsWith("/00000002"))
+                return new DelayedErrorReply(op, request, &fakeFolder.syncEngine());
+            return nullptr;
+        });
+        fakeFolder.localModifier().insert("A/a0", size);
+        QVERIFY(!fakeFolder.syncOnce());
+
+        QCOMPARE(fakeFolder.uploadState().children.count(), 1);
+        auto chunkingId = fakeFolder.uploadState().children.first().name;
+        QCOMPARE(fakeFolder.uploadState().children.first().children.count(), 9);
+        auto uploadInfo = fakeFolder.syncEngine().journal()->getUploadInfo("A/a0");
+        QCOMPARE(uploadInfo._doneChunks.keys(), QList<int>() << 3 << 4 << 5 << 6 << 7 << 8 << 9);
+        QCOMPARE(uploadInfo._doneChunks[3], quint64(3 * 1000 * 1000));
+
+        QStringList putPaths;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::PutOperation)
+                putPaths.append(request.url().path());
+            return nullptr;
+        });
+        fakeFolder.syncEngine().journal()->wipeErrorBlacklist();
+        QVERIFY(fakeFolder.syncOnce());
+
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(fakeFolder.currentRemoteState().find("A/a0")->size, size);
+        QCOMPARE(putPaths.size(), 1);
+        QVERIFY(putPaths.first().endsWith("/00000002"));
+        QCOMPARE(fakeFolder.uploadState().children.count(), 1);
+        QCOMPARE(fakeFolder.uploadState().children.first().name, chunkingId);
+    }
 };
 
 QTEST_GUILESS_MAIN(TestChunkingNG)
@@ -70,6 +70,34 @@ private slots:
         QCOMPARE(sSum, sum);
     }
 
+    void testFileEquals()
+    {
+        // Bigger than one comparison window
+        QByteArray data(5 * 1024 * 1024 + 17, 'A');
+        for (int i = 0; i < data.size(); i += 4096)
+            data[i] = char(i / 4096);
+
+        auto write = [&](const QString &name, const QByteArray &content) {
+            QFile f(_root.path() + "/" + name);
+            QVERIFY(f.open(QIODevice::WriteOnly));
+            QCOMPARE(f.write(content), qint64(content.size()));
+        };
+        write("eq1", data);
+        write("eq2", data);
+        QByteArray changed = data;
+        changed[changed.size() - 1] = 'B';
+        write("last", changed);
+        write("short", data.left(data.size() - 1));
+        write("empty1", QByteArray());
+        write("empty2", QByteArray());
+
+        QVERIFY(fileEquals(_root.path() + "/eq1", _root.path() + "/eq2"));
+        QVERIFY(!fileEquals(_root.path() + "/eq1", _root.path() + "/last"));
+        QVERIFY(!fileEquals(_root.path() + "/last", _root.path() + "/eq1"));
+        QVERIFY(!fileEquals(_root.path() + "/eq1", _root.path() + "/short"));
+        QVERIFY(fileEquals(_root.path() + "/empty1", _root.path() + "/empty2"));
+        QVERIFY(!fileEquals(_root.path() + "/eq1", _root.path() + "/missing"));
+    }
 };
 
 QTEST_APPLESS_MAIN(TestFileSystem)
@@ -0,0 +1,108 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+
+#include <sqlite3.h>
+
+#include "journalmaintenance.h"
+#include "syncjournaldb.h"
+#include "syncjournalfilerecord.h"
+
+using namespace OCC;
+
+class TestJournalMaintenance : public QObject
+{
+    Q_OBJECT
+
+    QTemporaryDir _tempDir;
+
+    QString fillJournal(const QString &name)
+    {
+        const QString path = _tempDir.path() + "/" + name;
+        SyncJournalDb journal(path);
+        for (int i = 0; i < 2000; ++i) {
+            SyncJournalFileRecord record;
+            record._path = QString("dir/file%1").arg(i);
+            record._inode = i + 1;
+            record._modtime = QDateTime::currentDateTime();
+            record._etag = QByteArray(100, 'e');
+            record._fileId = QByteArray(100, 'f');
+            journal.setFileRecord(record);
+        }
+        journal.commit("fill");
+        // Leaves most of the file unused
+        journal.deleteFileRecord("dir", true);
+        journal.close();
+        return path;
+    }
+
+private slots:
+    void testRunsDueSteps()
+    {
+        const QString path = fillJournal("steps.db");
+        SyncJournalDb journal(path);
+        JournalMaintenance maintenance(&journal);
+        maintenance.setIdleDelay(0);
+        QSignalSpy stepSpy(&maintenance, SIGNAL(stepFinished(QString, qint64, bool)));
+        QSignalSpy idleSpy(&maintenance, SIGNAL(idle()));
+
+        const qint64 sizeBefore = QFileInfo(path).size() + QFileInfo(path + "-wal").size();
+        maintenance.scheduleWhenIdle();
+        QVERIFY(idleSpy.wait(10000));
+
+        // The integrity check isn't due, the journal was checked when opened
+        QStringList steps;
+        for (const auto &args : stepSpy) {
+            steps.append(args.at(0).toString());
+            QVERIFY(args.at(2).toBool());
+        }
+        QCOMPARE(steps, QStringList() << "WAL checkpoint"
+                                      << "Analyze"
+                                      << "Vacuum");
+        QVERIFY(QFileInfo(path).size() + QFileInfo(path + "-wal").size() < sizeBefore);
+
+        sqlite3 *db = 0;
+        QCOMPARE(sqlite3_open(path.toUtf8().constData(), &db), SQLITE_OK);
+        QCOMPARE(sqlite3_exec(db, "SELECT * FROM sqlite_stat1;", 0, 0, 0), SQLITE_OK);
+        sqlite3_close(db);
+
+        // Only the checkpoint is due after the next sync
+        stepSpy.clear();
+        maintenance.scheduleWhenIdle();
+        QVERIFY(idleSpy.wait(10000));
+        QCOMPARE(stepSpy.count(), 1);
+        QCOMPARE(stepSpy.at(0).at(0).toString(), QString("WAL checkpoint"));
+
+        // The journal still works
+        QCOMPARE(journal.getFileRecordCount(), 0);
+    }
+
+    void testInterrupt()
+    {
+        const QString path = fillJournal("interrupt.db");
+        SyncJournalDb journal(path);
+        JournalMaintenance maintenance(&journal);
+        maintenance.setIdleDelay(0);
+        QSignalSpy stepSpy(&maintenance, SIGNAL(stepFinished(QString, qint64, bool)));
+
+        // A sync starting right away cancels the scheduled steps
+        maintenance.scheduleWhenIdle();
+        maintenance.interrupt();
+        QVERIFY(!stepSpy.wait(500));
+        QVERIFY(!maintenance.isRunning());
+
+        // After the sync everything is still due
+        QSignalSpy idleSpy(&maintenance, SIGNAL(idle()));
+        maintenance.scheduleWhenIdle();
+        QVERIFY(idleSpy.wait(10000));
+        QCOMPARE(stepSpy.count(), 3);
+    }
+};
+
+QTEST_GUILESS_MAIN(TestJournalMaintenance)
+#include "testjournalmaintenance.moc"
@@ -0,0 +1,119 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+#include "syncenginetestutils.h"
+#include "socketapiworker.h"
+
+using namespace OCC;
+
+class MessageSpy : public QSignalSpy
+{
+public:
+    MessageSpy(SocketApiWorker *worker)
+        : QSignalSpy(worker, SIGNAL(messagesReady(QIODevice *, QStringList)))
+    { }
+
+    /** Everything written to \a socket, in order */
+    QStringList messagesTo(QIODevice *socket) const {
+        QStringList messages;
+        for (int i = 0; i < size(); ++i) {
+            if (at(i)[0].value<QIODevice *>() == socket)
+                messages += at(i)[1].toStringList();
+        }
+        return messages;
+    }
+
+    int writesTo(QIODevice *socket) const {
+        int writes = 0;
+        for (int i = 0; i < size(); ++i) {
+            if (at(i)[0].value<QIODevice *>() == socket)
+                ++writes;
+        }
+        return writes;
+    }
+};
+
+class TestSocketApiWorker : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase() {
+        qRegisterMetaType<QIODevice *>("QIODevice*");
+    }
+
+    void testPushesGoToTheMonitoringListeners() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        auto &tracker = fakeFolder.syncEngine().syncFileStatusTracker();
+        const QString root = QDir::cleanPath(fakeFolder.localPath());
+        SocketApiWorker worker;
+        worker.addFolder(root, &tracker, fakeFolder.syncJournal().databaseFilePath());
+        MessageSpy spy(&worker);
+        QBuffer listener;
+        QBuffer other;
+
+        worker.slotRequest(&listener, ("RETRIEVE_DIRECTORY_STATUS:" + root + "/B").toUtf8());
+        QCOMPARE(spy.messagesTo(&listener), QStringList()
+            << "STATUS:OK:" + root + "/B/b1"
+            << "STATUS:OK:" + root + "/B/b2"
+            << "DIRECTORY_STATUS_END:" + root + "/B");
+        worker.slotRequest(&other, ("RETRIEVE_FILE_STATUS:" + root + "/C/c1").toUtf8());
+        QCOMPARE(spy.messagesTo(&other), QStringList() << "STATUS:OK:" + root + "/C/c1");
+        spy.clear();
+
+        // The pushes emitted together are written together, after what was sent before
+        worker.slotStatusPushes(&tracker,
+            QStringList() << root + "/B/b1" << root + "/A/a1" << root + "/B/b2" << root + "/B",
+            QStringList() << "SYNC" << "SYNC" << "SYNC" << "SYNC");
+        worker.slotRequest(&listener, ("RETRIEVE_FILE_STATUS:" + root + "/B/b1").toUtf8());
+        QCOMPARE(spy.writesTo(&listener), 2);
+        QCOMPARE(spy.messagesTo(&listener), QStringList()
+            << "STATUS:SYNC:" + root + "/B/b1"
+            << "STATUS:SYNC:" + root + "/B/b2"
+            << "STATUS:OK:" + root + "/B/b1");
+        QCOMPARE(spy.messagesTo(&other), QStringList());
+
+        // Nothing is sent for removed folders
+        spy.clear();
+        worker.removeFolder(&tracker);
+        worker.slotStatusPushes(&tracker, QStringList() << root + "/B/b1", QStringList() << "OK");
+        QCOMPARE(spy.size(), 0);
+    }
+
+    // The snapshot is published before the tracker emits the changes, so
+    // a reply is never older than a push sent before it.
+    void testRepliesAreNotOlderThanPushes() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.localModifier().appendByte("B/b1");
+        fakeFolder.remoteModifier().appendByte("C/c1");
+        auto &tracker = fakeFolder.syncEngine().syncFileStatusTracker();
+        SocketApiWorker worker;
+        worker.addFolder(QDir::cleanPath(fakeFolder.localPath()), &tracker, fakeFolder.syncJournal().databaseFilePath());
+        MessageSpy spy(&worker);
+        QBuffer requester;
+
+        int pushes = 0;
+        connect(&tracker, &SyncFileStatusTracker::fileStatusChanged, [&](const QString &systemPath, SyncFileStatus status) {
+            spy.clear();
+            worker.slotRequest(&requester, ("RETRIEVE_FILE_STATUS:" + systemPath).toUtf8());
+            QCOMPARE(spy.messagesTo(&requester), QStringList() << "STATUS:" + status.toSocketAPIString() + ":" + systemPath);
+            ++pushes;
+        });
+
+        fakeFolder.scheduleSync();
+        fakeFolder.execUntilBeforePropagation();
+        QVERIFY(pushes > 0);
+        pushes = 0;
+        fakeFolder.execUntilFinished();
+        QVERIFY(pushes > 0);
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+};
+
+QTEST_GUILESS_MAIN(TestSocketApiWorker)
+#include "testsocketapiworker.moc"
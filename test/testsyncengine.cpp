@@ -8,6 +8,7 @@
 #include <QtTest>
 #include "syncenginetestutils.h"
 #include <syncengine.h>
+#include <localioexecutor.h>
 
 using namespace OCC;
 
@@ -121,6 +122,63 @@ private slots:
         QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
     }
 
+    void testUploadChecksumTypes() {
+        FakeFolder fakeFolder{FileInfo{}};
+        // The server wants MD5, the content checksum is SHA1: both are computed in one pass
+        fakeFolder.syncEngine().account()->setCapabilities({ { "checksums", QVariantMap{ { "supportedTypes", QVariantList{ "MD5" } } } } });
+        QMap<QString, QByteArray> transmissionChecksums;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::PutOperation)
+                transmissionChecksums[getFilePathFromUrl(request.url())] = request.rawHeader("OC-Checksum");
+            return nullptr;
+        });
+
+        // One small file that is kept in memory for the upload, one that is read again
+        const int bigSize = 3 * 1000 * 1000;
+        fakeFolder.localModifier().insert("small", 64, 'A');
+        fakeFolder.localModifier().insert("big", bigSize, 'B');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+
+        QCOMPARE(transmissionChecksums["small"],
+            "MD5:" + QCryptographicHash::hash(QByteArray(64, 'A'), QCryptographicHash::Md5).toHex());
+        QCOMPARE(transmissionChecksums["big"],
+            "MD5:" + QCryptographicHash::hash(QByteArray(bigSize, 'B'), QCryptographicHash::Md5).toHex());
+        QCOMPARE(fakeFolder.syncJournal().getFileRecord("small")._checksumHeader,
+            "SHA1:" + QCryptographicHash::hash(QByteArray(64, 'A'), QCryptographicHash::Sha1).toHex());
+        QCOMPARE(fakeFolder.syncJournal().getFileRecord("big")._checksumHeader,
+            "SHA1:" + QCryptographicHash::hash(QByteArray(bigSize, 'B'), QCryptographicHash::Sha1).toHex());
+    }
+
+    void testChecksumCache() {
+        FakeFolder fakeFolder{FileInfo{}};
+        auto &journal = fakeFolder.syncJournal();
+        const auto sha1 = [](char c) { return QCryptographicHash::hash(QByteArray(64, c), QCryptographicHash::Sha1).toHex(); };
+
+        // Uploaded and downloaded files both get their checksum cached
+        fakeFolder.localModifier().insert("up", 64, 'U');
+        fakeFolder.remoteModifier().insert("down", 64, 'D');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        auto upKey = SyncJournalDb::ChecksumCacheKey::forFile(fakeFolder.localPath() + "up");
+        QVERIFY(upKey.isValid());
+        QCOMPARE(journal.getCachedChecksum(upKey, "SHA1"), sha1('U'));
+        auto downKey = SyncJournalDb::ChecksumCacheKey::forFile(fakeFolder.localPath() + "down");
+        QCOMPARE(journal.getCachedChecksum(downKey, "SHA1"), sha1('D'));
+
+        // A changed file isn't found in the cache anymore
+        fakeFolder.localModifier().setContents("up", 'V');
+        QVERIFY(journal.getCachedChecksum(SyncJournalDb::ChecksumCacheKey::forFile(fakeFolder.localPath() + "up"), "SHA1").isEmpty());
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(journal.getCachedChecksum(SyncJournalDb::ChecksumCacheKey::forFile(fakeFolder.localPath() + "up"), "SHA1"), sha1('V'));
+
+        // Entries of removed files are cleaned up after the sync
+        fakeFolder.localModifier().remove("down");
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(journal.getCachedChecksum(downKey, "SHA1").isEmpty());
+    }
+
     void testRemoteChangeInMovedFolder() {
         // issue #5192
         FakeFolder fakeFolder{FileInfo{ QString(), {
@@ -386,6 +444,48 @@ private slots:
         QCOMPARE(nGET, 1);
     }
 
+    void testConflictContentComparison()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        auto conflictFiles = [&]() {
+            QStringList names;
+            foreach (const FileInfo &fi, fakeFolder.currentLocalState().find("A")->children) {
+                if (fi.name.contains("_conflict"))
+                    names.append(fi.name);
+            }
+            return names;
+        };
+
+        // Both sides changed to the same content: the checksums show it, no conflict file
+        fakeFolder.localModifier().setContents("A/a1", 'X');
+        fakeFolder.localModifier().setModTime("A/a1", QDateTime::currentDateTime().addDays(-2));
+        fakeFolder.remoteModifier().setContents("A/a1", 'X');
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(conflictFiles().isEmpty());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+
+        // Same size, different content: the local version is kept as a conflict file
+        fakeFolder.localModifier().setContents("A/a2", 'Y');
+        fakeFolder.localModifier().setModTime("A/a2", QDateTime::currentDateTime().addDays(-2));
+        fakeFolder.remoteModifier().setContents("A/a2", 'Z');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(conflictFiles().size(), 1);
+        QVERIFY(conflictFiles().first().startsWith("a2_conflict"));
+        QCOMPARE(fakeFolder.currentLocalState().find("A/a2")->contentChar, 'Z');
+        QCOMPARE(fakeFolder.currentLocalState().find("A/" + conflictFiles().first())->contentChar, 'Y');
+
+        // The decision comes from the checksums, not from comparing the files: with
+        // a wrong cached checksum, equal content is taken for a conflict
+        fakeFolder.localModifier().setContents("A/a1", 'V');
+        fakeFolder.localModifier().setModTime("A/a1", QDateTime::currentDateTime().addDays(-3));
+        fakeFolder.remoteModifier().setContents("A/a1", 'V');
+        fakeFolder.syncJournal().setCachedChecksum(
+            SyncJournalDb::ChecksumCacheKey::forFile(fakeFolder.localPath() + "A/a1"), "SHA1", "0000");
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(conflictFiles().size(), 2);
+        QCOMPARE(fakeFolder.currentLocalState().find("A/a1")->contentChar, 'V');
+    }
+
     /**
      * Checks whether SyncFileItems have the expected properties before start
      * of propagation.
@@ -465,6 +565,239 @@ private slots:
 
         QVERIFY(fakeFolder.syncOnce());
     }
+
+    void testSizeAwareScheduling_data()
+    {
+        QTest::addColumn<bool>("sizeAware");
+        QTest::newRow("plan order") << false;
+        QTest::newRow("size aware") << true;
+    }
+
+    void testSizeAwareScheduling()
+    {
+        QFETCH(bool, sizeAware);
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        SyncOptions options;
+        options._largeFileSize = sizeAware ? 1000 * 1000 : 0;
+        fakeFolder.syncEngine().setSyncOptions(options);
+
+        QStringList getOrder;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::GetOperation)
+                getOrder.append(getFilePathFromUrl(request.url()));
+            return nullptr;
+        });
+
+        fakeFolder.remoteModifier().insert("A/a0", 10);
+        fakeFolder.remoteModifier().insert("A/a3", 10);
+        fakeFolder.remoteModifier().insert("B/b0", 500 * 1000);
+        fakeFolder.remoteModifier().insert("C/c0", 200 * 1000);
+        fakeFolder.remoteModifier().insert("S/s0", 2 * 1000 * 1000);
+        fakeFolder.remoteModifier().insert("S/s3", 3 * 1000 * 1000);
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+
+        QCOMPARE(getOrder.size(), 6);
+        if (sizeAware) {
+            // The large files first, then the biggest medium one takes the slot
+            // that is kept free of large files
+            QCOMPARE(getOrder.mid(0, 3), QStringList() << "S/s3" << "S/s0" << "B/b0");
+        } else {
+            QCOMPARE(getOrder.first(), QString("A/a0"));
+        }
+    }
+
+    void testSegmentedDownload()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        SyncOptions options;
+        options._segmentedDownloadSize = 1000 * 1000;
+        fakeFolder.syncEngine().setSyncOptions(options);
+        const int size = 10 * 1000 * 1000;
+
+        // The middle segment fails, the first one completes before
+        QList<QByteArray> ranges;
+        bool failMiddle = true;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op != QNetworkAccessManager::GetOperation || getFilePathFromUrl(request.url()) != "A/big")
+                return nullptr;
+            ranges.append(request.rawHeader("Range"));
+            if (failMiddle && ranges.size() == 2)
+                return new FakeErrorReply{ op, request, &fakeFolder.syncEngine(), 500 };
+            return nullptr;
+        });
+        fakeFolder.remoteModifier().insert("A/big", size);
+        QVERIFY(!fakeFolder.syncOnce());
+
+        // One segment per transfer slot
+        QCOMPARE(ranges, QList<QByteArray>() << "bytes=0-3333332"
+                                             << "bytes=3333333-6666665"
+                                             << "bytes=6666666-9999999");
+        auto downloadInfo = fakeFolder.syncEngine().journal()->getDownloadInfo("A/big");
+        QVERIFY(downloadInfo._valid);
+        QMap<quint64, quint64> segments;
+        segments[0] = 3333333;
+        segments[3333333] = 0;
+        segments[6666666] = 0;
+        QCOMPARE(downloadInfo._segments, segments);
+
+        // Only the missing segments are downloaded again
+        ranges.clear();
+        failMiddle = false;
+        fakeFolder.syncEngine().journal()->wipeErrorBlacklist();
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(ranges, QList<QByteArray>() << "bytes=3333333-6666665"
+                                             << "bytes=6666666-9999999");
+        QCOMPARE(fakeFolder.syncEngine().journal()->downloadInfoCount(), 0);
+    }
+
+    void testDownloadWriteAlignment()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        SyncOptions options;
+        options._downloadBufferSize = 10 * 1000;
+        options._downloadWriteAlignment = 4096;
+        fakeFolder.syncEngine().setSyncOptions(options);
+
+        // Smaller than a block, exactly a block, and more than the buffer
+        fakeFolder.remoteModifier().insert("A/a0", 1);
+        fakeFolder.remoteModifier().insert("A/a3", 4096);
+        fakeFolder.remoteModifier().insert("A/a4", 123456);
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+
+    void testReuseLocalContent()
+    {
+        FakeFolder fakeFolder{ FileInfo{} };
+        QStringList gets;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            if (op == QNetworkAccessManager::GetOperation)
+                gets.append(getFilePathFromUrl(request.url()));
+            return nullptr;
+        });
+        const QByteArray sha1 = "SHA1:" + QCryptographicHash::hash(QByteArray(1000, 'U'), QCryptographicHash::Sha1).toHex();
+
+        // The journal knows the checksum of the uploaded file
+        fakeFolder.localModifier().insert("up", 1000, 'U');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(fakeFolder.syncJournal().getFileRecord("up")._checksumHeader, sha1);
+
+        // A copy made on the server is copied locally
+        fakeFolder.remoteModifier().insert("copy", 1000, 'U');
+        fakeFolder.remoteModifier().find("copy")->checksums = sha1;
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(gets.isEmpty());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QCOMPARE(fakeFolder.syncJournal().getFileRecord("copy")._checksumHeader, sha1);
+
+        // The local files changed without the journal noticing: download
+        fakeFolder.localModifier().setContents("up", 'X');
+        fakeFolder.localModifier().setModTime("up", fakeFolder.syncJournal().getFileRecord("up")._modtime);
+        fakeFolder.localModifier().remove("copy");
+        fakeFolder.remoteModifier().insert("copy2", 1000, 'U');
+        fakeFolder.remoteModifier().find("copy2")->checksums = sha1;
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(gets, QStringList() << "copy2");
+        QFile copy2(fakeFolder.localPath() + "copy2");
+        QVERIFY(copy2.open(QIODevice::ReadOnly));
+        QCOMPARE(copy2.readAll(), QByteArray(1000, 'U'));
+    }
+
+    void testUploadCopiesExistingContent()
+    {
+        FakeFolder fakeFolder{ FileInfo{} };
+        fakeFolder.remoteModifier().mkdir("A");
+        QVERIFY(fakeFolder.syncOnce());
+        QStringList puts, copies, deletes;
+        QString failingPropfind;
+        fakeFolder.setServerOverride([&](QNetworkAccessManager::Operation op, const QNetworkRequest &request) -> QNetworkReply * {
+            const QString path = getFilePathFromUrl(request.url());
+            const QVariant verb = request.attribute(QNetworkRequest::CustomVerbAttribute);
+            if (op == QNetworkAccessManager::PutOperation)
+                puts.append(path);
+            if (op == QNetworkAccessManager::DeleteOperation)
+                deletes.append(path);
+            if (verb == "COPY")
+                copies.append(path);
+            if (verb == "PROPFIND" && path == failingPropfind)
+                return new FakeErrorReply{ op, request, &fakeFolder.syncEngine(), 500 };
+            return nullptr;
+        });
+        const QByteArray sha1 = "SHA1:" + QCryptographicHash::hash(QByteArray(1000, 'U'), QCryptographicHash::Sha1).toHex();
+
+        fakeFolder.localModifier().insert("up", 1000, 'U');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(puts, QStringList() << "up");
+        fakeFolder.remoteModifier().find("up")->checksums = sha1;
+
+        // A new file with the same content is copied on the server
+        puts.clear();
+        fakeFolder.localModifier().insert("A/dup", 1000, 'U');
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(puts.isEmpty());
+        QCOMPARE(copies, QStringList() << "up");
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        auto dup = fakeFolder.currentRemoteState().find("A/dup");
+        QCOMPARE(dup->lastModified.toTime_t(), QFileInfo(fakeFolder.localPath() + "A/dup").lastModified().toTime_t());
+        auto record = fakeFolder.syncJournal().getFileRecord("A/dup");
+        QCOMPARE(record._etag, dup->etag.toUtf8());
+        QCOMPARE(record._fileId, dup->fileId);
+
+        // A copy that can't be verified is removed before the upload
+        copies.clear();
+        failingPropfind = "A/dup3";
+        fakeFolder.localModifier().insert("A/dup3", 1000, 'U');
+        QVERIFY(fakeFolder.syncOnce());
+        QCOMPARE(copies.size(), 1);
+        QCOMPARE(deletes, QStringList() << "A/dup3");
+        QCOMPARE(puts, QStringList() << "A/dup3");
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+
+        // Without the checksum on the server the copy can't be verified: upload without copying
+        copies.clear();
+        deletes.clear();
+        puts.clear();
+        fakeFolder.remoteModifier().find("up")->checksums.clear();
+        fakeFolder.remoteModifier().find("A/dup")->checksums.clear();
+        fakeFolder.remoteModifier().find("A/dup3")->checksums.clear();
+        fakeFolder.localModifier().insert("A/dup2", 1000, 'U');
+        QVERIFY(fakeFolder.syncOnce());
+        QVERIFY(copies.isEmpty());
+        QVERIFY(deletes.isEmpty());
+        QCOMPARE(puts, QStringList() << "A/dup2");
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+    }
+
+    void testLocalIoOffThread()
+    {
+        FakeFolder fakeFolder{ FileInfo::A12_B12_C12_S12() };
+        fakeFolder.remoteModifier().remove("A");
+        fakeFolder.remoteModifier().mkdir("D");
+        fakeFolder.remoteModifier().insert("D/d1");
+        fakeFolder.remoteModifier().rename("B", "E");
+        fakeFolder.remoteModifier().appendByte("C/c1");
+
+        // While the executor is busy, the local operations wait but the event loop keeps running
+        QSemaphore busy;
+        LocalIoExecutor::instance()->run<bool>([&busy]() {
+            busy.acquire();
+            return true;
+        });
+        QSignalSpy finishedSpy(&fakeFolder.syncEngine(), SIGNAL(finished(bool)));
+        fakeFolder.syncEngine().startSync();
+        QVERIFY(!finishedSpy.wait(500));
+        QVERIFY(fakeFolder.currentLocalState().find("A"));
+        QVERIFY(!fakeFolder.currentLocalState().find("D"));
+
+        busy.release();
+        QVERIFY(finishedSpy.wait());
+        QVERIFY(finishedSpy.first().first().toBool());
+        QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
+        QVERIFY(fakeFolder.syncEngine().journal()->getFileRecord("E/b1").isValid());
+        QVERIFY(!fakeFolder.syncEngine().journal()->getFileRecord("A/a1").isValid());
+    }
 };
 
 QTEST_GUILESS_MAIN(TestSyncEngine)
@@ -409,6 +409,43 @@ private slots:
         QCOMPARE(statusSpy.statusOf("C/c1"), SyncFileStatus(SyncFileStatus::StatusUpToDate));
     }
 
+    // Each item with an error invalidates all its parents, these
+    // are emitted once, after the item.
+    void statusChangesAreCoalesced() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        foreach (const QString &path, QStringList() << "A/a1" << "A/a2" << "B/b1" << "B/b2") {
+            fakeFolder.serverErrorPaths().append(path);
+            fakeFolder.localModifier().appendByte(path);
+        }
+        QVERIFY(!fakeFolder.syncOnce());
+
+        // The errors are blacklisted in the second sync
+        fakeFolder.serverErrorPaths().clear();
+        StatusPushSpy statusSpy(fakeFolder.syncEngine());
+        fakeFolder.scheduleSync();
+        fakeFolder.execUntilBeforePropagation();
+        verifyThatPushMatchesPull(fakeFolder, statusSpy);
+        // The root is also pushed when the sync starts
+        QSet<QString> pushed;
+        for (int i = 0; i < statusSpy.size(); ++i) {
+            const QString path = statusSpy.at(i)[0].toString();
+            if (QFileInfo(path) == QFileInfo(fakeFolder.localPath()))
+                continue;
+            QVERIFY2(!pushed.contains(path), qPrintable(path));
+            pushed.insert(path);
+        }
+        QVERIFY(pushed.contains(fakeFolder.localPath() + "A"));
+        QCOMPARE(statusSpy.statusOf(""), SyncFileStatus(SyncFileStatus::StatusWarning));
+        QCOMPARE(statusSpy.statusOf("A"), SyncFileStatus(SyncFileStatus::StatusWarning));
+        QCOMPARE(statusSpy.statusOf("A/a2"), SyncFileStatus(SyncFileStatus::StatusError));
+        QCOMPARE(statusSpy.statusOf("B"), SyncFileStatus(SyncFileStatus::StatusWarning));
+        QVERIFY(statusSpy.statusEmittedBefore("A/a1", "A"));
+        QVERIFY(statusSpy.statusEmittedBefore("A/a2", "A"));
+        QVERIFY(statusSpy.statusEmittedBefore("B/b2", "B"));
+        QVERIFY(statusSpy.statusEmittedBefore("A", ""));
+        QVERIFY(statusSpy.statusEmittedBefore("B", ""));
+    }
+
     void sharedStatus() {
         SyncFileStatus sharedUpToDateStatus(SyncFileStatus::StatusUpToDate);
         sharedUpToDateStatus.setShared(true);
@@ -443,6 +480,71 @@ private slots:
 
         QCOMPARE(fakeFolder.currentLocalState(), fakeFolder.currentRemoteState());
     }
+
+    void directoryStatusMatchesFileStatus() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.syncEngine().excludedFiles().addExcludeExpr("A/a1");
+        fakeFolder.syncEngine().excludedFiles().addExcludeExpr("B");
+        fakeFolder.remoteModifier().appendByte("S/s1");
+        fakeFolder.localModifier().mkdir("A/sub");
+        fakeFolder.localModifier().insert("A/sub/deep");
+        QVERIFY(fakeFolder.syncOnce());
+        fakeFolder.localModifier().insert("A/a0");
+        fakeFolder.remoteModifier().appendByte("C/c1");
+
+        auto &tracker = fakeFolder.syncEngine().syncFileStatusTracker();
+        auto verify = [&]() {
+            foreach (const QString &directory, QStringList() << "" << "A" << "B" << "C" << "S") {
+                const QString prefix = directory.isEmpty() ? QString() : directory + "/";
+                const auto statuses = tracker.directoryStatus(directory);
+                auto entries = QDir(fakeFolder.localPath() + directory).entryList(QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot);
+                entries.sort();
+                QCOMPARE(statuses.keys(), entries);
+                for (auto it = statuses.constBegin(); it != statuses.constEnd(); ++it)
+                    QCOMPARE(it.value(), tracker.fileStatus(prefix + it.key()));
+            }
+        };
+
+        fakeFolder.scheduleSync();
+        fakeFolder.execUntilBeforePropagation();
+        verify();
+        QCOMPARE(tracker.directoryStatus("C").value("c1"), SyncFileStatus(SyncFileStatus::StatusSync));
+        fakeFolder.execUntilFinished();
+        verify();
+        QCOMPARE(tracker.directoryStatus("A").value("a1"), SyncFileStatus(SyncFileStatus::StatusWarning));
+        QCOMPARE(tracker.directoryStatus("A").value("a0"), SyncFileStatus(SyncFileStatus::StatusUpToDate));
+        QCOMPARE(tracker.directoryStatus("B").value("b1"), SyncFileStatus(SyncFileStatus::StatusWarning));
+        QVERIFY(tracker.directoryStatus("").value("S").shared());
+    }
+
+    void snapshotFollowsTheTracker() {
+        FakeFolder fakeFolder{FileInfo::A12_B12_C12_S12()};
+        fakeFolder.remoteModifier().appendByte("B/b1");
+        auto &tracker = fakeFolder.syncEngine().syncFileStatusTracker();
+        // The snapshots don't use the journal's connection
+        SyncJournalReader journal(fakeFolder.syncJournal().databaseFilePath());
+
+        auto before = tracker.snapshot();
+        fakeFolder.scheduleSync();
+        fakeFolder.execUntilBeforePropagation();
+        // Published before the changes were emitted
+        auto during = tracker.snapshot();
+        QVERIFY(during != before);
+        QCOMPARE(before->fileStatus("B/b1", &journal), SyncFileStatus(SyncFileStatus::StatusUpToDate));
+        QCOMPARE(during->fileStatus("B/b1", &journal), SyncFileStatus(SyncFileStatus::StatusSync));
+        QCOMPARE(during->directoryStatus("B", &journal).value("b1"), SyncFileStatus(SyncFileStatus::StatusSync));
+
+        fakeFolder.execUntilFinished();
+        // Published snapshots don't change
+        QCOMPARE(during->fileStatus("B/b1", &journal), SyncFileStatus(SyncFileStatus::StatusSync));
+        auto after = tracker.snapshot();
+        QCOMPARE(after->fileStatus("B/b1", &journal), SyncFileStatus(SyncFileStatus::StatusUpToDate));
+        QCOMPARE(after->fileStatus("B/b1", &journal), tracker.fileStatus("B/b1"));
+        QCOMPARE(after->fileStatus("", &journal), tracker.fileStatus(""));
+        // The records are read
+        QVERIFY(after->fileStatus("S", &journal).shared());
+        QCOMPARE(after->directoryStatus("", &journal), tracker.directoryStatus(""));
+    }
 };
 
 QTEST_GUILESS_MAIN(TestSyncFileStatusTracker)
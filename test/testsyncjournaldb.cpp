@@ -136,6 +136,13 @@ private slots:
         Info storedRecord = _db.getDownloadInfo("foo");
         QVERIFY(storedRecord == record);
 
+        // A segmented download
+        record._segments[0] = 1000;
+        record._segments[12894700000] = 0;
+        _db.setDownloadInfo("foo", record);
+        storedRecord = _db.getDownloadInfo("foo");
+        QVERIFY(storedRecord == record);
+
         _db.setDownloadInfo("foo", Info());
         Info wipedRecord = _db.getDownloadInfo("foo");
         QVERIFY(!wipedRecord._valid);
@@ -158,11 +165,317 @@ private slots:
         Info storedRecord = _db.getUploadInfo("foo");
         QVERIFY(storedRecord == record);
 
+        // Chunks acknowledged out of order
+        record._doneChunks[14] = 140000;
+        record._doneChunks[16] = 12894700000;
+        _db.setUploadInfo("foo", record);
+        storedRecord = _db.getUploadInfo("foo");
+        QVERIFY(storedRecord == record);
+
         _db.setUploadInfo("foo", Info());
         Info wipedRecord = _db.getUploadInfo("foo");
         QVERIFY(!wipedRecord._valid);
     }
 
+    void testFileRecordCache()
+    {
+        SyncJournalFileRecord record;
+        record._path = "cached";
+        record._inode = 42;
+        record._modtime = dropMsecs(QDateTime::currentDateTime());
+        record._etag = "etag1";
+        QVERIFY(_db.setFileRecord(record));
+        record._path = "cached/child";
+        QVERIFY(_db.setFileRecord(record));
+
+        auto stats = _db.fileRecordCacheStats();
+        QCOMPARE(_db.getFileRecord("cached")._etag, QByteArray("etag1"));
+        QCOMPARE(_db.getFileRecord("cached")._etag, QByteArray("etag1"));
+        QVERIFY(!_db.getFileRecord("cached-missing").isValid());
+        QVERIFY(!_db.getFileRecord("cached-missing").isValid());
+        QCOMPARE(_db.fileRecordCacheStats()._hits, stats._hits + 2);
+        QCOMPARE(_db.fileRecordCacheStats()._misses, stats._misses + 2);
+
+        // Writes update what's read
+        record._path = "cached";
+        record._etag = "etag2";
+        QVERIFY(_db.setFileRecord(record));
+        QCOMPARE(_db.getFileRecord("cached")._etag, QByteArray("etag2"));
+        record._path = "cached-missing";
+        _db.queueFileRecord(record);
+        QVERIFY(_db.getFileRecord("cached-missing").isValid());
+        QVERIFY(_db.updateFileRecordChecksum("cached", "abc", "SHA1"));
+        QCOMPARE(_db.getFileRecord("cached")._checksumHeader, QByteArray("SHA1:abc"));
+
+        QVERIFY(_db.getFileRecord("cached/child").isValid());
+        QVERIFY(_db.deleteFileRecord("cached", true));
+        QVERIFY(!_db.getFileRecord("cached").isValid());
+        QVERIFY(!_db.getFileRecord("cached/child").isValid());
+        QVERIFY(_db.deleteFileRecord("cached-missing"));
+        QVERIFY(!_db.getFileRecord("cached-missing").isValid());
+    }
+
+    void testFileRecordsInDirectory()
+    {
+        const QStringList paths = {
+            "listed", "listed/a", "listed/b", "listed/sub", "listed/sub/c", "listed-other/d", "listed.x", "listed0"
+        };
+        foreach (const QString &path, paths) {
+            SyncJournalFileRecord record;
+            record._path = path;
+            record._modtime = dropMsecs(QDateTime::currentDateTime());
+            record._remotePerm = "S";
+            QVERIFY(_db.setFileRecord(record));
+        }
+        // Queued writes are seen too
+        SyncJournalFileRecord record;
+        record._path = "listed/queued";
+        _db.queueFileRecord(record);
+
+        auto pathsOf = [](const QVector<SyncJournalFileRecord> &records) {
+            QStringList result;
+            foreach (const SyncJournalFileRecord &rec, records)
+                result.append(rec._path);
+            result.sort();
+            return result;
+        };
+        QCOMPARE(pathsOf(_db.getFileRecordsInDirectory("listed")),
+            QStringList({ "listed/a", "listed/b", "listed/queued", "listed/sub" }));
+        QCOMPARE(pathsOf(_db.getFileRecordsInDirectory("listed/sub")), QStringList({ "listed/sub/c" }));
+        QCOMPARE(_db.getFileRecordsInDirectory("listed/a").size(), 0);
+        QCOMPARE(_db.getFileRecordsInDirectory("listed/sub").first()._remotePerm, QByteArray("S"));
+
+        const QStringList rootPaths = pathsOf(_db.getFileRecordsInDirectory(""));
+        QVERIFY(rootPaths.contains("listed"));
+        QVERIFY(rootPaths.contains("listed0"));
+        QVERIFY(!rootPaths.contains("listed/a"));
+
+        QVERIFY(_db.deleteFileRecord("listed", true));
+        QVERIFY(_db.deleteFileRecord("listed-other", true));
+        QVERIFY(_db.deleteFileRecord("listed.x"));
+        QVERIFY(_db.deleteFileRecord("listed0"));
+    }
+
+    void testFileRecordsInDeepDirectory()
+    {
+        // Every directory has files sorting before, inside and after its subtree
+        QString directory = "deep";
+        for (int depth = 0; depth < 8; ++depth) {
+            foreach (const QString &name, QStringList({ "d", "d!", "d.txt", "d0", "e" })) {
+                SyncJournalFileRecord record;
+                record._path = directory + "/" + name;
+                record._modtime = dropMsecs(QDateTime::currentDateTime());
+                QVERIFY(_db.setFileRecord(record));
+            }
+            for (int i = 0; i < 20; ++i) {
+                SyncJournalFileRecord record;
+                record._path = directory + QString("/d/f%1").arg(i);
+                QVERIFY(_db.setFileRecord(record));
+            }
+            directory += "/d";
+        }
+
+        auto pathsOf = [](const QVector<SyncJournalFileRecord> &records) {
+            QStringList result;
+            foreach (const SyncJournalFileRecord &rec, records)
+                result.append(rec._path);
+            return result;
+        };
+        // In path order
+        QCOMPARE(pathsOf(_db.getFileRecordsInDirectory("deep")),
+            QStringList({ "deep/d", "deep/d!", "deep/d.txt", "deep/d0", "deep/e" }));
+        const auto inner = pathsOf(_db.getFileRecordsInDirectory("deep/d/d/d"));
+        QCOMPARE(inner.size(), 25);
+        QVERIFY(inner.contains("deep/d/d/d/d.txt"));
+        QVERIFY(inner.contains("deep/d/d/d/f19"));
+        QVERIFY(!inner.contains("deep/d/d/d/d/f0"));
+        // The directory without a record of its own, and its sibling
+        QCOMPARE(pathsOf(_db.getFileRecordsInDirectory("")).count("deep"), 0);
+        QCOMPARE(_db.getFileRecordsInDirectory("dee").size(), 0);
+
+        // The same over a connection of its own
+        SyncJournalReader reader(_db.databaseFilePath());
+        QCOMPARE(pathsOf(reader.getFileRecordsInDirectory("deep/d/d/d")), inner);
+        QCOMPARE(reader.getFileRecord("deep/d/d.txt")._path, QString("deep/d/d.txt"));
+        QVERIFY(!reader.getFileRecord("deep/d/missing").isValid());
+
+        QVERIFY(_db.deleteFileRecord("deep", true));
+    }
+
+    void testQueuedWrites()
+    {
+        SyncJournalFileRecord record;
+        record._path = "queued";
+        record._inode = 5678;
+        record._modtime = dropMsecs(QDateTime::currentDateTime());
+        record._etag = "789789";
+        record._fileId = "abcd";
+        _db.queueFileRecord(record);
+        record._path = "queued/child";
+        _db.queueFileRecord(record);
+
+        // Reads see the queued writes right away
+        QVERIFY(_db.getFileRecord("queued").isValid());
+        QVERIFY(_db.getFileRecord("queued/child").isValid());
+
+        _db.queueDeleteFileRecord("queued", true);
+        QVERIFY(!_db.getFileRecord("queued/child").isValid());
+
+        // Writes are applied in order
+        _db.queueFileRecord(record);
+        _db.queueDeleteFileRecord("queued/child");
+        _db.queueFileRecord(record);
+        QVERIFY(_db.flushPendingWrites());
+
+        // Flushed writes are visible to other connections
+        SyncJournalDb other(_db.databaseFilePath());
+        QCOMPARE(other.getFileRecord("queued/child")._inode, quint64(5678));
+        QVERIFY(!other.getFileRecord("queued").isValid());
+        other.close();
+
+        _db.queueDeleteFileRecord("queued", true);
+        QVERIFY(_db.flushPendingWrites());
+    }
+
+    void testPostSyncCleanup()
+    {
+        const QStringList paths = {
+            "keep", "gone", "dir", "dir/a", "dir/sub/b", "dir2/c", "other/d", "other/e/f", "zzz"
+        };
+        foreach (const QString &path, paths) {
+            SyncJournalFileRecord record;
+            record._path = path;
+            record._inode = 1;
+            record._modtime = dropMsecs(QDateTime::currentDateTime());
+            QVERIFY(_db.setFileRecord(record));
+        }
+
+        // Prefixes are plain string prefixes, like before: "dir" keeps "dir2/c" too.
+        // "other/e" is covered by "other/", which must still be found.
+        QVERIFY(_db.postSyncCleanup({ "keep", "zzz" }, { "dir", "other/", "other/e" }));
+        foreach (const QString &path, paths) {
+            QCOMPARE(_db.getFileRecord(path).isValid(), path != "gone");
+        }
+
+        QVERIFY(_db.postSyncCleanup({ "keep" }, {}));
+        foreach (const QString &path, paths) {
+            QCOMPARE(_db.getFileRecord(path).isValid(), path == "keep");
+        }
+
+        // The empty prefix keeps everything
+        QVERIFY(_db.postSyncCleanup({}, { "" }));
+        QVERIFY(_db.getFileRecord("keep").isValid());
+        QVERIFY(_db.deleteFileRecord("keep"));
+    }
+
+    void testChecksumCache()
+    {
+        SyncJournalDb::ChecksumCacheKey key;
+        key._inode = 4321;
+        key._size = 100;
+        key._modtime = 1000;
+        key._ctime = 2000;
+        QVERIFY(_db.getCachedChecksum(key, "SHA1").isEmpty());
+
+        _db.setCachedChecksum(key, "SHA1", "mysha1");
+        _db.setCachedChecksum(key, "MD5", "mymd5");
+        QCOMPARE(_db.getCachedChecksum(key, "SHA1"), QByteArray("mysha1"));
+        QCOMPARE(_db.getCachedChecksum(key, "MD5"), QByteArray("mymd5"));
+        QVERIFY(_db.getCachedChecksum(key, "Adler32").isEmpty());
+
+        // Any change of the file makes the entry unreachable
+        auto changed = key;
+        changed._size = 101;
+        QVERIFY(_db.getCachedChecksum(changed, "SHA1").isEmpty());
+        changed = key;
+        changed._modtime = 1001;
+        QVERIFY(_db.getCachedChecksum(changed, "SHA1").isEmpty());
+        changed = key;
+        changed._ctime = 2001;
+        QVERIFY(_db.getCachedChecksum(changed, "SHA1").isEmpty());
+
+        // A new version replaces the old one
+        _db.setCachedChecksum(changed, "SHA1", "othersha1");
+        QCOMPARE(_db.getCachedChecksum(changed, "SHA1"), QByteArray("othersha1"));
+        QVERIFY(_db.getCachedChecksum(key, "SHA1").isEmpty());
+
+        // Invalid keys are never cached
+        _db.setCachedChecksum(SyncJournalDb::ChecksumCacheKey(), "SHA1", "mysha1");
+        QVERIFY(_db.getCachedChecksum(SyncJournalDb::ChecksumCacheKey(), "SHA1").isEmpty());
+    }
+
+    void testMetadataMigration()
+    {
+        // A journal written by older clients, with string phash and modtime
+        const QString path = _tempDir.path() + "/legacy.db";
+        sqlite3 *db = 0;
+        QCOMPARE(sqlite3_open(path.toUtf8().constData(), &db), SQLITE_OK);
+        QCOMPARE(sqlite3_exec(db,
+                     "CREATE TABLE metadata(phash INTEGER(8), pathlen INTEGER, path VARCHAR(4096), inode INTEGER,"
+                     " uid INTEGER, gid INTEGER, mode INTEGER, modtime INTEGER(8), type INTEGER, md5 VARCHAR(32),"
+                     " fileid VARCHAR(128), remotePerm VARCHAR(128), filesize BIGINT, ignoredChildrenRemote INT,"
+                     " contentChecksum TEXT, contentChecksumTypeId INTEGER, PRIMARY KEY(phash));",
+                     0, 0, 0),
+            SQLITE_OK);
+        const QByteArray insert = "INSERT INTO metadata VALUES ('"
+            + QByteArray::number(SyncJournalDb::getPHash("dir/file"))
+            + "', 8, 'dir/file', 42, 0, 0, 0, '1500000000', '0', 'etag', 'fid', 'WDNVR', 100, 0, NULL, NULL);";
+        QCOMPARE(sqlite3_exec(db, insert.constData(), 0, 0, 0), SQLITE_OK);
+        sqlite3_close(db);
+
+        {
+            SyncJournalDb journal(path);
+            SyncJournalFileRecord record = journal.getFileRecord("dir/file");
+            QVERIFY(record.isValid());
+            QCOMPARE(record._inode, quint64(42));
+            QCOMPARE(Utility::qDateTimeToTime_t(record._modtime), qint64(1500000000));
+            QCOMPARE(record._etag, QByteArray("etag"));
+            QCOMPARE(record._fileId, QByteArray("fid"));
+            QCOMPARE(record._fileSize, qint64(100));
+
+            record._path = "dir/other";
+            QVERIFY(journal.setFileRecord(record));
+            QVERIFY(journal.getFileRecord("dir/other").isValid());
+        }
+
+        QCOMPARE(sqlite3_open(path.toUtf8().constData(), &db), SQLITE_OK);
+        sqlite3_stmt *stmt = 0;
+        QCOMPARE(sqlite3_prepare_v2(db, "SELECT typeof(phash), typeof(modtime) FROM metadata WHERE path = 'dir/file';", -1, &stmt, 0), SQLITE_OK);
+        QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+        QCOMPARE(QByteArray(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))), QByteArray("integer"));
+        QCOMPARE(QByteArray(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1))), QByteArray("integer"));
+        sqlite3_finalize(stmt);
+        QVERIFY(sqlite3_prepare_v2(db, "SELECT uid FROM metadata;", -1, &stmt, 0) != SQLITE_OK);
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+
+    void testNewJournalIsCompact()
+    {
+        const QString path = _tempDir.path() + "/new.db";
+        {
+            SyncJournalDb journal(path);
+            SyncJournalFileRecord record;
+            record._path = "foo";
+            record._inode = 1;
+            record._modtime = QDateTime::currentDateTimeUtc();
+            record._etag = "etag";
+            QVERIFY(journal.setFileRecord(record));
+        }
+
+        // Created without the legacy columns, there is nothing to migrate
+        sqlite3 *db = 0;
+        QCOMPARE(sqlite3_open(path.toUtf8().constData(), &db), SQLITE_OK);
+        sqlite3_stmt *stmt = 0;
+        QCOMPARE(sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type = 'table' AND name = 'metadata';", -1, &stmt, 0), SQLITE_OK);
+        QCOMPARE(sqlite3_step(stmt), SQLITE_ROW);
+        QVERIFY(QByteArray(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))).contains("WITHOUT ROWID"));
+        sqlite3_finalize(stmt);
+        QVERIFY(sqlite3_prepare_v2(db, "SELECT uid FROM metadata;", -1, &stmt, 0) != SQLITE_OK);
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    }
+
 private:
     SyncJournalDb _db;
 };
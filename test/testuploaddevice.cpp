@@ -0,0 +1,113 @@
+/*
+ *    This software is in the public domain, furnished "as is", without technical
+ *    support, and with no warranty, express or implied, as to its usefulness for
+ *    any purpose.
+ *
+ */
+
+#include <QtTest>
+#include <QTemporaryDir>
+
+#include "propagateupload.h"
+#include "bandwidthmanager.h"
+#include "localioexecutor.h"
+
+using namespace OCC;
+
+class TestUploadDevice : public QObject
+{
+    Q_OBJECT
+
+    QTemporaryDir _dir;
+
+    /* Writes a file of two and a half read windows */
+    QByteArray writeFile(const QString &path)
+    {
+        QByteArray content(UploadDevice::readWindowSize * 5 / 2, Qt::Uninitialized);
+        for (int i = 0; i < content.size(); ++i)
+            content[i] = char(i % 251);
+        QFile file(path);
+        file.open(QIODevice::WriteOnly);
+        file.write(content);
+        return content;
+    }
+
+    /* Reads \a maxSize bytes of \a device, waiting for readyRead() when it has nothing yet; -1 on error */
+    static qint64 readSome(UploadDevice &device, QByteArray *read, qint64 maxSize)
+    {
+        QSignalSpy readyRead(&device, SIGNAL(readyRead()));
+        while (true) {
+            QByteArray buffer(maxSize, Qt::Uninitialized);
+            const qint64 n = device.read(buffer.data(), buffer.size());
+            if (n != 0) {
+                if (n > 0)
+                    *read += buffer.left(n);
+                return n;
+            }
+            if (!readyRead.wait())
+                return -1;
+        }
+    }
+
+private slots:
+    void testReadsDontWaitForTheLocalIo()
+    {
+        const QString path = _dir.path() + "/file";
+        const QByteArray content = writeFile(path);
+
+        // The LocalIoExecutor is busy for the whole test
+        QSemaphore release;
+        QFuture<bool> busy = LocalIoExecutor::instance()->run<bool>([&release]() {
+            release.acquire();
+            return true;
+        });
+
+        BandwidthManager bandwidthManager;
+        UploadDevice device(&bandwidthManager);
+        QVERIFY(device.prepareAndOpen(path, 0, content.size()));
+        QCOMPARE(device.size(), qint64(content.size()));
+
+        QByteArray read;
+        while (read.size() < content.size())
+            QVERIFY(readSome(device, &read, 64 * 1024) > 0);
+        QCOMPARE(read, content);
+
+        // Sending the request again reads it again
+        QVERIFY(device.seek(0));
+        read.clear();
+        while (read.size() < content.size())
+            QVERIFY(readSome(device, &read, 64 * 1024) > 0);
+        QCOMPARE(read, content);
+
+        release.release();
+        busy.waitForFinished();
+    }
+
+    void testFileChangedWhileStreaming()
+    {
+        const QString path = _dir.path() + "/changed";
+        const QByteArray content = writeFile(path);
+
+        BandwidthManager bandwidthManager;
+        UploadDevice device(&bandwidthManager);
+        QVERIFY(device.prepareAndOpen(path, 0, content.size()));
+        QByteArray read;
+        QVERIFY(readSome(device, &read, 1024) > 0);
+
+        // The windows read after the change fail, and every read after them
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::Append));
+        file.write("changed");
+        file.close();
+        qint64 n;
+        while ((n = readSome(device, &read, 64 * 1024)) > 0) {
+        }
+        QCOMPARE(n, qint64(-1));
+        QVERIFY(read.size() < content.size());
+        QCOMPARE(device.errorString(), QString("Local file changed during sync."));
+        QCOMPARE(readSome(device, &read, 1024), qint64(-1));
+    }
+};
+
+QTEST_GUILESS_MAIN(TestUploadDevice)
+#include "testuploaddevice.moc"